@@ -42,30 +42,42 @@ static int WaitForSocketReady(SOCKET sock, BOOL bWrite, int timeoutMs)
 static int SendRelayPacket(SOCKET sock, BYTE msgType, const BYTE *data, DWORD dataLength)
 {
     RELAY_HEADER header;
-    BYTE *packet;
-    DWORD packetSize;
+    BYTE smallPayload[64];  /* Control messages fit here */
+    BYTE *payload = smallPayload;
+    WSABUF buffers[2];
+    DWORD bufferCount = 1;
+    DWORD bytesSent = 0;
     int result;
     
     if (sock == INVALID_SOCKET) return RD2K_ERR_SOCKET;
     
-    packetSize = sizeof(RELAY_HEADER) + dataLength;
-    packet = (BYTE*)malloc(packetSize);
-    if (!packet) return RD2K_ERR_MEMORY;
+    if (!data) dataLength = 0;
     
     header.msgType = msgType;
     header.flags = 0x01;  /* Flag: encrypted */
     header.reserved = 0;
     header.dataLength = dataLength;
     
-    CopyMemory(packet, &header, sizeof(RELAY_HEADER));
-    if (data && dataLength > 0) {
-        CopyMemory(packet + sizeof(RELAY_HEADER), data, dataLength);
+    /* Header and payload go out as two buffers of one WSASend() call.
+     * Only the payload is copied, because it is encrypted in place. */
+    buffers[0].buf = (char*)&header;
+    buffers[0].len = sizeof(RELAY_HEADER);
+    
+    if (dataLength > 0) {
+        if (dataLength > sizeof(smallPayload)) {
+            payload = (BYTE*)malloc(dataLength);
+            if (!payload) return RD2K_ERR_MEMORY;
+        }
+        CopyMemory(payload, data, dataLength);
         /* XOR encrypt the data portion */
-        Crypto_Encrypt(packet + sizeof(RELAY_HEADER), dataLength);
+        Crypto_Encrypt(payload, dataLength);
+        buffers[1].buf = (char*)payload;
+        buffers[1].len = dataLength;
+        bufferCount = 2;
     }
     
-    result = send(sock, (const char*)packet, packetSize, 0);
-    free(packet);
+    result = WSASend(sock, buffers, bufferCount, &bytesSent, 0, NULL, NULL);
+    if (payload != smallPayload) free(payload);
     
     if (result == SOCKET_ERROR) {
         return RD2K_ERR_SEND;
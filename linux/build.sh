@@ -31,7 +31,7 @@ echo "Compiling..."
 gcc -Wall -Wextra -std=c99 -O2 \
     -D_POSIX_C_SOURCE=200809L -D_GNU_SOURCE \
     -DNDEBUG \
-    relay_main.c relay.c crypto.c \
+    relay_main.c relay.c relay_admit.c relay_capture.c relay_cluster.c relay_hist.c relay_log.c relay_pool.c relay_registry.c relay_ring.c relay_timer.c relay_upgrade.c relay_uring.c crypto.c \
     -lpthread \
     -o relay_server
 
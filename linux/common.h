@@ -54,7 +54,7 @@ typedef int         SOCKET;
 
 /* Relay configuration */
 #define RELAY_DEFAULT_PORT          5000
-#define RELAY_MAX_CONNECTIONS       1024
+#define RELAY_MAX_CONNECTIONS       65536   /* Event loop holds idle clients cheaply */
 #define RELAY_BUFFER_SIZE           (64 * 1024)
 #define RELAY_CONNECTION_TIMEOUT    300000
 
@@ -68,6 +68,7 @@ typedef int         SOCKET;
 #define RELAY_MSG_PING              0x55
 #define RELAY_MSG_PONG              0x56
 #define RELAY_MSG_PARTNER_DISCONNECTED 0x57
+#define RELAY_MSG_PARTNER_CONNECTED    0x59
 
 /* Relay states */
 #define RELAY_STATE_CONNECTED       0
@@ -123,8 +124,26 @@ typedef struct {
     DWORD   partnerId;
 } RELAY_PARTNER_DISCONNECTED;
 
+typedef struct {
+    DWORD   partnerId;
+    DWORD   reserved;
+} RELAY_PARTNER_CONNECTED;
+
 #pragma pack(pop)
 
+/* Mix a 32-bit key for hash tables. Client IDs and IPv4 addresses of
+ * one network differ in a few bits only; this spreads them over all */
+static inline DWORD HashDword(DWORD key)
+{
+    DWORD h = key;
+    h ^= h >> 16;
+    h *= 0x7FEB352DU;
+    h ^= h >> 15;
+    h *= 0x846CA68BU;
+    h ^= h >> 16;
+    return h;
+}
+
 /* Time helper */
 static inline DWORD GetTickCount(void)
 {
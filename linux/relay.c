@@ -1,79 +1,397 @@
 /*
  * relay.c - RemoteDesk2K Linux Relay Server
- * 
+ *
  * POSIX/pthread implementation of the relay server
  * Compatible with Windows RemoteDesk2K clients
+ *
+ * The server runs one or more shards. Each shard is a thread with its own
+ * SO_REUSEPORT listen socket and an edge-triggered epoll loop that owns
+ * every client socket it accepted. Frames are reassembled incrementally in
+ * each connection's recvBuffer and dispatched to ProcessRelayMessage;
+ * output that does not fit into the kernel socket buffer waits in
+ * sendBuffer until EPOLLOUT.
+ *
+ * A connection is only ever touched by the shard that owns it. When a
+ * CONNECT_REQUEST pairs two clients living on different shards, the
+ * partner is handed over to the requester's shard through the shards'
+ * message inboxes, so DATA forwarding always stays on one thread and
+ * never takes a lock. Registered clients are found through a lock-striped
+ * hash map (relay_registry.c) instead of scanning every connection.
+ *
+ * With splice mode enabled, DATA payloads between paired clients are moved
+ * socket -> pipe -> socket with splice() and never enter user space; the
+ * relay only reads the 8-byte RELAY_HEADERs.
+ *
+ * With a coalescing window, small DATA output is held for a few
+ * microseconds so back-to-back frames for the same partner leave in one
+ * send().
+ *
+ * With fair scheduling, output that cannot go out at once waits in the
+ * connection's sendBuffer and each shard writes those queues in deficit
+ * round robin order, so one bulk transfer cannot crowd out interactive
+ * sessions; output can also be paced to an uplink rate and capped per
+ * client.
+ *
+ * In a cluster (relay_cluster.c), registrations are announced to the other
+ * nodes. A CONNECT_REQUEST for an ID registered elsewhere opens a node
+ * link: an outbound connection to the partner's node that is paired with
+ * the requester like any partner, while the other node pairs its end of
+ * the link with the partner.
+ *
+ * Shards can be pinned to CPUs. A pinned shard takes its buffers from
+ * arenas on its CPU's NUMA node (relay_pool.c) and, with accept steering,
+ * its listen socket carries SO_INCOMING_CPU so the kernel hands it the
+ * connections whose packets that CPU receives.
+ *
+ * Relay_ListSessions and Relay_CloseSession are answered by every shard
+ * from its own connection list between two loop passes.
+ *
+ * For a hot upgrade (relay_upgrade.c), Relay_Detach quiesces the shards
+ * and describes every socket and buffered byte in a RELAY_HANDOFF; the
+ * successor passes the same handoff to Relay_CreateEx and carries on.
  */
 
 #include "common.h"
 #include "crypto.h"
+#include "relay.h"
+#include "relay_admit.h"
+#include "relay_capture.h"
+#include "relay_cluster.h"
+#include "relay_hist.h"
+#include "relay_pool.h"
+#include "relay_registry.h"
+#include "relay_timer.h"
+#include "relay_uring.h"
 #include <netinet/tcp.h>
+#include <poll.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
 
 /* Inactivity timeout - disconnect clients that don't send any data */
 #define CLIENT_INACTIVITY_TIMEOUT_MS  5000  /* 5 seconds - fast timeout for relay */
 
+/* Event loop tuning */
+#define RELAY_MAX_EVENTS            256     /* epoll events per wakeup */
+#define RELAY_POLL_INTERVAL_MS      100     /* epoll_wait timeout (idle timer tick) */
+#define RELAY_ACCEPT_BATCH          128     /* accept4() calls per listener wakeup */
+#define RELAY_READ_BUDGET           16      /* recv() calls per connection per wakeup */
+#define RELAY_MAX_PENDING_SEND      (4 * 1024 * 1024)  /* Unsent bytes before a peer is dropped */
+#define RELAY_SEND_HIGH_WATER       (1024 * 1024)      /* Stop reading the partner above this */
+#define RELAY_SEND_LOW_WATER        (256 * 1024)       /* Resume reading the partner below this */
+#define RELAY_SPLICE_PIPE_SIZE      (256 * 1024)       /* Requested splice pipe capacity */
+#define RELAY_FORWARD_IOV           64      /* iovecs per forwarding sendmsg() */
+#define RELAY_CUT_THROUGH_MIN       (16 * 1024)  /* DATA frames this big are forwarded as they arrive */
+#define RELAY_IDLE_BUFFER_SIZE      64      /* Inline recvBuffer until a session needs more */
+#define RELAY_SESSION_MARKS         64      /* Forwarded batches timed per session */
+#define RELAY_QUIESCE_MS            2000    /* Relay_Detach: wait for shards to settle */
+
+/* Fair scheduling */
+#define RELAY_SCHED_QUANTUM         (16 * 1024)  /* Bytes per round at weight 1 */
+#define RELAY_SCHED_QUANTUM_MIN     2048    /* Paced: at least this per round... */
+#define RELAY_SCHED_QUANTUM_US      2000    /* ...and at most this much uplink time */
+#define RELAY_SCHED_NOTSENT_LOWAT   (128 * 1024) /* Unsent bytes the kernel may hold per socket */
+#define RELAY_RATE_BURST_MS         10      /* Rate buckets hold this much of their rate */
+
+/* io_uring backend */
+#define RELAY_URING_ENTRIES         1024    /* SQ size per shard */
+#define RELAY_URING_BUFFERS         256     /* Provided recv buffers per shard */
+#define RELAY_URING_BUFFER_SIZE     (16 * 1024)
+#define RELAY_URING_BUFFER_GROUP    0
+#define RELAY_URING_DRAIN_MS        1000    /* Wait for in-flight requests on destroy */
+/* A paused reader's recv may fill the whole buffer ring before its cancel lands */
+#define RELAY_URING_STASH_MAX       (2 * RELAY_URING_BUFFERS * RELAY_URING_BUFFER_SIZE)
+
+/* io_uring user_data: connection (or shard) pointer | operation tag */
+#define URING_TAG_ACCEPT            1
+#define URING_TAG_WAKE              2
+#define URING_TAG_RECV              3
+#define URING_TAG_SEND              4
+#define URING_TAG_CANCEL            5
+#define URING_TAG_MASK              7ULL
+
 /* ============================================================
  * LOGGING
  * ============================================================ */
 
 typedef void (*RELAY_LOG_CALLBACK)(const char* message);
-static RELAY_LOG_CALLBACK g_pfnLogCallback = NULL;
-static pthread_mutex_t g_logMutex = PTHREAD_MUTEX_INITIALIZER;
+static RELAY_LOG_CALLBACK g_pfnLogCallback = NULL;     /* Atomic */
 
 void Relay_SetLogCallback(RELAY_LOG_CALLBACK pfnCallback)
 {
-    pthread_mutex_lock(&g_logMutex);
-    g_pfnLogCallback = pfnCallback;
-    pthread_mutex_unlock(&g_logMutex);
+    __atomic_store_n(&g_pfnLogCallback, pfnCallback, __ATOMIC_RELEASE);
 }
 
+/* Runs on the shard threads: format on the stack and hand the text over.
+ * The callback may be called from several threads at once and must not
+ * block (relay_main.c queues it for its log writer thread) */
 static void RelayLog(const char* format, ...)
 {
+    RELAY_LOG_CALLBACK pfnCallback = __atomic_load_n(&g_pfnLogCallback, __ATOMIC_ACQUIRE);
     char buffer[512];
     va_list args;
-    
+
+    if (!pfnCallback) return;
+
     va_start(args, format);
     vsnprintf(buffer, sizeof(buffer)-1, format, args);
     buffer[sizeof(buffer)-1] = '\0';
     va_end(args);
-    
-    pthread_mutex_lock(&g_logMutex);
-    if (g_pfnLogCallback) {
-        g_pfnLogCallback(buffer);
-    }
-    pthread_mutex_unlock(&g_logMutex);
+
+    pfnCallback(buffer);
 }
 
 /* ============================================================
  * DATA STRUCTURES
  * ============================================================ */
 
+/* Token bucket in bytes, refilled from the clock whenever it is used */
+typedef struct _RELAY_RATE {
+    DWORD               rate;               /* Bytes per second, 0 = unlimited */
+    unsigned long long  level;              /* Bytes available, times 1000000 */
+    unsigned long long  burst;              /* Most level may reach, same unit */
+    unsigned long long  refilledUs;
+} RELAY_RATE;
+
+/* A forwarded batch of DATA frames waiting for the socket to take it */
+typedef struct _RELAY_SEND_MARK {
+    unsigned long long  receivedUs;         /* Frames fully received */
+    DWORD               endSeq;             /* sentSeq once the batch is out */
+    DWORD               frames;
+} RELAY_SEND_MARK;
+
+/* Forwarding statistics for the DATA a paired connection receives from
+ * its partner. Byte sequence numbers count this socket's output since
+ * pairing; a batch is out when sentSeq passes its mark. Batches beyond
+ * RELAY_SESSION_MARKS in flight are counted by size only */
+typedef struct _RELAY_SESSION {
+    DWORD               partnerId;
+    DWORD               startTime;
+    DWORD               sendSeq;            /* Bytes queued */
+    DWORD               sentSeq;            /* Bytes taken by the kernel */
+    DWORD               markHead;
+    DWORD               markCount;
+    RELAY_SEND_MARK     marks[RELAY_SESSION_MARKS];
+    RELAY_HIST          delay;              /* Receipt to send completion, microseconds */
+    RELAY_HIST          size;               /* DATA frame size, header included */
+} RELAY_SESSION;
+
 typedef struct _RELAY_CONNECTION {
     SOCKET              socket;
-    DWORD               clientId;
-    DWORD               state;
-    pthread_t           thread;
-    int                 threadValid;
-    volatile int        shouldStop;
+    DWORD               clientId;           /* Written under its registry stripe lock */
+    DWORD               state;              /* Written under its registry stripe lock */
+    DWORD               prevState;          /* State to restore if pairing fails */
+    BOOL                bClosed;            /* Socket closed, awaiting free */
+    BOOL                bReadPending;       /* Read budget exhausted, on ready list */
+    BOOL                bReadPaused;        /* Partner's queue above high water mark */
+    BOOL                bSendBlocked;       /* Socket full: output waits for EPOLLOUT */
+    BOOL                bParked;            /* Reaped while still referenced */
+    BOOL                bNodeLink;          /* Carries a session to another cluster node */
+    DWORD               peerAddr;           /* Source IPv4, network order (0 = unknown) */
+    DWORD               captureId;          /* Connection number in the capture, 0 = not captured */
+    unsigned long long  bytesIn;            /* Frames received, headers included */
+    unsigned long long  bytesOut;           /* DATA forwarded to us */
+    DWORD               pendingMsgs;        /* Shard messages still referencing us (atomic) */
     struct _RELAY_CONNECTION* pPartner;
     struct _RELAY_SERVER* pServer;
-    BYTE*               recvBuffer;
+    struct _RELAY_SHARD* pShard;            /* Owning shard, written under its stripe lock */
+    struct _RELAY_CONNECTION* pPrevConn;    /* Shard connection list */
+    struct _RELAY_CONNECTION* pNextConn;
+    struct _RELAY_CONNECTION* pNextReady;   /* Ready list (read budget carry-over) */
+    struct _RELAY_CONNECTION* pNextClosed;  /* Closed list (freed after event batch) */
+    BYTE*               recvBuffer;         /* idleBuffer, or RELAY_BUFFER_SIZE from the pool */
     DWORD               recvBufferSize;
+    DWORD               recvPos;            /* Bytes buffered, not yet processed */
+    BYTE                idleBuffer[RELAY_IDLE_BUFFER_SIZE];
+    BYTE*               sendBuffer;         /* Bytes the socket could not take yet */
+    DWORD               sendBufferSize;
+    DWORD               sendPos;
+    DWORD               sendLen;
     DWORD               lastActivity;
+    RELAY_TIMER         idleTimer;          /* Inactivity deadline on the owning shard's wheel */
+    int                 pipeFds[2];         /* Splice mode: payload pipe, -1 until needed */
+    DWORD               pipeSize;
+    DWORD               pipeLen;            /* Bytes in the pipe not yet sent to the partner */
+    DWORD               spliceIn;           /* Payload bytes still to move from our socket */
+    struct _RELAY_CONNECTION* pSpliceFrom;  /* Partner whose spliced frame we are sending */
+    /* Cut-through forwarding */
+    DWORD               streamIn;           /* Bytes of the DATA frame being forwarded still to read */
+    BOOL                bStreamDrop;        /* That frame arrived unpaired: discard the rest */
+    BOOL                bMidFrame;          /* Our output ends inside the partner's frame */
+    BOOL                bPongOwed;          /* PING received while bMidFrame */
+    /* io_uring backend */
+    DWORD               uringOps;           /* Requests in flight that reference us */
+    BOOL                bRecvArmed;         /* Multishot recv active */
+    BOOL                bSendInFlight;
+    BOOL                bSendQueued;        /* On the shard's send list */
+    struct _RELAY_CONNECTION* pNextSend;
+    BYTE*               flightBuffer;       /* Bytes the kernel is sending; sendBuffer fills meanwhile */
+    DWORD               flightBufferSize;
+    DWORD               flightPos;
+    DWORD               flightLen;
+    BYTE*               stashBuffer;        /* Received while paused, framed on resume */
+    DWORD               stashSize;
+    DWORD               stashLen;
+    struct _RELAY_SHARD_MSG* pHandoffMsg;   /* Pair request waiting for our requests to finish */
+    RELAY_SESSION*      pSession;           /* While paired */
+    /* Send coalescing */
+    BOOL                bHeld;              /* On the shard's held list */
+    unsigned long long  heldSinceUs;        /* Written out coalesceUs after this */
+    struct _RELAY_CONNECTION* pNextHeld;
+    /* Fair scheduling */
+    BOOL                bScheduled;         /* On one of the shard's round robin lists */
+    DWORD               weight;             /* Quanta per round, from the partner's share */
+    DWORD               deficit;            /* Bytes it may still write this round */
+    RELAY_RATE          cap;                /* The partner's rate cap */
+    struct _RELAY_CONNECTION* pNextScheduled;
 } RELAY_CONNECTION;
 
-typedef struct _RELAY_SERVER {
+/* Cross-shard messages */
+#define SHARD_MSG_KICK          1   /* Close pConn (stale duplicate ID) */
+#define SHARD_MSG_PAIR_REQUEST  2   /* Claim partnerId for requester pConn */
+#define SHARD_MSG_PAIR_ATTACH   3   /* pPartner was claimed, adopt it and pair */
+#define SHARD_MSG_PAIR_FAILED   4   /* Claim failed, answer requester pConn */
+
+typedef struct _RELAY_SHARD_MSG {
+    DWORD               type;
+    RELAY_CONNECTION*   pConn;
+    RELAY_CONNECTION*   pPartner;
+    DWORD               requesterId;
+    DWORD               partnerId;
+    struct _RELAY_SHARD* pReplyShard;
+    struct _RELAY_SHARD_MSG* pNext;
+} RELAY_SHARD_MSG;
+
+/* Counters of one shard. The shard thread is the only writer, so updates
+ * are plain relaxed stores; Relay_GetStatsEx sums them */
+typedef struct _RELAY_SHARD_STATS {
+    unsigned long long  totalConnections;
+    unsigned long long  successfulPairs;
+    unsigned long long  failedConnections;
+    unsigned long long  rejectedRegistrations;
+    unsigned long long  timeouts;
+    unsigned long long  framesIn[RELAY_STATS_MSG_TYPES];
+    unsigned long long  bytesIn[RELAY_STATS_MSG_TYPES];
+    unsigned long long  framesForwarded;
+    unsigned long long  bytesForwarded;
+    unsigned long long  coalescedBatches;
+    unsigned long long  coalescedSends;
+    unsigned long long  nodeLinkPairs;
+    unsigned long long  cutThroughFrames;
+    unsigned long long  scheduledBytes;
+    unsigned long long  rateCapWaits;
+    unsigned long long  uplinkWaits;
+    unsigned long long  remoteAccepts;
+} RELAY_SHARD_STATS;
+
+#define SHARD_STAT_ADD(pShard, field, n) \
+    __atomic_store_n(&(pShard)->stats.field, (pShard)->stats.field + (n), __ATOMIC_RELAXED)
+
+typedef struct _RELAY_SHARD {
+    struct _RELAY_SERVER* pServer;
+    DWORD               index;
+    int                 cpu;                /* Pinned to this CPU, -1 = not pinned */
     SOCKET              listenSocket;
-    RELAY_CONNECTION**  connections;
+    int                 epollFd;
+    int                 wakeFd;             /* eventfd, signalled on inbox post */
+    pthread_t           thread;
+    int                 threadValid;
+    pthread_mutex_t     inboxMutex;
+    RELAY_SHARD_MSG*    pInboxHead;
+    RELAY_SHARD_MSG*    pInboxTail;
+    RELAY_CONNECTION*   pConnList;          /* Connections owned by this shard */
+    RELAY_CONNECTION*   pReadyList;
+    RELAY_CONNECTION*   pClosedList;
+    RELAY_TIMER_WHEEL   timers;             /* Connection inactivity deadlines */
+    /* Send coalescing (epoll backend) */
+    int                 coalesceFd;         /* timerfd for the oldest hold, -1 when off */
+    unsigned long long  coalesceArmedUs;    /* Deadline coalesceFd was last set to */
+    RELAY_CONNECTION*   pHeldHead;          /* Holding output, oldest first */
+    RELAY_CONNECTION*   pHeldTail;
+    /* Fair scheduling (epoll backend) */
+    int                 schedFd;            /* timerfd for rate waits, -1 when off */
+    unsigned long long  schedArmedUs;
+    RELAY_CONNECTION*   pNewHead;           /* Output that just started to queue */
+    RELAY_CONNECTION*   pNewTail;
+    RELAY_CONNECTION*   pOldHead;           /* Backlogged output */
+    RELAY_CONNECTION*   pOldTail;
+    DWORD               scheduledCount;     /* On either list */
+    DWORD               uplinkCredit;       /* Taken from the server's uplink bucket, unspent */
+    /* io_uring backend */
+    RELAY_URING         ring;
+    RELAY_CONNECTION*   pSendList;          /* Connections with output to submit */
+    DWORD               uringOps;           /* Connection requests in flight */
+    uint64_t            wakeCount;          /* eventfd read target */
+    BOOL                bDraining;          /* Destroying: only account completions */
+    BOOL                bArmed;             /* Accept and eventfd read submitted */
+    BOOL                bQuiesced;          /* Upgrade: accept and requests cancelled */
+    BOOL                bSettled;           /* Upgrade: nothing left in flight (atomic) */
+    BOOL                bResume;            /* Re-arm every connection when the loop starts */
+    DWORD               histDumpSeq;        /* Last Relay_DumpHistograms request served */
+    DWORD               adminSeq;           /* Last admin request answered (answerMutex) */
+    RELAY_SESSION_INFO* pAnswer;            /* Listed sessions, taken by the requester */
+    DWORD               answerCount;        /* Sessions listed, or connections closed */
+    int                 answerStatus;       /* RD2K_SUCCESS or RD2K_ERR_MEMORY */
+    RELAY_HIST          delayHist;          /* All sessions, written by this shard only */
+    RELAY_HIST          sizeHist;
+    RELAY_SHARD_STATS   stats;
+    BYTE                padding[64];        /* Keep shards' counters on separate cache lines */
+} RELAY_SHARD;
+
+typedef struct _RELAY_SERVER {
+    RELAY_SHARD*        shards;
+    DWORD               shardCount;
+    RELAY_REGISTRY*     pRegistry;          /* clientId -> registered connection */
+    struct _RELAY_CLUSTER* pCluster;        /* Other nodes' registrations, NULL = standalone */
+    RELAY_ADMIT*        pAdmit;             /* Accept/REGISTER rate limits, NULL = none */
+    RELAY_CAPTURE*      pCapture;           /* Client traffic recorder, NULL = off */
     DWORD               maxConnections;
-    DWORD               activeConnections;
+    DWORD               activeConnections;  /* Atomic */
+    DWORD               pausedReaders;      /* Atomic */
+    unsigned long long  queuedBytes;        /* Atomic, sum of all sendBuffers */
+    unsigned long long  backpressurePauses; /* Atomic */
     WORD                port;
-    pthread_t           acceptThread;
-    int                 acceptThreadValid;
-    pthread_mutex_t     connMutex;
+    BOOL                bSplice;            /* Zero-copy DATA forwarding */
+    DWORD               backend;            /* RELAY_BACKEND_* */
+    DWORD               coalesceUs;         /* 0 = send coalescing off */
+    DWORD               coalesceBytes;
+    BOOL                bSteerAccepts;      /* SO_INCOMING_CPU on pinned shards' listeners */
+    BOOL                bReencrypt;         /* Old DATA path, for relay_bench */
+    BOOL                bFair;              /* Fair scheduling */
+    DWORD               schedQuantum;
+    RELAY_CLIENT_SHARE* pShares;
+    DWORD               shareCount;
+    pthread_mutex_t     uplinkMutex;
+    RELAY_RATE          uplink;             /* Shared by all shards, rate 0 = unpaced */
+    DWORD               histDumpSeq;        /* Atomic, bumped by Relay_DumpHistograms */
+    pthread_mutex_t     adminMutex;         /* One admin request at a time */
+    pthread_mutex_t     answerMutex;        /* Shards' answers */
+    pthread_cond_t      answerCond;
+    DWORD               adminSeq;           /* Atomic, bumped per admin request */
+    DWORD               adminCloseId;       /* Request: close this client, 0 = list sessions */
+    DWORD               shardMsgs;          /* Atomic, shard messages not yet freed */
+    volatile int        bQuiescing;         /* Relay_Detach: stop reading and accepting */
+    BOOL                bDetached;          /* Sockets handed over, keep them intact */
     volatile int        bRunning;
 } RELAY_SERVER;
 
+static void CloseConnection(RELAY_SHARD *pShard, RELAY_CONNECTION *pConn);
+static void FailConnectRequest(RELAY_SHARD *pShard, RELAY_CONNECTION *pConn);
+static void UringMarkSend(RELAY_SHARD *pShard, RELAY_CONNECTION *pConn);
+static BOOL UringArmRecv(RELAY_SHARD *pShard, RELAY_CONNECTION *pConn);
+static void UringDetach(RELAY_SHARD *pShard, RELAY_CONNECTION *pConn);
+static void AccountQueued(RELAY_CONNECTION *pConn, DWORD bytes);
+static void AccountSent(RELAY_CONNECTION *pConn, DWORD bytes);
+static int QueueForward(RELAY_SHARD *pShard, RELAY_CONNECTION *pConn,
+                        struct iovec *iov, int iovCount, DWORD length);
+static void UnholdConnection(RELAY_SHARD *pShard, RELAY_CONNECTION *pConn);
+static void SetOutputShare(RELAY_SERVER *pServer, RELAY_CONNECTION *pConn, DWORD partnerId);
+static void UnscheduleConnection(RELAY_SHARD *pShard, RELAY_CONNECTION *pConn);
+static void ResumeShard(RELAY_SHARD *pShard);
+
 /* ============================================================
  * HELPER FUNCTIONS
  * ============================================================ */
@@ -87,198 +405,630 @@ static void FormatClientId(DWORD id, char *buffer)
             id & 0xFF);
 }
 
-static int SendRelayPacket(SOCKET sock, BYTE msgType, const BYTE *data, DWORD dataLength)
+static unsigned long long GetMicroseconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000 + (unsigned long long)ts.tv_nsec / 1000;
+}
+
+/* Set a shard's timerfd to fire at deadlineUs (GetMicroseconds time) */
+static void ArmTimerFd(int fd, unsigned long long *pArmedUs, unsigned long long deadlineUs)
+{
+    struct itimerspec its;
+
+    if (deadlineUs == *pArmedUs) return;
+
+    ZeroMemory(&its, sizeof(its));
+    its.it_value.tv_sec = (time_t)(deadlineUs / 1000000);
+    its.it_value.tv_nsec = (long)(deadlineUs % 1000000) * 1000;
+    timerfd_settime(fd, TFD_TIMER_ABSTIME, &its, NULL);
+    *pArmedUs = deadlineUs;
+}
+
+static void ReadTimerFd(int fd)
+{
+    uint64_t expirations;
+
+    if (read(fd, &expirations, sizeof(expirations)) < 0) {
+        /* Already consumed */
+    }
+}
+
+/* Outbound bytes not yet taken by the kernel */
+static DWORD PendingSend(RELAY_CONNECTION *pConn)
+{
+    return (pConn->sendLen - pConn->sendPos) + (pConn->flightLen - pConn->flightPos);
+}
+
+/* Write up to limit bytes of sendBuffer. Returns the number written,
+ * fewer than that only if the socket is full, or -1 on a socket error */
+static int WriteSendBuffer(RELAY_CONNECTION *pConn, DWORD limit)
+{
+    DWORD written = 0;
+    ssize_t sent;
+
+    while (pConn->sendPos < pConn->sendLen && written < limit) {
+        DWORD want = pConn->sendLen - pConn->sendPos;
+
+        if (want > limit - written) want = limit - written;
+        sent = send(pConn->socket, pConn->sendBuffer + pConn->sendPos, want, MSG_NOSIGNAL);
+        if (sent > 0) {
+            pConn->sendPos += (DWORD)sent;
+            pConn->bSendBlocked = FALSE;
+            written += (DWORD)sent;
+            AccountSent(pConn, (DWORD)sent);
+            __atomic_sub_fetch(&pConn->pServer->queuedBytes, (unsigned long long)sent,
+                               __ATOMIC_RELAXED);
+            continue;
+        }
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            pConn->bSendBlocked = TRUE;
+            return (int)written;
+        }
+        return -1;
+    }
+
+    if (pConn->sendPos == pConn->sendLen) {
+        pConn->sendPos = 0;
+        pConn->sendLen = 0;
+    }
+    return (int)written;
+}
+
+/* Write as much of sendBuffer as the socket accepts.
+ * Returns 0 when drained or the socket is full, -1 on a socket error */
+static int FlushSendBuffer(RELAY_CONNECTION *pConn)
+{
+    return WriteSendBuffer(pConn, 0xFFFFFFFF) < 0 ? -1 : 0;
+}
+
+/* Copy a gather list of length bytes to the end of sendBuffer */
+static int AppendSendBuffer(RELAY_CONNECTION *pConn, const struct iovec *iov, int iovCount,
+                            DWORD length)
+{
+    DWORD pending;
+    int i;
+
+    /* Compact, then grow the queue if needed */
+    if (PendingSend(pConn) + length > RELAY_MAX_PENDING_SEND) return RD2K_ERR_SEND;
+    pending = pConn->sendLen - pConn->sendPos;
+
+    if (pConn->sendPos > 0) {
+        memmove(pConn->sendBuffer, pConn->sendBuffer + pConn->sendPos, pending);
+        pConn->sendPos = 0;
+        pConn->sendLen = pending;
+    }
+
+    if (pending + length > pConn->sendBufferSize) {
+        DWORD newSize = pConn->sendBufferSize ? pConn->sendBufferSize : RELAY_BUFFER_SIZE;
+        BYTE *newBuffer;
+
+        while (newSize < pending + length) newSize *= 2;
+        newBuffer = (BYTE*)Pool_Realloc(pConn->sendBuffer, newSize);
+        if (!newBuffer) return RD2K_ERR_MEMORY;
+        pConn->sendBuffer = newBuffer;
+        pConn->sendBufferSize = newSize;
+    }
+
+    for (i = 0; i < iovCount; i++) {
+        memcpy(pConn->sendBuffer + pConn->sendLen, iov[i].iov_base, iov[i].iov_len);
+        pConn->sendLen += (DWORD)iov[i].iov_len;
+    }
+    __atomic_add_fetch(&pConn->pServer->queuedBytes, length, __ATOMIC_RELAXED);
+    return RD2K_SUCCESS;
+}
+
+/* Send a gather list to a connection without blocking. Whatever the kernel
+ * does not take immediately is appended to sendBuffer and written on
+ * EPOLLOUT. The iovecs are consumed (advanced) in place. */
+static int QueueSendV(RELAY_CONNECTION *pConn, struct iovec *iov, int iovCount)
+{
+    struct msghdr msg;
+    ssize_t sent;
+    DWORD length = 0;
+    int i, result;
+
+    if (pConn->bClosed || pConn->socket == INVALID_SOCKET) return RD2K_ERR_SOCKET;
+
+    for (i = 0; i < iovCount; i++)
+        length += (DWORD)iov[i].iov_len;
+    AccountQueued(pConn, length);
+
+    /* Nothing queued - try to hand the bytes straight to the kernel in one
+     * sendmsg(). While a spliced frame is being written, everything waits
+     * behind it. The io_uring backend always queues and submits one SEND
+     * per connection per loop pass. */
+    while (pConn->pServer->backend == RELAY_BACKEND_EPOLL &&
+           pConn->sendLen == pConn->sendPos && !pConn->pSpliceFrom && length > 0) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = (size_t)iovCount;
+
+        sent = sendmsg(pConn->socket, &msg, MSG_NOSIGNAL);
+        if (sent > 0) {
+            length -= (DWORD)sent;
+            pConn->bSendBlocked = FALSE;
+            AccountSent(pConn, (DWORD)sent);
+            /* Skip what went out, possibly ending inside an iovec */
+            while (iovCount > 0 && (size_t)sent >= iov->iov_len) {
+                sent -= (ssize_t)iov->iov_len;
+                iov++;
+                iovCount--;
+            }
+            if (iovCount > 0) {
+                iov->iov_base = (BYTE*)iov->iov_base + sent;
+                iov->iov_len -= (size_t)sent;
+            }
+            continue;
+        }
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            pConn->bSendBlocked = TRUE;
+            break;
+        }
+        return RD2K_ERR_SEND;
+    }
+
+    if (length == 0) return RD2K_SUCCESS;
+
+    result = AppendSendBuffer(pConn, iov, iovCount, length);
+    if (result == RD2K_SUCCESS && pConn->pServer->backend == RELAY_BACKEND_URING)
+        UringMarkSend(pConn->pShard, pConn);
+    return result;
+}
+
+/* Header and payload go out as separate iovecs; only the payload is copied,
+ * because it has to be encrypted */
+static int SendRelayPacket(RELAY_CONNECTION *pConn, BYTE msgType, const BYTE *data, DWORD dataLength)
 {
     RELAY_HEADER header;
-    BYTE *packet;
-    DWORD packetSize;
-    ssize_t result;
-    
-    if (sock == INVALID_SOCKET) return RD2K_ERR_SOCKET;
-    
-    packetSize = sizeof(RELAY_HEADER) + dataLength;
-    packet = (BYTE*)malloc(packetSize);
-    if (!packet) return RD2K_ERR_MEMORY;
-    
+    BYTE smallPayload[64];  /* Control messages fit here */
+    BYTE *payload = smallPayload;
+    struct iovec iov[2];
+    int iovCount = 1;
+    int result;
+
+    if (!pConn || pConn->bClosed) return RD2K_ERR_SOCKET;
+
+    if (!data) dataLength = 0;
+
     header.msgType = msgType;
     header.flags = 0x01;  /* Encrypted */
     header.reserved = 0;
     header.dataLength = dataLength;
-    
-    memcpy(packet, &header, sizeof(RELAY_HEADER));
-    if (data && dataLength > 0) {
-        memcpy(packet + sizeof(RELAY_HEADER), data, dataLength);
-        Crypto_Encrypt(packet + sizeof(RELAY_HEADER), dataLength);
+
+    iov[0].iov_base = &header;
+    iov[0].iov_len = sizeof(RELAY_HEADER);
+
+    if (dataLength > 0) {
+        if (dataLength > sizeof(smallPayload)) {
+            payload = (BYTE*)Pool_Alloc(dataLength);
+            if (!payload) return RD2K_ERR_MEMORY;
+        }
+        memcpy(payload, data, dataLength);
+        Crypto_Encrypt(payload, dataLength);
+        iov[1].iov_base = payload;
+        iov[1].iov_len = dataLength;
+        iovCount = 2;
     }
-    
-    result = send(sock, packet, packetSize, MSG_NOSIGNAL);
-    free(packet);
-    
-    return (result == (ssize_t)packetSize) ? RD2K_SUCCESS : RD2K_ERR_SEND;
+
+    result = QueueSendV(pConn, iov, iovCount);
+    if (payload != smallPayload)
+        Pool_Free(payload);
+
+    return result;
 }
 
-static int WaitForSocketReady(SOCKET sock, BOOL bWrite, int timeoutMs)
+/* Fields read by other shards (state, pShard) change under the registry
+ * stripe lock of the connection's clientId */
+static void SetConnectionState(RELAY_SERVER *pServer, RELAY_CONNECTION *pConn, DWORD state)
 {
-    fd_set fds;
-    struct timeval tv;
-    int result;
-    
-    if (sock == INVALID_SOCKET) return -1;
-    
-    FD_ZERO(&fds);
-    FD_SET(sock, &fds);
-    
-    tv.tv_sec = timeoutMs / 1000;
-    tv.tv_usec = (timeoutMs % 1000) * 1000;
-    
-    if (bWrite)
-        result = select(sock + 1, NULL, &fds, NULL, &tv);
-    else
-        result = select(sock + 1, &fds, NULL, NULL, &tv);
-    
-    if (result < 0) return -1;
-    if (result == 0) return 0;
-    return 1;
+    Registry_Lock(pServer->pRegistry, pConn->clientId);
+    pConn->state = state;
+    Registry_Unlock(pServer->pRegistry, pConn->clientId);
 }
 
-static BOOL IsSocketAlive(SOCKET sock)
+/* Caller must hold the stripe lock for clientId; the result is only valid
+ * while it is held */
+static RELAY_CONNECTION* FindConnectionById(RELAY_SERVER *pServer, DWORD clientId)
 {
-    char buf;
-    int result;
-    fd_set readfds;
-    struct timeval tv;
-    
-    if (sock == INVALID_SOCKET) return FALSE;
-    
-    FD_ZERO(&readfds);
-    FD_SET(sock, &readfds);
-    tv.tv_sec = 0;
-    tv.tv_usec = 0;
-    
-    result = select(sock + 1, &readfds, NULL, NULL, &tv);
-    
-    if (result < 0) return FALSE;
-    
-    if (result > 0) {
-        result = recv(sock, &buf, 1, MSG_PEEK | MSG_DONTWAIT);
-        if (result == 0) return FALSE;
-        if (result < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
-            return FALSE;
+    RELAY_CONNECTION *pConn;
+
+    if (!pServer) return NULL;
+
+    pConn = (RELAY_CONNECTION*)Registry_Find(pServer->pRegistry, clientId);
+    if (pConn && pConn->state == RELAY_STATE_DISCONNECTED) return NULL;
+    return pConn;
+}
+
+/* ============================================================
+ * SESSION HISTOGRAMS
+ * ============================================================ */
+
+/* Bytes about to enter pConn's output stream */
+static void AccountQueued(RELAY_CONNECTION *pConn, DWORD bytes)
+{
+    if (pConn->pSession) pConn->pSession->sendSeq += bytes;
+}
+
+/* The kernel took bytes of pConn's output: finish every batch they cover */
+static void AccountSent(RELAY_CONNECTION *pConn, DWORD bytes)
+{
+    RELAY_SESSION *pSession = pConn->pSession;
+    unsigned long long now = 0;
+
+    if (!pSession) return;
+
+    pSession->sentSeq += bytes;
+    while (pSession->markCount > 0) {
+        RELAY_SEND_MARK *pMark = &pSession->marks[pSession->markHead];
+        DWORD delay;
+
+        if ((int)(pSession->sentSeq - pMark->endSeq) < 0) break;
+
+        if (now == 0) now = GetMicroseconds();
+        delay = (DWORD)(now - pMark->receivedUs);
+        Hist_Record(&pSession->delay, delay, pMark->frames);
+        Hist_Record(&pConn->pShard->delayHist, delay, pMark->frames);
+
+        pSession->markHead = (pSession->markHead + 1) % RELAY_SESSION_MARKS;
+        pSession->markCount--;
+    }
+}
+
+/* Time the next bytes queued to pConn as frames received at receivedUs.
+ * Call before the bytes are queued */
+static void MarkForwarded(RELAY_CONNECTION *pConn, DWORD bytes, DWORD frames,
+                          unsigned long long receivedUs)
+{
+    RELAY_SESSION *pSession = pConn->pSession;
+    RELAY_SEND_MARK *pMark;
+
+    if (!pSession || pSession->markCount == RELAY_SESSION_MARKS) return;
+
+    pMark = &pSession->marks[(pSession->markHead + pSession->markCount) % RELAY_SESSION_MARKS];
+    pMark->receivedUs = receivedUs;
+    pMark->endSeq = pSession->sendSeq + bytes;
+    pMark->frames = frames;
+    pSession->markCount++;
+}
+
+/* A DATA frame from pConn is on its way to pConn's partner */
+static void RecordFrameSize(RELAY_SHARD *pShard, RELAY_CONNECTION *pConn, DWORD size)
+{
+    Hist_Record(&pShard->sizeHist, size, 1);
+    if (pConn->pPartner && pConn->pPartner->pSession)
+        Hist_Record(&pConn->pPartner->pSession->size, size, 1);
+}
+
+static void LogSession(RELAY_CONNECTION *pConn, const char *what)
+{
+    RELAY_SESSION *pSession = pConn->pSession;
+    char fromStr[20], toStr[20];
+    char summary[160];
+
+    if (pSession->size.total == 0) return;
+
+    FormatClientId(pSession->partnerId, fromStr);
+    FormatClientId(pConn->clientId, toStr);
+
+    Hist_Format(&pSession->delay, summary, sizeof(summary));
+    RelayLog("[HIST] Session %s -> %s %s after %u s, forwarding delay (us): %s\n",
+             fromStr, toStr, what, (GetTickCount() - pSession->startTime) / 1000, summary);
+    Hist_Format(&pSession->size, summary, sizeof(summary));
+    RelayLog("[HIST] Session %s -> %s frame size (bytes): %s\n", fromStr, toStr, summary);
+}
+
+/* Start timing what pConn receives from partnerId. Output queued before
+ * this point is not part of the session */
+static void StartSession(RELAY_CONNECTION *pConn, DWORD partnerId)
+{
+    if (pConn->pSession) return;
+
+    /* Without memory the session just goes unmeasured */
+    pConn->pSession = (RELAY_SESSION*)Pool_Alloc(sizeof(RELAY_SESSION));
+    if (!pConn->pSession) return;
+
+    pConn->pSession->partnerId = partnerId;
+    pConn->pSession->startTime = GetTickCount();
+    pConn->pSession->sendSeq = PendingSend(pConn);
+    pConn->pSession->sentSeq = 0;
+    pConn->pSession->markHead = 0;
+    pConn->pSession->markCount = 0;
+    Hist_Reset(&pConn->pSession->delay);
+    Hist_Reset(&pConn->pSession->size);
+}
+
+static void EndSession(RELAY_CONNECTION *pConn)
+{
+    if (!pConn->pSession) return;
+
+    LogSession(pConn, "ended");
+    Pool_Free(pConn->pSession);
+    pConn->pSession = NULL;
+}
+
+/* Relay_DumpHistograms asked every shard to log its open sessions */
+static void DumpSessionHistograms(RELAY_SHARD *pShard)
+{
+    RELAY_CONNECTION *pConn;
+    DWORD seq = __atomic_load_n(&pShard->pServer->histDumpSeq, __ATOMIC_RELAXED);
+
+    if (seq == pShard->histDumpSeq) return;
+    pShard->histDumpSeq = seq;
+
+    for (pConn = pShard->pConnList; pConn; pConn = pConn->pNextConn) {
+        if (pConn->pSession && !pConn->bClosed)
+            LogSession(pConn, "open");
+    }
+}
+
+/* ============================================================
+ * ADMIN REQUESTS
+ *
+ * A requester posts adminSeq/adminCloseId and wakes the shards. Each
+ * answers from its own connection list, the one place a connection is
+ * known to be attached and not in transit between shards, and hands the
+ * answer over under answerMutex.
+ * ============================================================ */
+
+static void DescribeConnection(RELAY_SHARD *pShard, RELAY_CONNECTION *pConn, DWORD now,
+                               RELAY_SESSION_INFO *pInfo)
+{
+    RELAY_SESSION *pSession = pConn->pSession;
+
+    ZeroMemory(pInfo, sizeof(RELAY_SESSION_INFO));
+    pInfo->clientId = pConn->clientId;
+    pInfo->partnerId = pConn->pPartner ? pConn->pPartner->clientId : 0;
+    pInfo->state = pConn->state;
+    pInfo->shard = pShard->index;
+    pInfo->peerAddr = pConn->peerAddr;
+    pInfo->bNodeLink = pConn->bNodeLink;
+    pInfo->idleMs = now - pConn->lastActivity;
+    pInfo->queuedBytes = PendingSend(pConn);
+    pInfo->bytesIn = pConn->bytesIn;
+    pInfo->bytesOut = pConn->bytesOut;
+
+    if (pSession) {
+        pInfo->frames = pSession->delay.total;
+        pInfo->delayP50 = Hist_Percentile(&pSession->delay, 500);
+        pInfo->delayP99 = Hist_Percentile(&pSession->delay, 990);
+        pInfo->delayMax = pSession->delay.max;
+        if (pSession->size.total > 0)
+            pInfo->sizeMean = (DWORD)(pSession->size.sum / pSession->size.total);
+    }
+}
+
+/* Close every connection registered as clientId. Returns how many */
+static DWORD CloseClient(RELAY_SHARD *pShard, DWORD clientId)
+{
+    RELAY_CONNECTION *pConn = pShard->pConnList;
+    char idStr[20];
+    DWORD count = 0;
+
+    FormatClientId(clientId, idStr);
+    while (pConn) {
+        if (pConn->clientId == clientId && !pConn->bNodeLink && !pConn->bClosed) {
+            RelayLog("[INFO] Closing client %s on admin request\n", idStr);
+            CloseConnection(pShard, pConn);
+            count++;
+            /* Its partner may have gone with it: start over */
+            pConn = pShard->pConnList;
+            continue;
+        }
+        pConn = pConn->pNextConn;
     }
-    
+    return count;
+}
+
+static void ServeAdminRequest(RELAY_SHARD *pShard)
+{
+    RELAY_SERVER *pServer = pShard->pServer;
+    DWORD seq = __atomic_load_n(&pServer->adminSeq, __ATOMIC_ACQUIRE);
+    RELAY_SESSION_INFO *pAnswer = NULL;
+    RELAY_CONNECTION *pConn;
+    int status = RD2K_SUCCESS;
+    DWORD count = 0;
+
+    if (seq == pShard->adminSeq) return;
+
+    if (pServer->adminCloseId != 0) {
+        count = CloseClient(pShard, pServer->adminCloseId);
+    } else {
+        DWORD now = GetTickCount();
+
+        for (pConn = pShard->pConnList; pConn; pConn = pConn->pNextConn)
+            count++;
+        if (count > 0) {
+            pAnswer = (RELAY_SESSION_INFO*)malloc(count * sizeof(RELAY_SESSION_INFO));
+            if (!pAnswer) status = RD2K_ERR_MEMORY;
+        }
+        count = 0;
+        for (pConn = pShard->pConnList; pAnswer && pConn; pConn = pConn->pNextConn)
+            DescribeConnection(pShard, pConn, now, &pAnswer[count++]);
+    }
+
+    pthread_mutex_lock(&pServer->answerMutex);
+    /* An answer nobody collected: its requester gave up waiting */
+    free(pShard->pAnswer);
+    pShard->pAnswer = pAnswer;
+    pShard->answerCount = count;
+    pShard->answerStatus = status;
+    pShard->adminSeq = seq;
+    pthread_cond_broadcast(&pServer->answerCond);
+    pthread_mutex_unlock(&pServer->answerMutex);
+}
+
+/* ============================================================
+ * SHARD MESSAGING
+ * ============================================================ */
+
+static void WakeShard(RELAY_SHARD *pShard)
+{
+    uint64_t one = 1;
+
+    if (write(pShard->wakeFd, &one, sizeof(one)) < 0) {
+        /* Counter saturated - the shard is awake anyway */
+    }
+}
+
+static void QueueShardMessage(RELAY_SHARD *pShard, RELAY_SHARD_MSG *pMsg)
+{
+    pMsg->pNext = NULL;
+
+    pthread_mutex_lock(&pShard->inboxMutex);
+    if (pShard->pInboxTail)
+        pShard->pInboxTail->pNext = pMsg;
+    else
+        pShard->pInboxHead = pMsg;
+    pShard->pInboxTail = pMsg;
+    pthread_mutex_unlock(&pShard->inboxMutex);
+
+    WakeShard(pShard);
+}
+
+static BOOL PostShardMessage(RELAY_SHARD *pShard, DWORD type, RELAY_CONNECTION *pConn,
+                             RELAY_CONNECTION *pPartner, DWORD requesterId, DWORD partnerId,
+                             RELAY_SHARD *pReplyShard)
+{
+    RELAY_SHARD_MSG *pMsg;
+
+    pMsg = (RELAY_SHARD_MSG*)Pool_Calloc(sizeof(RELAY_SHARD_MSG));
+    if (!pMsg) return FALSE;
+
+    pMsg->type = type;
+    pMsg->pConn = pConn;
+    pMsg->pPartner = pPartner;
+    pMsg->requesterId = requesterId;
+    pMsg->partnerId = partnerId;
+    pMsg->pReplyShard = pReplyShard;
+
+    if (pConn) __atomic_add_fetch(&pConn->pendingMsgs, 1, __ATOMIC_ACQ_REL);
+    __atomic_add_fetch(&pShard->pServer->shardMsgs, 1, __ATOMIC_RELEASE);
+
+    QueueShardMessage(pShard, pMsg);
     return TRUE;
 }
 
-static RELAY_CONNECTION* FindConnectionById(RELAY_SERVER *pServer, DWORD clientId)
+/* Relay_Detach waits for every message, including pair requests parked
+ * on io_uring completions, to be freed here */
+static void FreeShardMessage(RELAY_SERVER *pServer, RELAY_SHARD_MSG *pMsg)
 {
-    DWORD i;
-    
-    if (!pServer) return NULL;
-    
-    pthread_mutex_lock(&pServer->connMutex);
-    
-    for (i = 0; i < pServer->maxConnections; i++) {
-        if (pServer->connections[i] && 
-            pServer->connections[i]->clientId == clientId &&
-            pServer->connections[i]->state != RELAY_STATE_DISCONNECTED) {
-            
-            pthread_mutex_unlock(&pServer->connMutex);
-            return pServer->connections[i];
-        }
-    }
-    
-    pthread_mutex_unlock(&pServer->connMutex);
-    return NULL;
+    Pool_Free(pMsg);
+    __atomic_sub_fetch(&pServer->shardMsgs, 1, __ATOMIC_RELEASE);
 }
 
-/* Remove stale connections with same clientId (for reconnection handling) 
+/* ============================================================
+ * CONNECTION MANAGEMENT
+ * ============================================================ */
+
+/* Remove a stale connection with same clientId (for reconnection handling)
+ * and claim the ID for pConn if it is free. Runs under the ID's registry
+ * stripe lock so two shards registering the same ID cannot both succeed.
  * IMPORTANT: Protect PAIRED connections always, REGISTERED with timeout.
  * Dead sockets will be cleaned up naturally when recv() fails.
- * Returns TRUE if ID is available for registration, FALSE if already in use */
-static BOOL RemoveStaleConnections(RELAY_SERVER *pServer, DWORD clientId, RELAY_CONNECTION *pExclude)
+ * Returns RELAY_REGISTER_OK if the ID was claimed, RELAY_REGISTER_DUPLICATE
+ * if it is in use, RELAY_REGISTER_ERROR if memory ran out */
+static int ClaimClientId(RELAY_SHARD *pShard, RELAY_CONNECTION *pConn, DWORD clientId)
 {
-    DWORD i;
-    BOOL bIdAvailable = TRUE;
+    RELAY_SERVER *pServer = pShard->pServer;
+    RELAY_CONNECTION *pOther;
+    int status = RELAY_REGISTER_OK;
     DWORD currentTime = GetTickCount();
-    
+    RELAY_CONNECTION *pStale = NULL;
+
     /* Short timeout for registered connections (5 seconds).
      * This allows legitimate reconnections while preventing rapid loops.
      * Dead sockets are detected when recv() fails, which triggers cleanup. */
     #define REGISTERED_TIMEOUT_MS 5000
-    
-    if (!pServer) return FALSE;
-    
-    pthread_mutex_lock(&pServer->connMutex);
-    
-    for (i = 0; i < pServer->maxConnections; i++) {
-        RELAY_CONNECTION *pConn = pServer->connections[i];
-        if (pConn && pConn != pExclude && pConn->clientId == clientId) {
-            char idStr[20];
-            DWORD idleTime;
-            FormatClientId(clientId, idStr);
-            
-            /* Check how long since last activity */
-            idleTime = currentTime - pConn->lastActivity;
-            
-            /* PAIRED connections - always protect, never kick out */
-            if (pConn->state == RELAY_STATE_PAIRED) {
-                RelayLog("[PROTECT] ID %s is in active session (PAIRED) - rejecting duplicate\n", idStr);
-                bIdAvailable = FALSE;
-                continue;
-            }
-            
+
+    Registry_Lock(pServer->pRegistry, clientId);
+
+    pOther = (RELAY_CONNECTION*)Registry_Find(pServer->pRegistry, clientId);
+    if (pOther && pOther != pConn) {
+        char idStr[20];
+        DWORD idleTime;
+        FormatClientId(clientId, idStr);
+
+        /* Check how long since last activity */
+        idleTime = currentTime - pOther->lastActivity;
+
+        if (pOther->state == RELAY_STATE_PAIRED || pOther->state == RELAY_STATE_WAITING) {
+            /* PAIRED (or pairing) connections - always protect, never kick out */
+            RelayLog("[PROTECT] ID %s is in active session (PAIRED) - rejecting duplicate\n", idStr);
+            status = RELAY_REGISTER_DUPLICATE;
+        } else if (pOther->state == RELAY_STATE_REGISTERED && idleTime < REGISTERED_TIMEOUT_MS) {
             /* REGISTERED connections - protect unless timed out */
-            if (pConn->state == RELAY_STATE_REGISTERED) {
-                if (idleTime < REGISTERED_TIMEOUT_MS) {
-                    RelayLog("[PROTECT] ID %s is recently registered (%u ms ago) - rejecting duplicate\n", 
-                            idStr, idleTime);
-                    bIdAvailable = FALSE;
-                    continue;
-                }
+            RelayLog("[PROTECT] ID %s is recently registered (%u ms ago) - rejecting duplicate\n",
+                    idStr, idleTime);
+            status = RELAY_REGISTER_DUPLICATE;
+        } else if (pOther->pShard != pShard &&
+                   !PostShardMessage(pOther->pShard, SHARD_MSG_KICK, pOther, NULL, 0, 0, NULL)) {
+            /* Unkicked, the old holder would live on next to the new one */
+            RelayLog("[ERROR] Cannot close stale connection for ID %s - rejecting registration\n",
+                    idStr);
+            status = RELAY_REGISTER_ERROR;
+        } else {
+            if (pOther->state == RELAY_STATE_REGISTERED) {
                 /* Timed out REGISTERED connection - allow removal */
-                RelayLog("[TIMEOUT] ID %s was REGISTERED but idle for %u ms - allowing reconnect\n", 
+                RelayLog("[TIMEOUT] ID %s was REGISTERED but idle for %u ms - allowing reconnect\n",
                         idStr, idleTime);
             }
-            
+
             /* Remove: DISCONNECTED, CONNECTED(zombie), or timed-out REGISTERED */
-            RelayLog("[CLEANUP] Removing connection for ID %s (state=%d, idle=%u ms)\n", 
-                    idStr, pConn->state, idleTime);
-            
-            /* Signal stop and close socket */
-            pConn->shouldStop = 1;
-            if (pConn->socket != INVALID_SOCKET) {
-                close(pConn->socket);
-                pConn->socket = INVALID_SOCKET;
-            }
-            pConn->state = RELAY_STATE_DISCONNECTED;
-            
-            /* Clear slot and update count */
-            pServer->connections[i] = NULL;
-            if (pServer->activeConnections > 0) {
-                pServer->activeConnections--;
-            }
+            RelayLog("[CLEANUP] Removing connection for ID %s (state=%d, idle=%u ms)\n",
+                    idStr, pOther->state, idleTime);
+
+            /* Drop the registration; the owning shard closes the socket
+             * (another shard's was sent a kick above) */
+            Registry_Remove(pServer->pRegistry, clientId, pOther);
+            pOther->state = RELAY_STATE_DISCONNECTED;
+            if (pOther->pShard == pShard) pStale = pOther;
+        }
+    }
+
+    if (status == RELAY_REGISTER_OK) {
+        if (Registry_Insert(pServer->pRegistry, clientId, pConn) == RD2K_SUCCESS) {
+            pConn->clientId = clientId;
+            pConn->state = RELAY_STATE_REGISTERED;
+            Cluster_Announce(pServer->pCluster, clientId);
+        } else {
+            status = RELAY_REGISTER_ERROR;
         }
     }
-    
-    pthread_mutex_unlock(&pServer->connMutex);
-    return bIdAvailable;
-    
+
+    Registry_Unlock(pServer->pRegistry, clientId);
+
+    if (pStale) CloseConnection(pShard, pStale);
+
+    return status;
+
     #undef REGISTERED_TIMEOUT_MS
 }
 
-static void ConfigureClientSocket(SOCKET sock)
+/* With fair scheduling the backlog stays in our queues, where the
+ * scheduler orders it, instead of the kernel's. 0 is the system default */
+static void SetSendLowWater(RELAY_SERVER *pServer, SOCKET sock)
+{
+    int opt = pServer->bFair ? RELAY_SCHED_NOTSENT_LOWAT : 0;
+    setsockopt(sock, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &opt, sizeof(opt));
+}
+
+static void ConfigureClientSocket(RELAY_SERVER *pServer, SOCKET sock)
 {
     int opt = 1;
     setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
-    
+
     opt = 512 * 1024;
     setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &opt, sizeof(opt));
     setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &opt, sizeof(opt));
-    
+
     /* Enable keep-alive with aggressive settings */
     opt = 1;
     setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &opt, sizeof(opt));
-    
+
     /* TCP keepalive: start probing after 30s, probe every 5s, fail after 3 probes */
     opt = 30;
     setsockopt(sock, IPPROTO_TCP, TCP_KEEPIDLE, &opt, sizeof(opt));
@@ -286,603 +1036,3625 @@ static void ConfigureClientSocket(SOCKET sock)
     setsockopt(sock, IPPROTO_TCP, TCP_KEEPINTVL, &opt, sizeof(opt));
     opt = 3;
     setsockopt(sock, IPPROTO_TCP, TCP_KEEPCNT, &opt, sizeof(opt));
+
+    SetSendLowWater(pServer, sock);
 }
 
-static RELAY_CONNECTION* AddConnection(RELAY_SERVER *pServer, SOCKET sock)
+/* Link a connection into the shard's list and start its idle timer */
+static void ListConnection(RELAY_SHARD *pShard, RELAY_CONNECTION *pConn)
 {
-    RELAY_CONNECTION *pConn;
-    DWORD i;
-    
-    if (!pServer || pServer->activeConnections >= pServer->maxConnections)
-        return NULL;
-    
-    ConfigureClientSocket(sock);
-    
-    pConn = (RELAY_CONNECTION*)calloc(1, sizeof(RELAY_CONNECTION));
-    if (!pConn) return NULL;
-    
-    pConn->socket = sock;
-    pConn->state = RELAY_STATE_CONNECTED;
-    pConn->pServer = pServer;
-    pConn->recvBufferSize = RELAY_BUFFER_SIZE;
-    pConn->recvBuffer = (BYTE*)malloc(RELAY_BUFFER_SIZE);
-    pConn->shouldStop = 0;
-    pConn->threadValid = 0;
-    
-    if (!pConn->recvBuffer) {
-        free(pConn);
-        return NULL;
-    }
-    
-    pthread_mutex_lock(&pServer->connMutex);
-    
-    for (i = 0; i < pServer->maxConnections; i++) {
-        if (!pServer->connections[i]) {
-            pServer->connections[i] = pConn;
-            pServer->activeConnections++;
-            pthread_mutex_unlock(&pServer->connMutex);
-            return pConn;
-        }
-    }
-    
-    pthread_mutex_unlock(&pServer->connMutex);
-    
-    free(pConn->recvBuffer);
-    free(pConn);
-    return NULL;
+    pConn->pPrevConn = NULL;
+    pConn->pNextConn = pShard->pConnList;
+    if (pShard->pConnList) pShard->pConnList->pPrevConn = pConn;
+    pShard->pConnList = pConn;
+
+    Timer_Schedule(&pShard->timers, &pConn->idleTimer,
+                   pConn->lastActivity + CLIENT_INACTIVITY_TIMEOUT_MS + 1);
 }
 
-static void RemoveConnection(RELAY_SERVER *pServer, RELAY_CONNECTION *pConn)
+/* Take ownership of a connection: register its socket with this shard's
+ * epoll and link it into the shard's list. The edge-triggered ADD reports
+ * any data or send space that is already there. */
+static BOOL AttachConnection(RELAY_SHARD *pShard, RELAY_CONNECTION *pConn)
 {
-    DWORD i;
-    
-    if (!pServer || !pConn) return;
-    
-    pthread_mutex_lock(&pServer->connMutex);
-    
-    for (i = 0; i < pServer->maxConnections; i++) {
-        if (pServer->connections[i] == pConn) {
-            pServer->connections[i] = NULL;
-            if (pServer->activeConnections > 0)
-                pServer->activeConnections--;
-            break;
+    struct epoll_event ev;
+
+    if (pShard->pServer->backend == RELAY_BACKEND_URING) {
+        /* Quiescing for an upgrade: the recv is armed on resume, if ever */
+        if (!pShard->pServer->bQuiescing && !UringArmRecv(pShard, pConn)) {
+            RelayLog("[ERROR] Failed to submit receive for client\n");
+            return FALSE;
+        }
+        /* A partner handed over mid-send continues on this ring */
+        if (PendingSend(pConn) > 0) UringMarkSend(pShard, pConn);
+    } else {
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = pConn;
+        if (epoll_ctl(pShard->epollFd, EPOLL_CTL_ADD, pConn->socket, &ev) < 0) {
+            RelayLog("[ERROR] Failed to register client with event loop: %s\n", strerror(errno));
+            return FALSE;
         }
     }
-    
-    pthread_mutex_unlock(&pServer->connMutex);
-    
-    if (pConn->socket != INVALID_SOCKET)
-        close(pConn->socket);
-    if (pConn->recvBuffer)
-        free(pConn->recvBuffer);
-    free(pConn);
+
+    ListConnection(pShard, pConn);
+    return TRUE;
 }
 
-/* ============================================================
- * MESSAGE PROCESSING
- * ============================================================ */
+/* Give up ownership (the connection is closing or moving to another shard) */
+static void DetachConnection(RELAY_SHARD *pShard, RELAY_CONNECTION *pConn)
+{
+    RELAY_CONNECTION **ppReady;
 
-static int ProcessRelayMessage(RELAY_SERVER *pServer, RELAY_CONNECTION *pConn,
+    if (pShard->pServer->backend == RELAY_BACKEND_URING)
+        UringDetach(pShard, pConn);
+    else if (pConn->socket != INVALID_SOCKET)
+        epoll_ctl(pShard->epollFd, EPOLL_CTL_DEL, pConn->socket, NULL);
+
+    if (pConn->pPrevConn)
+        pConn->pPrevConn->pNextConn = pConn->pNextConn;
+    else if (pShard->pConnList == pConn)
+        pShard->pConnList = pConn->pNextConn;
+    if (pConn->pNextConn)
+        pConn->pNextConn->pPrevConn = pConn->pPrevConn;
+    pConn->pPrevConn = NULL;
+    pConn->pNextConn = NULL;
+
+    Timer_Cancel(&pShard->timers, &pConn->idleTimer);
+    UnholdConnection(pShard, pConn);
+    UnscheduleConnection(pShard, pConn);
+
+    if (pConn->bReadPending) {
+        for (ppReady = &pShard->pReadyList; *ppReady; ppReady = &(*ppReady)->pNextReady) {
+            if (*ppReady == pConn) {
+                *ppReady = pConn->pNextReady;
+                break;
+            }
+        }
+        pConn->bReadPending = FALSE;
+    }
+}
+
+/* Replace pConn's inline receive buffer with a full one.
+ * Returns FALSE if out of memory */
+static BOOL GrowRecvBuffer(RELAY_CONNECTION *pConn)
+{
+    BYTE *buffer;
+
+    if (pConn->recvBuffer != pConn->idleBuffer) return TRUE;
+
+    buffer = (BYTE*)Pool_Alloc(RELAY_BUFFER_SIZE);
+    if (!buffer) return FALSE;
+    memcpy(buffer, pConn->idleBuffer, pConn->recvPos);
+    pConn->recvBuffer = buffer;
+    pConn->recvBufferSize = RELAY_BUFFER_SIZE;
+    return TRUE;
+}
+
+/* Before a read. Connections waiting for a partner only ever receive a
+ * few small control frames, so they make do with idleBuffer; a session,
+ * a cut-through frame or a partial frame that fills idleBuffer gets the
+ * full buffer. Returns FALSE if out of memory */
+static BOOL ReserveRecvBuffer(RELAY_CONNECTION *pConn)
+{
+    if (pConn->recvBuffer == pConn->idleBuffer &&
+        (pConn->pPartner || pConn->streamIn > 0 || pConn->recvPos == RELAY_IDLE_BUFFER_SIZE))
+        return GrowRecvBuffer(pConn);
+    return TRUE;
+}
+
+/* After a read: without a session, go back to idleBuffer once what is
+ * buffered fits there */
+static void ShrinkRecvBuffer(RELAY_CONNECTION *pConn)
+{
+    if (pConn->recvBuffer == pConn->idleBuffer || pConn->pPartner || pConn->streamIn > 0 ||
+        pConn->recvPos > RELAY_IDLE_BUFFER_SIZE || pConn->bClosed)
+        return;
+
+    memcpy(pConn->idleBuffer, pConn->recvBuffer, pConn->recvPos);
+    Pool_Free(pConn->recvBuffer);
+    pConn->recvBuffer = pConn->idleBuffer;
+    pConn->recvBufferSize = RELAY_IDLE_BUFFER_SIZE;
+}
+
+static void FreeRecvBuffer(RELAY_CONNECTION *pConn)
+{
+    if (pConn->recvBuffer != pConn->idleBuffer) Pool_Free(pConn->recvBuffer);
+}
+
+/* A CONNECTED connection for sock, not attached to any shard yet */
+static RELAY_CONNECTION* NewConnection(RELAY_SHARD *pShard, SOCKET sock)
+{
+    RELAY_CONNECTION *pConn;
+
+    pConn = (RELAY_CONNECTION*)Pool_Calloc(sizeof(RELAY_CONNECTION));
+    if (!pConn) return NULL;
+
+    pConn->socket = sock;
+    pConn->state = RELAY_STATE_CONNECTED;
+    pConn->pServer = pShard->pServer;
+    pConn->pShard = pShard;
+    pConn->recvBuffer = pConn->idleBuffer;
+    pConn->recvBufferSize = RELAY_IDLE_BUFFER_SIZE;
+    pConn->lastActivity = GetTickCount();
+    pConn->pipeFds[0] = -1;
+    pConn->pipeFds[1] = -1;
+    pConn->weight = 1;
+    return pConn;
+}
+
+static RELAY_CONNECTION* AddConnection(RELAY_SHARD *pShard, SOCKET sock)
+{
+    RELAY_SERVER *pServer = pShard->pServer;
+    RELAY_CONNECTION *pConn;
+
+    pConn = NewConnection(pShard, sock);
+    if (!pConn) return NULL;
+
+    if (__atomic_add_fetch(&pServer->activeConnections, 1, __ATOMIC_RELAXED) <= pServer->maxConnections) {
+        if (AttachConnection(pShard, pConn)) return pConn;
+    }
+
+    __atomic_sub_fetch(&pServer->activeConnections, 1, __ATOMIC_RELAXED);
+    Pool_Free(pConn);
+    return NULL;
+}
+
+/* Drop a connection's registration (if a stale-ID cleanup has not already
+ * done so) and its place in the connection count. Called once per connection */
+static void UnlistConnection(RELAY_SERVER *pServer, RELAY_CONNECTION *pConn)
+{
+    Registry_Lock(pServer->pRegistry, pConn->clientId);
+    if (Registry_Remove(pServer->pRegistry, pConn->clientId, pConn))
+        Cluster_Withdraw(pServer->pCluster, pConn->clientId);
+    pConn->state = RELAY_STATE_DISCONNECTED;
+    Registry_Unlock(pServer->pRegistry, pConn->clientId);
+
+    __atomic_sub_fetch(&pServer->activeConnections, 1, __ATOMIC_RELAXED);
+}
+
+static void FreeConnection(RELAY_CONNECTION *pConn)
+{
+    if (pConn->socket != INVALID_SOCKET)
+        close(pConn->socket);
+    FreeRecvBuffer(pConn);
+    Pool_Free(pConn->sendBuffer);
+    Pool_Free(pConn->flightBuffer);
+    Pool_Free(pConn->stashBuffer);
+    Pool_Free(pConn->pSession);
+    if (pConn->pipeFds[0] >= 0) {
+        close(pConn->pipeFds[0]);
+        close(pConn->pipeFds[1]);
+    }
+    Pool_Free(pConn);
+}
+
+/* Close a connection on its owning shard. If it was paired, the partner
+ * is notified and closed as well. The struct itself stays allocated until
+ * the current event batch is finished (see ReapClosedConnections), since
+ * later events in the same batch may still reference it. */
+static void CloseConnection(RELAY_SHARD *pShard, RELAY_CONNECTION *pConn)
+{
+    char idStr[20];
+    RELAY_CONNECTION *pPartner;
+
+    if (!pConn || pConn->bClosed) return;
+
+    FormatClientId(pConn->clientId, idStr);
+
+    if (pConn->clientId != 0)
+        RelayLog("[DISCONNECT] Client %s connection closed\n", idStr);
+    else
+        RelayLog("[DISCONNECT] Unregistered client connection closed\n");
+
+    pConn->bClosed = TRUE;
+    UnlistConnection(pShard->pServer, pConn);
+    if (pConn->captureId != 0)
+        Capture_Close(pShard->pServer->pCapture, pConn->captureId, pConn->clientId);
+
+    /* io_uring: last words (e.g. PARTNER_DISCONNECTED) are still queued.
+     * Hand them to the socket now, unless a SEND is using it. Held output
+     * (send coalescing) is written the same way */
+    if (((pShard->pServer->backend == RELAY_BACKEND_URING && !pConn->bSendInFlight) ||
+         pConn->bHeld) && pConn->socket != INVALID_SOCKET)
+        FlushSendBuffer(pConn);
+    EndSession(pConn);
+
+    /* Queued output dies with the socket */
+    __atomic_sub_fetch(&pShard->pServer->queuedBytes, (unsigned long long)PendingSend(pConn),
+                       __ATOMIC_RELAXED);
+    pConn->sendPos = 0;
+    pConn->sendLen = 0;
+    pConn->flightPos = 0;
+    pConn->flightLen = 0;
+    if (pConn->bReadPaused) {
+        pConn->bReadPaused = FALSE;
+        __atomic_sub_fetch(&pShard->pServer->pausedReaders, 1, __ATOMIC_RELAXED);
+    }
+
+    pPartner = pConn->pPartner;
+    pConn->pPartner = NULL;
+
+    if (pPartner && pConn->bNodeLink && pPartner->state == RELAY_STATE_WAITING) {
+        /* Node link lost before the partner's node answered */
+        pPartner->pPartner = NULL;
+        FailConnectRequest(pShard, pPartner);
+    } else if (pPartner) {
+        RELAY_PARTNER_DISCONNECTED notification;
+        notification.reason = RELAY_DISCONNECT_PARTNER_LEFT;
+        notification.partnerId = pConn->clientId;
+        /* Not in the middle of our unfinished frame: the partner could
+         * not tell it apart from payload */
+        if (!pPartner->bMidFrame)
+            SendRelayPacket(pPartner, RELAY_MSG_PARTNER_DISCONNECTED,
+                           (const BYTE*)&notification, sizeof(notification));
+        pPartner->pPartner = NULL;
+        /* CRITICAL: Close the partner rather than returning it to REGISTERED.
+         * This ensures ID is cleaned up when they reconnect. */
+        CloseConnection(pShard, pPartner);
+    }
+
+    DetachConnection(pShard, pConn);
+
+    if (pConn->socket != INVALID_SOCKET) {
+        /* In-flight io_uring requests hold their own file reference;
+         * shutdown() makes them complete instead of waiting forever */
+        if (pShard->pServer->backend == RELAY_BACKEND_URING)
+            shutdown(pConn->socket, SHUT_RDWR);
+        close(pConn->socket);
+        pConn->socket = INVALID_SOCKET;
+    }
+
+    pConn->pNextClosed = pShard->pClosedList;
+    pShard->pClosedList = pConn;
+}
+
+/* Free connections closed during this pass. Ones still referenced by a
+ * queued shard message are freed when that message is handled. */
+static void ReapClosedConnections(RELAY_SHARD *pShard)
+{
+    while (pShard->pClosedList) {
+        RELAY_CONNECTION *pConn = pShard->pClosedList;
+        pShard->pClosedList = pConn->pNextClosed;
+        /* Whoever drops the last reference puts a parked connection back */
+        if (__atomic_load_n(&pConn->pendingMsgs, __ATOMIC_ACQUIRE) == 0 && pConn->uringOps == 0)
+            FreeConnection(pConn);
+        else
+            pConn->bParked = TRUE;
+    }
+}
+
+static void UnparkConnection(RELAY_SHARD *pShard, RELAY_CONNECTION *pConn)
+{
+    if (pConn->bParked) {
+        pConn->bParked = FALSE;
+        pConn->pNextClosed = pShard->pClosedList;
+        pShard->pClosedList = pConn;
+    }
+}
+
+/* A shard message referencing pConn has been handled. The last reference
+ * is always dropped by the owning shard, so bParked is only read there. */
+static void ReleaseConnection(RELAY_SHARD *pShard, RELAY_CONNECTION *pConn)
+{
+    /* Already reaped while the message was in flight - free it now */
+    if (__atomic_sub_fetch(&pConn->pendingMsgs, 1, __ATOMIC_ACQ_REL) == 0)
+        UnparkConnection(pShard, pConn);
+}
+
+/* ============================================================
+ * PAIRING
+ * ============================================================ */
+
+/* Runs on the shard that owns the partner: check that partnerId can be
+ * paired and mark it PAIRED so nobody else can take it.
+ * Returns the claimed partner or NULL (reason already logged) */
+static RELAY_CONNECTION* ClaimPartner(RELAY_SHARD *pShard, DWORD requesterId, DWORD partnerId)
+{
+    RELAY_SERVER *pServer = pShard->pServer;
+    RELAY_CONNECTION *pPartner;
+    char clientIdStr[20], partnerIdStr[20];
+
+    FormatClientId(requesterId, clientIdStr);
+    FormatClientId(partnerId, partnerIdStr);
+
+    Registry_Lock(pServer->pRegistry, partnerId);
+
+    pPartner = FindConnectionById(pServer, partnerId);
+
+    if (!pPartner) {
+        RelayLog("[CONNECT] %s -> %s: NOT ONLINE\n", clientIdStr, partnerIdStr);
+    } else if (pPartner->state == RELAY_STATE_PAIRED) {
+        RelayLog("[CONNECT] %s -> %s: BUSY\n", clientIdStr, partnerIdStr);
+        pPartner = NULL;
+    } else if (pPartner->state != RELAY_STATE_REGISTERED || pPartner->pShard != pShard) {
+        RelayLog("[CONNECT] %s -> %s: NOT READY\n", clientIdStr, partnerIdStr);
+        pPartner = NULL;
+    } else {
+        pPartner->state = RELAY_STATE_PAIRED;
+    }
+
+    Registry_Unlock(pServer->pRegistry, partnerId);
+    return pPartner;
+}
+
+static void SendConnectResponse(RELAY_CONNECTION *pConn, DWORD status)
+{
+    RELAY_CONNECT_RESPONSE response;
+
+    response.status = status;
+    response.reserved = 0;
+    SendRelayPacket(pConn, RELAY_MSG_CONNECT_RESPONSE,
+                   (const BYTE*)&response, sizeof(response));
+    pConn->lastActivity = GetTickCount();
+}
+
+/* Both connections are owned by pShard and pPartner is already PAIRED */
+static void JoinSession(RELAY_SHARD *pShard, RELAY_CONNECTION *pConn, RELAY_CONNECTION *pPartner)
+{
+    pConn->pPartner = pPartner;
+    pPartner->pPartner = pConn;
+    SetConnectionState(pShard->pServer, pConn, RELAY_STATE_PAIRED);
+    StartSession(pConn, pPartner->clientId);
+    StartSession(pPartner, pConn->clientId);
+    SetOutputShare(pShard->pServer, pConn, pPartner->clientId);
+    SetOutputShare(pShard->pServer, pPartner, pConn->clientId);
+}
+
+/* Both connections are owned by pShard - link them up */
+static void PairConnections(RELAY_SHARD *pShard, RELAY_CONNECTION *pConn, RELAY_CONNECTION *pPartner)
+{
+    RELAY_PARTNER_CONNECTED partnerNotify;
+    char clientIdStr[20], partnerIdStr[20];
+
+    FormatClientId(pConn->clientId, clientIdStr);
+    FormatClientId(pPartner->clientId, partnerIdStr);
+
+    JoinSession(pShard, pConn, pPartner);
+
+    /* CRITICAL: Notify the partner that someone connected to them!
+     * Without this, the partner doesn't know they're paired and
+     * won't start the handshake → authentication fails! */
+    partnerNotify.partnerId = pConn->clientId;
+    partnerNotify.reserved = 0;
+    SendRelayPacket(pPartner, RELAY_MSG_PARTNER_CONNECTED,
+                   (const BYTE*)&partnerNotify, sizeof(partnerNotify));
+
+    /* Update partner's activity too */
+    pPartner->lastActivity = GetTickCount();
+
+    RelayLog("[CONNECT] %s <-> %s: PAIRED\n", clientIdStr, partnerIdStr);
+    RelayLog("[NOTIFY] Sent PARTNER_CONNECTED to %s\n", partnerIdStr);
+    SHARD_STAT_ADD(pShard, successfulPairs, 1);
+
+    SendConnectResponse(pConn, RD2K_SUCCESS);
+}
+
+static void FailConnectRequest(RELAY_SHARD *pShard, RELAY_CONNECTION *pConn)
+{
+    SHARD_STAT_ADD(pShard, failedConnections, 1);
+    SetConnectionState(pShard->pServer, pConn, pConn->prevState);
+    SendConnectResponse(pConn, (DWORD)RD2K_ERR_CONNECT);
+}
+
+/* partnerId is not registered here. If another node announced it, open a
+ * node link to that node and ask it to pair the link with the partner;
+ * pConn waits for the answer (CompleteNodeLink). Returns FALSE if no node
+ * has the ID or the link cannot be started */
+static BOOL DialPartnerNode(RELAY_SHARD *pShard, RELAY_CONNECTION *pConn, DWORD partnerId)
+{
+    RELAY_SERVER *pServer = pShard->pServer;
+    RELAY_PEER_CONNECT request;
+    RELAY_CONNECTION *pLink;
+    struct sockaddr_in addr;
+    char clientIdStr[20], partnerIdStr[20];
+    DWORD nodeId;
+    SOCKET sock;
+
+    if (!Cluster_Lookup(pServer->pCluster, partnerId, &addr, &nodeId)) return FALSE;
+
+    FormatClientId(pConn->clientId, clientIdStr);
+    FormatClientId(partnerId, partnerIdStr);
+
+    /* Queued output goes out once the connection is up */
+    sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+    if (sock == INVALID_SOCKET ||
+        (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS)) {
+        RelayLog("[CONNECT] %s -> %s: node %u unreachable: %s\n",
+                 clientIdStr, partnerIdStr, nodeId, strerror(errno));
+        if (sock != INVALID_SOCKET) close(sock);
+        return FALSE;
+    }
+
+    ConfigureClientSocket(pServer, sock);
+    pLink = AddConnection(pShard, sock);
+    if (!pLink) {
+        close(sock);
+        return FALSE;
+    }
+
+    /* The link stands in for the partner: same ID, never registered */
+    pLink->bNodeLink = TRUE;
+    pLink->clientId = partnerId;
+    SetConnectionState(pServer, pLink, RELAY_STATE_WAITING);
+    pLink->pPartner = pConn;
+    pConn->pPartner = pLink;
+
+    request.requesterId = pConn->clientId;
+    request.partnerId = partnerId;
+    request.nodeId = Cluster_GetNodeId(pServer->pCluster);
+    request.reserved = 0;
+    if (SendRelayPacket(pLink, RELAY_MSG_PEER_CONNECT, (const BYTE*)&request,
+                        sizeof(request)) != RD2K_SUCCESS) {
+        pLink->pPartner = NULL;
+        pConn->pPartner = NULL;
+        CloseConnection(pShard, pLink);
+        return FALSE;
+    }
+
+    RelayLog("[CONNECT] %s -> %s: registered on node %u, linking\n",
+             clientIdStr, partnerIdStr, nodeId);
+    return TRUE;
+}
+
+/* The partner's node answered our PEER_CONNECT.
+ * Returns 0 to keep the link, 1 to close it */
+static int CompleteNodeLink(RELAY_SHARD *pShard, RELAY_CONNECTION *pLink, DWORD status)
+{
+    RELAY_CONNECTION *pConn = pLink->pPartner;
+    char clientIdStr[20], partnerIdStr[20];
+
+    /* The requester closes its link when it leaves */
+    if (!pConn) return 1;
+
+    FormatClientId(pConn->clientId, clientIdStr);
+    FormatClientId(pLink->clientId, partnerIdStr);
+
+    if (status != RD2K_SUCCESS) {
+        RelayLog("[CONNECT] %s -> %s: refused by partner's node\n", clientIdStr, partnerIdStr);
+        pConn->pPartner = NULL;
+        pLink->pPartner = NULL;
+        FailConnectRequest(pShard, pConn);
+        return 1;
+    }
+
+    SetConnectionState(pShard->pServer, pLink, RELAY_STATE_PAIRED);
+    JoinSession(pShard, pConn, pLink);
+
+    RelayLog("[CONNECT] %s <-> %s: PAIRED through node link\n", clientIdStr, partnerIdStr);
+    SHARD_STAT_ADD(pShard, successfulPairs, 1);
+    SHARD_STAT_ADD(pShard, nodeLinkPairs, 1);
+
+    SendConnectResponse(pConn, RD2K_SUCCESS);
+    return 0;
+}
+
+static void HandleConnectRequest(RELAY_SHARD *pShard, RELAY_CONNECTION *pConn, DWORD partnerId)
+{
+    RELAY_SERVER *pServer = pShard->pServer;
+    RELAY_CONNECTION *pPartner;
+    RELAY_SHARD *pOwner = NULL;
+
+    if (pConn->state == RELAY_STATE_WAITING || pConn->state == RELAY_STATE_PAIRED) {
+        SHARD_STAT_ADD(pShard, failedConnections, 1);
+        SendConnectResponse(pConn, (DWORD)RD2K_ERR_CONNECT);
+        return;
+    }
+
+    Registry_Lock(pServer->pRegistry, partnerId);
+    pPartner = FindConnectionById(pServer, partnerId);
+    if (pPartner) pOwner = pPartner->pShard;
+    Registry_Unlock(pServer->pRegistry, partnerId);
+
+    pConn->prevState = pConn->state;
+    SetConnectionState(pServer, pConn, RELAY_STATE_WAITING);
+
+    if (!pOwner) {
+        char clientIdStr[20], partnerIdStr[20];
+
+        /* A node link asks for local partners only */
+        if (!pConn->bNodeLink && DialPartnerNode(pShard, pConn, partnerId)) return;
+
+        FormatClientId(pConn->clientId, clientIdStr);
+        FormatClientId(partnerId, partnerIdStr);
+        RelayLog("[CONNECT] %s -> %s: NOT ONLINE\n", clientIdStr, partnerIdStr);
+        FailConnectRequest(pShard, pConn);
+        return;
+    }
+
+    if (pOwner == pShard) {
+        pPartner = ClaimPartner(pShard, pConn->clientId, partnerId);
+        if (pPartner)
+            PairConnections(pShard, pConn, pPartner);
+        else
+            FailConnectRequest(pShard, pConn);
+        return;
+    }
+
+    /* Partner lives on another shard - ask it to hand the partner over */
+    if (!PostShardMessage(pOwner, SHARD_MSG_PAIR_REQUEST, pConn, NULL,
+                          pConn->clientId, partnerId, pShard)) {
+        FailConnectRequest(pShard, pConn);
+    }
+}
+
+/* ============================================================
+ * ADMISSION CONTROL
+ * ============================================================ */
+
+/* Source IPv4 address of a connected socket, network order (0 = unknown) */
+static DWORD PeerAddress(SOCKET sock)
+{
+    struct sockaddr_in addr;
+    socklen_t addrLen = sizeof(addr);
+
+    if (getpeername(sock, (struct sockaddr*)&addr, &addrLen) < 0 || addr.sin_family != AF_INET)
+        return 0;
+    return addr.sin_addr.s_addr;
+}
+
+/* Take an admission token for event from addr. Cluster peers are exempt:
+ * their node links arrive in bursts whenever sessions cross nodes */
+static BOOL AdmitSource(RELAY_SERVER *pServer, DWORD event, DWORD addr)
+{
+    struct in_addr inAddr;
+    char addrStr[INET_ADDRSTRLEN];
+    const char *what = event == ADMIT_ACCEPT ? "Connections" : "Registrations";
+    BOOL bFirst;
+    int result;
+
+    if (!pServer->pAdmit) return TRUE;
+
+    inAddr.s_addr = addr;
+    if (pServer->pCluster && Cluster_IsPeerHost(pServer->pCluster, &inAddr)) return TRUE;
+
+    result = Admit_Check(pServer->pAdmit, event, addr, &bFirst);
+    if (result == ADMIT_OK) return TRUE;
+
+    /* Once per episode - a reconnect loop would flood the log otherwise */
+    if (bFirst) {
+        if (result == ADMIT_REFUSED_SOURCE) {
+            inet_ntop(AF_INET, &inAddr, addrStr, sizeof(addrStr));
+            RelayLog("[PROTECT] %s from %s over the per-source limit - refusing\n", what, addrStr);
+        } else {
+            RelayLog("[PROTECT] %s over the total limit - refusing\n", what);
+        }
+    }
+    return FALSE;
+}
+
+/* ============================================================
+ * MESSAGE PROCESSING
+ * ============================================================ */
+
+static void CountFrameIn(RELAY_SHARD *pShard, RELAY_CONNECTION *pConn, BYTE msgType, DWORD length)
+{
+    DWORD index = (DWORD)(msgType - RELAY_STATS_MSG_BASE);
+
+    pConn->bytesIn += length;
+
+    if (msgType >= RELAY_STATS_MSG_BASE && index < RELAY_STATS_MSG_TYPES) {
+        SHARD_STAT_ADD(pShard, framesIn[index], 1);
+        SHARD_STAT_ADD(pShard, bytesIn[index], length);
+    }
+}
+
+/* frame holds the first available bytes of a frameLength frame */
+static void CaptureFrame(RELAY_CONNECTION *pConn, const BYTE *frame, DWORD available,
+                         DWORD frameLength)
+{
+    if (pConn->captureId != 0)
+        Capture_Frame(pConn->pServer->pCapture, pConn->captureId, pConn->clientId,
+                      frame, available, frameLength);
+}
+
+/* Pass DATA frames to the partner untouched, all in one sendmsg().
+ * receivedUs is when the last of them was completely received */
+static void ForwardFrames(RELAY_SHARD *pShard, RELAY_CONNECTION *pConn,
+                          struct iovec *iov, int iovCount, DWORD frameCount,
+                          unsigned long long receivedUs)
+{
+    DWORD now = GetTickCount();
+    DWORD bytes = 0;
+    int i;
+
+    if (pConn->pPartner && !pConn->pPartner->bClosed) {
+        for (i = 0; i < iovCount; i++)
+            bytes += (DWORD)iov[i].iov_len;
+
+        MarkForwarded(pConn->pPartner, bytes, frameCount, receivedUs);
+        if (QueueForward(pShard, pConn->pPartner, iov, iovCount, bytes) != RD2K_SUCCESS) {
+            /* Partner socket is dead or hopelessly behind */
+            CloseConnection(pShard, pConn->pPartner);
+            return;
+        }
+        SHARD_STAT_ADD(pShard, framesForwarded, frameCount);
+        SHARD_STAT_ADD(pShard, bytesForwarded, bytes);
+        pConn->pPartner->bytesOut += bytes;
+        /* Update BOTH partners' activity - CRITICAL for preventing timeout */
+        pConn->pPartner->lastActivity = now;
+    }
+    pConn->lastActivity = now;
+}
+
+static int ProcessRelayMessage(RELAY_SHARD *pShard, RELAY_CONNECTION *pConn,
                               BYTE *buffer, DWORD length)
 {
     RELAY_HEADER header;
     RELAY_CONNECTION *pPartner;
-    RELAY_CONNECT_RESPONSE response;
-    
+
     if (length < sizeof(RELAY_HEADER)) return -1;
-    
+
     memcpy(&header, buffer, sizeof(RELAY_HEADER));
-    
-    if ((header.flags & 0x01) && header.dataLength > 0)
+
+    /* DATA payloads are forwarded opaque (header flags included), so the
+     * receiver decrypts exactly what the sender encrypted. Only control
+     * messages are read by the relay itself. */
+    if ((header.flags & 0x01) && header.dataLength > 0 &&
+        (header.msgType != RELAY_MSG_DATA || pShard->pServer->bReencrypt))
         Crypto_Decrypt(buffer + sizeof(RELAY_HEADER), header.dataLength);
-    
+
     switch (header.msgType) {
         case RELAY_MSG_REGISTER: {
             RELAY_REGISTER_MSG reg;
             RELAY_REGISTER_RESPONSE regResponse;
             char idStr[20];
-            BOOL bIdAvailable;
-            
+
             if (length < sizeof(RELAY_HEADER) + sizeof(RELAY_REGISTER_MSG))
                 return -1;
-            
+
             memcpy(&reg, buffer + sizeof(RELAY_HEADER), sizeof(RELAY_REGISTER_MSG));
-            bIdAvailable = RemoveStaleConnections(pServer, reg.clientId, pConn);
             FormatClientId(reg.clientId, idStr);
-            
-            if (!bIdAvailable) {
-                /* Send duplicate ID error to client */
-                RelayLog("[REJECT] Registration rejected for ID %s - already connected\n", idStr);
-                regResponse.status = RELAY_REGISTER_DUPLICATE;
+
+            if (pConn->state == RELAY_STATE_CONNECTED &&
+                !AdmitSource(pShard->pServer, ADMIT_REGISTER, pConn->peerAddr)) {
+                regResponse.status = RELAY_REGISTER_ERROR;
+                regResponse.reserved = 0;
+                SendRelayPacket(pConn, RELAY_MSG_REGISTER_RESPONSE,
+                               (const BYTE*)&regResponse, sizeof(regResponse));
+                return -1;
+            }
+
+            regResponse.status = pConn->state == RELAY_STATE_CONNECTED ?
+                (DWORD)ClaimClientId(pShard, pConn, reg.clientId) : RELAY_REGISTER_DUPLICATE;
+            if (regResponse.status != RELAY_REGISTER_OK) {
+                /* Send duplicate ID (or out of memory) error to client */
+                if (regResponse.status == RELAY_REGISTER_DUPLICATE)
+                    RelayLog("[REJECT] Registration rejected for ID %s - already connected\n", idStr);
+                SHARD_STAT_ADD(pShard, rejectedRegistrations, 1);
                 regResponse.reserved = 0;
-                SendRelayPacket(pConn->socket, RELAY_MSG_REGISTER_RESPONSE,
+                SendRelayPacket(pConn, RELAY_MSG_REGISTER_RESPONSE,
                                (const BYTE*)&regResponse, sizeof(regResponse));
                 return -1;  /* Disconnect after sending response */
             }
-            
-            pConn->clientId = reg.clientId;
-            pConn->state = RELAY_STATE_REGISTERED;
+
             pConn->lastActivity = GetTickCount();
-            
+
             /* Send success response */
             regResponse.status = RELAY_REGISTER_OK;
             regResponse.reserved = 0;
-            SendRelayPacket(pConn->socket, RELAY_MSG_REGISTER_RESPONSE,
+            SendRelayPacket(pConn, RELAY_MSG_REGISTER_RESPONSE,
                            (const BYTE*)&regResponse, sizeof(regResponse));
-            
+
             RelayLog("[REGISTER] Client ID: %s registered\n", idStr);
             return 0;
         }
-        
+
         case RELAY_MSG_CONNECT_REQUEST: {
             RELAY_CONNECT_REQUEST req;
-            char clientIdStr[20], partnerIdStr[20];
-            
+
             if (length < sizeof(RELAY_HEADER) + sizeof(RELAY_CONNECT_REQUEST))
                 return -1;
-            
+
             memcpy(&req, buffer + sizeof(RELAY_HEADER), sizeof(RELAY_CONNECT_REQUEST));
-            FormatClientId(pConn->clientId, clientIdStr);
-            FormatClientId(req.partnerId, partnerIdStr);
-            
-            pPartner = FindConnectionById(pServer, req.partnerId);
-            
-            if (!pPartner) {
-                response.status = RD2K_ERR_CONNECT;
-                RelayLog("[CONNECT] %s -> %s: NOT ONLINE\n", clientIdStr, partnerIdStr);
-            } else if (pPartner->state == RELAY_STATE_PAIRED) {
-                response.status = RD2K_ERR_CONNECT;
-                RelayLog("[CONNECT] %s -> %s: BUSY\n", clientIdStr, partnerIdStr);
-            } else if (pPartner->state != RELAY_STATE_REGISTERED) {
-                response.status = RD2K_ERR_CONNECT;
-                RelayLog("[CONNECT] %s -> %s: NOT READY\n", clientIdStr, partnerIdStr);
-            } else {
-                /* Partner available - Pair the connections */
-                RELAY_PARTNER_CONNECTED partnerNotify;
-                
-                pConn->pPartner = pPartner;
-                pPartner->pPartner = pConn;
-                pConn->state = RELAY_STATE_PAIRED;
-                pPartner->state = RELAY_STATE_PAIRED;
-                response.status = RD2K_SUCCESS;
-                
-                /* CRITICAL: Notify the partner that someone connected to them!
-                 * Without this, the partner doesn't know they're paired and
-                 * won't start the handshake → authentication fails! */
-                partnerNotify.partnerId = pConn->clientId;
-                partnerNotify.reserved = 0;
-                SendRelayPacket(pPartner->socket, RELAY_MSG_PARTNER_CONNECTED,
-                               (const BYTE*)&partnerNotify, sizeof(partnerNotify));
-                
-                /* Update partner's activity too */
-                pPartner->lastActivity = GetTickCount();
-                
-                RelayLog("[CONNECT] %s <-> %s: PAIRED\n", clientIdStr, partnerIdStr);
-                RelayLog("[NOTIFY] Sent PARTNER_CONNECTED to %s\n", partnerIdStr);
+            HandleConnectRequest(pShard, pConn, req.partnerId);
+            pConn->lastActivity = GetTickCount();
+            return 0;
+        }
+
+        case RELAY_MSG_PEER_CONNECT: {
+            RELAY_PEER_CONNECT req;
+            struct sockaddr_in peerAddr;
+            socklen_t addrLen = sizeof(peerAddr);
+            char idStr[20];
+
+            /* Another node opens a link with this instead of REGISTER */
+            if (!pShard->pServer->pCluster || pConn->state != RELAY_STATE_CONNECTED ||
+                length < sizeof(RELAY_HEADER) + sizeof(RELAY_PEER_CONNECT))
+                return -1;
+
+            if (getpeername(pConn->socket, (struct sockaddr*)&peerAddr, &addrLen) < 0 ||
+                !Cluster_IsPeerHost(pShard->pServer->pCluster, &peerAddr.sin_addr)) {
+                RelayLog("[REJECT] Node link from a host that is not a cluster peer\n");
+                return -1;
             }
-            
-            SendRelayPacket(pConn->socket, RELAY_MSG_CONNECT_RESPONSE,
-                           (const BYTE*)&response, sizeof(response));
+
+            memcpy(&req, buffer + sizeof(RELAY_HEADER), sizeof(RELAY_PEER_CONNECT));
+            FormatClientId(req.requesterId, idStr);
+            RelayLog("[CONNECT] Node link from node %u for client %s\n", req.nodeId, idStr);
+
+            /* Stands in for the requester: same ID, never registered. What
+             * a node link carries is another relay's, not a client's */
+            if (pConn->captureId != 0) {
+                Capture_Close(pShard->pServer->pCapture, pConn->captureId, pConn->clientId);
+                pConn->captureId = 0;
+            }
+            pConn->bNodeLink = TRUE;
+            pConn->clientId = req.requesterId;
+            HandleConnectRequest(pShard, pConn, req.partnerId);
             pConn->lastActivity = GetTickCount();
             return 0;
         }
-        
+
+        case RELAY_MSG_CONNECT_RESPONSE: {
+            RELAY_CONNECT_RESPONSE response;
+
+            /* Only the partner's node answers us, on a node link we opened */
+            if (!pConn->bNodeLink || pConn->state != RELAY_STATE_WAITING ||
+                length < sizeof(RELAY_HEADER) + sizeof(RELAY_CONNECT_RESPONSE))
+                return -1;
+
+            memcpy(&response, buffer + sizeof(RELAY_HEADER), sizeof(RELAY_CONNECT_RESPONSE));
+            pConn->lastActivity = GetTickCount();
+            return CompleteNodeLink(pShard, pConn, response.status);
+        }
+
         case RELAY_MSG_DATA: {
-            DWORD now = GetTickCount();
-            if (pConn->pPartner && pConn->pPartner->socket != INVALID_SOCKET) {
-                SendRelayPacket(pConn->pPartner->socket, RELAY_MSG_DATA,
-                               buffer + sizeof(RELAY_HEADER), header.dataLength);
-                /* Update BOTH partners' activity - CRITICAL for preventing timeout */
-                pConn->pPartner->lastActivity = now;
+            struct iovec iov;
+            BYTE *packet = NULL;
+
+            iov.iov_base = buffer;
+            iov.iov_len = length;
+            if (pShard->pServer->bReencrypt) {
+                /* Old path: the payload was decrypted above; forward an
+                 * encrypted copy in a new packet */
+                packet = (BYTE*)Pool_Alloc(length);
+                if (!packet) return 0;
+                header.flags = 0x01;
+                memcpy(packet, &header, sizeof(RELAY_HEADER));
+                memcpy(packet + sizeof(RELAY_HEADER), buffer + sizeof(RELAY_HEADER), header.dataLength);
+                Crypto_Encrypt(packet + sizeof(RELAY_HEADER), header.dataLength);
+                iov.iov_base = packet;
             }
-            pConn->lastActivity = now;
+            RecordFrameSize(pShard, pConn, length);
+            ForwardFrames(pShard, pConn, &iov, 1, 1, GetMicroseconds());
+            if (packet) Pool_Free(packet);
             return 0;
         }
-        
+
         case RELAY_MSG_DISCONNECT: {
             char idStr[20];
             char partnerIdStr[20];
             FormatClientId(pConn->clientId, idStr);
             RelayLog("[DISCONNECT] Client %s requested disconnect\n", idStr);
-            
-            /* Mark this client as disconnected */
-            pConn->state = RELAY_STATE_DISCONNECTED;
-            
+
             /* If has partner, notify and disconnect partner too */
             if (pConn->pPartner) {
-                CONNECTION *pPartner = pConn->pPartner;
+                pPartner = pConn->pPartner;
                 FormatClientId(pPartner->clientId, partnerIdStr);
-                
+
                 /* Notify partner that session ended */
-                if (pPartner->socket != INVALID_SOCKET) {
-                    SendRelayPacket(pPartner->socket, RELAY_MSG_PARTNER_DISCONNECTED, NULL, 0);
-                    RelayLog("[DISCONNECT] Sent PARTNER_DISCONNECTED to %s\n", partnerIdStr);
-                }
-                
-                /* Signal partner's disconnect event (if using threaded mode) */
-                if (pPartner->hDisconnectEvent) {
-                    pthread_cond_signal(pPartner->hDisconnectEvent);
-                }
-                
-                /* Mark partner as disconnected */
-                pPartner->state = RELAY_STATE_DISCONNECTED;
-                
+                SendRelayPacket(pPartner, RELAY_MSG_PARTNER_DISCONNECTED, NULL, 0);
+                RelayLog("[DISCONNECT] Sent PARTNER_DISCONNECTED to %s\n", partnerIdStr);
+
                 /* Clear partner linkage */
                 pPartner->pPartner = NULL;
                 pConn->pPartner = NULL;
-                
+
+                /* Partner is done as well */
+                CloseConnection(pShard, pPartner);
+
                 RelayLog("[DISCONNECT] Session %s <-> %s terminated\n", idStr, partnerIdStr);
             }
-            
+
+            return 1;
+        }
+
+        case RELAY_MSG_PARTNER_DISCONNECTED: {
+            /* Only a node link reports this: the session ended on the
+             * other node. Pass the notice on and end it here too */
+            if (!pConn->bNodeLink) return -1;
+
+            pPartner = pConn->pPartner;
+            if (pPartner) {
+                SendRelayPacket(pPartner, RELAY_MSG_PARTNER_DISCONNECTED,
+                                buffer + sizeof(RELAY_HEADER), header.dataLength);
+                pPartner->pPartner = NULL;
+                pConn->pPartner = NULL;
+                CloseConnection(pShard, pPartner);
+            }
             return 1;
         }
-        
+
         case RELAY_MSG_PING: {
-            SendRelayPacket(pConn->socket, RELAY_MSG_PONG, NULL, 0);
+            /* A PONG now would land inside the partner's frame */
+            if (pConn->bMidFrame)
+                pConn->bPongOwed = TRUE;
+            else
+                SendRelayPacket(pConn, RELAY_MSG_PONG, NULL, 0);
             pConn->lastActivity = GetTickCount();
+            /* Pings are answered here and never cross a node link, so
+             * they keep the session's link alive as well */
+            if (pConn->pPartner && pConn->pPartner->bNodeLink)
+                pConn->pPartner->lastActivity = pConn->lastActivity;
             return 0;
         }
-        
+
         default:
             RelayLog("[ERROR] Unknown message type: 0x%02X\n", header.msgType);
             return -1;
     }
-}
+}
+
+/* pConn's output is back at a frame boundary. Answer the PING that had
+ * to wait for it */
+static void LeaveFrame(RELAY_CONNECTION *pConn)
+{
+    pConn->bMidFrame = FALSE;
+    if (pConn->bPongOwed) {
+        pConn->bPongOwed = FALSE;
+        SendRelayPacket(pConn, RELAY_MSG_PONG, NULL, 0);
+    }
+}
+
+/* The next length bytes of the frame pConn is cutting through: pass them
+ * to the partner, or drop them if the frame started while unpaired */
+static void StreamFrameBytes(RELAY_SHARD *pShard, RELAY_CONNECTION *pConn, BYTE *data,
+                             DWORD length)
+{
+    RELAY_CONNECTION *pPartner = pConn->pPartner;
+    DWORD now = GetTickCount();
+    struct iovec iov;
+
+    pConn->streamIn -= length;
+    pConn->lastActivity = now;
+    if (pConn->bStreamDrop || !pPartner || pPartner->bClosed) return;
+
+    iov.iov_base = data;
+    iov.iov_len = length;
+    if (length > 0 && QueueForward(pShard, pPartner, &iov, 1, length) != RD2K_SUCCESS) {
+        CloseConnection(pShard, pPartner);
+        return;
+    }
+    pPartner->lastActivity = now;
+    if (pConn->streamIn == 0) LeaveFrame(pPartner);
+}
+
+/* A large DATA frame is only partly here: forward its header and the
+ * payload so far now, and the rest as it is read (streamIn), so frames
+ * of any size pass through one recvBuffer. Like a spliced frame, it is
+ * timed from its header. Until it is complete the partner's output is
+ * inside the frame, so nothing else may be queued to the partner */
+static void StartCutThrough(RELAY_SHARD *pShard, RELAY_CONNECTION *pConn, BYTE *frame,
+                            DWORD available, DWORD frameSize)
+{
+    RELAY_CONNECTION *pPartner = pConn->pPartner;
+
+    CountFrameIn(pShard, pConn, RELAY_MSG_DATA, frameSize);
+    CaptureFrame(pConn, frame, available, frameSize);
+    RecordFrameSize(pShard, pConn, frameSize);
+
+    pConn->streamIn = frameSize;
+    pConn->bStreamDrop = !pPartner || pPartner->bClosed;
+    if (!pConn->bStreamDrop) {
+        MarkForwarded(pPartner, frameSize, 1, GetMicroseconds());
+        pPartner->bMidFrame = TRUE;
+        SHARD_STAT_ADD(pShard, framesForwarded, 1);
+        SHARD_STAT_ADD(pShard, bytesForwarded, frameSize);
+        SHARD_STAT_ADD(pShard, cutThroughFrames, 1);
+        pPartner->bytesOut += frameSize;
+    }
+    StreamFrameBytes(pShard, pConn, frame, available);
+}
+
+/* Dispatch every complete frame in recvBuffer and keep the partial tail.
+ * Runs of DATA frames are gathered and forwarded with a single sendmsg();
+ * the run is flushed before any control message so ordering is kept. A
+ * large DATA frame that is still arriving is cut through instead of
+ * waiting for its tail. Returns 0 to keep the connection, non-zero to
+ * close it */
+static int ProcessReceivedFrames(RELAY_SHARD *pShard, RELAY_CONNECTION *pConn)
+{
+    struct iovec iov[RELAY_FORWARD_IOV];
+    int iovCount = 0;
+    DWORD frameCount = 0;
+    DWORD offset = 0;
+    unsigned long long receivedUs = 0;
+    BOOL bReencrypt = pShard->pServer->bReencrypt;
+    int result = 0;
+
+    /* The rest of a cut-through frame comes first */
+    if (pConn->streamIn > 0) {
+        offset = pConn->recvPos < pConn->streamIn ? pConn->recvPos : pConn->streamIn;
+        StreamFrameBytes(pShard, pConn, pConn->recvBuffer, offset);
+    }
+
+    while (!pConn->bClosed && pConn->recvPos - offset >= sizeof(RELAY_HEADER)) {
+        RELAY_HEADER header;
+        DWORD totalPacketSize;
+        BYTE *frame = pConn->recvBuffer + offset;
+
+        memcpy(&header, frame, sizeof(RELAY_HEADER));
+
+        /* Only opaque DATA may be larger than recvBuffer; its size must fit a DWORD */
+        if (header.dataLength > 0xFFFFFFFFU - sizeof(RELAY_HEADER) ||
+            ((header.msgType != RELAY_MSG_DATA || bReencrypt) &&
+             header.dataLength > RELAY_BUFFER_SIZE - sizeof(RELAY_HEADER))) {
+            result = -1;
+            break;
+        }
+
+        if (header.msgType == RELAY_MSG_DATA && !bReencrypt &&
+            header.dataLength >= RELAY_CUT_THROUGH_MIN - sizeof(RELAY_HEADER) &&
+            pConn->recvPos - offset < sizeof(RELAY_HEADER) + header.dataLength) {
+            if (iovCount > 0) {
+                ForwardFrames(pShard, pConn, iov, iovCount, frameCount, receivedUs);
+                iovCount = 0;
+                frameCount = 0;
+                if (pConn->bClosed) break;
+            }
+            StartCutThrough(pShard, pConn, frame, pConn->recvPos - offset,
+                            sizeof(RELAY_HEADER) + header.dataLength);
+            offset = pConn->recvPos;
+            break;
+        }
+
+        totalPacketSize = sizeof(RELAY_HEADER) + header.dataLength;
+        if (pConn->recvPos - offset < totalPacketSize) break;
+        offset += totalPacketSize;
+        CountFrameIn(pShard, pConn, header.msgType, totalPacketSize);
+        CaptureFrame(pConn, frame, totalPacketSize, totalPacketSize);
+
+        if (header.msgType == RELAY_MSG_DATA && !bReencrypt) {
+            /* Everything in this batch arrived with the last recv() */
+            if (receivedUs == 0) receivedUs = GetMicroseconds();
+            RecordFrameSize(pShard, pConn, totalPacketSize);
+
+            /* Frames sit back to back in recvBuffer; extend the last iovec
+             * when this one follows it directly */
+            if (iovCount > 0 &&
+                (BYTE*)iov[iovCount - 1].iov_base + iov[iovCount - 1].iov_len == frame) {
+                iov[iovCount - 1].iov_len += totalPacketSize;
+                frameCount++;
+                continue;
+            }
+            if (iovCount == RELAY_FORWARD_IOV) {
+                ForwardFrames(pShard, pConn, iov, iovCount, frameCount, receivedUs);
+                iovCount = 0;
+                frameCount = 0;
+                if (pConn->bClosed) break;
+            }
+            iov[iovCount].iov_base = frame;
+            iov[iovCount].iov_len = totalPacketSize;
+            iovCount++;
+            frameCount++;
+            continue;
+        }
+
+        if (iovCount > 0) {
+            ForwardFrames(pShard, pConn, iov, iovCount, frameCount, receivedUs);
+            iovCount = 0;
+            frameCount = 0;
+            if (pConn->bClosed) break;
+        }
+
+        result = ProcessRelayMessage(pShard, pConn, frame, totalPacketSize);
+        if (result != 0 || pConn->bClosed) break;
+    }
+
+    if (iovCount > 0)
+        ForwardFrames(pShard, pConn, iov, iovCount, frameCount, receivedUs);
+
+    if (offset > 0 && !pConn->bClosed) {
+        memmove(pConn->recvBuffer, pConn->recvBuffer + offset, pConn->recvPos - offset);
+        pConn->recvPos -= offset;
+    }
+
+    return result;
+}
+
+/* Feed bytes read elsewhere (an io_uring buffer, a handoff) through the
+ * framer, a receive buffer's worth at a time. Returns 0 to keep the
+ * connection, non-zero to close it */
+static int FeedReceivedBytes(RELAY_SHARD *pShard, RELAY_CONNECTION *pConn, const BYTE *data,
+                             DWORD length)
+{
+    while (length > 0 && !pConn->bClosed) {
+        DWORD chunk;
+
+        if (!ReserveRecvBuffer(pConn)) return -1;
+        chunk = pConn->recvBufferSize - pConn->recvPos;
+        if (chunk == 0) return -1;
+        if (chunk > length) chunk = length;
+
+        memcpy(pConn->recvBuffer + pConn->recvPos, data, chunk);
+        pConn->recvPos += chunk;
+        data += chunk;
+        length -= chunk;
+
+        if (ProcessReceivedFrames(pShard, pConn) != 0) return -1;
+    }
+    ShrinkRecvBuffer(pConn);
+    return 0;
+}
+
+/* Read pConn again on the next loop pass without waiting for a new edge */
+static void ScheduleRead(RELAY_SHARD *pShard, RELAY_CONNECTION *pConn)
+{
+    if (!pConn->bReadPending && !pConn->bClosed) {
+        pConn->bReadPending = TRUE;
+        pConn->pNextReady = pShard->pReadyList;
+        pShard->pReadyList = pConn;
+    }
+}
+
+/* ============================================================
+ * BACKPRESSURE
+ *
+ * A connection's sendBuffer is its outbound queue. Once a partner's
+ * queue passes RELAY_SEND_HIGH_WATER we stop reading from the sender,
+ * so its TCP window closes instead of the relay buffering without
+ * bound. Draining below RELAY_SEND_LOW_WATER schedules the sender
+ * again (its EPOLLIN edge was already consumed).
+ * ============================================================ */
+
+/* Stop reading pConn if its partner cannot keep up. Returns TRUE if paused */
+static BOOL CheckBackpressure(RELAY_CONNECTION *pConn)
+{
+    RELAY_CONNECTION *pPartner = pConn->pPartner;
+
+    if (!pPartner || PendingSend(pPartner) <= RELAY_SEND_HIGH_WATER)
+        return FALSE;
+
+    if (!pConn->bReadPaused) {
+        pConn->bReadPaused = TRUE;
+        __atomic_add_fetch(&pConn->pServer->pausedReaders, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&pConn->pServer->backpressurePauses, 1, __ATOMIC_RELAXED);
+    }
+    return TRUE;
+}
+
+/* pConn's queue drained a bit; wake the partner paused on it */
+static void ReleaseBackpressure(RELAY_SHARD *pShard, RELAY_CONNECTION *pConn)
+{
+    RELAY_CONNECTION *pSender = pConn->pPartner;
+
+    if (!pSender || !pSender->bReadPaused) return;
+
+    /* The queue is moving, so the paused sender is not idle */
+    pSender->lastActivity = GetTickCount();
+
+    if (PendingSend(pConn) > RELAY_SEND_LOW_WATER) return;
+
+    pSender->bReadPaused = FALSE;
+    __atomic_sub_fetch(&pShard->pServer->pausedReaders, 1, __ATOMIC_RELAXED);
+    ScheduleRead(pShard, pSender);
+}
+
+/* ============================================================
+ * FAIR SCHEDULING
+ *
+ * Output that cannot be written the moment it is forwarded waits in the
+ * connection's sendBuffer, and the shard writes those queues in deficit
+ * round robin order: each turn a connection may write up to its deficit,
+ * which grows by schedQuantum times its weight every round it is
+ * backlogged. Connections whose output just started to queue are served
+ * before the backlogged ones, so a session of small frames waits behind
+ * at most one quantum of each bulk transfer. TCP_NOTSENT_LOWAT keeps the
+ * kernel from taking more than a little of any queue ahead of time.
+ *
+ * The scheduler can also pace all output to an uplink rate (one bucket
+ * shared by the shards) and cap what a client sends, in which case a
+ * batch only skips the queue if the budgets allow it. Epoll backend only.
+ * ============================================================ */
+
+static void RateInit(RELAY_RATE *pRate, DWORD rate, DWORD minBurst)
+{
+    unsigned long long burst = (unsigned long long)rate * RELAY_RATE_BURST_MS / 1000;
+
+    if (burst < minBurst) burst = minBurst;
+    pRate->rate = rate;
+    pRate->burst = burst * 1000000;
+    pRate->level = pRate->burst;
+    pRate->refilledUs = GetMicroseconds();
+}
+
+/* Bytes that may be sent at nowUs */
+static DWORD RateAvailable(RELAY_RATE *pRate, unsigned long long nowUs)
+{
+    unsigned long long level;
+
+    if (pRate->rate == 0) return 0xFFFFFFFF;
+
+    /* Shards share the uplink bucket and may come with an older nowUs */
+    if (nowUs > pRate->refilledUs) {
+        unsigned long long elapsedUs = nowUs - pRate->refilledUs;
+
+        if (elapsedUs >= (pRate->burst - pRate->level) / pRate->rate)
+            pRate->level = pRate->burst;
+        else
+            pRate->level += elapsedUs * pRate->rate;
+        pRate->refilledUs = nowUs;
+    }
+
+    level = pRate->level / 1000000;
+    return level < 0xFFFFFFFF ? (DWORD)level : 0xFFFFFFFF;
+}
+
+static void RateTake(RELAY_RATE *pRate, DWORD bytes)
+{
+    unsigned long long amount = (unsigned long long)bytes * 1000000;
+
+    if (pRate->rate == 0) return;
+    pRate->level = pRate->level > amount ? pRate->level - amount : 0;
+}
+
+/* Microseconds until bytes (at most a full bucket) are available */
+static unsigned long long RateWait(const RELAY_RATE *pRate, DWORD bytes)
+{
+    unsigned long long need = (unsigned long long)bytes * 1000000;
+
+    if (pRate->rate == 0) return 0;
+    if (need > pRate->burst) need = pRate->burst;
+    if (pRate->level >= need) return 0;
+    return (need - pRate->level + pRate->rate - 1) / pRate->rate;
+}
+
+/* Up to want bytes of the uplink rate for this shard. The shared bucket
+ * is only locked when the shard's own credit runs short */
+static DWORD TakeUplink(RELAY_SHARD *pShard, DWORD want, unsigned long long nowUs)
+{
+    RELAY_SERVER *pServer = pShard->pServer;
+    DWORD granted;
+
+    if (pServer->uplink.rate == 0) return want;
+
+    if (pShard->uplinkCredit < want) {
+        pthread_mutex_lock(&pServer->uplinkMutex);
+        granted = RateAvailable(&pServer->uplink, nowUs);
+        if (granted > want - pShard->uplinkCredit) granted = want - pShard->uplinkCredit;
+        RateTake(&pServer->uplink, granted);
+        pthread_mutex_unlock(&pServer->uplinkMutex);
+        pShard->uplinkCredit += granted;
+    }
+
+    granted = want < pShard->uplinkCredit ? want : pShard->uplinkCredit;
+    pShard->uplinkCredit -= granted;
+    return granted;
+}
+
+/* Keep the unused part of a TakeUplink grant for the next one */
+static void ReturnUplink(RELAY_SHARD *pShard, DWORD bytes)
+{
+    if (pShard->pServer->uplink.rate != 0) pShard->uplinkCredit += bytes;
+}
+
+static unsigned long long UplinkWait(RELAY_SHARD *pShard, DWORD bytes)
+{
+    RELAY_SERVER *pServer = pShard->pServer;
+    unsigned long long waitUs;
+
+    pthread_mutex_lock(&pServer->uplinkMutex);
+    waitUs = RateWait(&pServer->uplink, bytes);
+    pthread_mutex_unlock(&pServer->uplinkMutex);
+    return waitUs;
+}
+
+/* pConn's output carries the DATA partnerId sends, so it gets that
+ * client's weight and rate cap. A client's own entry wins over the
+ * catch-all, field by field */
+static void SetOutputShare(RELAY_SERVER *pServer, RELAY_CONNECTION *pConn, DWORD partnerId)
+{
+    DWORD weight = 1, rate = 0;
+    DWORD pass, i;
+
+    for (pass = 0; pass < 2; pass++) {
+        DWORD clientId = pass == 0 ? RELAY_SHARE_ANY_CLIENT : partnerId;
+
+        if (pass == 1 && partnerId == RELAY_SHARE_ANY_CLIENT) break;
+        for (i = 0; i < pServer->shareCount; i++) {
+            if (pServer->pShares[i].clientId != clientId) continue;
+            if (pServer->pShares[i].weight) weight = pServer->pShares[i].weight;
+            if (pServer->pShares[i].rate) rate = pServer->pShares[i].rate;
+        }
+    }
+
+    /* A full deficit must fit the cap's bucket */
+    pConn->weight = weight;
+    RateInit(&pConn->cap, rate, pServer->schedQuantum * weight);
+}
+
+static void PushScheduled(RELAY_SHARD *pShard, RELAY_CONNECTION *pConn, BOOL bNew)
+{
+    RELAY_CONNECTION **ppHead = bNew ? &pShard->pNewHead : &pShard->pOldHead;
+    RELAY_CONNECTION **ppTail = bNew ? &pShard->pNewTail : &pShard->pOldTail;
+
+    pConn->pNextScheduled = NULL;
+    if (*ppTail)
+        (*ppTail)->pNextScheduled = pConn;
+    else
+        *ppHead = pConn;
+    *ppTail = pConn;
+}
+
+static void PopScheduled(RELAY_SHARD *pShard, BOOL bNew)
+{
+    RELAY_CONNECTION **ppHead = bNew ? &pShard->pNewHead : &pShard->pOldHead;
+    RELAY_CONNECTION **ppTail = bNew ? &pShard->pNewTail : &pShard->pOldTail;
+    RELAY_CONNECTION *pConn = *ppHead;
+
+    *ppHead = pConn->pNextScheduled;
+    if (*ppTail == pConn) *ppTail = NULL;
+    pConn->pNextScheduled = NULL;
+}
+
+/* pConn has output queued: give it a turn, ahead of the backlogged ones.
+ * A blocked socket gets its turn on EPOLLOUT */
+static void ScheduleConnection(RELAY_SHARD *pShard, RELAY_CONNECTION *pConn)
+{
+    if (pConn->bScheduled || pConn->bSendBlocked || pConn->bClosed) return;
+
+    pConn->bScheduled = TRUE;
+    pConn->deficit = pShard->pServer->schedQuantum * pConn->weight;
+    PushScheduled(pShard, pConn, TRUE);
+    pShard->scheduledCount++;
+}
+
+static BOOL RemoveScheduled(RELAY_CONNECTION **ppHead, RELAY_CONNECTION **ppTail,
+                            RELAY_CONNECTION *pConn)
+{
+    RELAY_CONNECTION **ppConn, *pPrev = NULL;
+
+    for (ppConn = ppHead; *ppConn; ppConn = &(*ppConn)->pNextScheduled) {
+        if (*ppConn == pConn) {
+            *ppConn = pConn->pNextScheduled;
+            if (*ppTail == pConn) *ppTail = pPrev;
+            return TRUE;
+        }
+        pPrev = *ppConn;
+    }
+    return FALSE;
+}
+
+/* Take pConn off the round robin lists (detach or close) */
+static void UnscheduleConnection(RELAY_SHARD *pShard, RELAY_CONNECTION *pConn)
+{
+    if (!pConn->bScheduled) return;
+
+    if (!RemoveScheduled(&pShard->pNewHead, &pShard->pNewTail, pConn))
+        RemoveScheduled(&pShard->pOldHead, &pShard->pOldTail, pConn);
+    pConn->bScheduled = FALSE;
+    pConn->pNextScheduled = NULL;
+    pShard->scheduledCount--;
+}
+
+/* May a batch go to pConn's socket right away? Only if pConn has no
+ * backlog and the batch fits its quantum and both rate budgets, which it
+ * then spends */
+static BOOL AdmitOutput(RELAY_SHARD *pShard, RELAY_CONNECTION *pConn, DWORD length)
+{
+    unsigned long long nowUs;
+    DWORD granted;
+
+    if (pConn->bScheduled || pConn->bSendBlocked ||
+        length > pShard->pServer->schedQuantum * pConn->weight)
+        return FALSE;
+
+    nowUs = GetMicroseconds();
+    if (RateAvailable(&pConn->cap, nowUs) < length) return FALSE;
+
+    granted = TakeUplink(pShard, length, nowUs);
+    if (granted < length) {
+        ReturnUplink(pShard, granted);
+        return FALSE;
+    }
+    RateTake(&pConn->cap, length);
+    return TRUE;
+}
+
+/* Queue a batch behind pConn's backlog and give pConn a turn */
+static int ScheduleOutput(RELAY_SHARD *pShard, RELAY_CONNECTION *pConn,
+                          struct iovec *iov, int iovCount, DWORD length)
+{
+    int result;
+
+    AccountQueued(pConn, length);
+    result = AppendSendBuffer(pConn, iov, iovCount, length);
+    if (result == RD2K_SUCCESS) ScheduleConnection(pShard, pConn);
+    return result;
+}
+
+/* Write queued output in round robin order, once per loop pass, until
+ * every queue is drained, blocked or out of budget. The timer brings the
+ * shard back when a budget has refilled */
+static void RunScheduler(RELAY_SHARD *pShard)
+{
+    RELAY_SERVER *pServer = pShard->pServer;
+    unsigned long long nowUs, waitUs = 0;
+    DWORD skipped = 0;
+
+    if (pShard->scheduledCount == 0) return;
+    nowUs = GetMicroseconds();
+
+    while (skipped < pShard->scheduledCount) {
+        BOOL bNew = pShard->pNewHead != NULL;
+        RELAY_CONNECTION *pConn = bNew ? pShard->pNewHead : pShard->pOldHead;
+        DWORD want = pConn->sendLen - pConn->sendPos;
+        DWORD granted;
+        int written;
+
+        if (want > pConn->deficit) want = pConn->deficit;
+
+        /* Over its cap: to the back of the line until the bucket refills */
+        granted = RateAvailable(&pConn->cap, nowUs);
+        if (granted == 0) {
+            unsigned long long capUs = RateWait(&pConn->cap, want);
+
+            if (waitUs == 0 || capUs < waitUs) waitUs = capUs;
+            PopScheduled(pShard, bNew);
+            PushScheduled(pShard, pConn, FALSE);
+            SHARD_STAT_ADD(pShard, rateCapWaits, 1);
+            skipped++;
+            continue;
+        }
+        if (want > granted) want = granted;
+
+        /* Uplink spent: nobody on this shard may write. pConn keeps its
+         * place at the head */
+        granted = TakeUplink(pShard, want, nowUs);
+        if (granted == 0) {
+            unsigned long long uplinkUs = UplinkWait(pShard, want);
+
+            if (waitUs == 0 || uplinkUs < waitUs) waitUs = uplinkUs;
+            SHARD_STAT_ADD(pShard, uplinkWaits, 1);
+            break;
+        }
+
+        PopScheduled(pShard, bNew);
+        written = WriteSendBuffer(pConn, granted);
+        if (written < 0) {
+            pConn->bScheduled = FALSE;
+            pShard->scheduledCount--;
+            CloseConnection(pShard, pConn);
+            continue;
+        }
+        ReturnUplink(pShard, granted - (DWORD)written);
+        RateTake(&pConn->cap, (DWORD)written);
+        pConn->deficit -= (DWORD)written;
+        SHARD_STAT_ADD(pShard, scheduledBytes, (DWORD)written);
+        if (written > 0) skipped = 0;
+
+        if (pConn->sendLen == pConn->sendPos || pConn->bSendBlocked) {
+            /* Drained, or the socket is full and EPOLLOUT brings it back */
+            pConn->bScheduled = FALSE;
+            pShard->scheduledCount--;
+        } else {
+            /* Quantum or budget used up: next round, behind the others */
+            if (pConn->deficit == 0) pConn->deficit = pServer->schedQuantum * pConn->weight;
+            PushScheduled(pShard, pConn, FALSE);
+        }
+        ReleaseBackpressure(pShard, pConn);
+    }
+
+    if (waitUs > 0 && pShard->scheduledCount > 0)
+        ArmTimerFd(pShard->schedFd, &pShard->schedArmedUs, nowUs + waitUs);
+}
+
+/* ============================================================
+ * SEND COALESCING
+ *
+ * Clients send a packet's header and its payload as two DATA frames, so
+ * an input event reaches the relay as two tiny frames, often in separate
+ * reads. With a coalescing window, a small forwarded batch for a socket
+ * with nothing queued is held in sendBuffer instead of being written at
+ * once. Whatever else is forwarded to that connection within coalesceUs
+ * leaves in the same send(), or earlier once coalesceBytes are waiting.
+ * Output is only delayed, never reordered, so the byte stream is the
+ * same. Epoll backend only: io_uring already merges everything queued
+ * for a connection during one loop pass into a single SEND.
+ * ============================================================ */
+
+/* Send a batch of DATA to pConn, holding it if it is small and the
+ * socket is idle, or queueing it for the fair scheduler. The iovecs may
+ * be consumed */
+static int QueueForward(RELAY_SHARD *pShard, RELAY_CONNECTION *pConn,
+                        struct iovec *iov, int iovCount, DWORD length)
+{
+    RELAY_SERVER *pServer = pShard->pServer;
+    int result;
+
+    if (pServer->bFair && !pConn->bClosed && !AdmitOutput(pShard, pConn, length))
+        return ScheduleOutput(pShard, pConn, iov, iovCount, length);
+
+    if (pShard->coalesceFd < 0 || pConn->pSpliceFrom || pConn->bClosed)
+        return QueueSendV(pConn, iov, iovCount);
+
+    if (!pConn->bHeld) {
+        /* Large batches, and output already waiting for EPOLLOUT, go as usual */
+        if (length >= pServer->coalesceBytes || pConn->sendLen > pConn->sendPos)
+            return QueueSendV(pConn, iov, iovCount);
+
+        pConn->bHeld = TRUE;
+        pConn->heldSinceUs = GetMicroseconds();
+        pConn->pNextHeld = NULL;
+        if (pShard->pHeldTail) {
+            pShard->pHeldTail->pNextHeld = pConn;
+        } else {
+            pShard->pHeldHead = pConn;
+            ArmTimerFd(pShard->coalesceFd, &pShard->coalesceArmedUs,
+                       pConn->heldSinceUs + pServer->coalesceUs);
+        }
+        pShard->pHeldTail = pConn;
+    }
+
+    AccountQueued(pConn, length);
+    result = AppendSendBuffer(pConn, iov, iovCount, length);
+    if (result != RD2K_SUCCESS) return result;
+    SHARD_STAT_ADD(pShard, coalescedBatches, 1);
+
+    /* Budget reached: write now. The hold itself lasts until its deadline,
+     * so more small batches still gather behind this send */
+    if (pConn->sendLen - pConn->sendPos >= pServer->coalesceBytes) {
+        SHARD_STAT_ADD(pShard, coalescedSends, 1);
+        if (FlushSendBuffer(pConn) < 0) return RD2K_ERR_SEND;
+    }
+    return RD2K_SUCCESS;
+}
+
+/* Take pConn off the held list (detach or close) */
+static void UnholdConnection(RELAY_SHARD *pShard, RELAY_CONNECTION *pConn)
+{
+    RELAY_CONNECTION **ppHeld, *pPrev = NULL;
+
+    if (!pConn->bHeld) return;
+
+    for (ppHeld = &pShard->pHeldHead; *ppHeld; ppHeld = &(*ppHeld)->pNextHeld) {
+        if (*ppHeld == pConn) {
+            *ppHeld = pConn->pNextHeld;
+            if (pShard->pHeldTail == pConn) pShard->pHeldTail = pPrev;
+            break;
+        }
+        pPrev = *ppHeld;
+    }
+    pConn->bHeld = FALSE;
+    pConn->pNextHeld = NULL;
+}
+
+/* Write out held output whose window has closed, once per loop pass */
+static void FlushHeldOutput(RELAY_SHARD *pShard)
+{
+    DWORD coalesceUs = pShard->pServer->coalesceUs;
+    unsigned long long nowUs;
+    RELAY_CONNECTION *pConn;
+
+    if (!pShard->pHeldHead) return;
+
+    nowUs = GetMicroseconds();
+    while ((pConn = pShard->pHeldHead) != NULL && pConn->heldSinceUs + coalesceUs <= nowUs) {
+        pShard->pHeldHead = pConn->pNextHeld;
+        if (!pShard->pHeldHead) pShard->pHeldTail = NULL;
+        pConn->bHeld = FALSE;
+        pConn->pNextHeld = NULL;
+
+        /* EPOLLOUT or the byte budget may have written it already, or
+         * later output put it in the scheduler's hands */
+        if (pConn->sendLen == pConn->sendPos || pConn->bScheduled) continue;
+
+        SHARD_STAT_ADD(pShard, coalescedSends, 1);
+        if (FlushSendBuffer(pConn) < 0) {
+            CloseConnection(pShard, pConn);
+            continue;
+        }
+        ReleaseBackpressure(pShard, pConn);
+    }
+
+    if (pConn) {
+        ArmTimerFd(pShard->coalesceFd, &pShard->coalesceArmedUs,
+                   pConn->heldSinceUs + coalesceUs);
+    }
+}
+
+/* ============================================================
+ * ZERO-COPY FORWARDING (splice mode)
+ *
+ * A paired connection reads only the 8-byte header of each frame. For a
+ * DATA frame the header is written into the connection's pipe and the
+ * payload is spliced socket -> pipe -> partner socket. The partner's
+ * output switches between its sendBuffer and our pipe only at frame
+ * boundaries: a spliced frame starts only when the partner's sendBuffer
+ * is empty, and anything queued for the partner meanwhile waits in
+ * sendBuffer until the frame is complete.
+ * ============================================================ */
+
+static BOOL EnsureSplicePipe(RELAY_CONNECTION *pConn)
+{
+    int size;
+
+    if (pConn->pipeFds[0] >= 0) return TRUE;
+
+    if (pipe2(pConn->pipeFds, O_NONBLOCK | O_CLOEXEC) < 0) {
+        pConn->pipeFds[0] = -1;
+        pConn->pipeFds[1] = -1;
+        return FALSE;
+    }
+
+    /* Larger pipes mean fewer round trips per large frame; the default
+     * stays in place if the system limit is lower */
+    fcntl(pConn->pipeFds[1], F_SETPIPE_SZ, RELAY_SPLICE_PIPE_SIZE);
+    size = fcntl(pConn->pipeFds[1], F_GETPIPE_SZ);
+    pConn->pipeSize = size > 0 ? (DWORD)size : 65536;
+    return TRUE;
+}
+
+/* How many bytes the next recv() may take. Paired splice-mode connections
+ * read exactly one header, then (if it cannot be spliced) exactly the rest
+ * of that frame, so no payload is ever pulled into user space by accident */
+static DWORD RecvWindow(RELAY_SHARD *pShard, RELAY_CONNECTION *pConn)
+{
+    RELAY_HEADER header;
+    DWORD frameSize;
+
+    if (!pShard->pServer->bSplice || !pConn->pPartner)
+        return pConn->recvBufferSize - pConn->recvPos;
+
+    /* The rest of a cut-through frame, then the next header by itself */
+    if (pConn->streamIn > 0)
+        return pConn->streamIn < pConn->recvBufferSize - pConn->recvPos ?
+               pConn->streamIn : pConn->recvBufferSize - pConn->recvPos;
+
+    if (pConn->recvPos < sizeof(RELAY_HEADER))
+        return sizeof(RELAY_HEADER) - pConn->recvPos;
+
+    memcpy(&header, pConn->recvBuffer, sizeof(RELAY_HEADER));
+    frameSize = sizeof(RELAY_HEADER) + header.dataLength;
+    if (header.dataLength > pConn->recvBufferSize - sizeof(RELAY_HEADER) ||
+        frameSize <= pConn->recvPos)
+        return pConn->recvBufferSize - pConn->recvPos;
+
+    return frameSize - pConn->recvPos;
+}
+
+/* Move what is in pSource's pipe to its partner.
+ * Returns bytes moved, or -1 if the partner's socket failed */
+static int PumpSplicePipe(RELAY_CONNECTION *pSource)
+{
+    RELAY_CONNECTION *pDest = pSource->pPartner;
+    int total = 0;
+    ssize_t moved;
+
+    while (pSource->pipeLen > 0) {
+        moved = splice(pSource->pipeFds[0], NULL, pDest->socket, NULL, pSource->pipeLen,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (moved > 0) {
+            pSource->pipeLen -= (DWORD)moved;
+            total += (int)moved;
+            AccountSent(pDest, (DWORD)moved);
+            continue;
+        }
+        if (moved < 0 && errno == EINTR) continue;
+        if (moved < 0 && errno == EAGAIN) return total;
+        return -1;
+    }
+
+    /* Frame complete - release the partner's output to its sendBuffer */
+    if (pSource->spliceIn == 0 && pDest->pSpliceFrom == pSource) {
+        pDest->pSpliceFrom = NULL;
+        if (FlushSendBuffer(pDest) < 0) return -1;
+        LeaveFrame(pDest);
+    }
+
+    return total;
+}
+
+/* If recvBuffer holds exactly a DATA header that can be spliced, start
+ * forwarding that frame through the pipe. Returns TRUE if started */
+static BOOL TryStartSplice(RELAY_SHARD *pShard, RELAY_CONNECTION *pConn)
+{
+    RELAY_CONNECTION *pPartner = pConn->pPartner;
+    RELAY_HEADER header;
+    DWORD frameSize;
+
+    if (!pShard->pServer->bSplice || !pPartner || pPartner->bClosed) return FALSE;
+    if (pConn->recvPos != sizeof(RELAY_HEADER)) return FALSE;
+
+    memcpy(&header, pConn->recvBuffer, sizeof(RELAY_HEADER));
+    if (header.msgType != RELAY_MSG_DATA || header.dataLength == 0 ||
+        header.dataLength > 0xFFFFFFFFU - sizeof(RELAY_HEADER))
+        return FALSE;
+
+    /* Only at a frame boundary of the partner's output */
+    if (pPartner->sendLen != pPartner->sendPos || pPartner->pSpliceFrom) return FALSE;
+    if (!EnsureSplicePipe(pConn)) return FALSE;
+
+    /* The pipe is empty here, so the header always fits */
+    if (write(pConn->pipeFds[1], pConn->recvBuffer, sizeof(RELAY_HEADER)) != sizeof(RELAY_HEADER))
+        return FALSE;
+
+    pConn->pipeLen = sizeof(RELAY_HEADER);
+    pConn->spliceIn = header.dataLength;
+    pConn->recvPos = 0;
+    pPartner->pSpliceFrom = pConn;
+    pPartner->bMidFrame = TRUE;
+
+    /* The payload is still in the socket, so a spliced frame is timed
+     * from its header */
+    frameSize = sizeof(RELAY_HEADER) + header.dataLength;
+    CountFrameIn(pShard, pConn, RELAY_MSG_DATA, frameSize);
+    CaptureFrame(pConn, (const BYTE*)&header, sizeof(RELAY_HEADER), frameSize);
+    RecordFrameSize(pShard, pConn, frameSize);
+    MarkForwarded(pPartner, frameSize, 1, GetMicroseconds());
+    AccountQueued(pPartner, frameSize);
+    SHARD_STAT_ADD(pShard, framesForwarded, 1);
+    SHARD_STAT_ADD(pShard, bytesForwarded, frameSize);
+    pPartner->bytesOut += frameSize;
+    return TRUE;
+}
+
+/* Advance the frame being spliced from pConn to its partner.
+ * Returns 1 if bytes moved, 0 if it has to wait for an event, -1 to close */
+static int ContinueSplice(RELAY_SHARD *pShard, RELAY_CONNECTION *pConn)
+{
+    RELAY_CONNECTION *pPartner = pConn->pPartner;
+    ssize_t filled = 0;
+    int pumped;
+
+    if (pConn->spliceIn > 0) {
+        DWORD room = pConn->pipeSize - pConn->pipeLen;
+        DWORD want = pConn->spliceIn < room ? pConn->spliceIn : room;
+
+        if (want > 0) {
+            filled = splice(pConn->socket, NULL, pConn->pipeFds[1], NULL, want,
+                            SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (filled == 0) return -1;     /* EOF in the middle of a frame */
+            if (filled < 0) {
+                if (errno != EAGAIN && errno != EINTR) return -1;
+                filled = 0;
+            }
+            pConn->spliceIn -= (DWORD)filled;
+            pConn->pipeLen += (DWORD)filled;
+        }
+    }
+
+    pumped = PumpSplicePipe(pConn);
+    if (pumped < 0) {
+        /* Partner socket is dead */
+        CloseConnection(pShard, pPartner);
+        return 0;
+    }
+
+    if (filled > 0 || pumped > 0) {
+        DWORD now = GetTickCount();
+        pConn->lastActivity = now;
+        pPartner->lastActivity = now;
+        return 1;
+    }
+    return 0;
+}
+
+/* Drain the socket (edge-triggered: read until EAGAIN or budget runs out).
+ * Returns 0 to keep the connection, non-zero to close it */
+static int HandleReadable(RELAY_SHARD *pShard, RELAY_CONNECTION *pConn)
+{
+    int budget = RELAY_READ_BUDGET;
+    ssize_t recvLen;
+
+    while (!pConn->bClosed) {
+        if (budget-- == 0) {
+            /* More data may be waiting; finish it on the next loop pass
+             * so one busy sender cannot starve the others */
+            ScheduleRead(pShard, pConn);
+            return 0;
+        }
+
+        /* A spliced frame in flight comes before the next header. If the
+         * partner's socket is full, its EPOLLOUT reschedules us */
+        if (pConn->spliceIn > 0 || pConn->pipeLen > 0) {
+            int result = ContinueSplice(pShard, pConn);
+            if (result < 0) return -1;
+            if (result == 0) return 0;
+            continue;
+        }
+
+        /* Leave the data in the kernel until the partner catches up */
+        if (CheckBackpressure(pConn)) return 0;
+        if (!ReserveRecvBuffer(pConn)) return -1;
+
+        recvLen = recv(pConn->socket, pConn->recvBuffer + pConn->recvPos,
+                       RecvWindow(pShard, pConn), 0);
+
+        if (recvLen == 0) return 1;
+        if (recvLen < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+
+        pConn->recvPos += (DWORD)recvLen;
+
+        if (TryStartSplice(pShard, pConn)) continue;
+        if (ProcessReceivedFrames(pShard, pConn) != 0) return -1;
+        ShrinkRecvBuffer(pConn);
+    }
+
+    return 0;
+}
+
+static void HandleConnectionEvent(RELAY_SHARD *pShard, RELAY_CONNECTION *pConn, DWORD events)
+{
+    if (pConn->bClosed) return;
+
+    if (events & EPOLLOUT) {
+        pConn->bSendBlocked = FALSE;
+        if (pConn->pSpliceFrom) {
+            /* Our output is the partner's spliced frame; the partner may be
+             * waiting for pipe space or for the frame to finish */
+            RELAY_CONNECTION *pSource = pConn->pSpliceFrom;
+            if (PumpSplicePipe(pSource) < 0) {
+                CloseConnection(pShard, pConn);
+                return;
+            }
+            ScheduleRead(pShard, pSource);
+        } else if (pShard->pServer->bFair) {
+            /* Queued output goes when the scheduler says so, held output
+             * when its coalescing window closes */
+            if (pConn->sendLen > pConn->sendPos && !pConn->bHeld)
+                ScheduleConnection(pShard, pConn);
+        } else if (FlushSendBuffer(pConn) < 0) {
+            CloseConnection(pShard, pConn);
+            return;
+        }
+        ReleaseBackpressure(pShard, pConn);
+    }
+
+    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+        if (HandleReadable(pShard, pConn) != 0)
+            CloseConnection(pShard, pConn);
+    }
+}
+
+/* Disconnect clients that have not sent anything for a while. Activity
+ * only stamps lastActivity; a timer that fires early because the client
+ * was busy is moved to the real deadline instead */
+static void ExpireIdleConnections(RELAY_SHARD *pShard)
+{
+    DWORD currentTime = GetTickCount();
+    RELAY_TIMER *pTimer = Timer_Advance(&pShard->timers, currentTime);
+
+    while (pTimer) {
+        RELAY_TIMER *pNext = pTimer->pNext;
+        RELAY_CONNECTION *pConn = (RELAY_CONNECTION*)((BYTE*)pTimer -
+                                  offsetof(RELAY_CONNECTION, idleTimer));
+
+        /* May already be gone as the partner of an earlier entry */
+        if (!pConn->bClosed) {
+            if (currentTime - pConn->lastActivity > CLIENT_INACTIVITY_TIMEOUT_MS) {
+                char idStr[20];
+                FormatClientId(pConn->clientId, idStr);
+                RelayLog("[TIMEOUT] Client %s inactive for %u ms - disconnecting\n",
+                        idStr, currentTime - pConn->lastActivity);
+                SHARD_STAT_ADD(pShard, timeouts, 1);
+                CloseConnection(pShard, pConn);
+            } else {
+                Timer_Schedule(&pShard->timers, pTimer,
+                               pConn->lastActivity + CLIENT_INACTIVITY_TIMEOUT_MS + 1);
+            }
+        }
+        pTimer = pNext;
+    }
+}
+
+/* ============================================================
+ * SHARD EVENT LOOP
+ * ============================================================ */
+
+/* Answer a PAIR_REQUEST on the requester's shard. The request itself
+ * goes back as the reply, so answering needs no memory (a claimed
+ * partner is never stranded) and its reference keeps the requester
+ * alive */
+static void ReplyPairRequest(RELAY_SHARD_MSG *pMsg, RELAY_CONNECTION *pPartner)
+{
+    pMsg->type = pPartner ? SHARD_MSG_PAIR_ATTACH : SHARD_MSG_PAIR_FAILED;
+    pMsg->pPartner = pPartner;
+    QueueShardMessage(pMsg->pReplyShard, pMsg);
+}
+
+static void ProcessShardMessages(RELAY_SHARD *pShard)
+{
+    RELAY_SHARD_MSG *pMsg;
+    uint64_t count;
+
+    if (pShard->pServer->backend == RELAY_BACKEND_EPOLL &&
+        read(pShard->wakeFd, &count, sizeof(count)) < 0) {
+        /* Nothing signalled */
+    }
+
+    pthread_mutex_lock(&pShard->inboxMutex);
+    pMsg = pShard->pInboxHead;
+    pShard->pInboxHead = NULL;
+    pShard->pInboxTail = NULL;
+    pthread_mutex_unlock(&pShard->inboxMutex);
+
+    while (pMsg) {
+        RELAY_SHARD_MSG *pNext = pMsg->pNext;
+        RELAY_CONNECTION *pConn = pMsg->pConn;
+
+        switch (pMsg->type) {
+            case SHARD_MSG_KICK:
+                CloseConnection(pShard, pConn);
+                break;
+
+            case SHARD_MSG_PAIR_REQUEST: {
+                /* We own the partner; on success it moves to the requester's shard */
+                RELAY_CONNECTION *pPartner = ClaimPartner(pShard, pMsg->requesterId, pMsg->partnerId);
+
+                if (pPartner) {
+                    DetachConnection(pShard, pPartner);
+                    Registry_Lock(pShard->pServer->pRegistry, pPartner->clientId);
+                    pPartner->pShard = pMsg->pReplyShard;
+                    Registry_Unlock(pShard->pServer->pRegistry, pPartner->clientId);
+
+                    /* io_uring requests on our ring still point at the
+                     * partner; it leaves once the last one completes */
+                    if (pPartner->uringOps > 0) {
+                        pPartner->pHandoffMsg = pMsg;
+                        pMsg = pNext;
+                        continue;
+                    }
+                }
+
+                ReplyPairRequest(pMsg, pPartner);
+                pMsg = pNext;
+                continue;
+            }
+
+            case SHARD_MSG_PAIR_ATTACH: {
+                RELAY_CONNECTION *pPartner = pMsg->pPartner;
+
+                if (!AttachConnection(pShard, pPartner)) {
+                    UnlistConnection(pShard->pServer, pPartner);
+                    FreeConnection(pPartner);
+                    if (!pConn->bClosed) FailConnectRequest(pShard, pConn);
+                    break;
+                }
+
+                if (pConn->bClosed) {
+                    /* Requester left while the partner was in transit */
+                    SetConnectionState(pShard->pServer, pPartner, RELAY_STATE_REGISTERED);
+                } else {
+                    PairConnections(pShard, pConn, pPartner);
+                }
+
+                /* Frames that arrived during an io_uring hand-off */
+                if (pShard->pServer->backend == RELAY_BACKEND_URING && pPartner->recvPos > 0)
+                    ScheduleRead(pShard, pPartner);
+                break;
+            }
+
+            case SHARD_MSG_PAIR_FAILED:
+                if (!pConn->bClosed) FailConnectRequest(pShard, pConn);
+                break;
+        }
+
+        ReleaseConnection(pShard, pConn);
+        FreeShardMessage(pShard->pServer, pMsg);
+        pMsg = pNext;
+    }
+}
+
+/* pAddr: address from accept(), NULL to look it up */
+static void AdoptClientSocket(RELAY_SHARD *pShard, SOCKET clientSocket,
+                              const struct sockaddr_in *pAddr)
+{
+    RELAY_SERVER *pServer = pShard->pServer;
+    RELAY_CONNECTION *pConn;
+    DWORD addr;
+
+    /* Multishot accepts come without the address */
+    addr = pAddr ? pAddr->sin_addr.s_addr : PeerAddress(clientSocket);
+
+    /* Before anything is allocated, so a reconnect loop costs a close() */
+    if (!AdmitSource(pServer, ADMIT_ACCEPT, addr)) {
+        close(clientSocket);
+        return;
+    }
+
+    RelayLog("[INFO] New client connection accepted\n");
+
+    pConn = AddConnection(pShard, clientSocket);
+    if (!pConn) {
+        RelayLog("[ERROR] Failed to add connection (max reached?)\n");
+        close(clientSocket);
+        return;
+    }
+    pConn->peerAddr = addr;
+    if (pServer->pCapture) pConn->captureId = Capture_Open(pServer->pCapture, addr);
+    SHARD_STAT_ADD(pShard, totalConnections, 1);
+
+    /* The CPU that processed the handshake takes the session's packets
+     * too; when it is not ours, every frame crosses between cores */
+    if (pShard->cpu >= 0) {
+        int cpu = -1;
+        socklen_t len = sizeof(cpu);
+
+        if (getsockopt(clientSocket, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == 0 &&
+            cpu >= 0 && cpu != pShard->cpu)
+            SHARD_STAT_ADD(pShard, remoteAccepts, 1);
+    }
+}
+
+/* Take what is in the listen queue, a batch at a time: the listener is
+ * level-triggered, so a longer backlog wakes us again on the next pass
+ * after the connections' own events have had their turn. Accepted sockets
+ * inherit the client options from the listener (InitShard) */
+static void AcceptConnections(RELAY_SHARD *pShard)
+{
+    DWORD i;
+
+    for (i = 0; i < RELAY_ACCEPT_BATCH; i++) {
+        struct sockaddr_in clientAddr;
+        socklen_t addrLen = sizeof(clientAddr);
+        SOCKET clientSocket;
+
+        clientSocket = accept4(pShard->listenSocket, (struct sockaddr*)&clientAddr, &addrLen,
+                               SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (clientSocket == INVALID_SOCKET) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                RelayLog("[ERROR] accept4() failed: %s\n", strerror(errno));
+            return;
+        }
+
+        AdoptClientSocket(pShard, clientSocket, &clientAddr);
+    }
+}
+
+static void EpollShardLoop(RELAY_SHARD *pShard)
+{
+    RELAY_SERVER *pServer = pShard->pServer;
+    struct epoll_event events[RELAY_MAX_EVENTS];
+    BOOL bWoken;
+    int count, i;
+
+    if (pShard->bResume) ResumeShard(pShard);
+
+    while (pServer->bRunning) {
+        RELAY_CONNECTION *pReady;
+        BOOL bQuiescing = pServer->bQuiescing;
+
+        if (bQuiescing && !pShard->bQuiesced) {
+            /* New clients wait in the listen queue for the successor */
+            epoll_ctl(pShard->epollFd, EPOLL_CTL_DEL, pShard->listenSocket, NULL);
+            pShard->bQuiesced = TRUE;
+        }
+
+        /* Carried-over readers must not wait for a new edge */
+        count = epoll_wait(pShard->epollFd, events, RELAY_MAX_EVENTS,
+                           pShard->pReadyList ? 0 : RELAY_POLL_INTERVAL_MS);
+        if (count < 0) {
+            if (errno == EINTR) continue;
+            RelayLog("[ERROR] epoll_wait() failed: %s\n", strerror(errno));
+            break;
+        }
+
+        bWoken = FALSE;
+        for (i = 0; i < count; i++) {
+            void *ptr = events[i].data.ptr;
+
+            /* Quiescing for an upgrade: write out what is queued, leave
+             * new input and new clients to the successor */
+            if (ptr == (void*)&pShard->listenSocket) {
+                AcceptConnections(pShard);
+            } else if (ptr == (void*)&pShard->wakeFd) {
+                bWoken = TRUE;
+            } else if (ptr == (void*)&pShard->coalesceFd) {
+                ReadTimerFd(pShard->coalesceFd);
+            } else if (ptr == (void*)&pShard->schedFd) {
+                ReadTimerFd(pShard->schedFd);
+            } else {
+                HandleConnectionEvent(pShard, (RELAY_CONNECTION*)ptr,
+                                      bQuiescing ? events[i].events & EPOLLOUT : events[i].events);
+            }
+        }
+
+        /* Continue readers whose budget ran out on the previous pass */
+        pReady = bQuiescing ? NULL : pShard->pReadyList;
+        if (pReady) pShard->pReadyList = NULL;
+        while (pReady) {
+            RELAY_CONNECTION *pNext = pReady->pNextReady;
+            pReady->bReadPending = FALSE;
+            HandleConnectionEvent(pShard, pReady, EPOLLIN);
+            pReady = pNext;
+        }
+
+        FlushHeldOutput(pShard);
+        RunScheduler(pShard);
+        ExpireIdleConnections(pShard);
+        DumpSessionHistograms(pShard);
+        ServeAdminRequest(pShard);
+
+        ReapClosedConnections(pShard);
+
+        /* Messages may free connections, so they run after the reap */
+        if (bWoken) {
+            ProcessShardMessages(pShard);
+            ReapClosedConnections(pShard);
+        }
+
+        /* A full pass without reading: nothing of ours is in flight */
+        if (bQuiescing) __atomic_store_n(&pShard->bSettled, TRUE, __ATOMIC_RELEASE);
+    }
+}
+
+/* ============================================================
+ * IO_URING BACKEND
+ *
+ * Same connection state machine, driven by completions instead of
+ * readiness. Each shard keeps one multishot accept, one eventfd read and
+ * one multishot recv per connection armed; received bytes land in the
+ * shard's provided buffers and are copied into recvBuffer for framing.
+ * Output is appended to sendBuffer and every connection with pending
+ * bytes gets one SEND per loop pass, so a pass over any number of
+ * frames costs a single io_uring_enter(). While a SEND is in flight its
+ * bytes live in flightBuffer and new output fills sendBuffer.
+ *
+ * A connection is freed, or handed to another shard, only after every
+ * request that names it has completed (uringOps == 0).
+ * ============================================================ */
+
+static unsigned long long UringData(void *ptr, unsigned long long tag)
+{
+    return (unsigned long long)(uintptr_t)ptr | tag;
+}
+
+static BOOL UringArmRecv(RELAY_SHARD *pShard, RELAY_CONNECTION *pConn)
+{
+    struct io_uring_sqe *pSqe = Uring_GetSqe(&pShard->ring);
+
+    if (!pSqe) return FALSE;
+
+    Uring_PrepRecvMultishot(pSqe, pConn->socket, RELAY_URING_BUFFER_GROUP,
+                            UringData(pConn, URING_TAG_RECV));
+    pConn->bRecvArmed = TRUE;
+    pConn->uringOps++;
+    pShard->uringOps++;
+    return TRUE;
+}
+
+static void UringCancelRecv(RELAY_SHARD *pShard, RELAY_CONNECTION *pConn)
+{
+    struct io_uring_sqe *pSqe;
+
+    if (!pConn->bRecvArmed) return;
+
+    pSqe = Uring_GetSqe(&pShard->ring);
+    if (pSqe)
+        Uring_PrepCancel(pSqe, UringData(pConn, URING_TAG_RECV), URING_TAG_CANCEL);
+}
+
+/* Submit the next SEND for pConn, moving sendBuffer into flight first if
+ * the previous one finished. Returns FALSE if no SQE could be had */
+static BOOL UringArmSend(RELAY_SHARD *pShard, RELAY_CONNECTION *pConn)
+{
+    struct io_uring_sqe *pSqe;
+
+    if (pConn->bSendInFlight) return TRUE;
+
+    if (pConn->flightPos == pConn->flightLen) {
+        BYTE *buffer = pConn->flightBuffer;
+        DWORD size = pConn->flightBufferSize;
+
+        if (pConn->sendPos == pConn->sendLen) return TRUE;
+
+        pConn->flightBuffer = pConn->sendBuffer;
+        pConn->flightBufferSize = pConn->sendBufferSize;
+        pConn->flightPos = pConn->sendPos;
+        pConn->flightLen = pConn->sendLen;
+        pConn->sendBuffer = buffer;
+        pConn->sendBufferSize = size;
+        pConn->sendPos = 0;
+        pConn->sendLen = 0;
+    }
+
+    pSqe = Uring_GetSqe(&pShard->ring);
+    if (!pSqe) return FALSE;
+
+    Uring_PrepSend(pSqe, pConn->socket, pConn->flightBuffer + pConn->flightPos,
+                   pConn->flightLen - pConn->flightPos, UringData(pConn, URING_TAG_SEND));
+    pConn->bSendInFlight = TRUE;
+    pConn->uringOps++;
+    pShard->uringOps++;
+    return TRUE;
+}
+
+static void UringMarkSend(RELAY_SHARD *pShard, RELAY_CONNECTION *pConn)
+{
+    if (!pConn->bSendQueued) {
+        pConn->bSendQueued = TRUE;
+        pConn->pNextSend = pShard->pSendList;
+        pShard->pSendList = pConn;
+    }
+}
+
+static void UringFlushSends(RELAY_SHARD *pShard)
+{
+    /* Quiescing: queued output is handed over instead */
+    if (pShard->pServer->bQuiescing) return;
+
+    while (pShard->pSendList) {
+        RELAY_CONNECTION *pConn = pShard->pSendList;
+
+        pShard->pSendList = pConn->pNextSend;
+        pConn->bSendQueued = FALSE;
+        if (!pConn->bClosed && !UringArmSend(pShard, pConn))
+            CloseConnection(pShard, pConn);
+    }
+}
+
+/* Leaving this ring: drop queued work, stop the recv. A SEND in flight is
+ * allowed to finish so the byte stream stays intact */
+static void UringDetach(RELAY_SHARD *pShard, RELAY_CONNECTION *pConn)
+{
+    RELAY_CONNECTION **ppSend;
+
+    if (pConn->bSendQueued) {
+        for (ppSend = &pShard->pSendList; *ppSend; ppSend = &(*ppSend)->pNextSend) {
+            if (*ppSend == pConn) {
+                *ppSend = pConn->pNextSend;
+                break;
+            }
+        }
+        pConn->bSendQueued = FALSE;
+    }
+
+    if (!pConn->bClosed) UringCancelRecv(pShard, pConn);
+}
+
+/* A request naming pConn completed */
+static void UringOpDone(RELAY_SHARD *pShard, RELAY_CONNECTION *pConn)
+{
+    RELAY_SHARD_MSG *pMsg;
+
+    pShard->uringOps--;
+    if (--pConn->uringOps > 0) return;
+
+    if (pConn->pHandoffMsg) {
+        pMsg = pConn->pHandoffMsg;
+        pConn->pHandoffMsg = NULL;
+        ReplyPairRequest(pMsg, pConn);
+    } else if (pConn->bClosed) {
+        UnparkConnection(pShard, pConn);
+    }
+}
+
+/* Frame what a completion delivered. Returns 0 to keep the connection,
+ * non-zero to close it */
+static int UringReceive(RELAY_SHARD *pShard, RELAY_CONNECTION *pConn, const BYTE *data, DWORD length)
+{
+    if (FeedReceivedBytes(pShard, pConn, data, length) != 0) return -1;
+
+    /* Bytes already delivered are forwarded; stop asking for more */
+    if (!pConn->bClosed && CheckBackpressure(pConn))
+        UringCancelRecv(pShard, pConn);
+
+    return 0;
+}
+
+/* Keep bytes a paused connection keeps delivering until the multishot
+ * recv is cancelled. Returns FALSE if the stash is over its limit */
+static BOOL UringStash(RELAY_CONNECTION *pConn, const BYTE *data, DWORD length)
+{
+    if (pConn->stashLen + length > pConn->stashSize) {
+        DWORD newSize = pConn->stashSize ? pConn->stashSize : RELAY_URING_BUFFER_SIZE;
+        BYTE *newBuffer;
+
+        if (pConn->stashLen + length > RELAY_URING_STASH_MAX) return FALSE;
+        while (newSize < pConn->stashLen + length) newSize *= 2;
+        newBuffer = (BYTE*)Pool_Realloc(pConn->stashBuffer, newSize);
+        if (!newBuffer) return FALSE;
+        pConn->stashBuffer = newBuffer;
+        pConn->stashSize = newSize;
+    }
+
+    memcpy(pConn->stashBuffer + pConn->stashLen, data, length);
+    pConn->stashLen += length;
+    return TRUE;
+}
+
+/* Frame stashed bytes until they run out or the partner fills up again.
+ * Returns 0 to keep the connection, non-zero to close it */
+static int UringDrainStash(RELAY_SHARD *pShard, RELAY_CONNECTION *pConn)
+{
+    DWORD offset = 0;
+
+    while (offset < pConn->stashLen && !pConn->bClosed && !pConn->bReadPaused) {
+        DWORD chunk = pConn->stashLen - offset;
+
+        if (chunk > RELAY_URING_BUFFER_SIZE) chunk = RELAY_URING_BUFFER_SIZE;
+        if (UringReceive(pShard, pConn, pConn->stashBuffer + offset, chunk) != 0) return -1;
+        offset += chunk;
+    }
+
+    if (offset > 0 && !pConn->bClosed) {
+        memmove(pConn->stashBuffer, pConn->stashBuffer + offset, pConn->stashLen - offset);
+        pConn->stashLen -= offset;
+    }
+    return 0;
+}
+
+static void UringRecvComplete(RELAY_SHARD *pShard, RELAY_CONNECTION *pConn, int res, DWORD flags)
+{
+    BOOL bActive = !pConn->bClosed && !pConn->pHandoffMsg && !pShard->bDraining;
+
+    if (res > 0 && (flags & IORING_CQE_F_BUFFER)) {
+        WORD bufferId = (WORD)(flags >> IORING_CQE_BUFFER_SHIFT);
+        BYTE *data = Uring_GetBuffer(&pShard->ring, bufferId);
+
+        if (bActive && (pConn->bReadPaused || pConn->stashLen > 0 || pShard->bQuiesced)) {
+            if (!UringStash(pConn, data, (DWORD)res))
+                CloseConnection(pShard, pConn);
+        } else if (bActive) {
+            if (UringReceive(pShard, pConn, data, (DWORD)res) != 0)
+                CloseConnection(pShard, pConn);
+        } else if (pConn->pHandoffMsg && !pConn->bClosed) {
+            /* In transit: keep the bytes for the new shard */
+            if (pConn->recvBufferSize - pConn->recvPos < (DWORD)res) GrowRecvBuffer(pConn);
+            if (pConn->recvBufferSize - pConn->recvPos >= (DWORD)res) {
+                memcpy(pConn->recvBuffer + pConn->recvPos, data, (DWORD)res);
+                pConn->recvPos += (DWORD)res;
+            } else {
+                shutdown(pConn->socket, SHUT_RDWR);
+            }
+        }
+        Uring_RecycleBuffer(&pShard->ring, bufferId);
+    } else if (bActive && res != -ENOBUFS && res != -ECANCELED) {
+        /* 0 = peer closed, otherwise a socket error */
+        CloseConnection(pShard, pConn);
+    }
+
+    if (flags & IORING_CQE_F_MORE) return;
+
+    /* Multishot recv ended: out of buffers, cancelled or closed. A reader
+     * that resumed before its cancel landed needs a fresh one, once its
+     * stash has been framed (UringResumeRead arms it then) */
+    pConn->bRecvArmed = FALSE;
+    if (!pConn->bClosed && !pConn->pHandoffMsg && !pShard->bDraining && !pShard->bQuiesced &&
+        !pConn->bReadPaused && pConn->stashLen == 0) {
+        if (!UringArmRecv(pShard, pConn))
+            CloseConnection(pShard, pConn);
+    }
+    UringOpDone(pShard, pConn);
+}
+
+static void UringSendComplete(RELAY_SHARD *pShard, RELAY_CONNECTION *pConn, int res)
+{
+    pConn->bSendInFlight = FALSE;
+
+    if (!pConn->bClosed && !pShard->bDraining) {
+        if (res < 0) {
+            /* A SEND cancelled while quiescing sent nothing; it is handed over */
+            if (!pConn->pHandoffMsg && !(res == -ECANCELED && pShard->bQuiesced))
+                CloseConnection(pShard, pConn);
+        } else {
+            pConn->flightPos += (DWORD)res;
+            AccountSent(pConn, (DWORD)res);
+            __atomic_sub_fetch(&pShard->pServer->queuedBytes, (unsigned long long)res,
+                               __ATOMIC_RELAXED);
+            if (pConn->flightPos == pConn->flightLen) {
+                pConn->flightPos = 0;
+                pConn->flightLen = 0;
+            }
+            if (!pConn->pHandoffMsg) {
+                if (PendingSend(pConn) > 0) UringMarkSend(pShard, pConn);
+                ReleaseBackpressure(pShard, pConn);
+            }
+        }
+    }
+
+    UringOpDone(pShard, pConn);
+}
+
+/* Ready-list entry: a resumed reader or a partner just handed over */
+static void UringResumeRead(RELAY_SHARD *pShard, RELAY_CONNECTION *pConn)
+{
+    if (pConn->bClosed) return;
+
+    if (ProcessReceivedFrames(pShard, pConn) != 0 || UringDrainStash(pShard, pConn) != 0) {
+        CloseConnection(pShard, pConn);
+        return;
+    }
+
+    if (!pConn->bClosed && !pConn->bRecvArmed && pConn->stashLen == 0 &&
+        !CheckBackpressure(pConn)) {
+        if (!UringArmRecv(pShard, pConn))
+            CloseConnection(pShard, pConn);
+    }
+}
+
+static BOOL UringArmShard(RELAY_SHARD *pShard)
+{
+    struct io_uring_sqe *pSqe;
+
+    pSqe = Uring_GetSqe(&pShard->ring);
+    if (!pSqe) return FALSE;
+    Uring_PrepAcceptMultishot(pSqe, pShard->listenSocket, UringData(pShard, URING_TAG_ACCEPT));
+
+    pSqe = Uring_GetSqe(&pShard->ring);
+    if (!pSqe) return FALSE;
+    Uring_PrepRead(pSqe, pShard->wakeFd, &pShard->wakeCount, sizeof(pShard->wakeCount),
+                   UringData(pShard, URING_TAG_WAKE));
+    return TRUE;
+}
+
+/* Handle every completion posted so far */
+static void UringReapCompletions(RELAY_SHARD *pShard, BOOL *pbWoken)
+{
+    struct io_uring_cqe *pCqe;
+
+    while ((pCqe = Uring_PeekCqe(&pShard->ring)) != NULL) {
+        unsigned long long userData = pCqe->user_data;
+        void *ptr = (void*)(uintptr_t)(userData & ~URING_TAG_MASK);
+        int res = pCqe->res;
+        DWORD flags = pCqe->flags;
+        struct io_uring_sqe *pSqe;
+
+        /* Copy out first: the CQE slot may be reused once seen */
+        Uring_SeenCqe(&pShard->ring);
+
+        switch (userData & URING_TAG_MASK) {
+            case URING_TAG_ACCEPT:
+                if (res >= 0) {
+                    if (pShard->bDraining) close(res);
+                    else AdoptClientSocket(pShard, (SOCKET)res, NULL);
+                } else if (res != -ECANCELED && res != -EINTR) {
+                    RelayLog("[ERROR] accept() failed: %s\n", strerror(-res));
+                }
+                if (!(flags & IORING_CQE_F_MORE) && !pShard->bDraining && !pShard->bQuiesced) {
+                    pSqe = Uring_GetSqe(&pShard->ring);
+                    if (pSqe)
+                        Uring_PrepAcceptMultishot(pSqe, pShard->listenSocket,
+                                                  UringData(pShard, URING_TAG_ACCEPT));
+                }
+                break;
+
+            case URING_TAG_WAKE:
+                *pbWoken = TRUE;
+                if (!pShard->bDraining) {
+                    pSqe = Uring_GetSqe(&pShard->ring);
+                    if (pSqe)
+                        Uring_PrepRead(pSqe, pShard->wakeFd, &pShard->wakeCount,
+                                       sizeof(pShard->wakeCount), UringData(pShard, URING_TAG_WAKE));
+                }
+                break;
+
+            case URING_TAG_RECV:
+                UringRecvComplete(pShard, (RELAY_CONNECTION*)ptr, res, flags);
+                break;
+
+            case URING_TAG_SEND:
+                UringSendComplete(pShard, (RELAY_CONNECTION*)ptr, res);
+                break;
+
+            default:
+                break;
+        }
+    }
+}
+
+/* Relay_Detach: stop accepting and receiving and take back SENDs that
+ * have not gone out yet, so every connection's bytes are in its buffers
+ * once its requests have completed. Data still arriving is stashed */
+static void UringQuiesceShard(RELAY_SHARD *pShard)
+{
+    RELAY_CONNECTION *pConn;
+    struct io_uring_sqe *pSqe;
+
+    pShard->bQuiesced = TRUE;
+
+    pSqe = Uring_GetSqe(&pShard->ring);
+    if (pSqe) Uring_PrepCancel(pSqe, UringData(pShard, URING_TAG_ACCEPT), URING_TAG_CANCEL);
+
+    for (pConn = pShard->pConnList; pConn; pConn = pConn->pNextConn) {
+        UringCancelRecv(pShard, pConn);
+        if (pConn->bSendInFlight) {
+            pSqe = Uring_GetSqe(&pShard->ring);
+            if (pSqe) Uring_PrepCancel(pSqe, UringData(pConn, URING_TAG_SEND), URING_TAG_CANCEL);
+        }
+    }
+}
+
+static void UringShardLoop(RELAY_SHARD *pShard)
+{
+    RELAY_SERVER *pServer = pShard->pServer;
+    BOOL bWoken;
+    int result;
+
+    if (!pShard->bArmed && !UringArmShard(pShard)) {
+        RelayLog("[ERROR] Shard %u could not arm io_uring requests\n", pShard->index);
+        return;
+    }
+    pShard->bArmed = TRUE;
+
+    if (pShard->bResume) ResumeShard(pShard);
+
+    while (pServer->bRunning) {
+        RELAY_CONNECTION *pReady;
+
+        if (pServer->bQuiescing && !pShard->bQuiesced) UringQuiesceShard(pShard);
+
+        /* One system call submits this pass's SENDs and waits for more */
+        UringFlushSends(pShard);
+        result = Uring_Submit(&pShard->ring, pShard->pReadyList ? 0 : RELAY_POLL_INTERVAL_MS);
+        if (result < 0) {
+            RelayLog("[ERROR] io_uring_enter() failed: %s\n", strerror(-result));
+            break;
+        }
+
+        bWoken = FALSE;
+        UringReapCompletions(pShard, &bWoken);
+
+        /* Quiescing: buffered input is handed over, not framed */
+        pReady = pShard->bQuiesced ? NULL : pShard->pReadyList;
+        if (pReady) pShard->pReadyList = NULL;
+        while (pReady) {
+            RELAY_CONNECTION *pNext = pReady->pNextReady;
+            pReady->bReadPending = FALSE;
+            UringResumeRead(pShard, pReady);
+            pReady = pNext;
+        }
+
+        ExpireIdleConnections(pShard);
+        DumpSessionHistograms(pShard);
+        ServeAdminRequest(pShard);
+
+        ReapClosedConnections(pShard);
+
+        if (bWoken) {
+            ProcessShardMessages(pShard);
+            ReapClosedConnections(pShard);
+        }
+
+        if (pShard->bQuiesced && pShard->uringOps == 0)
+            __atomic_store_n(&pShard->bSettled, TRUE, __ATOMIC_RELEASE);
+    }
+}
+
+/* Relay_Destroy: complete every request that still names a connection so
+ * their memory can be freed. Open sockets are shut down to end them */
+static void UringDrainShard(RELAY_SHARD *pShard)
+{
+    RELAY_CONNECTION *pConn;
+    DWORD start = GetTickCount();
+    BOOL bWoken;
+
+    pShard->bDraining = TRUE;
+
+    for (pConn = pShard->pConnList; pConn; pConn = pConn->pNextConn) {
+        if (pConn->socket != INVALID_SOCKET)
+            shutdown(pConn->socket, SHUT_RDWR);
+    }
+
+    while (pShard->uringOps > 0 && GetTickCount() - start < RELAY_URING_DRAIN_MS) {
+        if (Uring_Submit(&pShard->ring, 10) < 0) break;
+        UringReapCompletions(pShard, &bWoken);
+    }
+}
+
+/* ============================================================
+ * SHARD THREAD
+ * ============================================================ */
+
+/* Move the calling shard thread onto its CPU and its pool allocations
+ * onto that CPU's node */
+static void PinShard(RELAY_SHARD *pShard)
+{
+    unsigned int cpu = 0, node = 0;
+    cpu_set_t set;
+    int err;
+
+    CPU_ZERO(&set);
+    CPU_SET(pShard->cpu, &set);
+    err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (err != 0) {
+        RelayLog("[WARN] Shard %u cannot be pinned to CPU %d: %s\n",
+                 pShard->index, pShard->cpu, strerror(err));
+        return;
+    }
+
+    /* The affinity change has moved us already */
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) < 0) {
+        RelayLog("[INFO] Shard %u pinned to CPU %d\n", pShard->index, pShard->cpu);
+        return;
+    }
+    Pool_SetThreadNode((int)node);
+    RelayLog("[INFO] Shard %u pinned to CPU %d, buffers on NUMA node %u\n",
+             pShard->index, pShard->cpu, node);
+}
+
+static void* ShardThread(void *arg)
+{
+    RELAY_SHARD *pShard = (RELAY_SHARD*)arg;
+
+    if (pShard->cpu >= 0) PinShard(pShard);
+
+    RelayLog("[INFO] Shard %u event loop started\n", pShard->index);
+
+    if (pShard->pServer->backend == RELAY_BACKEND_URING)
+        UringShardLoop(pShard);
+    else
+        EpollShardLoop(pShard);
+
+    RelayLog("[INFO] Shard %u event loop stopping\n", pShard->index);
+    Pool_ThreadFlush();
+    return NULL;
+}
+
+/* ============================================================
+ * SETUP HELPERS
+ * ============================================================ */
+
+static SOCKET CreateListenSocket(WORD port, const char *ipAddr)
+{
+    struct sockaddr_in addr;
+    SOCKET sock;
+    int opt = 1;
+
+    sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+    if (sock == INVALID_SOCKET) return INVALID_SOCKET;
+
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    /* Every shard binds its own socket; the kernel spreads new connections */
+    setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
+
+    ZeroMemory(&addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    if (ipAddr && ipAddr[0] && strcmp(ipAddr, "0.0.0.0") != 0)
+        addr.sin_addr.s_addr = inet_addr(ipAddr);
+    else
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+
+    if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+        listen(sock, SOMAXCONN) < 0) {
+        close(sock);
+        return INVALID_SOCKET;
+    }
+
+    return sock;
+}
+
+static BOOL InitShard(RELAY_SERVER *pServer, RELAY_SHARD *pShard, DWORD index, int cpu,
+                      WORD port, const char *ipAddr, SOCKET listenSocket)
+{
+    struct epoll_event ev;
+
+    pShard->pServer = pServer;
+    pShard->index = index;
+    pShard->cpu = cpu;
+    pShard->listenSocket = listenSocket;    /* Handed over, or INVALID_SOCKET */
+    pShard->wakeFd = -1;
+    pthread_mutex_init(&pShard->inboxMutex, NULL);
+    Timer_InitWheel(&pShard->timers, GetTickCount());
+
+    pShard->epollFd = -1;
+    pShard->ring.ringFd = -1;
+    pShard->coalesceFd = -1;
+    pShard->schedFd = -1;
+
+    pShard->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (pShard->wakeFd < 0) return FALSE;
+
+    if (pShard->listenSocket == INVALID_SOCKET)
+        pShard->listenSocket = CreateListenSocket(port, ipAddr);
+    if (pShard->listenSocket == INVALID_SOCKET) return FALSE;
+
+    /* Set once here, inherited by every socket accepted from it. A
+     * handed-over listener may carry its predecessor's options */
+    ConfigureClientSocket(pServer, pShard->listenSocket);
+
+    /* Kernels since 6.1 honour this across a SO_REUSEPORT group; older
+     * ones pick by hash and the remote accept count shows it */
+    if (pServer->bSteerAccepts && cpu >= 0 &&
+        setsockopt(pShard->listenSocket, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu)) < 0)
+        RelayLog("[WARN] Shard %u cannot steer accepts to CPU %d: %s\n",
+                 index, cpu, strerror(errno));
+
+    if (pServer->backend == RELAY_BACKEND_URING) {
+        if (Uring_Init(&pShard->ring, RELAY_URING_ENTRIES) != RD2K_SUCCESS) return FALSE;
+        return Uring_SetupBuffers(&pShard->ring, RELAY_URING_BUFFER_GROUP,
+                                  RELAY_URING_BUFFERS, RELAY_URING_BUFFER_SIZE) == RD2K_SUCCESS;
+    }
+
+    pShard->epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (pShard->epollFd < 0) return FALSE;
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = &pShard->listenSocket;
+    if (epoll_ctl(pShard->epollFd, EPOLL_CTL_ADD, pShard->listenSocket, &ev) < 0)
+        return FALSE;
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = &pShard->wakeFd;
+    if (epoll_ctl(pShard->epollFd, EPOLL_CTL_ADD, pShard->wakeFd, &ev) < 0)
+        return FALSE;
+
+    if (pServer->coalesceUs > 0) {
+        pShard->coalesceFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (pShard->coalesceFd < 0) return FALSE;
+
+        ev.events = EPOLLIN;
+        ev.data.ptr = &pShard->coalesceFd;
+        if (epoll_ctl(pShard->epollFd, EPOLL_CTL_ADD, pShard->coalesceFd, &ev) < 0)
+            return FALSE;
+    }
+
+    if (pServer->bFair) {
+        pShard->schedFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (pShard->schedFd < 0) return FALSE;
+
+        ev.events = EPOLLIN;
+        ev.data.ptr = &pShard->schedFd;
+        if (epoll_ctl(pShard->epollFd, EPOLL_CTL_ADD, pShard->schedFd, &ev) < 0)
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* Drop undelivered messages once every shard thread has exited. Must run
+ * for all shards before any CleanupShard, as messages point across shards */
+static void DrainShardInbox(RELAY_SHARD *pShard)
+{
+    RELAY_SHARD_MSG *pMsg;
+
+    while ((pMsg = pShard->pInboxHead) != NULL) {
+        pShard->pInboxHead = pMsg->pNext;
+        /* Partners in transit are on no shard's list */
+        if (pMsg->type == SHARD_MSG_PAIR_ATTACH && pMsg->pPartner)
+            FreeConnection(pMsg->pPartner);
+        if (--pMsg->pConn->pendingMsgs == 0 && pMsg->pConn->bClosed)
+            FreeConnection(pMsg->pConn);
+        FreeShardMessage(pShard->pServer, pMsg);
+    }
+    pShard->pInboxTail = NULL;
+}
+
+/* Free a shard's resources once its thread has exited */
+static void CleanupShard(RELAY_SHARD *pShard)
+{
+    /* Closing the ring cancels the accept and eventfd reads */
+    if (pShard->ring.ringFd >= 0) Uring_Destroy(&pShard->ring);
+
+    while (pShard->pConnList) {
+        RELAY_CONNECTION *pConn = pShard->pConnList;
+        pShard->pConnList = pConn->pNextConn;
+        FreeConnection(pConn);
+    }
+
+    if (pShard->listenSocket != INVALID_SOCKET) close(pShard->listenSocket);
+    if (pShard->wakeFd >= 0) close(pShard->wakeFd);
+    if (pShard->coalesceFd >= 0) close(pShard->coalesceFd);
+    if (pShard->schedFd >= 0) close(pShard->schedFd);
+    if (pShard->epollFd >= 0) close(pShard->epollFd);
+    pthread_mutex_destroy(&pShard->inboxMutex);
+    free(pShard->pAnswer);
+}
+
+/* ============================================================
+ * HOT UPGRADE
+ *
+ * Relay_Detach sets bQuiescing. Each shard then stops accepting and
+ * reading (epoll: only EPOLLOUT is handled; io_uring: the accept, recvs
+ * and unsent SENDs are cancelled) but keeps answering shard messages, so
+ * pairings already under way finish. Once no message is left and every
+ * shard reports bSettled, the threads stop and each connection's state
+ * is flattened into a RELAY_HANDOFF: bytes read but not framed, bytes
+ * not yet written. The successor rebuilds the connections from it
+ * (AdoptHandoff) and re-arms them on its shard threads (ResumeShard);
+ * Relay_Resume does the same here when the handoff fails.
+ * ============================================================ */
+
+/* Serve connections this shard's loop has not armed: taken over from a
+ * predecessor, or left alone while quiescing. Runs on the shard thread */
+static void ResumeShard(RELAY_SHARD *pShard)
+{
+    RELAY_CONNECTION *pConn;
+    struct epoll_event ev;
+
+    pShard->bResume = FALSE;
+
+    if (pShard->pServer->backend == RELAY_BACKEND_URING) {
+        struct io_uring_sqe *pSqe;
+
+        if (pShard->bQuiesced) {
+            pSqe = Uring_GetSqe(&pShard->ring);
+            if (pSqe)
+                Uring_PrepAcceptMultishot(pSqe, pShard->listenSocket,
+                                          UringData(pShard, URING_TAG_ACCEPT));
+            pShard->bQuiesced = FALSE;
+        }
+
+        /* UringResumeRead frames buffered input, then arms the recv */
+        for (pConn = pShard->pConnList; pConn; pConn = pConn->pNextConn) {
+            ScheduleRead(pShard, pConn);
+            if (PendingSend(pConn) > 0) UringMarkSend(pShard, pConn);
+        }
+        return;
+    }
+
+    if (pShard->bQuiesced) {
+        ev.events = EPOLLIN;
+        ev.data.ptr = &pShard->listenSocket;
+        epoll_ctl(pShard->epollFd, EPOLL_CTL_ADD, pShard->listenSocket, &ev);
+        pShard->bQuiesced = FALSE;
+    }
+
+    /* (Re-)registering reports what is readable or writable right now,
+     * so edges skipped while quiescing are not lost. A socket that cannot
+     * be registered is left to its idle timer */
+    for (pConn = pShard->pConnList; pConn; pConn = pConn->pNextConn) {
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = pConn;
+        if (epoll_ctl(pShard->epollFd, EPOLL_CTL_MOD, pConn->socket, &ev) < 0 &&
+            epoll_ctl(pShard->epollFd, EPOLL_CTL_ADD, pConn->socket, &ev) < 0)
+            RelayLog("[ERROR] Failed to register client with event loop: %s\n", strerror(errno));
+    }
+}
+
+/* Turn the frame pSource is splicing to its partner into a cut-through
+ * frame, which is plain state: the pipe's contents go in front of the
+ * partner's queued output, and streamIn covers the payload still in the
+ * socket. Returns FALSE if the pipe could not be read */
+static BOOL UnspliceFrame(RELAY_CONNECTION *pSource)
+{
+    RELAY_CONNECTION *pDest = pSource->pPartner;
+    DWORD length = pSource->pipeLen;
+    DWORD pending = pDest->sendLen - pDest->sendPos;
+    DWORD have = 0;
+    BYTE *buffer;
+    ssize_t n;
+
+    if (length > 0) {
+        buffer = (BYTE*)Pool_Alloc(length + pending);
+        if (!buffer) return FALSE;
+
+        while (have < length) {
+            n = read(pSource->pipeFds[0], buffer + have, length - have);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                Pool_Free(buffer);
+                return FALSE;
+            }
+            have += (DWORD)n;
+        }
+
+        memcpy(buffer + length, pDest->sendBuffer + pDest->sendPos, pending);
+        Pool_Free(pDest->sendBuffer);
+        pDest->sendBuffer = buffer;
+        pDest->sendBufferSize = length + pending;
+        pDest->sendPos = 0;
+        pDest->sendLen = length + pending;
+        __atomic_add_fetch(&pDest->pServer->queuedBytes, length, __ATOMIC_RELAXED);
+    }
+
+    pSource->streamIn = pSource->spliceIn;
+    pSource->bStreamDrop = FALSE;
+    pSource->pipeLen = 0;
+    pSource->spliceIn = 0;
+    pDest->pSpliceFrom = NULL;
+    if (pSource->streamIn == 0) LeaveFrame(pDest);
+    return TRUE;
+}
+
+static int CompareConnections(const void *pLeft, const void *pRight)
+{
+    uintptr_t left = (uintptr_t)*(RELAY_CONNECTION* const*)pLeft;
+    uintptr_t right = (uintptr_t)*(RELAY_CONNECTION* const*)pRight;
+
+    return left < right ? -1 : left > right;
+}
+
+/* Copy the pieces of a connection's buffered bytes into one allocation */
+static BYTE* JoinBytes(const BYTE *first, DWORD firstLength, const BYTE *second,
+                       DWORD secondLength)
+{
+    BYTE *buffer = (BYTE*)malloc(firstLength + secondLength);
+
+    if (!buffer) return NULL;
+    if (firstLength > 0) memcpy(buffer, first, firstLength);
+    if (secondLength > 0) memcpy(buffer + firstLength, second, secondLength);
+    return buffer;
+}
+
+/* Describe every connection of the stopped shards in pHandoff */
+static int ExportConnections(RELAY_SERVER *pServer, RELAY_HANDOFF *pHandoff)
+{
+    RELAY_CONNECTION **ppConns;
+    RELAY_CONNECTION *pConn;
+    DWORD now = GetTickCount();
+    DWORD count = 0;
+    DWORD i;
+
+    for (i = 0; i < pServer->shardCount; i++) {
+        for (pConn = pServer->shards[i].pConnList; pConn; pConn = pConn->pNextConn)
+            count++;
+    }
+
+    pHandoff->listenSockets = (SOCKET*)malloc(pServer->shardCount * sizeof(SOCKET));
+    pHandoff->conns = (RELAY_HANDOFF_CONN*)calloc(count ? count : 1, sizeof(RELAY_HANDOFF_CONN));
+    ppConns = (RELAY_CONNECTION**)malloc((count ? count : 1) * sizeof(RELAY_CONNECTION*));
+    if (!pHandoff->listenSockets || !pHandoff->conns || !ppConns) {
+        free(ppConns);
+        Relay_FreeHandoff(pHandoff);
+        return RD2K_ERR_MEMORY;
+    }
+
+    count = 0;
+    for (i = 0; i < pServer->shardCount; i++) {
+        pHandoff->listenSockets[i] = pServer->shards[i].listenSocket;
+        for (pConn = pServer->shards[i].pConnList; pConn; pConn = pConn->pNextConn)
+            ppConns[count++] = pConn;
+    }
+    pHandoff->listenCount = pServer->shardCount;
+
+    /* Sorted, so partners are found by address */
+    qsort(ppConns, count, sizeof(RELAY_CONNECTION*), CompareConnections);
+
+    for (i = 0; i < count; i++) {
+        RELAY_HANDOFF_CONN *pEntry = &pHandoff->conns[i];
+
+        pConn = ppConns[i];
+        pEntry->socket = pConn->socket;
+        pEntry->clientId = pConn->clientId;
+        pEntry->state = pConn->state;
+        pEntry->prevState = pConn->prevState;
+        pEntry->flags = pConn->bNodeLink ? RELAY_HANDOFF_NODE_LINK : 0;
+        if (pConn->bMidFrame) pEntry->flags |= RELAY_HANDOFF_MID_FRAME;
+        if (pConn->bPongOwed) pEntry->flags |= RELAY_HANDOFF_PONG_OWED;
+        if (pConn->bStreamDrop) pEntry->flags |= RELAY_HANDOFF_STREAM_DROP;
+        pEntry->idleMs = now - pConn->lastActivity;
+        pEntry->streamIn = pConn->streamIn;
+        pEntry->partner = RELAY_HANDOFF_NONE;
+        if (pConn->pPartner) {
+            RELAY_CONNECTION **ppPartner = (RELAY_CONNECTION**)bsearch(
+                &pConn->pPartner, ppConns, count, sizeof(RELAY_CONNECTION*), CompareConnections);
+            if (ppPartner) pEntry->partner = (DWORD)(ppPartner - ppConns);
+        }
+
+        /* Framing resumes with the partial frame, then what was stashed */
+        pEntry->inputLength = pConn->recvPos + pConn->stashLen;
+        if (pEntry->inputLength > 0)
+            pEntry->input = JoinBytes(pConn->recvBuffer, pConn->recvPos,
+                                      pConn->stashBuffer, pConn->stashLen);
+
+        /* An io_uring SEND's bytes go before anything queued after them */
+        pEntry->outputLength = PendingSend(pConn);
+        if (pEntry->outputLength > 0)
+            pEntry->output = JoinBytes(pConn->flightBuffer + pConn->flightPos,
+                                       pConn->flightLen - pConn->flightPos,
+                                       pConn->sendBuffer + pConn->sendPos,
+                                       pConn->sendLen - pConn->sendPos);
+
+        pHandoff->connCount = i + 1;
+        if ((pEntry->inputLength > 0 && !pEntry->input) ||
+            (pEntry->outputLength > 0 && !pEntry->output)) {
+            free(ppConns);
+            Relay_FreeHandoff(pHandoff);
+            return RD2K_ERR_MEMORY;
+        }
+    }
+
+    free(ppConns);
+    return RD2K_SUCCESS;
+}
+
+/* Rebuild one handed-over connection on pShard. Output is queued as is;
+ * io_uring input waits in recvBuffer and the stash for the shard thread */
+static RELAY_CONNECTION* AdoptConnection(RELAY_SHARD *pShard, RELAY_HANDOFF_CONN *pEntry,
+                                         DWORD now)
+{
+    RELAY_SERVER *pServer = pShard->pServer;
+    RELAY_CONNECTION *pConn;
+    BOOL bListed = TRUE;
+
+    pConn = NewConnection(pShard, pEntry->socket);
+    if (!pConn) {
+        close(pEntry->socket);
+        pEntry->socket = INVALID_SOCKET;
+        return NULL;
+    }
+    pEntry->socket = INVALID_SOCKET;
+    __atomic_add_fetch(&pServer->activeConnections, 1, __ATOMIC_RELAXED);
+
+    pConn->clientId = pEntry->clientId;
+    pConn->state = pEntry->state;
+    pConn->prevState = pEntry->prevState;
+    pConn->bNodeLink = (pEntry->flags & RELAY_HANDOFF_NODE_LINK) != 0;
+    pConn->bMidFrame = (pEntry->flags & RELAY_HANDOFF_MID_FRAME) != 0;
+    pConn->bPongOwed = (pEntry->flags & RELAY_HANDOFF_PONG_OWED) != 0;
+    pConn->bStreamDrop = (pEntry->flags & RELAY_HANDOFF_STREAM_DROP) != 0;
+    pConn->streamIn = pEntry->streamIn;
+    pConn->peerAddr = PeerAddress(pConn->socket);
+    /* The predecessor may have been started with other options */
+    SetSendLowWater(pServer, pConn->socket);
+    pConn->lastActivity = now - (pEntry->idleMs < CLIENT_INACTIVITY_TIMEOUT_MS ?
+                                 pEntry->idleMs : CLIENT_INACTIVITY_TIMEOUT_MS);
+
+    if (pEntry->outputLength > 0) {
+        struct iovec iov;
+
+        iov.iov_base = pEntry->output;
+        iov.iov_len = pEntry->outputLength;
+        if (AppendSendBuffer(pConn, &iov, 1, pEntry->outputLength) != RD2K_SUCCESS)
+            bListed = FALSE;
+    }
+
+    if (bListed && pEntry->inputLength > RELAY_IDLE_BUFFER_SIZE && !GrowRecvBuffer(pConn))
+        bListed = FALSE;
+
+    if (bListed && pEntry->inputLength > 0 && pServer->backend == RELAY_BACKEND_URING) {
+        DWORD first = pEntry->inputLength < pConn->recvBufferSize ?
+                      pEntry->inputLength : pConn->recvBufferSize;
+
+        memcpy(pConn->recvBuffer, pEntry->input, first);
+        pConn->recvPos = first;
+        if (first < pEntry->inputLength &&
+            !UringStash(pConn, pEntry->input + first, pEntry->inputLength - first))
+            bListed = FALSE;
+    }
 
-static int RecvExact(SOCKET sock, BYTE *buffer, int length, int timeoutMs)
-{
-    int totalRecv = 0;
-    ssize_t recvLen;
-    int waitResult;
-    int retries = 0;
-    int maxRetries = (timeoutMs / 100) + 10;
-    
-    while (totalRecv < length) {
-        waitResult = WaitForSocketReady(sock, FALSE, 100);
-        
-        if (waitResult < 0) return -1;
-        if (waitResult == 0) {
-            retries++;
-            if (retries > maxRetries) return totalRecv > 0 ? totalRecv : 0;
-            continue;
-        }
-        
-        recvLen = recv(sock, buffer + totalRecv, length - totalRecv, 0);
-        
-        if (recvLen == 0) return 0;
-        if (recvLen < 0) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK) continue;
-            return -1;
-        }
-        
-        totalRecv += recvLen;
-        retries = 0;
+    if (bListed && !pConn->bNodeLink && pConn->state >= RELAY_STATE_REGISTERED &&
+        pConn->state <= RELAY_STATE_PAIRED) {
+        Registry_Lock(pServer->pRegistry, pConn->clientId);
+        if (Registry_Insert(pServer->pRegistry, pConn->clientId, pConn) == RD2K_SUCCESS)
+            Cluster_Announce(pServer->pCluster, pConn->clientId);
+        else
+            bListed = FALSE;
+        Registry_Unlock(pServer->pRegistry, pConn->clientId);
     }
-    
-    return totalRecv;
-}
 
-/* ============================================================
- * WORKER THREAD
- * ============================================================ */
+    if (!bListed) {
+        __atomic_sub_fetch(&pServer->queuedBytes, (unsigned long long)PendingSend(pConn),
+                           __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&pServer->activeConnections, 1, __ATOMIC_RELAXED);
+        FreeConnection(pConn);
+        return NULL;
+    }
 
-static void* ClientWorkerThread(void *arg)
+    ListConnection(pShard, pConn);
+    return pConn;
+}
+
+/* Relay_CreateEx: take over a predecessor's connections before any shard
+ * runs. Partners land on the same shard. Epoll input is framed here; the
+ * io_uring backend frames it on the shard thread (ResumeShard), since its
+ * requests belong to the thread that submits them */
+static BOOL AdoptHandoff(RELAY_SERVER *pServer, RELAY_HANDOFF *pHandoff)
 {
-    RELAY_CONNECTION *pConn = (RELAY_CONNECTION*)arg;
-    RELAY_SERVER *pServer;
-    BYTE *buffer;
-    int result;
-    
-    if (!pConn) return NULL;
-    
-    pServer = pConn->pServer;
-    if (!pServer) return NULL;
-    
-    buffer = (BYTE*)malloc(RELAY_BUFFER_SIZE);
-    if (!buffer) return NULL;
-    
-    RelayLog("[INFO] Client worker thread started\n");
-    
-    /* Initialize last activity time for timeout tracking */
-    pConn->lastActivity = GetTickCount();
-    
-    while (pConn->state != RELAY_STATE_DISCONNECTED && pServer->bRunning && !pConn->shouldStop) {
-        RELAY_HEADER header;
-        DWORD totalPacketSize;
-        int recvLen;
-        DWORD currentTime;
-        DWORD inactiveTime;
-        
-        recvLen = RecvExact(pConn->socket, (BYTE*)&header, sizeof(RELAY_HEADER), 1000);
-        
-        if (recvLen == 0) {
-            /* Timeout with no data - check for inactivity timeout */
-            currentTime = GetTickCount();
-            inactiveTime = currentTime - pConn->lastActivity;
-            
-            if (inactiveTime > CLIENT_INACTIVITY_TIMEOUT_MS) {
-                char idStr[20];
-                FormatClientId(pConn->clientId, idStr);
-                RelayLog("[TIMEOUT] Client %s inactive for %u ms - disconnecting\n", 
-                        idStr, inactiveTime);
-                break;
-            }
-            continue;
-        }
-        if (recvLen < 0) break;
-        if (recvLen < (int)sizeof(RELAY_HEADER)) break;
-        
-        totalPacketSize = sizeof(RELAY_HEADER) + header.dataLength;
-        
-        if (header.dataLength > RELAY_BUFFER_SIZE - sizeof(RELAY_HEADER)) break;
-        
-        memcpy(buffer, &header, sizeof(RELAY_HEADER));
-        
-        if (header.dataLength > 0) {
-            recvLen = RecvExact(pConn->socket, buffer + sizeof(RELAY_HEADER), 
-                               header.dataLength, 30000);
-            if (recvLen < 0 || recvLen < (int)header.dataLength) break;
-        }
-        
-        result = ProcessRelayMessage(pServer, pConn, buffer, totalPacketSize);
-        if (result != 0 && result != RD2K_SUCCESS) break;
-    }
-    
-    /* Cleanup */
-    {
-        char idStr[20];
-        FormatClientId(pConn->clientId, idStr);
-        
-        if (pConn->clientId != 0)
-            RelayLog("[DISCONNECT] Client %s connection closed\n", idStr);
+    RELAY_CONNECTION **ppConns;
+    DWORD now = GetTickCount();
+    DWORD next = 0, adopted = 0, paired = 0;
+    DWORD i;
+
+    ppConns = (RELAY_CONNECTION**)calloc(pHandoff->connCount ? pHandoff->connCount : 1,
+                                         sizeof(RELAY_CONNECTION*));
+    if (!ppConns) return FALSE;
+
+    for (i = 0; i < pHandoff->connCount; i++) {
+        RELAY_HANDOFF_CONN *pEntry = &pHandoff->conns[i];
+        RELAY_SHARD *pShard;
+
+        if (pEntry->partner < i && ppConns[pEntry->partner])
+            pShard = ppConns[pEntry->partner]->pShard;
         else
-            RelayLog("[DISCONNECT] Unregistered client connection closed\n");
-        
-        if (pConn->pPartner && pConn->pPartner->socket != INVALID_SOCKET) {
-            RELAY_PARTNER_DISCONNECTED notification;
-            notification.reason = RELAY_DISCONNECT_PARTNER_LEFT;
-            notification.partnerId = pConn->clientId;
-            SendRelayPacket(pConn->pPartner->socket, RELAY_MSG_PARTNER_DISCONNECTED,
-                           (const BYTE*)&notification, sizeof(notification));
-            /* Signal partner's disconnect event so their thread exits */
-            if (pConn->pPartner->hDisconnectEvent) {
-                pthread_cond_signal(pConn->pPartner->hDisconnectEvent);
-            }
-            pConn->pPartner->pPartner = NULL;
-            /* CRITICAL: Set to DISCONNECTED, not REGISTERED!
-             * This ensures ID is cleaned up when they reconnect. */
-            pConn->pPartner->state = RELAY_STATE_DISCONNECTED;
-        }
+            pShard = &pServer->shards[next++ % pServer->shardCount];
+
+        ppConns[i] = AdoptConnection(pShard, pEntry, now);
+        if (ppConns[i]) adopted++;
     }
-    
-    pConn->state = RELAY_STATE_DISCONNECTED;
-    pConn->pPartner = NULL;
-    
-    free(buffer);
-    
-    /* Remove from server array */
-    pthread_mutex_lock(&pServer->connMutex);
-    for (DWORD i = 0; i < pServer->maxConnections; i++) {
-        if (pServer->connections[i] == pConn) {
-            pServer->connections[i] = NULL;
-            if (pServer->activeConnections > 0) pServer->activeConnections--;
-            break;
+
+    for (i = 0; i < pHandoff->connCount; i++) {
+        RELAY_CONNECTION *pConn = ppConns[i];
+        DWORD partner = pHandoff->conns[i].partner;
+
+        if (!pConn || partner == RELAY_HANDOFF_NONE) continue;
+
+        if (partner < pHandoff->connCount && ppConns[partner]) {
+            pConn->pPartner = ppConns[partner];
+            if (pConn->state == RELAY_STATE_PAIRED) {
+                StartSession(pConn, pConn->pPartner->clientId);
+                SetOutputShare(pServer, pConn, pConn->pPartner->clientId);
+                paired++;
+            }
+        } else if (!pConn->bClosed) {
+            /* Its partner could not be taken over */
+            CloseConnection(pConn->pShard, pConn);
         }
     }
-    pthread_mutex_unlock(&pServer->connMutex);
-    
-    if (pConn->socket != INVALID_SOCKET) {
-        close(pConn->socket);
-        pConn->socket = INVALID_SOCKET;
-    }
-    if (pConn->recvBuffer) {
-        free(pConn->recvBuffer);
-        pConn->recvBuffer = NULL;
+
+    for (i = 0; i < pHandoff->connCount; i++) {
+        RELAY_CONNECTION *pConn = ppConns[i];
+        RELAY_HANDOFF_CONN *pEntry = &pHandoff->conns[i];
+
+        if (pServer->backend == RELAY_BACKEND_EPOLL && pConn && !pConn->bClosed &&
+            pEntry->inputLength > 0 &&
+            FeedReceivedBytes(pConn->pShard, pConn, pEntry->input, pEntry->inputLength) != 0)
+            CloseConnection(pConn->pShard, pConn);
     }
-    
-    /* Free the connection struct to prevent memory leak.
-     * Thread is detached so no join needed. */
-    free(pConn);
-    
-    return NULL;
-}
 
-/* ============================================================
- * ACCEPT THREAD
- * ============================================================ */
+    for (i = 0; i < pServer->shardCount; i++)
+        pServer->shards[i].bResume = TRUE;
+
+    free(ppConns);
+    RelayLog("[UPGRADE] Took over %u of %u connections (%u in sessions) on %u listen socket(s)\n",
+             adopted, pHandoff->connCount, paired, pServer->shardCount);
+    return TRUE;
+}
 
-static void* AcceptThread(void *arg)
+/* Close whatever sockets of a handoff were not taken over */
+static void CloseHandoffSockets(RELAY_HANDOFF *pHandoff)
 {
-    RELAY_SERVER *pServer = (RELAY_SERVER*)arg;
-    struct sockaddr_in clientAddr;
-    socklen_t addrLen;
-    SOCKET clientSocket;
-    RELAY_CONNECTION *pConn;
-    fd_set readfds;
-    struct timeval tv;
-    int selectResult;
-    
-    if (!pServer) return NULL;
-    
-    RelayLog("[INFO] Accept thread started, waiting for connections...\n");
-    
-    while (pServer->bRunning) {
-        FD_ZERO(&readfds);
-        FD_SET(pServer->listenSocket, &readfds);
-        tv.tv_sec = 0;
-        tv.tv_usec = 100000;
-        
-        selectResult = select(pServer->listenSocket + 1, &readfds, NULL, NULL, &tv);
-        if (selectResult < 0) {
-            if (errno == EINTR) continue;
-            RelayLog("[ERROR] select() failed: %s\n", strerror(errno));
-            break;
-        }
-        if (selectResult == 0) continue;
-        
-        addrLen = sizeof(clientAddr);
-        clientSocket = accept(pServer->listenSocket, (struct sockaddr*)&clientAddr, &addrLen);
-        if (clientSocket == INVALID_SOCKET) {
-            if (pServer->bRunning && errno != EINTR)
-                RelayLog("[ERROR] accept() failed: %s\n", strerror(errno));
-            continue;
-        }
-        
-        RelayLog("[INFO] New client connection accepted\n");
-        
-        pConn = AddConnection(pServer, clientSocket);
-        if (!pConn) {
-            RelayLog("[ERROR] Failed to add connection (max reached?)\n");
-            close(clientSocket);
-            continue;
-        }
-        
-        if (pthread_create(&pConn->thread, NULL, ClientWorkerThread, pConn) == 0) {
-            pConn->threadValid = 1;
-            pthread_detach(pConn->thread);
-            RelayLog("[INFO] Worker thread created for new client\n");
-        } else {
-            RelayLog("[ERROR] Failed to create worker thread\n");
-            RemoveConnection(pServer, pConn);
-        }
+    DWORD i;
+
+    for (i = 0; i < pHandoff->listenCount; i++) {
+        if (pHandoff->listenSockets[i] != INVALID_SOCKET) close(pHandoff->listenSockets[i]);
+        pHandoff->listenSockets[i] = INVALID_SOCKET;
+    }
+    for (i = 0; i < pHandoff->connCount; i++) {
+        if (pHandoff->conns[i].socket != INVALID_SOCKET) close(pHandoff->conns[i].socket);
+        pHandoff->conns[i].socket = INVALID_SOCKET;
     }
-    
-    RelayLog("[INFO] Accept thread stopping\n");
-    return NULL;
 }
 
 /* ============================================================
  * PUBLIC API
  * ============================================================ */
 
-RELAY_SERVER* Relay_Create(WORD port, const char* ipAddr)
+void Relay_InitConfig(RELAY_CONFIG *pConfig)
+{
+    if (!pConfig) return;
+
+    ZeroMemory(pConfig, sizeof(RELAY_CONFIG));
+    pConfig->shardCount = 0;  /* One per online CPU */
+    pConfig->bSplice = FALSE;
+    pConfig->backend = RELAY_BACKEND_EPOLL;
+    pConfig->coalesceUs = 0;
+    pConfig->coalesceBytes = RELAY_COALESCE_BYTES;
+    pConfig->pCluster = NULL;
+    pConfig->pHandoff = NULL;
+    pConfig->pAdmit = NULL;
+    pConfig->bFair = FALSE;
+    pConfig->uplinkRate = 0;
+    pConfig->pShares = NULL;
+    pConfig->shareCount = 0;
+    pConfig->pCapture = NULL;
+    pConfig->pCpus = NULL;
+    pConfig->cpuCount = 0;
+    pConfig->bSteerAccepts = FALSE;
+    pConfig->bReencrypt = FALSE;
+}
+
+static RELAY_SERVER* CreateServer(WORD port, const char* ipAddr, const RELAY_CONFIG *pConfig)
 {
     RELAY_SERVER *pServer;
-    struct sockaddr_in addr;
-    int opt = 1;
-    
+    RELAY_CONFIG config;
+    DWORD i;
+
+    if (pConfig)
+        config = *pConfig;
+    else
+        Relay_InitConfig(&config);
+
+    if (!config.pCpus) config.cpuCount = 0;
+    if (config.bSteerAccepts && config.cpuCount == 0) {
+        RelayLog("[INFO] Accept steering needs pinned shards - disabled\n");
+        config.bSteerAccepts = FALSE;
+    }
+    if (config.shardCount == 0 && config.cpuCount > 0)
+        config.shardCount = config.cpuCount;
+    if (config.shardCount == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        config.shardCount = cpus > 0 ? (DWORD)cpus : 1;
+    }
+    if (config.shardCount > RELAY_MAX_SHARDS)
+        config.shardCount = RELAY_MAX_SHARDS;
+
+    /* One shard per handed-over listen socket */
+    if (config.pHandoff) {
+        if (config.pHandoff->listenCount == 0 || config.pHandoff->listenCount > RELAY_MAX_SHARDS)
+            return NULL;
+        if (pConfig && pConfig->shardCount != 0 && pConfig->shardCount != config.pHandoff->listenCount)
+            RelayLog("[INFO] Taking over %u listen socket(s) - running %u shard(s)\n",
+                     config.pHandoff->listenCount, config.pHandoff->listenCount);
+        config.shardCount = config.pHandoff->listenCount;
+    }
+
     pServer = (RELAY_SERVER*)calloc(1, sizeof(RELAY_SERVER));
     if (!pServer) return NULL;
-    
+
+    if (config.backend == RELAY_BACKEND_URING && !Uring_IsSupported()) {
+        RelayLog("[ERROR] io_uring backend not supported by this kernel - using epoll\n");
+        config.backend = RELAY_BACKEND_EPOLL;
+    }
+    if (config.backend == RELAY_BACKEND_URING && config.bSplice) {
+        RelayLog("[INFO] Splice mode is not available with io_uring - disabled\n");
+        config.bSplice = FALSE;
+    }
+    if (config.backend == RELAY_BACKEND_URING && config.coalesceUs > 0) {
+        RelayLog("[INFO] io_uring merges each pass's output already - send coalescing disabled\n");
+        config.coalesceUs = 0;
+    }
+    if (config.coalesceBytes == 0)
+        config.coalesceBytes = RELAY_COALESCE_BYTES;
+    if (config.bFair && config.backend == RELAY_BACKEND_URING) {
+        RelayLog("[INFO] Fair scheduling needs the epoll backend - disabled\n");
+        config.bFair = FALSE;
+    }
+    if (config.bFair && config.bSplice) {
+        RelayLog("[INFO] Spliced frames would bypass the fair scheduler - splice mode disabled\n");
+        config.bSplice = FALSE;
+    }
+    if (config.bReencrypt && config.bSplice) {
+        RelayLog("[INFO] Spliced frames cannot be re-encrypted - splice mode disabled\n");
+        config.bSplice = FALSE;
+    }
+
     pServer->port = port;
+    pServer->bSplice = config.bSplice;
+    pServer->backend = config.backend;
+    pServer->coalesceUs = config.coalesceUs;
+    pServer->coalesceBytes = config.coalesceBytes;
+    pServer->pCluster = config.pCluster;
+    pServer->pCapture = config.pCapture;
+    pServer->bSteerAccepts = config.bSteerAccepts;
+    pServer->bReencrypt = config.bReencrypt;
+    pServer->bFair = config.bFair;
+    pServer->schedQuantum = RELAY_SCHED_QUANTUM;
+    pthread_mutex_init(&pServer->uplinkMutex, NULL);
+    pthread_mutex_init(&pServer->adminMutex, NULL);
+    pthread_mutex_init(&pServer->answerMutex, NULL);
+    pthread_cond_init(&pServer->answerCond, NULL);
+    if (config.bFair && config.uplinkRate > 0) {
+        /* Paced, a quantum is how long a new session may wait for the
+         * transfer ahead of it */
+        unsigned long long quantum =
+            (unsigned long long)config.uplinkRate * RELAY_SCHED_QUANTUM_US / 1000000;
+
+        if (quantum < RELAY_SCHED_QUANTUM_MIN) quantum = RELAY_SCHED_QUANTUM_MIN;
+        if (quantum < RELAY_SCHED_QUANTUM) pServer->schedQuantum = (DWORD)quantum;
+        RateInit(&pServer->uplink, config.uplinkRate, pServer->schedQuantum);
+    }
     pServer->maxConnections = RELAY_MAX_CONNECTIONS;
     pServer->activeConnections = 0;
     pServer->bRunning = 0;
-    pServer->acceptThreadValid = 0;
-    
-    pServer->connections = (RELAY_CONNECTION**)calloc(RELAY_MAX_CONNECTIONS, sizeof(RELAY_CONNECTION*));
-    if (!pServer->connections) {
-        free(pServer);
-        return NULL;
+
+    pServer->pRegistry = Registry_Create(1024);
+    pServer->shards = (RELAY_SHARD*)calloc(config.shardCount, sizeof(RELAY_SHARD));
+    if (config.pAdmit) pServer->pAdmit = Admit_Create(config.pAdmit);
+    if (config.bFair && config.shareCount > 0) {
+        pServer->pShares = (RELAY_CLIENT_SHARE*)malloc(config.shareCount * sizeof(RELAY_CLIENT_SHARE));
+        if (pServer->pShares) {
+            memcpy(pServer->pShares, config.pShares, config.shareCount * sizeof(RELAY_CLIENT_SHARE));
+            pServer->shareCount = config.shareCount;
+        }
     }
-    
-    pthread_mutex_init(&pServer->connMutex, NULL);
-    
-    pServer->listenSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    if (pServer->listenSocket == INVALID_SOCKET) {
-        free(pServer->connections);
-        pthread_mutex_destroy(&pServer->connMutex);
-        free(pServer);
+    if (!pServer->pRegistry || !pServer->shards || (config.pAdmit && !pServer->pAdmit) ||
+        (config.bFair && config.shareCount > 0 && !pServer->pShares)) {
+        Relay_Destroy(pServer);
         return NULL;
     }
-    
-    setsockopt(pServer->listenSocket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-    
-    ZeroMemory(&addr, sizeof(addr));
-    addr.sin_family = AF_INET;
-    if (ipAddr && ipAddr[0] && strcmp(ipAddr, "0.0.0.0") != 0)
-        addr.sin_addr.s_addr = inet_addr(ipAddr);
-    else
-        addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    addr.sin_port = htons(port);
-    
-    if (bind(pServer->listenSocket, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
-        close(pServer->listenSocket);
-        free(pServer->connections);
-        pthread_mutex_destroy(&pServer->connMutex);
-        free(pServer);
-        return NULL;
+
+    for (i = 0; i < config.shardCount; i++) {
+        SOCKET listenSocket = INVALID_SOCKET;
+
+        if (config.pHandoff) {
+            listenSocket = config.pHandoff->listenSockets[i];
+            config.pHandoff->listenSockets[i] = INVALID_SOCKET;
+        }
+        pServer->shardCount++;
+        if (!InitShard(pServer, &pServer->shards[i], i,
+                       config.cpuCount > 0 ? config.pCpus[i % config.cpuCount] : -1,
+                       port, ipAddr, listenSocket)) {
+            Relay_Destroy(pServer);
+            return NULL;
+        }
     }
-    
-    if (listen(pServer->listenSocket, SOMAXCONN) < 0) {
-        close(pServer->listenSocket);
-        free(pServer->connections);
-        pthread_mutex_destroy(&pServer->connMutex);
-        free(pServer);
+
+    if (config.pHandoff && !AdoptHandoff(pServer, config.pHandoff)) {
+        Relay_Destroy(pServer);
         return NULL;
     }
-    
+
+    return pServer;
+}
+
+RELAY_SERVER* Relay_CreateEx(WORD port, const char* ipAddr, const RELAY_CONFIG *pConfig)
+{
+    RELAY_SERVER *pServer = CreateServer(port, ipAddr, pConfig);
+
+    /* The handoff's sockets are ours either way */
+    if (pConfig && pConfig->pHandoff) CloseHandoffSockets(pConfig->pHandoff);
     return pServer;
 }
 
+RELAY_SERVER* Relay_Create(WORD port, const char* ipAddr)
+{
+    return Relay_CreateEx(port, ipAddr, NULL);
+}
+
 int Relay_Start(RELAY_SERVER *pServer)
 {
+    DWORD i;
+
     if (!pServer) return RD2K_ERR_SOCKET;
-    
+
     pServer->bRunning = 1;
-    
-    if (pthread_create(&pServer->acceptThread, NULL, AcceptThread, pServer) != 0) {
-        pServer->bRunning = 0;
-        return RD2K_ERR_SOCKET;
+
+    for (i = 0; i < pServer->shardCount; i++) {
+        RELAY_SHARD *pShard = &pServer->shards[i];
+
+        if (pthread_create(&pShard->thread, NULL, ShardThread, pShard) != 0) {
+            Relay_Stop(pServer);
+            return RD2K_ERR_SOCKET;
+        }
+        pShard->threadValid = 1;
     }
-    
-    pServer->acceptThreadValid = 1;
+
+    RelayLog("[INFO] Relay running with %u shard(s), waiting for connections...\n",
+             pServer->shardCount);
     return RD2K_SUCCESS;
 }
 
 void Relay_Stop(RELAY_SERVER *pServer)
 {
     DWORD i;
-    
+
     if (!pServer) return;
-    
+
     pServer->bRunning = 0;
-    
-    if (pServer->acceptThreadValid) {
-        pthread_join(pServer->acceptThread, NULL);
-        pServer->acceptThreadValid = 0;
-    }
-    
-    pthread_mutex_lock(&pServer->connMutex);
-    for (i = 0; i < pServer->maxConnections; i++) {
-        if (pServer->connections[i]) {
-            pServer->connections[i]->shouldStop = 1;
-            if (pServer->connections[i]->socket != INVALID_SOCKET)
-                shutdown(pServer->connections[i]->socket, SHUT_RDWR);
+    for (i = 0; i < pServer->shardCount; i++)
+        WakeShard(&pServer->shards[i]);
+
+    /* Once the shard threads have exited nothing else touches the
+     * connections, so Relay_Destroy can free them directly */
+    for (i = 0; i < pServer->shardCount; i++) {
+        if (pServer->shards[i].threadValid) {
+            pthread_join(pServer->shards[i].thread, NULL);
+            pServer->shards[i].threadValid = 0;
         }
     }
-    pthread_mutex_unlock(&pServer->connMutex);
 }
 
 void Relay_Destroy(RELAY_SERVER *pServer)
 {
     DWORD i;
-    
+
     if (!pServer) return;
-    
+
     Relay_Stop(pServer);
-    
-    /* Wait a bit for worker threads to finish */
-    usleep(500000);
-    
-    for (i = 0; i < pServer->maxConnections; i++) {
-        if (pServer->connections[i])
-            RemoveConnection(pServer, pServer->connections[i]);
-    }
-    
-    if (pServer->listenSocket != INVALID_SOCKET)
-        close(pServer->listenSocket);
-    
-    pthread_mutex_destroy(&pServer->connMutex);
-    free(pServer->connections);
+
+    /* After a handoff nothing is in flight, and the sockets live on */
+    if (pServer->backend == RELAY_BACKEND_URING && !pServer->bDetached) {
+        for (i = 0; i < pServer->shardCount; i++)
+            UringDrainShard(&pServer->shards[i]);
+    }
+    for (i = 0; i < pServer->shardCount; i++)
+        ReapClosedConnections(&pServer->shards[i]);
+    for (i = 0; i < pServer->shardCount; i++)
+        DrainShardInbox(&pServer->shards[i]);
+    for (i = 0; i < pServer->shardCount; i++)
+        CleanupShard(&pServer->shards[i]);
+
+    Registry_Destroy(pServer->pRegistry);
+    Admit_Destroy(pServer->pAdmit);
+    pthread_mutex_destroy(&pServer->uplinkMutex);
+    pthread_mutex_destroy(&pServer->adminMutex);
+    pthread_mutex_destroy(&pServer->answerMutex);
+    pthread_cond_destroy(&pServer->answerCond);
+    free(pServer->pShares);
+    free(pServer->shards);
     free(pServer);
 }
 
+int Relay_Detach(RELAY_SERVER *pServer, RELAY_HANDOFF *pHandoff)
+{
+    DWORD start = GetTickCount();
+    BOOL bSettled = FALSE;
+    DWORD i;
+
+    if (!pServer || !pHandoff) return RD2K_ERR_SOCKET;
+
+    ZeroMemory(pHandoff, sizeof(RELAY_HANDOFF));
+    pServer->bQuiescing = 1;
+    for (i = 0; i < pServer->shardCount; i++)
+        WakeShard(&pServer->shards[i]);
+
+    /* Pair requests still travelling between shards must land first */
+    while (!bSettled && GetTickCount() - start < RELAY_QUIESCE_MS) {
+        bSettled = __atomic_load_n(&pServer->shardMsgs, __ATOMIC_ACQUIRE) == 0;
+        for (i = 0; bSettled && i < pServer->shardCount; i++)
+            bSettled = __atomic_load_n(&pServer->shards[i].bSettled, __ATOMIC_ACQUIRE);
+        if (!bSettled) usleep(1000);
+    }
+
+    Relay_Stop(pServer);
+
+    if (!bSettled) {
+        RelayLog("[WARN] Shards did not settle within %u ms - not handing over\n", RELAY_QUIESCE_MS);
+        return RD2K_ERR_TIMEOUT;
+    }
+
+    /* The shard threads are gone. A pipe cannot be handed over, so
+     * spliced frames continue as cut-through frames */
+    for (i = 0; i < pServer->shardCount; i++) {
+        RELAY_SHARD *pShard = &pServer->shards[i];
+        RELAY_CONNECTION *pConn = pShard->pConnList;
+
+        while (pConn) {
+            if ((pConn->pipeLen > 0 || pConn->spliceIn > 0) &&
+                (!pConn->pPartner || !UnspliceFrame(pConn))) {
+                RelayLog("[WARN] Could not read a spliced frame's pipe - closing its session\n");
+                CloseConnection(pShard, pConn);
+                pConn = pShard->pConnList;  /* The partner may have gone too */
+                continue;
+            }
+            pConn = pConn->pNextConn;
+        }
+        ReapClosedConnections(pShard);
+    }
+
+    if (ExportConnections(pServer, pHandoff) != RD2K_SUCCESS) {
+        RelayLog("[ERROR] Out of memory describing connections for the handoff\n");
+        return RD2K_ERR_MEMORY;
+    }
+
+    pServer->bDetached = TRUE;
+    RelayLog("[UPGRADE] Detached %u connection(s) on %u listen socket(s)\n",
+             pHandoff->connCount, pHandoff->listenCount);
+    return RD2K_SUCCESS;
+}
+
+int Relay_Resume(RELAY_SERVER *pServer)
+{
+    DWORD now = GetTickCount();
+    DWORD i;
+
+    if (!pServer) return RD2K_ERR_SOCKET;
+
+    pServer->bQuiescing = 0;
+    pServer->bDetached = FALSE;
+    for (i = 0; i < pServer->shardCount; i++) {
+        RELAY_SHARD *pShard = &pServer->shards[i];
+        RELAY_CONNECTION *pConn;
+
+        ReapClosedConnections(pShard);
+
+        /* The clients were not idle, we were not listening */
+        for (pConn = pShard->pConnList; pConn; pConn = pConn->pNextConn)
+            pConn->lastActivity = now;
+
+        __atomic_store_n(&pShard->bSettled, FALSE, __ATOMIC_RELAXED);
+        pShard->bResume = TRUE;
+    }
+
+    RelayLog("[UPGRADE] Resuming service\n");
+    return Relay_Start(pServer);
+}
+
+void Relay_FreeHandoff(RELAY_HANDOFF *pHandoff)
+{
+    DWORD i;
+
+    if (!pHandoff) return;
+
+    if (pHandoff->conns) {
+        for (i = 0; i < pHandoff->connCount; i++) {
+            free(pHandoff->conns[i].input);
+            free(pHandoff->conns[i].output);
+        }
+    }
+    free(pHandoff->conns);
+    free(pHandoff->listenSockets);
+    ZeroMemory(pHandoff, sizeof(RELAY_HANDOFF));
+}
+
 void Relay_GetStats(RELAY_SERVER *pServer, DWORD *activeConnections)
 {
     if (!pServer || !activeConnections) return;
-    
-    pthread_mutex_lock(&pServer->connMutex);
-    *activeConnections = pServer->activeConnections;
-    pthread_mutex_unlock(&pServer->connMutex);
-}
\ No newline at end of file
+
+    *activeConnections = __atomic_load_n(&pServer->activeConnections, __ATOMIC_RELAXED);
+}
+
+void Relay_GetStatsEx(RELAY_SERVER *pServer, RELAY_STATS *pStats)
+{
+    ADMIT_STATS admitStats;
+    DWORD i, type;
+
+    if (!pServer || !pStats) return;
+
+    pStats->activeConnections = __atomic_load_n(&pServer->activeConnections, __ATOMIC_RELAXED);
+    pStats->pausedReaders = __atomic_load_n(&pServer->pausedReaders, __ATOMIC_RELAXED);
+    pStats->queuedBytes = __atomic_load_n(&pServer->queuedBytes, __ATOMIC_RELAXED);
+    pStats->backpressurePauses = __atomic_load_n(&pServer->backpressurePauses, __ATOMIC_RELAXED);
+
+    pStats->totalConnections = 0;
+    pStats->successfulPairs = 0;
+    pStats->failedConnections = 0;
+    pStats->rejectedRegistrations = 0;
+    pStats->timeouts = 0;
+    pStats->framesForwarded = 0;
+    pStats->bytesForwarded = 0;
+    pStats->coalescedBatches = 0;
+    pStats->coalescedSends = 0;
+    pStats->nodeLinkPairs = 0;
+    pStats->cutThroughFrames = 0;
+    pStats->scheduledBytes = 0;
+    pStats->rateCapWaits = 0;
+    pStats->uplinkWaits = 0;
+    pStats->remoteAccepts = 0;
+    ZeroMemory(pStats->framesIn, sizeof(pStats->framesIn));
+    ZeroMemory(pStats->bytesIn, sizeof(pStats->bytesIn));
+
+    for (i = 0; i < pServer->shardCount; i++) {
+        RELAY_SHARD_STATS *pShardStats = &pServer->shards[i].stats;
+
+        pStats->totalConnections += __atomic_load_n(&pShardStats->totalConnections, __ATOMIC_RELAXED);
+        pStats->successfulPairs += __atomic_load_n(&pShardStats->successfulPairs, __ATOMIC_RELAXED);
+        pStats->failedConnections += __atomic_load_n(&pShardStats->failedConnections, __ATOMIC_RELAXED);
+        pStats->rejectedRegistrations +=
+            __atomic_load_n(&pShardStats->rejectedRegistrations, __ATOMIC_RELAXED);
+        pStats->timeouts += __atomic_load_n(&pShardStats->timeouts, __ATOMIC_RELAXED);
+        pStats->framesForwarded += __atomic_load_n(&pShardStats->framesForwarded, __ATOMIC_RELAXED);
+        pStats->bytesForwarded += __atomic_load_n(&pShardStats->bytesForwarded, __ATOMIC_RELAXED);
+        pStats->coalescedBatches += __atomic_load_n(&pShardStats->coalescedBatches, __ATOMIC_RELAXED);
+        pStats->coalescedSends += __atomic_load_n(&pShardStats->coalescedSends, __ATOMIC_RELAXED);
+        pStats->nodeLinkPairs += __atomic_load_n(&pShardStats->nodeLinkPairs, __ATOMIC_RELAXED);
+        pStats->cutThroughFrames += __atomic_load_n(&pShardStats->cutThroughFrames, __ATOMIC_RELAXED);
+        pStats->scheduledBytes += __atomic_load_n(&pShardStats->scheduledBytes, __ATOMIC_RELAXED);
+        pStats->rateCapWaits += __atomic_load_n(&pShardStats->rateCapWaits, __ATOMIC_RELAXED);
+        pStats->uplinkWaits += __atomic_load_n(&pShardStats->uplinkWaits, __ATOMIC_RELAXED);
+        pStats->remoteAccepts += __atomic_load_n(&pShardStats->remoteAccepts, __ATOMIC_RELAXED);
+        for (type = 0; type < RELAY_STATS_MSG_TYPES; type++) {
+            pStats->framesIn[type] += __atomic_load_n(&pShardStats->framesIn[type], __ATOMIC_RELAXED);
+            pStats->bytesIn[type] += __atomic_load_n(&pShardStats->bytesIn[type], __ATOMIC_RELAXED);
+        }
+    }
+
+    Admit_GetStats(pServer->pAdmit, &admitStats);
+    pStats->refusedAccepts[0] = admitStats.refusedSource[ADMIT_ACCEPT];
+    pStats->refusedAccepts[1] = admitStats.refusedTotal[ADMIT_ACCEPT];
+    pStats->refusedRegisters[0] = admitStats.refusedSource[ADMIT_REGISTER];
+    pStats->refusedRegisters[1] = admitStats.refusedTotal[ADMIT_REGISTER];
+    pStats->admitSources = admitStats.sources;
+}
+
+void Relay_GetHistograms(RELAY_SERVER *pServer, RELAY_HIST *pDelay, RELAY_HIST *pSize)
+{
+    DWORD i;
+
+    Hist_Reset(pDelay);
+    Hist_Reset(pSize);
+    if (!pServer) return;
+
+    for (i = 0; i < pServer->shardCount; i++) {
+        Hist_Merge(pDelay, &pServer->shards[i].delayHist);
+        Hist_Merge(pSize, &pServer->shards[i].sizeHist);
+    }
+}
+
+void Relay_DumpHistograms(RELAY_SERVER *pServer)
+{
+    RELAY_HIST delay, size;
+    char summary[160];
+
+    if (!pServer) return;
+
+    Relay_GetHistograms(pServer, &delay, &size);
+
+    Hist_Format(&delay, summary, sizeof(summary));
+    RelayLog("[HIST] All sessions, forwarding delay (us): %s\n", summary);
+    Hist_Format(&size, summary, sizeof(summary));
+    RelayLog("[HIST] All sessions, frame size (bytes): %s\n", summary);
+
+    /* Sessions belong to their shards' threads; each logs its own */
+    __atomic_add_fetch(&pServer->histDumpSeq, 1, __ATOMIC_RELAXED);
+}
+
+/* Post an admin request to every shard and wait for all answers. The
+ * caller holds adminMutex; the answers stay put until its next request.
+ * Returns RD2K_SUCCESS or RD2K_ERR_TIMEOUT */
+static int AdminRequest(RELAY_SERVER *pServer, DWORD closeId)
+{
+    struct timespec deadline;
+    DWORD seq, i;
+    BOOL bAnswered = FALSE;
+    int err = 0;
+
+    if (!pServer->bRunning) return RD2K_ERR_TIMEOUT;
+
+    pServer->adminCloseId = closeId;
+    seq = __atomic_add_fetch(&pServer->adminSeq, 1, __ATOMIC_RELEASE);
+    for (i = 0; i < pServer->shardCount; i++)
+        WakeShard(&pServer->shards[i]);
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += RELAY_ADMIN_WAIT_MS / 1000;
+    deadline.tv_nsec += (long)(RELAY_ADMIN_WAIT_MS % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&pServer->answerMutex);
+    while (!bAnswered && err == 0) {
+        bAnswered = TRUE;
+        for (i = 0; bAnswered && i < pServer->shardCount; i++)
+            bAnswered = pServer->shards[i].adminSeq == seq;
+        if (!bAnswered)
+            err = pthread_cond_timedwait(&pServer->answerCond, &pServer->answerMutex, &deadline);
+    }
+    pthread_mutex_unlock(&pServer->answerMutex);
+
+    return bAnswered ? RD2K_SUCCESS : RD2K_ERR_TIMEOUT;
+}
+
+int Relay_ListSessions(RELAY_SERVER *pServer, RELAY_SESSION_INFO **ppInfo, DWORD *pCount)
+{
+    RELAY_SESSION_INFO *pInfo = NULL;
+    DWORD total = 0, i;
+    int result;
+
+    *ppInfo = NULL;
+    *pCount = 0;
+    if (!pServer) return RD2K_ERR_SOCKET;
+
+    pthread_mutex_lock(&pServer->adminMutex);
+    result = AdminRequest(pServer, 0);
+
+    for (i = 0; result == RD2K_SUCCESS && i < pServer->shardCount; i++) {
+        if (pServer->shards[i].answerStatus != RD2K_SUCCESS)
+            result = pServer->shards[i].answerStatus;
+        total += pServer->shards[i].answerCount;
+    }
+    if (result == RD2K_SUCCESS && total > 0) {
+        pInfo = (RELAY_SESSION_INFO*)malloc(total * sizeof(RELAY_SESSION_INFO));
+        if (!pInfo) result = RD2K_ERR_MEMORY;
+    }
+    if (pInfo) {
+        for (i = 0; i < pServer->shardCount; i++) {
+            RELAY_SHARD *pShard = &pServer->shards[i];
+
+            if (pShard->answerCount > 0)
+                memcpy(pInfo + *pCount, pShard->pAnswer, pShard->answerCount * sizeof(RELAY_SESSION_INFO));
+            *pCount += pShard->answerCount;
+        }
+        *ppInfo = pInfo;
+    }
+
+    /* Collected or not, the lists are of no further use */
+    pthread_mutex_lock(&pServer->answerMutex);
+    for (i = 0; i < pServer->shardCount; i++) {
+        free(pServer->shards[i].pAnswer);
+        pServer->shards[i].pAnswer = NULL;
+    }
+    pthread_mutex_unlock(&pServer->answerMutex);
+
+    pthread_mutex_unlock(&pServer->adminMutex);
+    return result;
+}
+
+int Relay_CloseSession(RELAY_SERVER *pServer, DWORD clientId, DWORD *pClosed)
+{
+    int result;
+    DWORD i;
+
+    *pClosed = 0;
+    if (!pServer) return RD2K_ERR_SOCKET;
+    if (clientId == 0) return RD2K_SUCCESS;
+
+    pthread_mutex_lock(&pServer->adminMutex);
+    result = AdminRequest(pServer, clientId);
+    for (i = 0; result == RD2K_SUCCESS && i < pServer->shardCount; i++)
+        *pClosed += pServer->shards[i].answerCount;
+    pthread_mutex_unlock(&pServer->adminMutex);
+
+    return result;
+}
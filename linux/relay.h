@@ -6,9 +6,141 @@
 #define _RELAY_H_
 
 #include "common.h"
+#include "relay_hist.h"
 
-/* Forward declaration */
+/* Forward declarations */
 typedef struct _RELAY_SERVER RELAY_SERVER;
+struct _RELAY_CLUSTER;
+struct _ADMIT_CONFIG;
+struct _RELAY_CAPTURE;
+
+/* Event loop backends */
+#define RELAY_BACKEND_EPOLL     0   /* Readiness: epoll + nonblocking syscalls */
+#define RELAY_BACKEND_URING     1   /* Completion: io_uring, batched submission */
+
+#define RELAY_MAX_SHARDS        64  /* Also the most listen sockets a handoff carries */
+
+/* One client connection handed from a running relay to its successor
+ * (relay_upgrade.c). Buffered bytes are flattened: input is what was read
+ * from the socket but not framed yet, output is what the client has still
+ * to receive, in order. A DATA frame being cut through continues in the
+ * successor: streamIn of its bytes are still to be read and forwarded */
+#define RELAY_HANDOFF_NONE      0xFFFFFFFF  /* partner: not paired */
+#define RELAY_HANDOFF_NODE_LINK 0x0001      /* flags: session link to another node */
+#define RELAY_HANDOFF_MID_FRAME 0x0002      /* flags: output ends inside the partner's frame */
+#define RELAY_HANDOFF_PONG_OWED 0x0004      /* flags: answer a PING once that frame is done */
+#define RELAY_HANDOFF_STREAM_DROP 0x0008    /* flags: streamIn bytes are discarded, not forwarded */
+
+typedef struct _RELAY_HANDOFF_CONN {
+    SOCKET  socket;
+    DWORD   clientId;
+    DWORD   state;          /* RELAY_STATE_* */
+    DWORD   prevState;      /* WAITING: state to return to if the connect fails */
+    DWORD   partner;        /* Index of the partner's entry, or RELAY_HANDOFF_NONE */
+    DWORD   flags;          /* RELAY_HANDOFF_* */
+    DWORD   idleMs;         /* Since the client was last heard from */
+    DWORD   streamIn;       /* Rest of a cut-through DATA frame, 0 = at a frame boundary */
+    BYTE*   input;
+    DWORD   inputLength;
+    BYTE*   output;
+    DWORD   outputLength;
+} RELAY_HANDOFF_CONN;
+
+typedef struct _RELAY_HANDOFF {
+    SOCKET*             listenSockets;  /* One per shard */
+    DWORD               listenCount;
+    RELAY_HANDOFF_CONN* conns;
+    DWORD               connCount;
+} RELAY_HANDOFF;
+
+/* How the fair scheduler treats the DATA one client sends: its partner's
+ * output gets weight quanta per round and at most rate bytes per second */
+#define RELAY_SHARE_ANY_CLIENT  0   /* clientId: every client, unless listed itself */
+
+typedef struct _RELAY_CLIENT_SHARE {
+    DWORD   clientId;       /* Or RELAY_SHARE_ANY_CLIENT */
+    DWORD   weight;         /* 0 = not set (1) */
+    DWORD   rate;           /* Bytes per second, 0 = not set (uncapped) */
+} RELAY_CLIENT_SHARE;
+
+/* Server tuning, filled with defaults by Relay_InitConfig */
+typedef struct _RELAY_CONFIG {
+    DWORD   shardCount;     /* Event loop threads, 0 = one per CPU in pCpus, else per online CPU */
+    BOOL    bSplice;        /* Forward DATA payloads with splice() (zero-copy) */
+    DWORD   backend;        /* RELAY_BACKEND_*; falls back to epoll if unsupported */
+    DWORD   coalesceUs;     /* Hold small DATA output this long to merge sends, 0 = off */
+    DWORD   coalesceBytes;  /* Write held output once this much is waiting */
+    struct _RELAY_CLUSTER* pCluster;  /* Started cluster (relay_cluster.h), NULL = standalone */
+    RELAY_HANDOFF* pHandoff;  /* Take over these sockets instead of listening, NULL = fresh start */
+    const struct _ADMIT_CONFIG* pAdmit;  /* Accept/REGISTER rate limits (relay_admit.h), NULL = none */
+    BOOL    bFair;          /* Deficit round robin over the sessions' output (epoll only) */
+    DWORD   uplinkRate;     /* Fair: bytes per second for all output together, 0 = unpaced */
+    const RELAY_CLIENT_SHARE* pShares;  /* Fair: per client weights and rate caps */
+    DWORD   shareCount;
+    struct _RELAY_CAPTURE* pCapture;  /* Started capture (relay_capture.h), NULL = off */
+    const int* pCpus;       /* Pin shard i to pCpus[i % cpuCount] and its buffers to that
+                             * CPU's NUMA node, NULL = not pinned */
+    DWORD   cpuCount;
+    BOOL    bSteerAccepts;  /* Pinned: accept a connection on the shard whose CPU took its packets */
+    BOOL    bReencrypt;     /* Decrypt and re-encrypt each DATA frame like the relay did before
+                             * opaque forwarding; for relay_bench comparisons only */
+} RELAY_CONFIG;
+
+#define RELAY_COALESCE_BYTES    (16 * 1024)     /* Default coalesceBytes */
+
+/* Per-type counters cover message types RELAY_STATS_MSG_BASE + 0..15 */
+#define RELAY_STATS_MSG_BASE    RELAY_MSG_REGISTER
+#define RELAY_STATS_MSG_TYPES   16
+
+/* Server counters, snapshot taken by Relay_GetStatsEx. Totals count
+ * since start and are summed over all shards */
+typedef struct _RELAY_STATS {
+    DWORD               activeConnections;
+    DWORD               pausedReaders;      /* Senders not read while their partner drains */
+    unsigned long long  queuedBytes;        /* Output waiting in all per-connection queues */
+    unsigned long long  backpressurePauses; /* Times a sender was paused (total) */
+    unsigned long long  totalConnections;   /* Accepted */
+    unsigned long long  successfulPairs;
+    unsigned long long  failedConnections;  /* CONNECT_REQUESTs refused */
+    unsigned long long  rejectedRegistrations; /* REGISTERs refused, ID in use */
+    unsigned long long  timeouts;           /* Closed for inactivity */
+    unsigned long long  framesIn[RELAY_STATS_MSG_TYPES];   /* Received, by msgType */
+    unsigned long long  bytesIn[RELAY_STATS_MSG_TYPES];    /* Headers included */
+    unsigned long long  framesForwarded;    /* DATA frames handed to a partner */
+    unsigned long long  bytesForwarded;
+    unsigned long long  coalescedBatches;   /* Forwarded DATA batches held to share a send() */
+    unsigned long long  coalescedSends;     /* Writes of held output */
+    unsigned long long  nodeLinkPairs;      /* Sessions paired with a client on another node */
+    unsigned long long  cutThroughFrames;   /* DATA frames forwarded while still arriving */
+    unsigned long long  scheduledBytes;     /* Output written by the fair scheduler */
+    unsigned long long  rateCapWaits;       /* Times a session's output waited for its rate cap */
+    unsigned long long  uplinkWaits;        /* Times a shard's output waited for the uplink rate */
+    unsigned long long  refusedAccepts[2];  /* Closed by admission limits: [0] per source, [1] total */
+    unsigned long long  refusedRegisters[2];/* REGISTERs refused by admission limits, same order */
+    DWORD               admitSources;       /* Source addresses the limits track now */
+    unsigned long long  remoteAccepts;      /* Accepted by a pinned shard off the packets' CPU */
+} RELAY_STATS;
+
+/* One connection in a Relay_ListSessions snapshot */
+typedef struct _RELAY_SESSION_INFO {
+    DWORD               clientId;           /* 0 = not registered yet */
+    DWORD               partnerId;          /* 0 = not paired */
+    DWORD               state;              /* RELAY_STATE_* */
+    DWORD               shard;
+    DWORD               peerAddr;           /* Source IPv4, network order (0 = unknown) */
+    BOOL                bNodeLink;          /* Stands in for a client on another node */
+    DWORD               idleMs;             /* Since it last sent or was sent anything */
+    DWORD               queuedBytes;        /* Output waiting for its socket */
+    unsigned long long  bytesIn;            /* Frames received from it, headers included */
+    unsigned long long  bytesOut;           /* DATA forwarded to it */
+    unsigned long long  frames;             /* Paired: DATA frames forwarded to it this session */
+    DWORD               delayP50;           /* Paired: forwarding delay (us) of those frames */
+    DWORD               delayP99;
+    DWORD               delayMax;
+    DWORD               sizeMean;           /* Paired: mean frame size (bytes) */
+} RELAY_SESSION_INFO;
+
+#define RELAY_ADMIN_WAIT_MS     1000    /* Longest wait for the shards to answer */
 
 /* ============================================================
  * PUBLIC API
@@ -22,6 +154,20 @@ typedef struct _RELAY_SERVER RELAY_SERVER;
  */
 RELAY_SERVER* Relay_Create(WORD port, const char* ipAddr);
 
+/*
+ * Fill a config with default values
+ */
+void Relay_InitConfig(RELAY_CONFIG *pConfig);
+
+/*
+ * Create a relay server instance with explicit settings
+ * pConfig: Settings (NULL for defaults). With pHandoff set, the server
+ *          serves the handed-over listen sockets (one shard each) and
+ *          connections; it owns all their sockets afterwards, also on failure
+ * Returns: Server instance or NULL on failure
+ */
+RELAY_SERVER* Relay_CreateEx(WORD port, const char* ipAddr, const RELAY_CONFIG *pConfig);
+
 /*
  * Start the relay server
  * Returns: RD2K_SUCCESS or RD2K_ERROR
@@ -39,7 +185,28 @@ void Relay_Stop(RELAY_SERVER *pServer);
 void Relay_Destroy(RELAY_SERVER *pServer);
 
 /*
- * Set log callback for receiving log messages
+ * Prepare a hot upgrade: stop reading and accepting, let cross-shard
+ * pairing and io_uring requests settle, stop the shards and describe every
+ * listen socket and connection in pHandoff. The sockets stay open; after
+ * a successful handoff Relay_Destroy closes this process's copies without
+ * disturbing the connections. Returns RD2K_SUCCESS or RD2K_ERR_TIMEOUT
+ * (the server is still stopped, Relay_Resume restarts it)
+ */
+int Relay_Detach(RELAY_SERVER *pServer, RELAY_HANDOFF *pHandoff);
+
+/*
+ * The successor did not take over: serve the connections again
+ */
+int Relay_Resume(RELAY_SERVER *pServer);
+
+/*
+ * Free a handoff's arrays and buffers (not its sockets)
+ */
+void Relay_FreeHandoff(RELAY_HANDOFF *pHandoff);
+
+/*
+ * Set log callback for receiving log messages. It is called on the shard
+ * threads, possibly concurrently, and should queue rather than block
  */
 void Relay_SetLogCallback(void (*callback)(const char*));
 
@@ -48,4 +215,39 @@ void Relay_SetLogCallback(void (*callback)(const char*));
  */
 void Relay_GetStats(RELAY_SERVER *pServer, DWORD *activeConnections);
 
+/*
+ * Get all server counters, including outbound queue depth. Cheap enough
+ * to poll: one pass over the shards, no locks
+ */
+void Relay_GetStatsEx(RELAY_SERVER *pServer, RELAY_STATS *pStats);
+
+/*
+ * Log the forwarding delay (DATA frame fully received to handed to the
+ * partner's socket) and frame size histograms of all sessions. Every
+ * shard then logs its open sessions on its next loop pass
+ */
+void Relay_DumpHistograms(RELAY_SERVER *pServer);
+
+/*
+ * Forwarding delay and frame size histograms of all sessions so far,
+ * merged over the shards
+ */
+void Relay_GetHistograms(RELAY_SERVER *pServer, RELAY_HIST *pDelay, RELAY_HIST *pSize);
+
+/*
+ * Snapshot of every connection. Each shard describes its own between two
+ * passes of its loop, so forwarding never stops for it. *ppInfo is an
+ * array of *pCount entries for the caller to free() (NULL if empty).
+ * Returns RD2K_SUCCESS, RD2K_ERR_MEMORY, or RD2K_ERR_TIMEOUT if a shard
+ * did not answer within RELAY_ADMIN_WAIT_MS (not running)
+ */
+int Relay_ListSessions(RELAY_SERVER *pServer, RELAY_SESSION_INFO **ppInfo, DWORD *pCount);
+
+/*
+ * Close the connection registered as clientId, as if it had hung up; its
+ * partner is told. *pClosed is 0 if no such client was found. Returns
+ * RD2K_SUCCESS or RD2K_ERR_TIMEOUT
+ */
+int Relay_CloseSession(RELAY_SERVER *pServer, DWORD clientId, DWORD *pClosed);
+
 #endif /* _RELAY_H_ */
\ No newline at end of file
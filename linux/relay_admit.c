@@ -0,0 +1,229 @@
+/*
+ * relay_admit.c - Admission Control for RemoteDesk2K Linux Relay
+ *
+ * Bucket levels are kept in thousandths of a token and refilled lazily:
+ * a source's buckets are topped up from the time it was last seen when
+ * it shows up again. A source's slot is found by probing a few slots of
+ * its stripe from the address hash; a new source takes a free slot among
+ * them or the one seen least recently.
+ */
+
+#include "relay_admit.h"
+
+#define ADMIT_STRIPE_BITS       6
+#define ADMIT_STRIPES           (1 << ADMIT_STRIPE_BITS)
+#define ADMIT_STRIPE_SLOTS      256     /* Sources per stripe, power of two */
+#define ADMIT_PROBE             8       /* Slots a source may occupy */
+#define ADMIT_UNIT              1000    /* Bucket level of one token */
+
+typedef struct _ADMIT_BUCKET {
+    DWORD               level;          /* Thousandths of a token */
+    BOOL                bRefusing;      /* Last take failed */
+} ADMIT_BUCKET;
+
+typedef struct _ADMIT_SOURCE {
+    DWORD               addr;
+    DWORD               lastSeen;       /* GetTickCount(), also the refill stamp */
+    BOOL                bUsed;
+    ADMIT_BUCKET        buckets[ADMIT_EVENTS];
+} ADMIT_SOURCE;
+
+typedef struct _ADMIT_STRIPE {
+    pthread_mutex_t     mutex;
+    DWORD               count;
+    ADMIT_SOURCE        slots[ADMIT_STRIPE_SLOTS];
+} ADMIT_STRIPE;
+
+struct _RELAY_ADMIT {
+    ADMIT_CONFIG        config;         /* Bursts filled in */
+    BOOL                bSource[ADMIT_EVENTS];  /* Any per-source limit for the event */
+    pthread_mutex_t     totalMutex;
+    DWORD               totalRefilled;
+    ADMIT_BUCKET        total[ADMIT_EVENTS];
+    unsigned long long  refusedSource[ADMIT_EVENTS];   /* Atomic */
+    unsigned long long  refusedTotal[ADMIT_EVENTS];    /* Atomic */
+    ADMIT_STRIPE        stripes[ADMIT_STRIPES];
+};
+
+/* ============================================================
+ * BUCKETS
+ * ============================================================ */
+
+static DWORD BucketSize(const ADMIT_LIMIT *pLimit)
+{
+    return pLimit->burst * ADMIT_UNIT;
+}
+
+static void Refill(ADMIT_BUCKET *pBucket, const ADMIT_LIMIT *pLimit, DWORD elapsedMs)
+{
+    unsigned long long level;
+
+    /* rate tokens per second = rate thousandths per millisecond */
+    level = pBucket->level + (unsigned long long)elapsedMs * pLimit->rate;
+    pBucket->level = level < BucketSize(pLimit) ? (DWORD)level : BucketSize(pLimit);
+}
+
+/* Whether a token is there to take. Returns FALSE if the bucket is empty */
+static BOOL HasToken(ADMIT_BUCKET *pBucket, const ADMIT_LIMIT *pLimit, BOOL *pbFirst)
+{
+    if (pLimit->rate == 0 || pBucket->level >= ADMIT_UNIT) return TRUE;
+
+    *pbFirst = !pBucket->bRefusing;
+    pBucket->bRefusing = TRUE;
+    return FALSE;
+}
+
+/* Take the token HasToken found */
+static void Take(ADMIT_BUCKET *pBucket, const ADMIT_LIMIT *pLimit)
+{
+    if (pLimit->rate == 0) return;
+
+    pBucket->level -= ADMIT_UNIT;
+    pBucket->bRefusing = FALSE;
+}
+
+/* Slot of addr in pStripe, claimed (full buckets) if it is new */
+static ADMIT_SOURCE* FindSource(RELAY_ADMIT *pAdmit, ADMIT_STRIPE *pStripe, DWORD addr,
+                                DWORD hash, DWORD now)
+{
+    ADMIT_SOURCE *pVictim = NULL;
+    DWORD i;
+
+    for (i = 0; i < ADMIT_PROBE; i++) {
+        ADMIT_SOURCE *pSource = &pStripe->slots[(hash + i) & (ADMIT_STRIPE_SLOTS - 1)];
+
+        if (!pSource->bUsed) {
+            if (!pVictim || pVictim->bUsed) pVictim = pSource;
+        } else if (pSource->addr == addr) {
+            return pSource;
+        } else if (!pVictim || (pVictim->bUsed &&
+                                now - pSource->lastSeen > now - pVictim->lastSeen)) {
+            pVictim = pSource;
+        }
+    }
+
+    if (!pVictim->bUsed) pStripe->count++;
+    pVictim->bUsed = TRUE;
+    pVictim->addr = addr;
+    pVictim->lastSeen = now;
+    for (i = 0; i < ADMIT_EVENTS; i++) {
+        pVictim->buckets[i].level = BucketSize(&pAdmit->config.source[i]);
+        pVictim->buckets[i].bRefusing = FALSE;
+    }
+    return pVictim;
+}
+
+/* ============================================================
+ * PUBLIC API
+ * ============================================================ */
+
+RELAY_ADMIT* Admit_Create(const ADMIT_CONFIG *pConfig)
+{
+    RELAY_ADMIT *pAdmit;
+    DWORD i;
+
+    pAdmit = (RELAY_ADMIT*)calloc(1, sizeof(RELAY_ADMIT));
+    if (!pAdmit) return NULL;
+
+    pAdmit->config = *pConfig;
+    for (i = 0; i < ADMIT_EVENTS; i++) {
+        ADMIT_LIMIT *pSource = &pAdmit->config.source[i];
+        ADMIT_LIMIT *pTotal = &pAdmit->config.total[i];
+
+        /* Larger limits would overflow the buckets */
+        if (pSource->rate > ADMIT_RATE_MAX) pSource->rate = ADMIT_RATE_MAX;
+        if (pTotal->rate > ADMIT_RATE_MAX) pTotal->rate = ADMIT_RATE_MAX;
+        if (pSource->burst == 0) pSource->burst = pSource->rate ? pSource->rate * 2 : 1;
+        if (pTotal->burst == 0) pTotal->burst = pTotal->rate ? pTotal->rate * 2 : 1;
+        if (pSource->burst > ADMIT_BURST_MAX) pSource->burst = ADMIT_BURST_MAX;
+        if (pTotal->burst > ADMIT_BURST_MAX) pTotal->burst = ADMIT_BURST_MAX;
+        pAdmit->bSource[i] = pSource->rate != 0;
+        pAdmit->total[i].level = BucketSize(pTotal);
+    }
+
+    pthread_mutex_init(&pAdmit->totalMutex, NULL);
+    pAdmit->totalRefilled = GetTickCount();
+    for (i = 0; i < ADMIT_STRIPES; i++)
+        pthread_mutex_init(&pAdmit->stripes[i].mutex, NULL);
+
+    return pAdmit;
+}
+
+void Admit_Destroy(RELAY_ADMIT *pAdmit)
+{
+    DWORD i;
+
+    if (!pAdmit) return;
+
+    for (i = 0; i < ADMIT_STRIPES; i++)
+        pthread_mutex_destroy(&pAdmit->stripes[i].mutex);
+    pthread_mutex_destroy(&pAdmit->totalMutex);
+    free(pAdmit);
+}
+
+int Admit_Check(RELAY_ADMIT *pAdmit, DWORD event, DWORD addr, BOOL *pbFirst)
+{
+    DWORD now = GetTickCount();
+    ADMIT_STRIPE *pStripe = NULL;
+    ADMIT_SOURCE *pSource = NULL;
+    int result = ADMIT_OK;
+    DWORD i;
+
+    *pbFirst = FALSE;
+    if (!pAdmit || event >= ADMIT_EVENTS) return ADMIT_OK;
+
+    /* The source's own bucket first, so one noisy address is refused
+     * without a look at the tokens everyone shares */
+    if (pAdmit->bSource[event]) {
+        DWORD hash = HashDword(addr);
+
+        pStripe = &pAdmit->stripes[hash >> (32 - ADMIT_STRIPE_BITS)];
+        pthread_mutex_lock(&pStripe->mutex);
+        pSource = FindSource(pAdmit, pStripe, addr, hash, now);
+        for (i = 0; i < ADMIT_EVENTS; i++)
+            Refill(&pSource->buckets[i], &pAdmit->config.source[i], now - pSource->lastSeen);
+        pSource->lastSeen = now;
+        if (!HasToken(&pSource->buckets[event], &pAdmit->config.source[event], pbFirst))
+            result = ADMIT_REFUSED_SOURCE;
+    }
+
+    /* The stripe stays locked meanwhile (always stripe, then total), so
+     * neither bucket is taken from unless both have a token */
+    if (result == ADMIT_OK && pAdmit->config.total[event].rate != 0) {
+        pthread_mutex_lock(&pAdmit->totalMutex);
+        for (i = 0; i < ADMIT_EVENTS; i++)
+            Refill(&pAdmit->total[i], &pAdmit->config.total[i], now - pAdmit->totalRefilled);
+        pAdmit->totalRefilled = now;
+        if (HasToken(&pAdmit->total[event], &pAdmit->config.total[event], pbFirst))
+            Take(&pAdmit->total[event], &pAdmit->config.total[event]);
+        else
+            result = ADMIT_REFUSED_TOTAL;
+        pthread_mutex_unlock(&pAdmit->totalMutex);
+    }
+
+    if (pSource) {
+        if (result == ADMIT_OK) Take(&pSource->buckets[event], &pAdmit->config.source[event]);
+        pthread_mutex_unlock(&pStripe->mutex);
+    }
+
+    if (result == ADMIT_REFUSED_SOURCE)
+        __atomic_add_fetch(&pAdmit->refusedSource[event], 1, __ATOMIC_RELAXED);
+    else if (result == ADMIT_REFUSED_TOTAL)
+        __atomic_add_fetch(&pAdmit->refusedTotal[event], 1, __ATOMIC_RELAXED);
+    return result;
+}
+
+void Admit_GetStats(RELAY_ADMIT *pAdmit, ADMIT_STATS *pStats)
+{
+    DWORD i;
+
+    ZeroMemory(pStats, sizeof(ADMIT_STATS));
+    if (!pAdmit) return;
+
+    for (i = 0; i < ADMIT_EVENTS; i++) {
+        pStats->refusedSource[i] = __atomic_load_n(&pAdmit->refusedSource[i], __ATOMIC_RELAXED);
+        pStats->refusedTotal[i] = __atomic_load_n(&pAdmit->refusedTotal[i], __ATOMIC_RELAXED);
+    }
+    for (i = 0; i < ADMIT_STRIPES; i++)
+        pStats->sources += __atomic_load_n(&pAdmit->stripes[i].count, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,68 @@
+/*
+ * relay_admit.h - Admission Control for RemoteDesk2K Linux Relay
+ *
+ * Token buckets that cap how fast connections are accepted and clients
+ * register, per source IPv4 address and over all sources. A bucket holds
+ * up to `burst` tokens and gains `rate` per second; each accept or
+ * REGISTER takes one, and an empty bucket refuses. The relay checks
+ * accepts before it allocates anything for the connection, so a client
+ * stuck in a reconnect loop costs an accept() and a close().
+ *
+ * Sources live in a fixed-size, lock-striped table. When a stripe is
+ * full, the source seen least recently is forgotten (its bucket starts
+ * full again), so memory stays bounded however many addresses connect;
+ * the totals still hold against floods from many addresses.
+ */
+
+#ifndef _RD2K_RELAY_ADMIT_H_
+#define _RD2K_RELAY_ADMIT_H_
+
+#include "common.h"
+
+/* Admit_Check events */
+#define ADMIT_ACCEPT            0
+#define ADMIT_REGISTER          1
+#define ADMIT_EVENTS            2
+
+/* Admit_Check results */
+#define ADMIT_OK                0
+#define ADMIT_REFUSED_SOURCE    1   /* Per-address bucket empty */
+#define ADMIT_REFUSED_TOTAL     2   /* Bucket for all addresses empty */
+
+/* Largest accepted limits: buckets count thousandths of a token in a DWORD */
+#define ADMIT_RATE_MAX          1000000
+#define ADMIT_BURST_MAX         (2 * ADMIT_RATE_MAX)
+
+typedef struct _RELAY_ADMIT RELAY_ADMIT;
+
+typedef struct _ADMIT_LIMIT {
+    DWORD   rate;               /* Events per second, 0 = unlimited */
+    DWORD   burst;              /* Bucket size, 0 = twice the rate */
+} ADMIT_LIMIT;
+
+typedef struct _ADMIT_CONFIG {
+    ADMIT_LIMIT source[ADMIT_EVENTS];   /* Per source address, by ADMIT_ event */
+    ADMIT_LIMIT total[ADMIT_EVENTS];    /* All sources together */
+} ADMIT_CONFIG;
+
+typedef struct _ADMIT_STATS {
+    unsigned long long  refusedSource[ADMIT_EVENTS];
+    unsigned long long  refusedTotal[ADMIT_EVENTS];
+    DWORD               sources;            /* Addresses tracked now */
+} ADMIT_STATS;
+
+/* Create the buckets. Returns NULL on failure */
+RELAY_ADMIT* Admit_Create(const ADMIT_CONFIG *pConfig);
+
+void Admit_Destroy(RELAY_ADMIT *pAdmit);
+
+/* Take a token for event (ADMIT_ACCEPT / ADMIT_REGISTER) from addr
+ * (network order) and from the bucket for all sources; neither is taken
+ * unless both have one. Returns ADMIT_OK or why it was refused. *pbFirst is set
+ * when this refusal starts a run of them for that bucket, so callers can
+ * log once per episode instead of once per attempt. Thread-safe */
+int Admit_Check(RELAY_ADMIT *pAdmit, DWORD event, DWORD addr, BOOL *pbFirst);
+
+void Admit_GetStats(RELAY_ADMIT *pAdmit, ADMIT_STATS *pStats);
+
+#endif /* _RD2K_RELAY_ADMIT_H_ */
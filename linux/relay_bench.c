@@ -0,0 +1,1107 @@
+/*
+ * relay_bench.c - RemoteDesk2K Linux Relay Microbenchmarks
+ *
+ * Standalone benchmark driver for relay internals. Build with "make bench"
+ * and run "./relay_bench [scenario...]" (all scenarios when none given).
+ *
+ * Scenarios:
+ *   registry  - REGISTER throughput (claim + stale eviction) against the
+ *               client ID registry, compared with the old linear slot scan
+ *   forward   - Loopback throughput of one paired session through a
+ *               single-shard relay per DATA payload size: opaque forwarding
+ *               versus the old decrypt + rebuild + re-encrypt path
+ *   splice    - Loopback throughput of one paired session through a
+ *               single-shard relay, copy mode versus splice mode
+ *   pool      - Buffer pool counters while that session is forwarding;
+ *               steady state must not allocate
+ *   uring     - Small-frame packet rate of several paired sessions through
+ *               a single-shard relay, epoll backend versus io_uring
+ *   timers    - Inactivity bookkeeping for many idle clients: the old
+ *               once-a-second sweep versus the shard timer wheel
+ *   logging   - Cost of a log line to the threads that emit it: the old
+ *               locked fprintf + fflush versus the per-thread log rings
+ *   rings     - Record ring check: several threads wrap the smallest rings
+ *               with small records of every padded size; each record must
+ *               come out once, whole and in order. Exits 1 on a mismatch
+ */
+
+#include "common.h"
+#include "crypto.h"
+#include "relay.h"
+#include "relay_log.h"
+#include "relay_pool.h"
+#include "relay_registry.h"
+#include "relay_ring.h"
+#include "relay_timer.h"
+#include "relay_uring.h"
+#include <netinet/tcp.h>
+
+#define BENCH_THREADS_MAX   16
+
+static int g_exitCode = 0;  /* Set by scenarios that check results */
+
+/* ============================================================
+ * HELPERS
+ * ============================================================ */
+
+static double NowSeconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/* xorshift32 - cheap, deterministic per-thread ID stream */
+static DWORD NextRandom(DWORD *pState)
+{
+    DWORD x = *pState;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *pState = x;
+    return x;
+}
+
+static DWORD BenchThreadCount(void)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1) cpus = 1;
+    if (cpus > BENCH_THREADS_MAX) cpus = BENCH_THREADS_MAX;
+    return (DWORD)cpus;
+}
+
+/* ============================================================
+ * SCENARIO: registry
+ * ============================================================ */
+
+/* Registered IDs look like the relay's: 0x0A000000 + index */
+#define BENCH_ID_BASE       0x0A000000
+
+typedef struct _BENCH_ENTRY {
+    DWORD               clientId;
+    DWORD               generation;     /* Bumped on every re-registration */
+} BENCH_ENTRY;
+
+typedef struct _REGISTRY_BENCH {
+    RELAY_REGISTRY*     pRegistry;
+    DWORD               idCount;
+    DWORD               opsPerThread;
+    DWORD               seed;
+} REGISTRY_BENCH;
+
+/* One reconnect: look the ID up, evict the stale entry, register the new
+ * connection - the same steps ClaimClientId takes under the stripe lock */
+static void* RegistryWorker(void *arg)
+{
+    REGISTRY_BENCH *pBench = (REGISTRY_BENCH*)arg;
+    DWORD state = pBench->seed;
+    DWORD i;
+
+    for (i = 0; i < pBench->opsPerThread; i++) {
+        DWORD index = NextRandom(&state) % pBench->idCount;
+        DWORD clientId = BENCH_ID_BASE + index;
+        BENCH_ENTRY *pOld;
+
+        Registry_Lock(pBench->pRegistry, clientId);
+        pOld = (BENCH_ENTRY*)Registry_Find(pBench->pRegistry, clientId);
+        if (pOld) {
+            Registry_Remove(pBench->pRegistry, clientId, pOld);
+            pOld->generation++;
+            Registry_Insert(pBench->pRegistry, clientId, pOld);
+        }
+        Registry_Unlock(pBench->pRegistry, clientId);
+    }
+
+    return NULL;
+}
+
+static double RunRegistry(DWORD idCount, DWORD threadCount, DWORD totalOps)
+{
+    REGISTRY_BENCH bench[BENCH_THREADS_MAX];
+    pthread_t threads[BENCH_THREADS_MAX];
+    RELAY_REGISTRY *pRegistry;
+    BENCH_ENTRY *entries;
+    double start, elapsed;
+    DWORD i;
+
+    pRegistry = Registry_Create(1024);
+    entries = (BENCH_ENTRY*)calloc(idCount, sizeof(BENCH_ENTRY));
+    if (!pRegistry || !entries) {
+        fprintf(stderr, "[ERROR] Out of memory\n");
+        exit(1);
+    }
+
+    /* Fill up from empty, as a fresh relay would */
+    for (i = 0; i < idCount; i++) {
+        entries[i].clientId = BENCH_ID_BASE + i;
+        Registry_Lock(pRegistry, entries[i].clientId);
+        Registry_Insert(pRegistry, entries[i].clientId, &entries[i]);
+        Registry_Unlock(pRegistry, entries[i].clientId);
+    }
+
+    for (i = 0; i < threadCount; i++) {
+        bench[i].pRegistry = pRegistry;
+        bench[i].idCount = idCount;
+        bench[i].opsPerThread = totalOps / threadCount;
+        bench[i].seed = 0x9E3779B9U ^ (i * 0x85EBCA6BU) ^ 1;
+    }
+
+    start = NowSeconds();
+    for (i = 0; i < threadCount; i++)
+        pthread_create(&threads[i], NULL, RegistryWorker, &bench[i]);
+    for (i = 0; i < threadCount; i++)
+        pthread_join(threads[i], NULL);
+    elapsed = NowSeconds() - start;
+
+    if (Registry_GetCount(pRegistry) != idCount)
+        fprintf(stderr, "[ERROR] Registry lost entries (%u of %u)\n",
+                Registry_GetCount(pRegistry), idCount);
+
+    Registry_Destroy(pRegistry);
+    free(entries);
+
+    return (double)(bench[0].opsPerThread * threadCount) / elapsed;
+}
+
+/* Previous design: one mutex, every REGISTER scans all slots for the ID */
+typedef struct _LINEAR_BENCH {
+    pthread_mutex_t*    pMutex;
+    BENCH_ENTRY**       slots;
+    DWORD               slotCount;
+    DWORD               idCount;
+    DWORD               opsPerThread;
+    DWORD               seed;
+} LINEAR_BENCH;
+
+static void* LinearWorker(void *arg)
+{
+    LINEAR_BENCH *pBench = (LINEAR_BENCH*)arg;
+    DWORD state = pBench->seed;
+    DWORD i, j;
+
+    for (i = 0; i < pBench->opsPerThread; i++) {
+        DWORD clientId = BENCH_ID_BASE + NextRandom(&state) % pBench->idCount;
+
+        pthread_mutex_lock(pBench->pMutex);
+        for (j = 0; j < pBench->slotCount; j++) {
+            BENCH_ENTRY *pEntry = pBench->slots[j];
+            if (pEntry && pEntry->clientId == clientId) {
+                pEntry->generation++;
+            }
+        }
+        pthread_mutex_unlock(pBench->pMutex);
+    }
+
+    return NULL;
+}
+
+static double RunLinear(DWORD idCount, DWORD threadCount, DWORD totalOps)
+{
+    LINEAR_BENCH bench[BENCH_THREADS_MAX];
+    pthread_t threads[BENCH_THREADS_MAX];
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    BENCH_ENTRY *entries;
+    BENCH_ENTRY **slots;
+    double start, elapsed;
+    DWORD i;
+
+    entries = (BENCH_ENTRY*)calloc(idCount, sizeof(BENCH_ENTRY));
+    slots = (BENCH_ENTRY**)calloc(idCount, sizeof(BENCH_ENTRY*));
+    if (!entries || !slots) {
+        fprintf(stderr, "[ERROR] Out of memory\n");
+        exit(1);
+    }
+
+    for (i = 0; i < idCount; i++) {
+        entries[i].clientId = BENCH_ID_BASE + i;
+        slots[i] = &entries[i];
+    }
+
+    for (i = 0; i < threadCount; i++) {
+        bench[i].pMutex = &mutex;
+        bench[i].slots = slots;
+        bench[i].slotCount = idCount;
+        bench[i].idCount = idCount;
+        bench[i].opsPerThread = totalOps / threadCount;
+        bench[i].seed = 0x9E3779B9U ^ (i * 0x85EBCA6BU) ^ 1;
+    }
+
+    start = NowSeconds();
+    for (i = 0; i < threadCount; i++)
+        pthread_create(&threads[i], NULL, LinearWorker, &bench[i]);
+    for (i = 0; i < threadCount; i++)
+        pthread_join(threads[i], NULL);
+    elapsed = NowSeconds() - start;
+
+    free(slots);
+    free(entries);
+
+    return (double)(bench[0].opsPerThread * threadCount) / elapsed;
+}
+
+static void BenchRegistry(void)
+{
+    static const DWORD idCounts[] = { 1000, 10000, 100000 };
+    DWORD threadCount = BenchThreadCount();
+    DWORD i;
+
+    printf("registry: re-registration of an existing ID (lookup + evict + insert)\n");
+    printf("  %8s  %7s  %16s  %16s\n", "ids", "threads", "hash reg/s", "linear reg/s");
+
+    for (i = 0; i < sizeof(idCounts) / sizeof(idCounts[0]); i++) {
+        DWORD ids = idCounts[i];
+        /* The scan is O(n); bound its work so the run stays short */
+        DWORD linearOps = 200000000U / ids;
+        double hashRate = RunRegistry(ids, threadCount, 2000000);
+        double linearRate = RunLinear(ids, threadCount, linearOps < 2000000 ? linearOps : 2000000);
+
+        printf("  %8u  %7u  %16.0f  %16.0f\n", ids, threadCount, hashRate, linearRate);
+    }
+    printf("\n");
+}
+
+/* ============================================================
+ * SCENARIO: splice
+ * ============================================================ */
+
+#define LOOPBACK_PORT           47311
+#define LOOPBACK_BYTES          (2048ULL * 1024 * 1024)
+#define LOOPBACK_PAYLOAD        (RELAY_BUFFER_SIZE - sizeof(RELAY_HEADER))
+#define LOOPBACK_WARMUP         (64ULL * 1024 * 1024)   /* Before steady state */
+#define LOOPBACK_PING_BYTES     (16 * RELAY_BUFFER_SIZE) /* DATA bytes per PING */
+
+/* One session's traffic */
+typedef struct _LOOPBACK_RUN {
+    SOCKET              sender;
+    DWORD               payload;        /* DATA payload bytes per frame */
+    unsigned long long  bytes;          /* Frame bytes to relay */
+} LOOPBACK_RUN;
+
+static BOOL SendAll(SOCKET sock, const BYTE *data, DWORD length)
+{
+    while (length > 0) {
+        ssize_t sent = send(sock, data, length, MSG_NOSIGNAL);
+        if (sent <= 0) {
+            if (sent < 0 && errno == EINTR) continue;
+            return FALSE;
+        }
+        data += sent;
+        length -= (DWORD)sent;
+    }
+    return TRUE;
+}
+
+static BOOL RecvAll(SOCKET sock, BYTE *data, DWORD length)
+{
+    while (length > 0) {
+        ssize_t got = recv(sock, data, length, 0);
+        if (got <= 0) {
+            if (got < 0 && errno == EINTR) continue;
+            return FALSE;
+        }
+        data += got;
+        length -= (DWORD)got;
+    }
+    return TRUE;
+}
+
+/* Skip incoming control messages until one of expectType arrives */
+static BOOL WaitForMessage(SOCKET sock, BYTE expectType)
+{
+    BYTE reply[64];
+    RELAY_HEADER header;
+
+    for (;;) {
+        if (!RecvAll(sock, (BYTE*)&header, sizeof(header))) return FALSE;
+        if (header.dataLength > sizeof(reply)) return FALSE;
+        if (!RecvAll(sock, reply, header.dataLength)) return FALSE;
+        if (header.msgType == expectType) return TRUE;
+    }
+}
+
+/* Send an unencrypted control message and wait for its reply */
+static BOOL ControlRequest(SOCKET sock, BYTE msgType, DWORD value, BYTE expectType)
+{
+    BYTE frame[sizeof(RELAY_HEADER) + 8];
+    RELAY_HEADER header;
+
+    header.msgType = msgType;
+    header.flags = 0;
+    header.reserved = 0;
+    header.dataLength = 8;
+    memcpy(frame, &header, sizeof(header));
+    memcpy(frame + sizeof(header), &value, 4);
+    ZeroMemory(frame + sizeof(header) + 4, 4);
+    if (!SendAll(sock, frame, sizeof(frame))) return FALSE;
+
+    return WaitForMessage(sock, expectType);
+}
+
+static SOCKET ConnectLoopback(void)
+{
+    struct sockaddr_in addr;
+    SOCKET sock;
+    int opt = 1;
+
+    sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock == INVALID_SOCKET) return INVALID_SOCKET;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+
+    ZeroMemory(&addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(LOOPBACK_PORT);
+    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(sock);
+        return INVALID_SOCKET;
+    }
+    return sock;
+}
+
+static void* LoopbackSender(void *arg)
+{
+    LOOPBACK_RUN *pRun = (LOOPBACK_RUN*)arg;
+    DWORD frameSize = sizeof(RELAY_HEADER) + pRun->payload;
+    RELAY_HEADER header;
+    RELAY_HEADER ping;
+    BYTE *frame;
+    unsigned long long sent;
+    unsigned long long pingAt = LOOPBACK_PING_BYTES;
+
+    frame = (BYTE*)malloc(frameSize);
+    if (!frame) return NULL;
+
+    header.msgType = RELAY_MSG_DATA;
+    header.flags = 0x01;
+    header.reserved = 0;
+    header.dataLength = pRun->payload;
+    memcpy(frame, &header, sizeof(header));
+    memset(frame + sizeof(header), 0x5A, pRun->payload);
+
+    /* Interleave keep-alives so the control path runs too; the PONGs are
+     * left unread in the socket buffer */
+    ping.msgType = RELAY_MSG_PING;
+    ping.flags = 0;
+    ping.reserved = 0;
+    ping.dataLength = 0;
+
+    for (sent = 0; sent < pRun->bytes; sent += frameSize) {
+        if (!SendAll(pRun->sender, frame, frameSize)) break;
+        if (sent + frameSize >= pingAt) {
+            if (!SendAll(pRun->sender, (const BYTE*)&ping, sizeof(ping))) break;
+            pingAt += LOOPBACK_PING_BYTES;
+        }
+    }
+
+    free(frame);
+    return NULL;
+}
+
+/* Relay bytes worth of frames with the given payload from one client to
+ * the other. Returns Gbit/s of relayed frames, or 0 on failure. If pSteady
+ * is given it receives the pool counter deltas after the warm-up */
+static double RunLoopback(const RELAY_CONFIG *pConfig, DWORD payload,
+                          unsigned long long bytes, POOL_STATS *pSteady)
+{
+    POOL_STATS before, after;
+    RELAY_CONFIG config = *pConfig;
+    RELAY_SERVER *pServer;
+    LOOPBACK_RUN run;
+    SOCKET sender, receiver;
+    pthread_t thread;
+    BYTE *sink;
+    unsigned long long received = 0;
+    double start, elapsed;
+
+    config.shardCount = 1;
+
+    pServer = Relay_CreateEx(LOOPBACK_PORT, "127.0.0.1", &config);
+    if (!pServer || Relay_Start(pServer) != RD2K_SUCCESS) {
+        fprintf(stderr, "[ERROR] Cannot start relay on port %d\n", LOOPBACK_PORT);
+        Relay_Destroy(pServer);
+        return 0;
+    }
+
+    sender = ConnectLoopback();
+    receiver = ConnectLoopback();
+    sink = (BYTE*)malloc(1024 * 1024);
+
+    if (sender == INVALID_SOCKET || receiver == INVALID_SOCKET || !sink ||
+        !ControlRequest(receiver, RELAY_MSG_REGISTER, 0x0A000001, RELAY_MSG_REGISTER_RESPONSE) ||
+        !ControlRequest(sender, RELAY_MSG_REGISTER, 0x0A000002, RELAY_MSG_REGISTER_RESPONSE) ||
+        !ControlRequest(sender, RELAY_MSG_CONNECT_REQUEST, 0x0A000001, RELAY_MSG_CONNECT_RESPONSE) ||
+        !WaitForMessage(receiver, RELAY_MSG_PARTNER_CONNECTED)) {
+        fprintf(stderr, "[ERROR] Loopback session setup failed\n");
+        received = 0;
+        elapsed = 1;
+    } else {
+        BOOL bWarm = FALSE;
+
+        run.sender = sender;
+        run.payload = payload;
+        run.bytes = bytes;
+        start = NowSeconds();
+        pthread_create(&thread, NULL, LoopbackSender, &run);
+        while (received < bytes) {
+            ssize_t got = recv(receiver, sink, 1024 * 1024, 0);
+            if (got <= 0) break;
+            received += (unsigned long long)got;
+            if (!bWarm && received >= LOOPBACK_WARMUP) {
+                Pool_GetStats(&before);
+                bWarm = TRUE;
+            }
+        }
+        Pool_GetStats(&after);
+        elapsed = NowSeconds() - start;
+        pthread_join(thread, NULL);
+
+        if (pSteady && bWarm) {
+            pSteady->allocations = after.allocations - before.allocations;
+            pSteady->frees = after.frees - before.frees;
+            pSteady->heapAllocations = after.heapAllocations - before.heapAllocations;
+            pSteady->bytesReserved = after.bytesReserved - before.bytesReserved;
+        }
+    }
+
+    if (sender != INVALID_SOCKET) close(sender);
+    if (receiver != INVALID_SOCKET) close(receiver);
+    free(sink);
+    Relay_Destroy(pServer);
+
+    return (double)received * 8.0 / elapsed / 1e9;
+}
+
+static void BenchSplice(void)
+{
+    RELAY_CONFIG config;
+    double copyRate, spliceRate;
+
+    printf("splice: one paired session through a 1-shard relay on loopback\n");
+    printf("  (%u-byte DATA frames, %llu MB, sender/receiver share this machine)\n",
+           (unsigned)LOOPBACK_PAYLOAD, LOOPBACK_BYTES / (1024 * 1024));
+
+    Relay_InitConfig(&config);
+    copyRate = RunLoopback(&config, LOOPBACK_PAYLOAD, LOOPBACK_BYTES, NULL);
+    config.bSplice = TRUE;
+    spliceRate = RunLoopback(&config, LOOPBACK_PAYLOAD, LOOPBACK_BYTES, NULL);
+
+    printf("  %10s  %10.2f Gbit/s\n", "copy", copyRate);
+    printf("  %10s  %10.2f Gbit/s\n", "splice", spliceRate);
+    printf("\n");
+}
+
+/* ============================================================
+ * SCENARIO: forward
+ * ============================================================ */
+
+/* Frame bytes relayed per payload size and path */
+#define FORWARD_BYTES           (256ULL * 1024 * 1024)
+
+static void BenchForward(void)
+{
+    static const DWORD payloadSizes[] = { 256, 4096, 16384, LOOPBACK_PAYLOAD };
+    RELAY_CONFIG config;
+    DWORD i;
+
+    Crypto_Init(NULL);
+
+    printf("forward: one paired session through a 1-shard relay on loopback\n");
+    printf("  (%llu MB per run, sender/receiver share this machine)\n",
+           FORWARD_BYTES / (1024 * 1024));
+    printf("  %8s  %18s  %18s  %8s\n", "payload", "re-encrypt Gbit/s", "opaque Gbit/s", "speedup");
+
+    Relay_InitConfig(&config);
+    for (i = 0; i < sizeof(payloadSizes) / sizeof(payloadSizes[0]); i++) {
+        double oldRate, newRate;
+
+        config.bReencrypt = TRUE;
+        oldRate = RunLoopback(&config, payloadSizes[i], FORWARD_BYTES, NULL);
+        config.bReencrypt = FALSE;
+        newRate = RunLoopback(&config, payloadSizes[i], FORWARD_BYTES, NULL);
+
+        printf("  %8u  %18.2f  %18.2f  %7.1fx\n", payloadSizes[i], oldRate, newRate,
+               oldRate > 0 ? newRate / oldRate : 0.0);
+    }
+    printf("\n");
+}
+
+/* ============================================================
+ * SCENARIO: pool
+ * ============================================================ */
+
+static void BenchPool(void)
+{
+    POOL_STATS steady, total;
+    RELAY_CONFIG config;
+    unsigned long long frames = (LOOPBACK_BYTES - LOOPBACK_WARMUP) / RELAY_BUFFER_SIZE;
+    DWORD i;
+
+    printf("pool: allocations while forwarding %llu DATA frames (+1 PING per %d)\n",
+           frames, LOOPBACK_PING_BYTES / RELAY_BUFFER_SIZE);
+    printf("  %10s  %12s  %12s  %14s\n", "mode", "pool allocs", "heap allocs", "allocs/frame");
+
+    for (i = 0; i < 2; i++) {
+        ZeroMemory(&steady, sizeof(steady));
+        Relay_InitConfig(&config);
+        config.bSplice = (i == 1);
+        RunLoopback(&config, LOOPBACK_PAYLOAD, LOOPBACK_BYTES, &steady);
+        printf("  %10s  %12llu  %12llu  %14.4f\n", i ? "splice" : "copy",
+               steady.allocations, steady.heapAllocations,
+               (double)steady.allocations / (double)frames);
+    }
+
+    Pool_GetStats(&total);
+    printf("  whole run: %llu allocations, %llu heap allocations, %llu KB reserved\n",
+           total.allocations, total.heapAllocations, total.bytesReserved / 1024);
+    printf("\n");
+}
+
+/* ============================================================
+ * SCENARIO: uring
+ * ============================================================ */
+
+#define SMALL_PAIRS             8
+#define SMALL_PAYLOAD           64
+#define SMALL_FRAMES            50000                   /* Per pair */
+#define SMALL_FRAME_SIZE        (sizeof(RELAY_HEADER) + SMALL_PAYLOAD)
+
+static void* SmallFrameSender(void *arg)
+{
+    SOCKET sock = *(SOCKET*)arg;
+    BYTE frame[SMALL_FRAME_SIZE];
+    RELAY_HEADER header;
+    DWORD i;
+
+    header.msgType = RELAY_MSG_DATA;
+    header.flags = 0x01;
+    header.reserved = 0;
+    header.dataLength = SMALL_PAYLOAD;
+    memcpy(frame, &header, sizeof(header));
+    memset(frame + sizeof(header), 0x5A, SMALL_PAYLOAD);
+
+    /* One send() per frame, the way input events leave a client */
+    for (i = 0; i < SMALL_FRAMES; i++) {
+        if (!SendAll(sock, frame, sizeof(frame))) break;
+    }
+    return NULL;
+}
+
+static void* SmallFrameReceiver(void *arg)
+{
+    SOCKET sock = *(SOCKET*)arg;
+    unsigned long long expected = (unsigned long long)SMALL_FRAMES * SMALL_FRAME_SIZE;
+    unsigned long long received = 0;
+    BYTE sink[64 * 1024];
+
+    while (received < expected) {
+        ssize_t got = recv(sock, sink, sizeof(sink), 0);
+        if (got <= 0) break;
+        received += (unsigned long long)got;
+    }
+    return NULL;
+}
+
+/* Returns relayed DATA frames per second, or 0 on failure */
+static double RunSmallFrames(DWORD backend)
+{
+    SOCKET senders[SMALL_PAIRS], receivers[SMALL_PAIRS];
+    pthread_t sendThreads[SMALL_PAIRS], recvThreads[SMALL_PAIRS];
+    RELAY_CONFIG config;
+    RELAY_SERVER *pServer;
+    BOOL bReady = TRUE;
+    double start, elapsed;
+    DWORD i;
+
+    Relay_InitConfig(&config);
+    config.shardCount = 1;
+    config.backend = backend;
+
+    pServer = Relay_CreateEx(LOOPBACK_PORT, "127.0.0.1", &config);
+    if (!pServer || Relay_Start(pServer) != RD2K_SUCCESS) {
+        fprintf(stderr, "[ERROR] Cannot start relay on port %d\n", LOOPBACK_PORT);
+        Relay_Destroy(pServer);
+        return 0;
+    }
+
+    for (i = 0; i < SMALL_PAIRS; i++) {
+        DWORD viewerId = BENCH_ID_BASE + 0x100 + i * 2;
+
+        senders[i] = ConnectLoopback();
+        receivers[i] = ConnectLoopback();
+        if (bReady && (senders[i] == INVALID_SOCKET || receivers[i] == INVALID_SOCKET ||
+            !ControlRequest(receivers[i], RELAY_MSG_REGISTER, viewerId, RELAY_MSG_REGISTER_RESPONSE) ||
+            !ControlRequest(senders[i], RELAY_MSG_REGISTER, viewerId + 1, RELAY_MSG_REGISTER_RESPONSE) ||
+            !ControlRequest(senders[i], RELAY_MSG_CONNECT_REQUEST, viewerId, RELAY_MSG_CONNECT_RESPONSE) ||
+            !WaitForMessage(receivers[i], RELAY_MSG_PARTNER_CONNECTED))) {
+            bReady = FALSE;
+        }
+    }
+
+    if (!bReady) {
+        fprintf(stderr, "[ERROR] Small-frame session setup failed\n");
+        elapsed = 0;
+    } else {
+        start = NowSeconds();
+        for (i = 0; i < SMALL_PAIRS; i++) {
+            pthread_create(&recvThreads[i], NULL, SmallFrameReceiver, &receivers[i]);
+            pthread_create(&sendThreads[i], NULL, SmallFrameSender, &senders[i]);
+        }
+        for (i = 0; i < SMALL_PAIRS; i++) {
+            pthread_join(recvThreads[i], NULL);
+            pthread_join(sendThreads[i], NULL);
+        }
+        elapsed = NowSeconds() - start;
+    }
+
+    for (i = 0; i < SMALL_PAIRS; i++) {
+        if (senders[i] != INVALID_SOCKET) close(senders[i]);
+        if (receivers[i] != INVALID_SOCKET) close(receivers[i]);
+    }
+    Relay_Destroy(pServer);
+
+    if (elapsed <= 0) return 0;
+    return (double)SMALL_PAIRS * SMALL_FRAMES / elapsed;
+}
+
+static void BenchUring(void)
+{
+    double epollRate, uringRate;
+
+    printf("uring: %d paired sessions through a 1-shard relay on loopback\n", SMALL_PAIRS);
+    printf("  (%d-byte DATA frames, %d per session, one send() per frame)\n",
+           SMALL_PAYLOAD, SMALL_FRAMES);
+
+    if (!Uring_IsSupported()) {
+        printf("  io_uring is not available on this kernel - skipped\n\n");
+        return;
+    }
+
+    epollRate = RunSmallFrames(RELAY_BACKEND_EPOLL);
+    uringRate = RunSmallFrames(RELAY_BACKEND_URING);
+
+    printf("  %10s  %14.0f frames/s\n", "epoll", epollRate);
+    printf("  %10s  %14.0f frames/s\n", "io_uring", uringRate);
+    if (epollRate > 0) printf("  %10s  %14.2fx\n", "speedup", uringRate / epollRate);
+    printf("\n");
+}
+
+/* ============================================================
+ * SCENARIO: timers
+ * ============================================================ */
+
+#define TIMERS_CONNECTIONS      100000
+#define TIMERS_SECONDS          60                      /* Simulated */
+#define TIMERS_PASS_MS          100                     /* Event loop wakeup */
+#define TIMERS_SWEEP_MS         1000                    /* Old sweep period */
+#define TIMERS_TIMEOUT_MS       5000
+#define TIMERS_PING_MS          2000                    /* Client keep-alive */
+
+typedef struct _TIMERS_CONN {
+    DWORD               lastActivity;
+    RELAY_TIMER         timer;
+    struct _TIMERS_CONN* pNext;
+} TIMERS_CONN;
+
+/* Keep-alives due this pass; both variants pay for these */
+static void TimersPing(TIMERS_CONN *conns, DWORD pass, DWORD now)
+{
+    DWORD groups = TIMERS_PING_MS / TIMERS_PASS_MS;
+    DWORD i;
+
+    for (i = pass % groups; i < TIMERS_CONNECTIONS; i += groups)
+        conns[i].lastActivity = now;
+}
+
+/* Returns seconds spent; *pExpired counts timeouts (should stay 0) */
+static double RunTimers(TIMERS_CONN *conns, TIMERS_CONN *pList, BOOL bWheel, DWORD *pExpired)
+{
+    RELAY_TIMER_WHEEL wheel;
+    DWORD passes = TIMERS_SECONDS * 1000 / TIMERS_PASS_MS;
+    DWORD now = 0;
+    DWORD pass, i;
+    double start;
+
+    *pExpired = 0;
+    Timer_InitWheel(&wheel, now);
+    for (i = 0; i < TIMERS_CONNECTIONS; i++) {
+        conns[i].lastActivity = now;
+        ZeroMemory(&conns[i].timer, sizeof(RELAY_TIMER));
+        if (bWheel) Timer_Schedule(&wheel, &conns[i].timer, now + TIMERS_TIMEOUT_MS + 1);
+    }
+
+    start = NowSeconds();
+    for (pass = 1; pass <= passes; pass++) {
+        now += TIMERS_PASS_MS;
+        TimersPing(conns, pass, now);
+
+        if (bWheel) {
+            RELAY_TIMER *pTimer = Timer_Advance(&wheel, now);
+
+            while (pTimer) {
+                RELAY_TIMER *pNext = pTimer->pNext;
+                TIMERS_CONN *pConn = (TIMERS_CONN*)((BYTE*)pTimer - offsetof(TIMERS_CONN, timer));
+
+                if (now - pConn->lastActivity > TIMERS_TIMEOUT_MS)
+                    (*pExpired)++;
+                else
+                    Timer_Schedule(&wheel, pTimer, pConn->lastActivity + TIMERS_TIMEOUT_MS + 1);
+                pTimer = pNext;
+            }
+        } else if (now % TIMERS_SWEEP_MS == 0) {
+            TIMERS_CONN *pConn;
+
+            for (pConn = pList; pConn; pConn = pConn->pNext) {
+                if (now - pConn->lastActivity > TIMERS_TIMEOUT_MS)
+                    (*pExpired)++;
+            }
+        }
+    }
+    return NowSeconds() - start;
+}
+
+static void BenchTimers(void)
+{
+    TIMERS_CONN *conns;
+    TIMERS_CONN *pList = NULL;
+    DWORD order[TIMERS_CONNECTIONS];
+    DWORD state = 0x9E3779B9;
+    DWORD sweepExpired, wheelExpired;
+    double sweepTime, wheelTime;
+    DWORD i;
+
+    conns = (TIMERS_CONN*)calloc(TIMERS_CONNECTIONS, sizeof(TIMERS_CONN));
+    if (!conns) return;
+
+    /* The shard's connection list is in accept order, not memory order */
+    for (i = 0; i < TIMERS_CONNECTIONS; i++) order[i] = i;
+    for (i = TIMERS_CONNECTIONS - 1; i > 0; i--) {
+        DWORD j = NextRandom(&state) % (i + 1);
+        DWORD t = order[i];
+        order[i] = order[j];
+        order[j] = t;
+    }
+    for (i = 0; i < TIMERS_CONNECTIONS; i++) {
+        conns[order[i]].pNext = pList;
+        pList = &conns[order[i]];
+    }
+
+    printf("timers: %d idle clients (PING every %d ms, %d ms timeout), %d s simulated\n",
+           TIMERS_CONNECTIONS, TIMERS_PING_MS, TIMERS_TIMEOUT_MS, TIMERS_SECONDS);
+
+    sweepTime = RunTimers(conns, pList, FALSE, &sweepExpired);
+    wheelTime = RunTimers(conns, pList, TRUE, &wheelExpired);
+
+    printf("  %10s  %10.2f ms  %8.1f ns/client/s  %u timeouts\n", "sweep", sweepTime * 1e3,
+           sweepTime * 1e9 / TIMERS_CONNECTIONS / TIMERS_SECONDS, sweepExpired);
+    printf("  %10s  %10.2f ms  %8.1f ns/client/s  %u timeouts\n", "wheel", wheelTime * 1e3,
+           wheelTime * 1e9 / TIMERS_CONNECTIONS / TIMERS_SECONDS, wheelExpired);
+    printf("  (both include the keep-alive stamps)\n");
+    printf("\n");
+
+    free(conns);
+}
+
+/* ============================================================
+ * SCENARIO: logging
+ * ============================================================ */
+
+#define LOGGING_MESSAGES        100000  /* Per thread */
+
+static FILE *g_logSinkFile = NULL;
+static pthread_mutex_t g_logSinkMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* What relay_main.c does per message, minus the colours */
+static void BenchLogSink(const char *message, unsigned long long timeUs)
+{
+    if (strstr(message, "[ERROR]") || strstr(message, "[WARN]") || strstr(message, "[INFO]"))
+        timeUs++;
+    fprintf(g_logSinkFile, "[%llu] %s", timeUs, message);
+}
+
+static void BenchLogFlush(void)
+{
+    fflush(g_logSinkFile);
+}
+
+/* Connection churn: one formatted line per message, as RelayLog emits them */
+static void* LoggingWorker(void *arg)
+{
+    BOOL bAsync = *(BOOL*)arg;
+    char line[128];
+    DWORD i;
+
+    for (i = 0; i < LOGGING_MESSAGES; i++) {
+        snprintf(line, sizeof(line), "[DISCONNECT] Client %03u %03u %03u %03u connection closed\n",
+                 10, (i >> 16) & 0xFF, (i >> 8) & 0xFF, i & 0xFF);
+        if (bAsync) {
+            Log_Write(line);
+        } else {
+            pthread_mutex_lock(&g_logSinkMutex);
+            BenchLogSink(line, (unsigned long long)i);
+            BenchLogFlush();
+            pthread_mutex_unlock(&g_logSinkMutex);
+        }
+    }
+    return NULL;
+}
+
+/* Returns seconds until every emitting thread is done */
+static double RunLogging(BOOL bAsync, DWORD threadCount)
+{
+    pthread_t threads[BENCH_THREADS_MAX];
+    double start, elapsed;
+    DWORD i;
+
+    start = NowSeconds();
+    for (i = 0; i < threadCount; i++)
+        pthread_create(&threads[i], NULL, LoggingWorker, &bAsync);
+    for (i = 0; i < threadCount; i++)
+        pthread_join(threads[i], NULL);
+    elapsed = NowSeconds() - start;
+
+    return elapsed;
+}
+
+static void BenchLogging(void)
+{
+    DWORD threadCount = BenchThreadCount() + 1;
+    LOG_STATS stats;
+    double syncTime, asyncTime, drainTime;
+    double messages;
+
+    if (threadCount > BENCH_THREADS_MAX) threadCount = BENCH_THREADS_MAX;
+    messages = (double)threadCount * LOGGING_MESSAGES;
+
+    g_logSinkFile = fopen("/dev/null", "w");
+    if (!g_logSinkFile) return;
+
+    printf("logging: %u threads x %d messages to /dev/null\n", threadCount, LOGGING_MESSAGES);
+
+    syncTime = RunLogging(FALSE, threadCount);
+
+    if (Log_Start(BenchLogSink, BenchLogFlush) != RD2K_SUCCESS) {
+        fclose(g_logSinkFile);
+        return;
+    }
+    asyncTime = RunLogging(TRUE, threadCount);
+    drainTime = NowSeconds();
+    Log_Stop();
+    drainTime = NowSeconds() - drainTime;
+    Log_GetStats(&stats);
+
+    printf("  %10s  %10.1f ns/message on the emitting threads\n", "locked", syncTime * 1e9 / messages);
+    printf("  %10s  %10.1f ns/message on the emitting threads, %.2f ms to drain after\n",
+           "ring", asyncTime * 1e9 / messages, drainTime * 1e3);
+    printf("  ring: %llu written in %llu batches, %llu dropped (ring full)\n",
+           stats.records, stats.batches, stats.dropped);
+    printf("\n");
+
+    fclose(g_logSinkFile);
+    g_logSinkFile = NULL;
+}
+
+/* ============================================================
+ * SCENARIO: rings
+ * ============================================================ */
+
+#define RINGS_SIZE              4096    /* Smallest ring: wraps every few dozen records */
+#define RINGS_THREADS           4
+#define RINGS_RECORDS           200000  /* Per thread */
+#define RINGS_PATTERN_MAX       72      /* Record sizes 16 to 96 after padding */
+#define RINGS_AHEAD             32      /* Records a producer may be ahead: less than a ring */
+#define RINGS_STALL_SECONDS     2.0     /* No progress for this long fails the check */
+
+typedef struct _RINGS_CHECK {
+    RELAY_RINGS*        pRings;
+    DWORD               next[RINGS_THREADS];    /* Written by the writer, atomic */
+    unsigned long long  received;               /* Written by the writer, atomic */
+    unsigned long long  errors;                 /* Written by the writer, atomic */
+} RINGS_CHECK;
+
+typedef struct _RINGS_PRODUCER {
+    RINGS_CHECK*        pCheck;
+    DWORD               thread;
+} RINGS_PRODUCER;
+
+static DWORD RingsPatternLength(DWORD seq)
+{
+    return (seq * 7) % RINGS_PATTERN_MAX;
+}
+
+static BYTE RingsPatternByte(DWORD thread, DWORD seq, DWORD i)
+{
+    return (BYTE)(thread * 31 + seq + i);
+}
+
+/* Records are (thread, seq) and then a pattern of a length set by seq.
+ * Producers never get a ring ahead, so none may be dropped */
+static void RingsConsume(void *pContext, unsigned long long timeUs, const BYTE *data, DWORD length)
+{
+    RINGS_CHECK *pCheck = (RINGS_CHECK*)pContext;
+    DWORD header[2];
+    DWORD i;
+
+    (void)timeUs;
+    __atomic_store_n(&pCheck->received, pCheck->received + 1, __ATOMIC_RELAXED);
+
+    if (length < sizeof(header)) {
+        __atomic_store_n(&pCheck->errors, pCheck->errors + 1, __ATOMIC_RELAXED);
+        return;
+    }
+    memcpy(header, data, sizeof(header));
+    if (header[0] >= RINGS_THREADS || header[1] < pCheck->next[header[0]] ||
+        length != sizeof(header) + RingsPatternLength(header[1])) {
+        __atomic_store_n(&pCheck->errors, pCheck->errors + 1, __ATOMIC_RELAXED);
+        return;
+    }
+    for (i = 0; i < RingsPatternLength(header[1]); i++) {
+        if (data[sizeof(header) + i] != RingsPatternByte(header[0], header[1], i)) {
+            __atomic_store_n(&pCheck->errors, pCheck->errors + 1, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+    __atomic_store_n(&pCheck->next[header[0]], header[1] + 1, __ATOMIC_RELEASE);
+}
+
+static void* RingsProducer(void *arg)
+{
+    RINGS_PRODUCER *pProducer = (RINGS_PRODUCER*)arg;
+    BYTE pattern[RINGS_PATTERN_MAX];
+    DWORD header[2];
+    DWORD seq, i;
+
+    header[0] = pProducer->thread;
+    for (seq = 0; seq < RINGS_RECORDS; seq++) {
+        /* After a bad record the sequence may stall: finish and report */
+        while (seq - __atomic_load_n(&pProducer->pCheck->next[pProducer->thread], __ATOMIC_ACQUIRE) >
+               RINGS_AHEAD && __atomic_load_n(&pProducer->pCheck->errors, __ATOMIC_RELAXED) == 0)
+            sched_yield();
+
+        header[1] = seq;
+        for (i = 0; i < RingsPatternLength(seq); i++)
+            pattern[i] = RingsPatternByte(pProducer->thread, seq, i);
+        Rings_Append(pProducer->pCheck->pRings, (unsigned long long)(NowSeconds() * 1e6),
+                     header, sizeof(header), pattern, RingsPatternLength(seq));
+    }
+    return NULL;
+}
+
+static void BenchRings(void)
+{
+    static RINGS_CHECK check;
+    RINGS_PRODUCER producers[RINGS_THREADS];
+    pthread_t threads[RINGS_THREADS];
+    RING_STATS stats;
+    unsigned long long total = (unsigned long long)RINGS_THREADS * RINGS_RECORDS;
+    unsigned long long received, errors, last = 0;
+    double elapsed, progress;
+    DWORD i;
+
+    ZeroMemory(&check, sizeof(check));
+    check.pRings = Rings_Create(RINGS_SIZE, 64, RingsConsume, NULL, &check);
+    if (!check.pRings || Rings_Start(check.pRings) != RD2K_SUCCESS) {
+        printf("rings: cannot start the writer\n\n");
+        Rings_Destroy(check.pRings);
+        g_exitCode = 1;
+        return;
+    }
+
+    printf("rings: %d threads x %d records through %d byte rings\n",
+           RINGS_THREADS, RINGS_RECORDS, RINGS_SIZE);
+
+    elapsed = NowSeconds();
+    for (i = 0; i < RINGS_THREADS; i++) {
+        producers[i].pCheck = &check;
+        producers[i].thread = i;
+        pthread_create(&threads[i], NULL, RingsProducer, &producers[i]);
+    }
+    for (i = 0; i < RINGS_THREADS; i++)
+        pthread_join(threads[i], NULL);
+
+    /* A writer misreading the ring may never drain it: leave it running
+     * rather than wait in Rings_Stop */
+    progress = NowSeconds();
+    for (;;) {
+        received = __atomic_load_n(&check.received, __ATOMIC_RELAXED);
+        errors = __atomic_load_n(&check.errors, __ATOMIC_RELAXED);
+        if (received >= total || errors > 0) break;
+        if (received != last) {
+            last = received;
+            progress = NowSeconds();
+        } else if (NowSeconds() - progress > RINGS_STALL_SECONDS) {
+            break;
+        }
+        usleep(10000);
+    }
+    if (received != total || errors > 0) {
+        printf("  %llu of %llu received, %llu bad\n  FAIL\n\n", received, total, errors);
+        exit(1);
+    }
+    Rings_Stop(check.pRings);
+    elapsed = NowSeconds() - elapsed;
+
+    Rings_GetStats(check.pRings, &stats);
+    Rings_Destroy(check.pRings);
+
+    printf("  %llu received, %llu dropped (ring full), %llu bad, %.1f ns/record\n",
+           check.received, stats.dropped, check.errors, elapsed * 1e9 / (double)total);
+    if (check.errors > 0 || stats.dropped > 0 || check.received != total) {
+        printf("  FAIL\n\n");
+        g_exitCode = 1;
+        return;
+    }
+    printf("  ok\n\n");
+}
+
+/* ============================================================
+ * MAIN
+ * ============================================================ */
+
+typedef struct _BENCH_SCENARIO {
+    const char*         name;
+    void                (*pfnRun)(void);
+} BENCH_SCENARIO;
+
+static const BENCH_SCENARIO g_scenarios[] = {
+    { "registry",   BenchRegistry },
+    { "forward",    BenchForward },
+    { "splice",     BenchSplice },
+    { "pool",       BenchPool },
+    { "uring",      BenchUring },
+    { "timers",     BenchTimers },
+    { "logging",    BenchLogging },
+    { "rings",      BenchRings },
+};
+
+#define BENCH_SCENARIO_COUNT (sizeof(g_scenarios) / sizeof(g_scenarios[0]))
+
+int main(int argc, char *argv[])
+{
+    DWORD i;
+    int arg;
+
+    if (argc < 2) {
+        for (i = 0; i < BENCH_SCENARIO_COUNT; i++)
+            g_scenarios[i].pfnRun();
+        return g_exitCode;
+    }
+
+    for (arg = 1; arg < argc; arg++) {
+        for (i = 0; i < BENCH_SCENARIO_COUNT; i++) {
+            if (strcmp(argv[arg], g_scenarios[i].name) == 0) {
+                g_scenarios[i].pfnRun();
+                break;
+            }
+        }
+        if (i == BENCH_SCENARIO_COUNT) {
+            fprintf(stderr, "Unknown scenario: %s\n", argv[arg]);
+            fprintf(stderr, "Scenarios:");
+            for (i = 0; i < BENCH_SCENARIO_COUNT; i++)
+                fprintf(stderr, " %s", g_scenarios[i].name);
+            fprintf(stderr, "\n");
+            return 1;
+        }
+    }
+
+    return g_exitCode;
+}
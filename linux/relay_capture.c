@@ -0,0 +1,215 @@
+/*
+ * relay_capture.c - Traffic Capture for RemoteDesk2K Linux Relay
+ *
+ * A ring set (relay_ring.c), as for the log: each ring record is a
+ * CAPTURE_RECORD and its payload, which the writer thread copies to the
+ * file as they are. Records carry CLOCK_MONOTONIC time since the capture
+ * began, which also orders the merge.
+ */
+
+#include "relay_capture.h"
+#include "relay_ring.h"
+
+#define CAPTURE_BATCH_MAX       1024        /* Records between idle checks */
+#define CAPTURE_FILE_BUFFER     (1024 * 1024)
+
+struct _RELAY_CAPTURE {
+    FILE*               file;
+    BYTE*               fileBuffer;
+    BOOL                bPayloads;
+    unsigned long long  startUs;            /* CLOCK_MONOTONIC, record times count from here */
+    DWORD               nextConn;           /* Atomic */
+    RELAY_RINGS*        pRings;
+    BOOL                bStopped;           /* Writer joined, file closed */
+    BOOL                bFailed;            /* Atomic */
+    unsigned long long  records;            /* Writer only, read atomically */
+    unsigned long long  bytes;
+};
+
+/* ============================================================
+ * HELPERS
+ * ============================================================ */
+
+static unsigned long long MonotonicUs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000 + (unsigned long long)ts.tv_nsec / 1000;
+}
+
+/* Append a record and its payload to the calling thread's ring */
+static void AddRecord(RELAY_CAPTURE *pCapture, CAPTURE_RECORD *pRecord, const BYTE *payload)
+{
+    pRecord->timeUs = MonotonicUs() - pCapture->startUs;
+    Rings_Append(pCapture->pRings, pRecord->timeUs, pRecord, sizeof(CAPTURE_RECORD),
+                 payload, pRecord->payloadLength);
+}
+
+/* Writer thread: one record to the file */
+static void WriteRecord(void *pContext, unsigned long long timeUs, const BYTE *data, DWORD length)
+{
+    RELAY_CAPTURE *pCapture = (RELAY_CAPTURE*)pContext;
+
+    (void)timeUs;
+
+    /* After a failed write, keep draining so producers see room */
+    if (__atomic_load_n(&pCapture->bFailed, __ATOMIC_RELAXED)) return;
+
+    if (fwrite(data, 1, length, pCapture->file) == length) {
+        __atomic_store_n(&pCapture->records, pCapture->records + 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&pCapture->bytes, pCapture->bytes + length, __ATOMIC_RELAXED);
+    } else {
+        __atomic_store_n(&pCapture->bFailed, TRUE, __ATOMIC_RELAXED);
+    }
+}
+
+/* Writer thread: idle, get what is buffered to the disk before napping */
+static void FlushFile(void *pContext, DWORD count)
+{
+    RELAY_CAPTURE *pCapture = (RELAY_CAPTURE*)pContext;
+
+    if (count == 0 && !__atomic_load_n(&pCapture->bFailed, __ATOMIC_RELAXED) &&
+        fflush(pCapture->file) != 0)
+        __atomic_store_n(&pCapture->bFailed, TRUE, __ATOMIC_RELAXED);
+}
+
+/* ============================================================
+ * PUBLIC API
+ * ============================================================ */
+
+/* Undo a Capture_Create that got as far as the file, keeping its errno */
+static RELAY_CAPTURE* FailCreate(RELAY_CAPTURE *pCapture)
+{
+    int error = errno;
+
+    Rings_Destroy(pCapture->pRings);
+    if (pCapture->file) fclose(pCapture->file);
+    free(pCapture->fileBuffer);
+    free(pCapture);
+    errno = error;
+    return NULL;
+}
+
+RELAY_CAPTURE* Capture_Create(const char *path, BOOL bPayloads)
+{
+    RELAY_CAPTURE *pCapture;
+    CAPTURE_FILE_HEADER header;
+    struct timespec now;
+
+    pCapture = (RELAY_CAPTURE*)calloc(1, sizeof(RELAY_CAPTURE));
+    if (!pCapture) return NULL;
+
+    pCapture->bPayloads = bPayloads;
+
+    pCapture->file = fopen(path, "wb");
+    pCapture->fileBuffer = (BYTE*)malloc(CAPTURE_FILE_BUFFER);
+    if (!pCapture->file || !pCapture->fileBuffer) return FailCreate(pCapture);
+    setvbuf(pCapture->file, (char*)pCapture->fileBuffer, _IOFBF, CAPTURE_FILE_BUFFER);
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    pCapture->startUs = MonotonicUs();
+
+    ZeroMemory(&header, sizeof(header));
+    header.magic = CAPTURE_MAGIC;
+    header.version = CAPTURE_VERSION;
+    header.flags = bPayloads ? CAPTURE_FILE_PAYLOADS : 0;
+    header.startTimeUs = (unsigned long long)now.tv_sec * 1000000 +
+                         (unsigned long long)now.tv_nsec / 1000;
+    header.payloadMax = bPayloads ? CAPTURE_PAYLOAD_MAX : 0;
+    if (fwrite(&header, sizeof(header), 1, pCapture->file) != 1 || fflush(pCapture->file) != 0)
+        return FailCreate(pCapture);
+
+    pCapture->pRings = Rings_Create(CAPTURE_RING_SIZE, CAPTURE_BATCH_MAX, WriteRecord, FlushFile,
+                                    pCapture);
+    if (!pCapture->pRings || Rings_Start(pCapture->pRings) != RD2K_SUCCESS)
+        return FailCreate(pCapture);
+
+    return pCapture;
+}
+
+void Capture_Stop(RELAY_CAPTURE *pCapture)
+{
+    if (!pCapture || pCapture->bStopped) return;
+
+    Rings_Stop(pCapture->pRings);
+
+    if (fclose(pCapture->file) != 0) __atomic_store_n(&pCapture->bFailed, TRUE, __ATOMIC_RELAXED);
+    pCapture->file = NULL;
+    pCapture->bStopped = TRUE;
+}
+
+void Capture_Destroy(RELAY_CAPTURE *pCapture)
+{
+    if (!pCapture) return;
+
+    Capture_Stop(pCapture);
+    Rings_Destroy(pCapture->pRings);
+    free(pCapture->fileBuffer);
+    free(pCapture);
+}
+
+DWORD Capture_Open(RELAY_CAPTURE *pCapture, DWORD addr)
+{
+    CAPTURE_RECORD record;
+
+    ZeroMemory(&record, sizeof(record));
+    record.conn = __atomic_add_fetch(&pCapture->nextConn, 1, __ATOMIC_RELAXED);
+    record.event = CAPTURE_EVENT_OPEN;
+    record.arg = addr;
+    AddRecord(pCapture, &record, NULL);
+    return record.conn;
+}
+
+void Capture_Frame(RELAY_CAPTURE *pCapture, DWORD conn, DWORD clientId,
+                   const BYTE *frame, DWORD available, DWORD frameLength)
+{
+    CAPTURE_RECORD record;
+    RELAY_HEADER header;
+    DWORD payloadLength = frameLength - sizeof(RELAY_HEADER);
+    DWORD kept = available - sizeof(RELAY_HEADER);
+
+    memcpy(&header, frame, sizeof(RELAY_HEADER));
+
+    /* Control frames always fit the receive buffer, so they are whole */
+    if (header.msgType == RELAY_MSG_DATA) {
+        if (!pCapture->bPayloads) kept = 0;
+        if (kept > CAPTURE_PAYLOAD_MAX) kept = CAPTURE_PAYLOAD_MAX;
+    }
+
+    ZeroMemory(&record, sizeof(record));
+    record.conn = conn;
+    record.clientId = clientId;
+    record.event = CAPTURE_EVENT_FRAME;
+    record.msgType = header.msgType;
+    if (header.msgType == RELAY_MSG_DATA && pCapture->bPayloads && kept < payloadLength)
+        record.flags = CAPTURE_RECORD_PARTIAL;
+    record.frameLength = frameLength;
+    record.arg = header.flags;
+    record.payloadLength = kept;
+    AddRecord(pCapture, &record, frame + sizeof(RELAY_HEADER));
+}
+
+void Capture_Close(RELAY_CAPTURE *pCapture, DWORD conn, DWORD clientId)
+{
+    CAPTURE_RECORD record;
+
+    ZeroMemory(&record, sizeof(record));
+    record.conn = conn;
+    record.clientId = clientId;
+    record.event = CAPTURE_EVENT_CLOSE;
+    AddRecord(pCapture, &record, NULL);
+}
+
+void Capture_GetStats(RELAY_CAPTURE *pCapture, CAPTURE_STATS *pStats)
+{
+    RING_STATS rings;
+
+    ZeroMemory(pStats, sizeof(CAPTURE_STATS));
+    if (!pCapture) return;
+
+    pStats->records = __atomic_load_n(&pCapture->records, __ATOMIC_RELAXED);
+    pStats->bytes = __atomic_load_n(&pCapture->bytes, __ATOMIC_RELAXED);
+    pStats->bFailed = __atomic_load_n(&pCapture->bFailed, __ATOMIC_RELAXED);
+    Rings_GetStats(pCapture->pRings, &rings);
+    pStats->dropped = rings.dropped;
+}
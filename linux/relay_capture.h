@@ -0,0 +1,96 @@
+/*
+ * relay_capture.h - Traffic Capture for RemoteDesk2K Linux Relay
+ *
+ * Records what clients send to the relay: when each connection opens and
+ * closes and every frame it sends, with microsecond timestamps, in a
+ * compact binary file that relay_replay turns back into traffic. Control
+ * frames are kept whole, since they are a few bytes and a replay needs
+ * them to register and pair; DATA payloads only on request, otherwise
+ * just their size.
+ *
+ * As with the log, each thread that captures appends to its own ring and
+ * a writer thread merges the rings into the file, so forwarding never
+ * waits on the disk. A full ring drops the record and counts it.
+ *
+ * File: a CAPTURE_FILE_HEADER, then CAPTURE_RECORDs, each followed by
+ * payloadLength bytes, all little-endian. Records are in time order,
+ * except that two from different shards microseconds apart may swap.
+ */
+
+#ifndef _RD2K_RELAY_CAPTURE_H_
+#define _RD2K_RELAY_CAPTURE_H_
+
+#include "common.h"
+
+#define CAPTURE_MAGIC           0x43324452  /* "RD2C" */
+#define CAPTURE_VERSION         1
+#define CAPTURE_RING_SIZE       (4 * 1024 * 1024)   /* Bytes per thread, power of two */
+#define CAPTURE_PAYLOAD_MAX     (64 * 1024)         /* Longer DATA payloads are cut */
+
+/* CAPTURE_RECORD events */
+#define CAPTURE_EVENT_OPEN      1   /* Accepted, arg = source IPv4 (network order) */
+#define CAPTURE_EVENT_FRAME     2   /* Received a frame, msgType and flags from its header */
+#define CAPTURE_EVENT_CLOSE     3   /* Closed, by either side */
+
+/* CAPTURE_FILE_HEADER flags */
+#define CAPTURE_FILE_PAYLOADS   0x0001      /* DATA payloads included */
+
+/* CAPTURE_RECORD flags */
+#define CAPTURE_RECORD_PARTIAL  0x0001      /* Fewer payload bytes than the frame had */
+
+typedef struct _RELAY_CAPTURE RELAY_CAPTURE;
+
+typedef struct _CAPTURE_FILE_HEADER {
+    DWORD               magic;
+    WORD                version;
+    WORD                flags;
+    unsigned long long  startTimeUs;        /* CLOCK_REALTIME when the capture began */
+    DWORD               payloadMax;         /* DATA payload bytes kept per frame */
+    DWORD               reserved;
+} CAPTURE_FILE_HEADER;
+
+typedef struct _CAPTURE_RECORD {
+    unsigned long long  timeUs;             /* Since startTimeUs */
+    DWORD               conn;               /* Connection number, from 1 */
+    DWORD               clientId;           /* Registered ID at the time, 0 = none yet */
+    BYTE                event;              /* CAPTURE_EVENT_* */
+    BYTE                msgType;            /* FRAME: header msgType */
+    WORD                flags;              /* CAPTURE_RECORD_* */
+    DWORD               frameLength;        /* FRAME: header + payload as sent */
+    DWORD               arg;                /* OPEN: source IPv4, FRAME: header flags */
+    DWORD               payloadLength;      /* Payload bytes that follow the record */
+} CAPTURE_RECORD;
+
+typedef struct _CAPTURE_STATS {
+    unsigned long long  records;            /* Written to the file */
+    unsigned long long  bytes;
+    unsigned long long  dropped;            /* Lost to a full ring */
+    BOOL                bFailed;            /* A write to the file failed, capture stopped */
+} CAPTURE_STATS;
+
+/* Create path (truncating it) and start the writer thread. bPayloads
+ * keeps DATA payloads. Returns NULL with errno set on failure */
+RELAY_CAPTURE* Capture_Create(const char *path, BOOL bPayloads);
+
+/* Write out everything queued and close the file, once nothing records
+ * any more (the relay is stopped). The stats stay readable */
+void Capture_Stop(RELAY_CAPTURE *pCapture);
+
+/* Stop if still running and free the capture */
+void Capture_Destroy(RELAY_CAPTURE *pCapture);
+
+/* Record a new connection from addr (network order). Returns its
+ * connection number for the calls below */
+DWORD Capture_Open(RELAY_CAPTURE *pCapture, DWORD addr);
+
+/* Record a frame from connection conn. frame holds its header and the
+ * first available bytes of its frameLength; spliced and cut-through
+ * frames are recorded when their header arrives, with what is there */
+void Capture_Frame(RELAY_CAPTURE *pCapture, DWORD conn, DWORD clientId,
+                   const BYTE *frame, DWORD available, DWORD frameLength);
+
+void Capture_Close(RELAY_CAPTURE *pCapture, DWORD conn, DWORD clientId);
+
+void Capture_GetStats(RELAY_CAPTURE *pCapture, CAPTURE_STATS *pStats);
+
+#endif /* _RD2K_RELAY_CAPTURE_H_ */
@@ -0,0 +1,1030 @@
+/*
+ * relay_cluster.c - Relay Cluster Membership for RemoteDesk2K Linux Relay
+ *
+ * Links are one-way streams of registry updates: a node only writes to
+ * the links it dialed (outbound) and only reads the links it accepted
+ * (inbound). Frames use the RELAY_HEADER layout, unencrypted:
+ *
+ *   HELLO     nodeId, advertised client address and port; first frame
+ *   ANNOUNCE  array of clientIds registered on the sender
+ *   WITHDRAW  array of clientIds no longer registered on the sender
+ *
+ * A new outbound link starts with HELLO and a snapshot of every local ID,
+ * then carries updates as they happen. When an inbound link goes away,
+ * everything it announced is dropped; the peer resends its snapshot when
+ * it reconnects. The same mechanism covers an update that could not be
+ * queued: the local ID set is kept by the shards themselves, so the thread
+ * drops its outbound links and each redial carries a correct snapshot. The remote registry maps clientId to the inbound link
+ * that announced it, and the link (with the node's client address) lives
+ * until its last entry has been removed under the stripe locks.
+ */
+
+#include "relay_cluster.h"
+#include "relay_registry.h"
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#define CLUSTER_MSG_HELLO       0x60
+#define CLUSTER_MSG_ANNOUNCE    0x61
+#define CLUSTER_MSG_WITHDRAW    0x62
+
+#define CLUSTER_MAX_EVENTS      64
+#define CLUSTER_POLL_MS         250     /* Redial check and stop flag interval */
+#define CLUSTER_RETRY_MS        1000    /* Wait before redialing a lost peer */
+#define CLUSTER_BATCH_IDS       1024    /* clientIds per ANNOUNCE/WITHDRAW frame */
+#define CLUSTER_RECV_SIZE       (64 * 1024)
+#define CLUSTER_MAX_BACKLOG     (16 * 1024 * 1024)  /* Unsent bytes before a link is dropped */
+
+/* Outbound link states */
+#define LINK_DOWN               0
+#define LINK_CONNECTING         1
+#define LINK_UP                 2
+
+#pragma pack(push, 1)
+
+typedef struct {
+    DWORD   nodeId;
+    DWORD   clientAddr;         /* Network order, 0 = use the link's source address */
+    WORD    clientPort;
+    WORD    reserved;
+} CLUSTER_HELLO;
+
+#pragma pack(pop)
+
+/* Registration change waiting for the cluster thread */
+typedef struct _CLUSTER_UPDATE {
+    DWORD               clientId;
+    BOOL                bAnnounce;
+} CLUSTER_UPDATE;
+
+typedef struct _CLUSTER_LINK {
+    SOCKET              socket;
+    BOOL                bOutbound;
+    DWORD               state;              /* Outbound: LINK_* */
+    DWORD               retryAt;            /* Outbound: next dial, GetTickCount() */
+    BOOL                bWarned;            /* Outbound: outage already logged */
+    BOOL                bBroken;            /* Outbound: output overflowed, close it */
+    BOOL                bClosed;            /* Inbound: waiting to be freed */
+    struct sockaddr_in  peerAddr;           /* Outbound: target; inbound: source */
+    char                name[32];           /* "host:port" for the logs */
+    /* Inbound: the node on the other end */
+    DWORD               nodeId;             /* 0 until HELLO */
+    struct sockaddr_in  clientAddr;         /* Its relay port, read under remote stripe locks */
+    BYTE*               sendBuffer;
+    DWORD               sendBufferSize;
+    DWORD               sendPos;
+    DWORD               sendLen;
+    BYTE*               recvBuffer;
+    DWORD               recvLen;
+    struct _CLUSTER_LINK* pNext;            /* Inbound list */
+} CLUSTER_LINK;
+
+struct _RELAY_CLUSTER {
+    DWORD               nodeId;
+    DWORD               clientAddr;         /* Network order, 0 = unspecified */
+    WORD                clientPort;
+    SOCKET              listenSocket;
+    int                 epollFd;
+    int                 wakeFd;             /* eventfd, signalled on queued updates */
+    pthread_t           thread;
+    BOOL                bThreadValid;
+    volatile int        bRunning;
+    void                (*pfnLog)(const char *message);
+    pthread_mutex_t     updateMutex;
+    CLUSTER_UPDATE*     updates;            /* Under updateMutex */
+    DWORD               updateCount;
+    DWORD               updateCapacity;
+    BOOL                bResync;            /* Under updateMutex: an update was lost */
+    RELAY_REGISTRY*     pLocal;             /* Announced IDs, kept by Cluster_Announce/Withdraw */
+    RELAY_REGISTRY*     pRemote;            /* clientId -> inbound CLUSTER_LINK */
+    CLUSTER_LINK        peers[CLUSTER_MAX_PEERS];
+    DWORD               peerCount;
+    CLUSTER_LINK*       pInbound;
+    DWORD               peersUp;            /* Atomic */
+    DWORD               nodesKnown;         /* Atomic */
+    unsigned long long  updatesSent;        /* Atomic */
+    unsigned long long  updatesReceived;    /* Atomic */
+    unsigned long long  linkFailures;       /* Atomic */
+};
+
+/* Collects clientIds into frames: a snapshot for one link, or a run of
+ * updates for every link that is up */
+typedef struct _CLUSTER_BATCH {
+    RELAY_CLUSTER*      pCluster;
+    CLUSTER_LINK*       pLink;              /* NULL = all outbound links that are up */
+    BYTE                msgType;
+    DWORD               count;
+    DWORD               ids[CLUSTER_BATCH_IDS];
+} CLUSTER_BATCH;
+
+#define CLUSTER_STAT_ADD(pCluster, field, n) \
+    __atomic_add_fetch(&(pCluster)->field, (n), __ATOMIC_RELAXED)
+
+/* ============================================================
+ * HELPERS
+ * ============================================================ */
+
+static void ClusterLog(RELAY_CLUSTER *pCluster, const char *format, ...)
+{
+    char buffer[512];
+    va_list args;
+
+    if (!pCluster->pfnLog) return;
+
+    va_start(args, format);
+    vsnprintf(buffer, sizeof(buffer), format, args);
+    va_end(args);
+
+    pCluster->pfnLog(buffer);
+}
+
+static void FormatAddress(const struct sockaddr_in *pAddr, char *buffer, size_t length)
+{
+    char host[INET_ADDRSTRLEN];
+
+    inet_ntop(AF_INET, &pAddr->sin_addr, host, sizeof(host));
+    snprintf(buffer, length, "%s:%u", host, ntohs(pAddr->sin_port));
+}
+
+/* "a.b.c.d:port" */
+static BOOL ParseAddress(const char *text, struct sockaddr_in *pAddr)
+{
+    char host[INET_ADDRSTRLEN];
+    const char *colon = strrchr(text, ':');
+    int port;
+
+    if (!colon || colon == text || (size_t)(colon - text) >= sizeof(host)) return FALSE;
+
+    memcpy(host, text, (size_t)(colon - text));
+    host[colon - text] = '\0';
+    port = atoi(colon + 1);
+    if (port <= 0 || port > 65535) return FALSE;
+
+    ZeroMemory(pAddr, sizeof(*pAddr));
+    pAddr->sin_family = AF_INET;
+    pAddr->sin_port = htons((WORD)port);
+    return inet_pton(AF_INET, host, &pAddr->sin_addr) == 1;
+}
+
+static void ConfigureLinkSocket(SOCKET sock)
+{
+    int opt = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+
+    /* A silent peer must not keep its IDs registered forever */
+    setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &opt, sizeof(opt));
+    opt = 10;
+    setsockopt(sock, IPPROTO_TCP, TCP_KEEPIDLE, &opt, sizeof(opt));
+    opt = 2;
+    setsockopt(sock, IPPROTO_TCP, TCP_KEEPINTVL, &opt, sizeof(opt));
+    opt = 3;
+    setsockopt(sock, IPPROTO_TCP, TCP_KEEPCNT, &opt, sizeof(opt));
+}
+
+static BOOL WatchLink(RELAY_CLUSTER *pCluster, CLUSTER_LINK *pLink)
+{
+    struct epoll_event ev;
+
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = pLink;
+    return epoll_ctl(pCluster->epollFd, EPOLL_CTL_ADD, pLink->socket, &ev) == 0;
+}
+
+/* ============================================================
+ * LINK OUTPUT
+ * ============================================================ */
+
+/* Write as much queued output as the socket takes. Returns -1 if the
+ * link is broken */
+static int FlushLink(CLUSTER_LINK *pLink)
+{
+    while (pLink->sendPos < pLink->sendLen) {
+        ssize_t sent = send(pLink->socket, pLink->sendBuffer + pLink->sendPos,
+                            pLink->sendLen - pLink->sendPos, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        pLink->sendPos += (DWORD)sent;
+    }
+
+    pLink->sendPos = 0;
+    pLink->sendLen = 0;
+    return 0;
+}
+
+/* Queue one frame. FALSE if the peer has fallen too far behind */
+static BOOL QueueLinkFrame(CLUSTER_LINK *pLink, BYTE msgType, const void *payload, DWORD length)
+{
+    RELAY_HEADER header;
+    DWORD needed = (DWORD)sizeof(header) + length;
+
+    if (pLink->sendLen - pLink->sendPos + needed > CLUSTER_MAX_BACKLOG) return FALSE;
+
+    if (pLink->sendPos > 0 && pLink->sendLen + needed > pLink->sendBufferSize) {
+        memmove(pLink->sendBuffer, pLink->sendBuffer + pLink->sendPos,
+                pLink->sendLen - pLink->sendPos);
+        pLink->sendLen -= pLink->sendPos;
+        pLink->sendPos = 0;
+    }
+
+    if (pLink->sendLen + needed > pLink->sendBufferSize) {
+        DWORD newSize = pLink->sendBufferSize ? pLink->sendBufferSize : CLUSTER_RECV_SIZE;
+        BYTE *newBuffer;
+
+        while (newSize < pLink->sendLen + needed) newSize *= 2;
+        newBuffer = (BYTE*)realloc(pLink->sendBuffer, newSize);
+        if (!newBuffer) return FALSE;
+        pLink->sendBuffer = newBuffer;
+        pLink->sendBufferSize = newSize;
+    }
+
+    header.msgType = msgType;
+    header.flags = 0;
+    header.reserved = 0;
+    header.dataLength = length;
+    memcpy(pLink->sendBuffer + pLink->sendLen, &header, sizeof(header));
+    if (length > 0) memcpy(pLink->sendBuffer + pLink->sendLen + sizeof(header), payload, length);
+    pLink->sendLen += needed;
+    return TRUE;
+}
+
+/* ============================================================
+ * LINK MANAGEMENT
+ * ============================================================ */
+
+/* Send the collected IDs as one frame to the batch's link(s) */
+static void FlushBatch(CLUSTER_BATCH *pBatch)
+{
+    RELAY_CLUSTER *pCluster = pBatch->pCluster;
+    DWORD length = pBatch->count * (DWORD)sizeof(DWORD);
+    DWORD i;
+
+    if (pBatch->count == 0) return;
+
+    for (i = 0; i < pCluster->peerCount; i++) {
+        CLUSTER_LINK *pLink = &pCluster->peers[i];
+
+        if (pBatch->pLink && pBatch->pLink != pLink) continue;
+        if (pLink->state != LINK_UP || pLink->bBroken) continue;
+
+        if (QueueLinkFrame(pLink, pBatch->msgType, pBatch->ids, length))
+            CLUSTER_STAT_ADD(pCluster, updatesSent, pBatch->count);
+        else
+            pLink->bBroken = TRUE;
+    }
+
+    pBatch->count = 0;
+}
+
+static void AddToBatch(CLUSTER_BATCH *pBatch, BYTE msgType, DWORD clientId)
+{
+    if (pBatch->count > 0 &&
+        (pBatch->msgType != msgType || pBatch->count == CLUSTER_BATCH_IDS))
+        FlushBatch(pBatch);
+
+    pBatch->msgType = msgType;
+    pBatch->ids[pBatch->count++] = clientId;
+}
+
+/* ============================================================
+ * OUTBOUND LINKS
+ * ============================================================ */
+
+static void CloseOutbound(RELAY_CLUSTER *pCluster, CLUSTER_LINK *pLink, const char *reason)
+{
+    if (pLink->state == LINK_UP) {
+        ClusterLog(pCluster, "[CLUSTER] Link to %s lost: %s\n", pLink->name, reason);
+        __atomic_sub_fetch(&pCluster->peersUp, 1, __ATOMIC_RELAXED);
+        CLUSTER_STAT_ADD(pCluster, linkFailures, 1);
+    } else if (!pLink->bWarned) {
+        /* Once per outage, not once per redial */
+        ClusterLog(pCluster, "[CLUSTER] Peer %s unreachable: %s - retrying every %u ms\n",
+                   pLink->name, reason, CLUSTER_RETRY_MS);
+        CLUSTER_STAT_ADD(pCluster, linkFailures, 1);
+    }
+
+    if (pLink->socket != INVALID_SOCKET) {
+        close(pLink->socket);
+        pLink->socket = INVALID_SOCKET;
+    }
+    pLink->state = LINK_DOWN;
+    pLink->bWarned = TRUE;
+    pLink->bBroken = FALSE;
+    pLink->sendPos = 0;
+    pLink->sendLen = 0;
+    pLink->retryAt = GetTickCount() + CLUSTER_RETRY_MS;
+}
+
+/* Write queued output to every outbound link, dropping broken ones */
+static void FlushOutbound(RELAY_CLUSTER *pCluster)
+{
+    DWORD i;
+
+    for (i = 0; i < pCluster->peerCount; i++) {
+        CLUSTER_LINK *pLink = &pCluster->peers[i];
+
+        if (pLink->state != LINK_UP) continue;
+
+        if (pLink->bBroken)
+            CloseOutbound(pCluster, pLink, "peer fell too far behind");
+        else if (FlushLink(pLink) < 0)
+            CloseOutbound(pCluster, pLink, strerror(errno));
+    }
+}
+
+static void SnapshotVisit(DWORD clientId, void *pValue, void *pContext)
+{
+    (void)pValue;
+    AddToBatch((CLUSTER_BATCH*)pContext, CLUSTER_MSG_ANNOUNCE, clientId);
+}
+
+/* Connected: introduce ourselves and send every local ID */
+static void LinkUp(RELAY_CLUSTER *pCluster, CLUSTER_LINK *pLink)
+{
+    CLUSTER_BATCH batch;
+    CLUSTER_HELLO hello;
+
+    pLink->state = LINK_UP;
+    pLink->bWarned = FALSE;
+    __atomic_add_fetch(&pCluster->peersUp, 1, __ATOMIC_RELAXED);
+
+    hello.nodeId = pCluster->nodeId;
+    hello.clientAddr = pCluster->clientAddr;
+    hello.clientPort = pCluster->clientPort;
+    hello.reserved = 0;
+    if (!QueueLinkFrame(pLink, CLUSTER_MSG_HELLO, &hello, sizeof(hello)))
+        pLink->bBroken = TRUE;
+
+    batch.pCluster = pCluster;
+    batch.pLink = pLink;
+    batch.count = 0;
+    Registry_ForEach(pCluster->pLocal, SnapshotVisit, &batch);
+    FlushBatch(&batch);
+
+    ClusterLog(pCluster, "[CLUSTER] Link to %s up, %u local IDs sent\n",
+               pLink->name, Registry_GetCount(pCluster->pLocal));
+}
+
+static void DialPeer(RELAY_CLUSTER *pCluster, CLUSTER_LINK *pLink)
+{
+    pLink->socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+    if (pLink->socket == INVALID_SOCKET) {
+        CloseOutbound(pCluster, pLink, strerror(errno));
+        return;
+    }
+
+    ConfigureLinkSocket(pLink->socket);
+    pLink->state = LINK_CONNECTING;
+
+    /* Completion or failure is reported as EPOLLOUT */
+    if ((connect(pLink->socket, (struct sockaddr*)&pLink->peerAddr, sizeof(pLink->peerAddr)) < 0 &&
+         errno != EINPROGRESS) || !WatchLink(pCluster, pLink)) {
+        CloseOutbound(pCluster, pLink, strerror(errno));
+    }
+}
+
+static void HandleOutboundEvent(RELAY_CLUSTER *pCluster, CLUSTER_LINK *pLink, DWORD events)
+{
+    if (pLink->state == LINK_CONNECTING) {
+        int error = 0;
+        socklen_t length = sizeof(error);
+
+        if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) return;
+
+        getsockopt(pLink->socket, SOL_SOCKET, SO_ERROR, &error, &length);
+        if (error != 0 || (events & (EPOLLERR | EPOLLHUP))) {
+            CloseOutbound(pCluster, pLink, strerror(error ? error : ECONNREFUSED));
+            return;
+        }
+
+        LinkUp(pCluster, pLink);
+        FlushOutbound(pCluster);
+        return;
+    }
+
+    if (pLink->state != LINK_UP) return;
+
+    /* The peer never writes to a link it accepted: input means it is gone */
+    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+        BYTE scratch[256];
+        ssize_t received;
+
+        while ((received = recv(pLink->socket, scratch, sizeof(scratch), 0)) > 0) {
+            /* Discard */
+        }
+        if (received == 0) {
+            CloseOutbound(pCluster, pLink, "closed by peer");
+            return;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            CloseOutbound(pCluster, pLink, strerror(errno));
+            return;
+        }
+    }
+
+    if ((events & EPOLLOUT) && FlushLink(pLink) < 0)
+        CloseOutbound(pCluster, pLink, strerror(errno));
+}
+
+/* Registrations queued by the shards: pass them on. pLocal already holds
+ * them, so a lost update is repaired by relinking and resending snapshots */
+static void ApplyUpdates(RELAY_CLUSTER *pCluster)
+{
+    CLUSTER_UPDATE *updates;
+    CLUSTER_BATCH batch;
+    DWORD count, i;
+    BOOL bResync;
+    uint64_t wakeCount;
+
+    if (read(pCluster->wakeFd, &wakeCount, sizeof(wakeCount)) < 0) {
+        /* Nothing signalled */
+    }
+
+    pthread_mutex_lock(&pCluster->updateMutex);
+    updates = pCluster->updates;
+    count = pCluster->updateCount;
+    pCluster->updates = NULL;
+    pCluster->updateCount = 0;
+    pCluster->updateCapacity = 0;
+    bResync = pCluster->bResync;
+    pCluster->bResync = FALSE;
+    pthread_mutex_unlock(&pCluster->updateMutex);
+
+    if (bResync) {
+        /* Peers drop what these links announced and get a fresh snapshot on
+         * redial; anything still queued is covered by it */
+        ClusterLog(pCluster, "[CLUSTER] Registry update lost - relinking to resync peers\n");
+        for (i = 0; i < pCluster->peerCount; i++) {
+            if (pCluster->peers[i].state == LINK_UP)
+                CloseOutbound(pCluster, &pCluster->peers[i], "resync after a lost update");
+        }
+        free(updates);
+        return;
+    }
+
+    if (!updates) return;
+
+    batch.pCluster = pCluster;
+    batch.pLink = NULL;
+    batch.count = 0;
+
+    for (i = 0; i < count; i++) {
+        AddToBatch(&batch, updates[i].bAnnounce ? CLUSTER_MSG_ANNOUNCE : CLUSTER_MSG_WITHDRAW,
+                   updates[i].clientId);
+    }
+    FlushBatch(&batch);
+    free(updates);
+
+    FlushOutbound(pCluster);
+}
+
+/* ============================================================
+ * INBOUND LINKS
+ * ============================================================ */
+
+static void CollectLinkIds(DWORD clientId, void *pValue, void *pContext)
+{
+    CLUSTER_BATCH *pBatch = (CLUSTER_BATCH*)pContext;
+
+    if (pValue == pBatch->pLink && pBatch->count < CLUSTER_BATCH_IDS)
+        pBatch->ids[pBatch->count++] = clientId;
+}
+
+/* Remove every ID an inbound link announced, one batch per registry pass.
+ * Returns the number removed */
+static DWORD ForgetLinkIds(RELAY_CLUSTER *pCluster, CLUSTER_LINK *pLink)
+{
+    CLUSTER_BATCH batch;
+    DWORD removed = 0;
+    DWORD i;
+
+    batch.pCluster = pCluster;
+    batch.pLink = pLink;
+
+    do {
+        batch.count = 0;
+        Registry_ForEach(pCluster->pRemote, CollectLinkIds, &batch);
+
+        for (i = 0; i < batch.count; i++) {
+            Registry_Lock(pCluster->pRemote, batch.ids[i]);
+            if (Registry_Remove(pCluster->pRemote, batch.ids[i], pLink)) removed++;
+            Registry_Unlock(pCluster->pRemote, batch.ids[i]);
+        }
+    } while (batch.count == CLUSTER_BATCH_IDS);
+
+    return removed;
+}
+
+/* Close an inbound link and forget its node's IDs. The struct is freed by
+ * ReapInbound, after the current event batch */
+static void CloseInbound(RELAY_CLUSTER *pCluster, CLUSTER_LINK *pLink, const char *reason)
+{
+    DWORD dropped;
+
+    if (pLink->bClosed) return;
+
+    pLink->bClosed = TRUE;
+    close(pLink->socket);
+    pLink->socket = INVALID_SOCKET;
+
+    dropped = ForgetLinkIds(pCluster, pLink);
+    if (pLink->nodeId != 0) {
+        ClusterLog(pCluster, "[CLUSTER] Node %u (%s) left: %s - %u IDs dropped\n",
+                   pLink->nodeId, pLink->name, reason, dropped);
+        __atomic_sub_fetch(&pCluster->nodesKnown, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static void ReapInbound(RELAY_CLUSTER *pCluster)
+{
+    CLUSTER_LINK **ppLink = &pCluster->pInbound;
+
+    while (*ppLink) {
+        CLUSTER_LINK *pLink = *ppLink;
+
+        if (pLink->bClosed) {
+            *ppLink = pLink->pNext;
+            free(pLink->recvBuffer);
+            free(pLink);
+        } else {
+            ppLink = &pLink->pNext;
+        }
+    }
+}
+
+static void AcceptLinks(RELAY_CLUSTER *pCluster)
+{
+    for (;;) {
+        struct sockaddr_in addr;
+        socklen_t addrLen = sizeof(addr);
+        CLUSTER_LINK *pLink;
+        SOCKET sock;
+
+        sock = accept4(pCluster->listenSocket, (struct sockaddr*)&addr, &addrLen,
+                       SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (sock == INVALID_SOCKET) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                ClusterLog(pCluster, "[ERROR] Cluster accept() failed: %s\n", strerror(errno));
+            return;
+        }
+
+        pLink = (CLUSTER_LINK*)calloc(1, sizeof(CLUSTER_LINK));
+        if (pLink) pLink->recvBuffer = (BYTE*)malloc(CLUSTER_RECV_SIZE);
+        if (!pLink || !pLink->recvBuffer) {
+            if (pLink) free(pLink);
+            close(sock);
+            continue;
+        }
+
+        pLink->socket = sock;
+        pLink->peerAddr = addr;
+        FormatAddress(&addr, pLink->name, sizeof(pLink->name));
+        ConfigureLinkSocket(sock);
+
+        if (!WatchLink(pCluster, pLink)) {
+            close(sock);
+            free(pLink->recvBuffer);
+            free(pLink);
+            continue;
+        }
+
+        pLink->pNext = pCluster->pInbound;
+        pCluster->pInbound = pLink;
+    }
+}
+
+/* Returns FALSE on a protocol violation */
+static BOOL HandleLinkFrame(RELAY_CLUSTER *pCluster, CLUSTER_LINK *pLink,
+                            const RELAY_HEADER *pHeader, const BYTE *payload)
+{
+    switch (pHeader->msgType) {
+        case CLUSTER_MSG_HELLO: {
+            CLUSTER_HELLO hello;
+            CLUSTER_LINK *pOther;
+            char clientAddr[32];
+
+            if (pHeader->dataLength < sizeof(hello) || pLink->nodeId != 0) return FALSE;
+            memcpy(&hello, payload, sizeof(hello));
+
+            if (hello.nodeId == 0 || hello.nodeId == pCluster->nodeId) {
+                ClusterLog(pCluster, "[WARN] Peer %s uses node ID %u, which is ours or invalid\n",
+                           pLink->name, hello.nodeId);
+                return FALSE;
+            }
+
+            /* A node that redialed replaces whatever its old link announced */
+            for (pOther = pCluster->pInbound; pOther; pOther = pOther->pNext) {
+                if (pOther != pLink && pOther->nodeId == hello.nodeId)
+                    CloseInbound(pCluster, pOther, "replaced by a new link");
+            }
+
+            pLink->clientAddr.sin_family = AF_INET;
+            pLink->clientAddr.sin_port = htons(hello.clientPort);
+            pLink->clientAddr.sin_addr.s_addr =
+                hello.clientAddr ? hello.clientAddr : pLink->peerAddr.sin_addr.s_addr;
+            pLink->nodeId = hello.nodeId;
+            __atomic_add_fetch(&pCluster->nodesKnown, 1, __ATOMIC_RELAXED);
+
+            FormatAddress(&pLink->clientAddr, clientAddr, sizeof(clientAddr));
+            ClusterLog(pCluster, "[CLUSTER] Node %u joined from %s, clients at %s\n",
+                       hello.nodeId, pLink->name, clientAddr);
+            return TRUE;
+        }
+
+        case CLUSTER_MSG_ANNOUNCE:
+        case CLUSTER_MSG_WITHDRAW: {
+            DWORD count = pHeader->dataLength / (DWORD)sizeof(DWORD);
+            DWORD i;
+
+            if (pLink->nodeId == 0 || pHeader->dataLength % sizeof(DWORD) != 0) return FALSE;
+
+            for (i = 0; i < count; i++) {
+                DWORD clientId;
+                int result = RD2K_SUCCESS;
+
+                memcpy(&clientId, payload + i * sizeof(DWORD), sizeof(DWORD));
+
+                Registry_Lock(pCluster->pRemote, clientId);
+                if (pHeader->msgType == CLUSTER_MSG_ANNOUNCE)
+                    result = Registry_Insert(pCluster->pRemote, clientId, pLink);
+                else
+                    Registry_Remove(pCluster->pRemote, clientId, pLink);
+                Registry_Unlock(pCluster->pRemote, clientId);
+
+                if (result != RD2K_SUCCESS) return FALSE;
+            }
+            CLUSTER_STAT_ADD(pCluster, updatesReceived, count);
+            return TRUE;
+        }
+
+        default:
+            return FALSE;
+    }
+}
+
+static void HandleInboundEvent(RELAY_CLUSTER *pCluster, CLUSTER_LINK *pLink)
+{
+    while (!pLink->bClosed) {
+        DWORD offset = 0;
+        ssize_t received;
+
+        received = recv(pLink->socket, pLink->recvBuffer + pLink->recvLen,
+                        CLUSTER_RECV_SIZE - pLink->recvLen, 0);
+        if (received == 0) {
+            CloseInbound(pCluster, pLink, "closed by peer");
+            return;
+        }
+        if (received < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                CloseInbound(pCluster, pLink, strerror(errno));
+            return;
+        }
+        pLink->recvLen += (DWORD)received;
+
+        while (pLink->recvLen - offset >= sizeof(RELAY_HEADER)) {
+            RELAY_HEADER header;
+
+            memcpy(&header, pLink->recvBuffer + offset, sizeof(header));
+            if (header.dataLength > CLUSTER_RECV_SIZE - sizeof(RELAY_HEADER)) {
+                CloseInbound(pCluster, pLink, "oversized frame");
+                return;
+            }
+            if (pLink->recvLen - offset < sizeof(RELAY_HEADER) + header.dataLength) break;
+
+            if (!HandleLinkFrame(pCluster, pLink, &header,
+                                 pLink->recvBuffer + offset + sizeof(RELAY_HEADER))) {
+                CloseInbound(pCluster, pLink, "protocol error");
+                return;
+            }
+            offset += (DWORD)sizeof(RELAY_HEADER) + header.dataLength;
+        }
+
+        if (offset > 0) {
+            memmove(pLink->recvBuffer, pLink->recvBuffer + offset, pLink->recvLen - offset);
+            pLink->recvLen -= offset;
+        }
+    }
+}
+
+/* ============================================================
+ * CLUSTER THREAD
+ * ============================================================ */
+
+static void* ClusterThread(void *arg)
+{
+    RELAY_CLUSTER *pCluster = (RELAY_CLUSTER*)arg;
+    struct epoll_event events[CLUSTER_MAX_EVENTS];
+    int count, i;
+
+    ClusterLog(pCluster, "[INFO] Cluster node %u started, %u peer(s) configured\n",
+               pCluster->nodeId, pCluster->peerCount);
+
+    while (pCluster->bRunning) {
+        BOOL bWoken = FALSE;
+        DWORD now;
+
+        count = epoll_wait(pCluster->epollFd, events, CLUSTER_MAX_EVENTS, CLUSTER_POLL_MS);
+        if (count < 0) {
+            if (errno == EINTR) continue;
+            ClusterLog(pCluster, "[ERROR] Cluster epoll_wait() failed: %s\n", strerror(errno));
+            break;
+        }
+
+        for (i = 0; i < count; i++) {
+            void *ptr = events[i].data.ptr;
+
+            if (ptr == (void*)&pCluster->listenSocket) {
+                AcceptLinks(pCluster);
+            } else if (ptr == (void*)&pCluster->wakeFd) {
+                bWoken = TRUE;
+            } else {
+                CLUSTER_LINK *pLink = (CLUSTER_LINK*)ptr;
+
+                if (pLink->bOutbound)
+                    HandleOutboundEvent(pCluster, pLink, events[i].events);
+                else
+                    HandleInboundEvent(pCluster, pLink);
+            }
+        }
+
+        if (bWoken) ApplyUpdates(pCluster);
+
+        now = GetTickCount();
+        for (i = 0; i < (int)pCluster->peerCount; i++) {
+            CLUSTER_LINK *pLink = &pCluster->peers[i];
+
+            if (pLink->state == LINK_DOWN && (int)(now - pLink->retryAt) >= 0)
+                DialPeer(pCluster, pLink);
+        }
+
+        ReapInbound(pCluster);
+    }
+
+    return NULL;
+}
+
+/* ============================================================
+ * PUBLIC API
+ * ============================================================ */
+
+RELAY_CLUSTER* Cluster_Create(const CLUSTER_CONFIG *pConfig)
+{
+    RELAY_CLUSTER *pCluster;
+    struct sockaddr_in addr;
+    struct epoll_event ev;
+    DWORD i;
+    int opt = 1;
+
+    if (!pConfig || pConfig->peerCount > CLUSTER_MAX_PEERS) return NULL;
+
+    pCluster = (RELAY_CLUSTER*)calloc(1, sizeof(RELAY_CLUSTER));
+    if (!pCluster) return NULL;
+
+    pCluster->nodeId = pConfig->nodeId;
+    pCluster->clientPort = pConfig->clientPort;
+    pCluster->pfnLog = pConfig->pfnLog;
+    pCluster->listenSocket = INVALID_SOCKET;
+    pCluster->epollFd = -1;
+    pCluster->wakeFd = -1;
+    pthread_mutex_init(&pCluster->updateMutex, NULL);
+
+    if (pConfig->clientAddr && pConfig->clientAddr[0] &&
+        strcmp(pConfig->clientAddr, "0.0.0.0") != 0)
+        inet_pton(AF_INET, pConfig->clientAddr, &pCluster->clientAddr);
+
+    if (pCluster->nodeId == 0) {
+        ClusterLog(pCluster, "[ERROR] Cluster node ID must not be 0\n");
+        Cluster_Destroy(pCluster);
+        return NULL;
+    }
+
+    for (i = 0; i < pConfig->peerCount; i++) {
+        CLUSTER_LINK *pLink = &pCluster->peers[i];
+
+        pLink->socket = INVALID_SOCKET;
+        pLink->bOutbound = TRUE;
+        pLink->state = LINK_DOWN;
+        pLink->retryAt = GetTickCount();
+        pCluster->peerCount++;
+
+        if (!ParseAddress(pConfig->peers[i], &pLink->peerAddr)) {
+            ClusterLog(pCluster, "[ERROR] Invalid cluster peer '%s' (expected IP:PORT)\n",
+                       pConfig->peers[i]);
+            Cluster_Destroy(pCluster);
+            return NULL;
+        }
+        FormatAddress(&pLink->peerAddr, pLink->name, sizeof(pLink->name));
+    }
+
+    pCluster->pLocal = Registry_Create(1024);
+    pCluster->pRemote = Registry_Create(1024 * (pCluster->peerCount + 1));
+    pCluster->epollFd = epoll_create1(EPOLL_CLOEXEC);
+    pCluster->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    pCluster->listenSocket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+    if (!pCluster->pLocal || !pCluster->pRemote || pCluster->epollFd < 0 ||
+        pCluster->wakeFd < 0 || pCluster->listenSocket == INVALID_SOCKET) {
+        Cluster_Destroy(pCluster);
+        return NULL;
+    }
+
+    setsockopt(pCluster->listenSocket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    ZeroMemory(&addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    if (pConfig->bindAddr && pConfig->bindAddr[0] && strcmp(pConfig->bindAddr, "0.0.0.0") != 0)
+        addr.sin_addr.s_addr = inet_addr(pConfig->bindAddr);
+    else
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(pConfig->port);
+
+    if (bind(pCluster->listenSocket, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+        listen(pCluster->listenSocket, 16) < 0) {
+        ClusterLog(pCluster, "[ERROR] Cannot listen for cluster peers on port %u: %s\n",
+                   pConfig->port, strerror(errno));
+        Cluster_Destroy(pCluster);
+        return NULL;
+    }
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = &pCluster->listenSocket;
+    if (epoll_ctl(pCluster->epollFd, EPOLL_CTL_ADD, pCluster->listenSocket, &ev) < 0) {
+        Cluster_Destroy(pCluster);
+        return NULL;
+    }
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = &pCluster->wakeFd;
+    if (epoll_ctl(pCluster->epollFd, EPOLL_CTL_ADD, pCluster->wakeFd, &ev) < 0) {
+        Cluster_Destroy(pCluster);
+        return NULL;
+    }
+
+    return pCluster;
+}
+
+int Cluster_Start(RELAY_CLUSTER *pCluster)
+{
+    if (!pCluster) return RD2K_ERR_SOCKET;
+
+    pCluster->bRunning = 1;
+    if (pthread_create(&pCluster->thread, NULL, ClusterThread, pCluster) != 0) {
+        pCluster->bRunning = 0;
+        return RD2K_ERR_SOCKET;
+    }
+    pCluster->bThreadValid = TRUE;
+    return RD2K_SUCCESS;
+}
+
+void Cluster_Stop(RELAY_CLUSTER *pCluster)
+{
+    uint64_t one = 1;
+
+    if (!pCluster || !pCluster->bThreadValid) return;
+
+    pCluster->bRunning = 0;
+    if (write(pCluster->wakeFd, &one, sizeof(one)) < 0) {
+        /* The thread notices within CLUSTER_POLL_MS anyway */
+    }
+    pthread_join(pCluster->thread, NULL);
+    pCluster->bThreadValid = FALSE;
+}
+
+void Cluster_Destroy(RELAY_CLUSTER *pCluster)
+{
+    DWORD i;
+
+    if (!pCluster) return;
+
+    for (i = 0; i < pCluster->peerCount; i++) {
+        if (pCluster->peers[i].socket != INVALID_SOCKET) close(pCluster->peers[i].socket);
+        free(pCluster->peers[i].sendBuffer);
+    }
+
+    while (pCluster->pInbound) {
+        CLUSTER_LINK *pLink = pCluster->pInbound;
+        pCluster->pInbound = pLink->pNext;
+        if (pLink->socket != INVALID_SOCKET) close(pLink->socket);
+        free(pLink->recvBuffer);
+        free(pLink);
+    }
+
+    if (pCluster->listenSocket != INVALID_SOCKET) close(pCluster->listenSocket);
+    if (pCluster->wakeFd >= 0) close(pCluster->wakeFd);
+    if (pCluster->epollFd >= 0) close(pCluster->epollFd);
+    Registry_Destroy(pCluster->pLocal);
+    Registry_Destroy(pCluster->pRemote);
+    free(pCluster->updates);
+    pthread_mutex_destroy(&pCluster->updateMutex);
+    free(pCluster);
+}
+
+static void QueueUpdate(RELAY_CLUSTER *pCluster, DWORD clientId, BOOL bAnnounce)
+{
+    uint64_t one = 1;
+    BOOL bWake;
+
+    /* The snapshot source. Calls for one ID are serialized by the relay's
+     * stripe lock, so pLocal ends up in registration order */
+    Registry_Lock(pCluster->pLocal, clientId);
+    if (bAnnounce)
+        Registry_Insert(pCluster->pLocal, clientId, pCluster);
+    else
+        Registry_Remove(pCluster->pLocal, clientId, pCluster);
+    Registry_Unlock(pCluster->pLocal, clientId);
+
+    pthread_mutex_lock(&pCluster->updateMutex);
+
+    if (pCluster->updateCount == pCluster->updateCapacity) {
+        DWORD newCapacity = pCluster->updateCapacity ? pCluster->updateCapacity * 2 : 256;
+        CLUSTER_UPDATE *newUpdates = (CLUSTER_UPDATE*)realloc(pCluster->updates,
+                                                              newCapacity * sizeof(CLUSTER_UPDATE));
+        if (!newUpdates) {
+            /* Have the thread relink so peers resync from pLocal */
+            bWake = !pCluster->bResync;
+            pCluster->bResync = TRUE;
+            pthread_mutex_unlock(&pCluster->updateMutex);
+            if (bWake && write(pCluster->wakeFd, &one, sizeof(one)) < 0) {
+                /* Counter saturated - the thread is awake anyway */
+            }
+            return;
+        }
+        pCluster->updates = newUpdates;
+        pCluster->updateCapacity = newCapacity;
+    }
+
+    pCluster->updates[pCluster->updateCount].clientId = clientId;
+    pCluster->updates[pCluster->updateCount].bAnnounce = bAnnounce;
+    pCluster->updateCount++;
+    /* The thread takes the whole queue at once; one signal per batch */
+    bWake = (pCluster->updateCount == 1);
+
+    pthread_mutex_unlock(&pCluster->updateMutex);
+
+    if (bWake && write(pCluster->wakeFd, &one, sizeof(one)) < 0) {
+        /* Counter saturated - the thread is awake anyway */
+    }
+}
+
+void Cluster_Announce(RELAY_CLUSTER *pCluster, DWORD clientId)
+{
+    if (pCluster && clientId != 0) QueueUpdate(pCluster, clientId, TRUE);
+}
+
+void Cluster_Withdraw(RELAY_CLUSTER *pCluster, DWORD clientId)
+{
+    if (pCluster && clientId != 0) QueueUpdate(pCluster, clientId, FALSE);
+}
+
+BOOL Cluster_Lookup(RELAY_CLUSTER *pCluster, DWORD clientId,
+                    struct sockaddr_in *pAddr, DWORD *pNodeId)
+{
+    CLUSTER_LINK *pLink;
+
+    if (!pCluster) return FALSE;
+
+    Registry_Lock(pCluster->pRemote, clientId);
+    pLink = (CLUSTER_LINK*)Registry_Find(pCluster->pRemote, clientId);
+    if (pLink) {
+        *pAddr = pLink->clientAddr;
+        *pNodeId = pLink->nodeId;
+    }
+    Registry_Unlock(pCluster->pRemote, clientId);
+
+    return pLink != NULL;
+}
+
+BOOL Cluster_IsPeerHost(RELAY_CLUSTER *pCluster, const struct in_addr *pAddr)
+{
+    DWORD i;
+
+    if (!pCluster) return FALSE;
+
+    /* peers[] does not change after Cluster_Create */
+    for (i = 0; i < pCluster->peerCount; i++) {
+        if (pCluster->peers[i].peerAddr.sin_addr.s_addr == pAddr->s_addr) return TRUE;
+    }
+    return FALSE;
+}
+
+DWORD Cluster_GetNodeId(RELAY_CLUSTER *pCluster)
+{
+    return pCluster ? pCluster->nodeId : 0;
+}
+
+void Cluster_GetStats(RELAY_CLUSTER *pCluster, CLUSTER_STATS *pStats)
+{
+    ZeroMemory(pStats, sizeof(CLUSTER_STATS));
+    if (!pCluster) return;
+
+    pStats->peersUp = __atomic_load_n(&pCluster->peersUp, __ATOMIC_RELAXED);
+    pStats->nodesKnown = __atomic_load_n(&pCluster->nodesKnown, __ATOMIC_RELAXED);
+    pStats->localIds = Registry_GetCount(pCluster->pLocal);
+    pStats->remoteIds = Registry_GetCount(pCluster->pRemote);
+    pStats->updatesSent = __atomic_load_n(&pCluster->updatesSent, __ATOMIC_RELAXED);
+    pStats->updatesReceived = __atomic_load_n(&pCluster->updatesReceived, __ATOMIC_RELAXED);
+    pStats->linkFailures = __atomic_load_n(&pCluster->linkFailures, __ATOMIC_RELAXED);
+}
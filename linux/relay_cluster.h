@@ -0,0 +1,97 @@
+/*
+ * relay_cluster.h - Relay Cluster Membership for RemoteDesk2K Linux Relay
+ *
+ * Several relay processes can share one client ID space. Every node dials
+ * the peers it was given and streams the IDs registered on it to them
+ * (a full snapshot when the link comes up, then announce/withdraw
+ * updates). What a node hears from its peers lands in a remote registry:
+ * clientId -> node address. A CONNECT_REQUEST for an ID that is not
+ * registered locally but is known on another node is then served by a
+ * node link: the relay connects to that node's client port, asks it with
+ * RELAY_MSG_PEER_CONNECT to pair the link with the partner, and pairs the
+ * requester with the link.
+ *
+ * The cluster runs on its own thread. The relay's shards only call
+ * Cluster_Announce / Cluster_Withdraw (queued, never block on I/O) and
+ * Cluster_Lookup (one registry stripe lock).
+ */
+
+#ifndef _RD2K_RELAY_CLUSTER_H_
+#define _RD2K_RELAY_CLUSTER_H_
+
+#include "common.h"
+
+#define CLUSTER_MAX_PEERS       16
+
+/* Node link request: sent by a relay on a connection it opened to another
+ * node's client port, instead of REGISTER. The receiving node pairs the
+ * connection with partnerId as if requesterId had asked for it, and
+ * answers with a CONNECT_RESPONSE. From then on the link carries the
+ * session's frames; either node ends it with PARTNER_DISCONNECTED */
+#define RELAY_MSG_PEER_CONNECT  0x5A
+
+#pragma pack(push, 1)
+
+typedef struct {
+    DWORD   requesterId;
+    DWORD   partnerId;
+    DWORD   nodeId;             /* Requesting node, for the logs */
+    DWORD   reserved;
+} RELAY_PEER_CONNECT;
+
+#pragma pack(pop)
+
+typedef struct _RELAY_CLUSTER RELAY_CLUSTER;
+
+typedef struct _CLUSTER_CONFIG {
+    DWORD       nodeId;                     /* Unique in the cluster, non-zero */
+    WORD        port;                       /* Listen port for peer links */
+    const char* bindAddr;                   /* NULL or "0.0.0.0" for all interfaces */
+    WORD        clientPort;                 /* Our relay port, advertised to peers */
+    const char* clientAddr;                 /* Advertised relay address, NULL = as seen by the peer */
+    const char* peers[CLUSTER_MAX_PEERS];   /* "host:port" of the other nodes' peer links */
+    DWORD       peerCount;
+    void        (*pfnLog)(const char *message);  /* Called on the cluster thread */
+} CLUSTER_CONFIG;
+
+typedef struct _CLUSTER_STATS {
+    DWORD               peersUp;            /* Outbound links connected */
+    DWORD               nodesKnown;         /* Inbound links that introduced themselves */
+    DWORD               localIds;           /* Announced by this node */
+    DWORD               remoteIds;          /* Known on other nodes */
+    unsigned long long  updatesSent;        /* Announce/withdraw records, snapshots included */
+    unsigned long long  updatesReceived;
+    unsigned long long  linkFailures;       /* Outbound links lost or refused */
+} CLUSTER_STATS;
+
+/* Create the cluster and its listen socket. Returns NULL on failure */
+RELAY_CLUSTER* Cluster_Create(const CLUSTER_CONFIG *pConfig);
+
+/* Start / stop the cluster thread */
+int Cluster_Start(RELAY_CLUSTER *pCluster);
+void Cluster_Stop(RELAY_CLUSTER *pCluster);
+
+/* Free the cluster (thread must be stopped) */
+void Cluster_Destroy(RELAY_CLUSTER *pCluster);
+
+/* clientId was registered / unregistered on this node. Updates for one ID
+ * must be made in registration order (the relay calls these under the
+ * ID's registry stripe lock) */
+void Cluster_Announce(RELAY_CLUSTER *pCluster, DWORD clientId);
+void Cluster_Withdraw(RELAY_CLUSTER *pCluster, DWORD clientId);
+
+/* Client port of the node clientId is registered on, if another node has
+ * announced it. Returns FALSE if no peer knows the ID */
+BOOL Cluster_Lookup(RELAY_CLUSTER *pCluster, DWORD clientId,
+                    struct sockaddr_in *pAddr, DWORD *pNodeId);
+
+/* TRUE if addr is the host of a configured peer; node links are only
+ * accepted from those */
+BOOL Cluster_IsPeerHost(RELAY_CLUSTER *pCluster, const struct in_addr *pAddr);
+
+/* This node's ID */
+DWORD Cluster_GetNodeId(RELAY_CLUSTER *pCluster);
+
+void Cluster_GetStats(RELAY_CLUSTER *pCluster, CLUSTER_STATS *pStats);
+
+#endif /* _RD2K_RELAY_CLUSTER_H_ */
@@ -0,0 +1,101 @@
+/*
+ * relay_hist.c - Histograms for RemoteDesk2K Linux Relay
+ *
+ * Values below 8 get a bucket each. Above that, a value with its top bit
+ * at position e lands in row e - 2, column = the 3 bits below the top
+ * bit. Percentiles report the top of their bucket, clamped to the
+ * largest value seen.
+ */
+
+#include "relay_hist.h"
+
+/* ============================================================
+ * HELPERS
+ * ============================================================ */
+
+static DWORD BucketIndex(DWORD value)
+{
+    DWORD top;
+
+    if (value < HIST_SUB_BUCKETS) return value;
+
+    top = 31 - (DWORD)__builtin_clz(value);
+    return (top - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS +
+           ((value >> (top - HIST_SUB_BITS)) & (HIST_SUB_BUCKETS - 1));
+}
+
+/* Largest value that lands in bucket index */
+static DWORD BucketTop(DWORD index)
+{
+    DWORD row, shift;
+
+    if (index < HIST_SUB_BUCKETS) return index;
+
+    row = index / HIST_SUB_BUCKETS;
+    shift = row - 1;
+    return ((HIST_SUB_BUCKETS + index % HIST_SUB_BUCKETS) << shift) + ((1U << shift) - 1);
+}
+
+/* ============================================================
+ * PUBLIC API
+ * ============================================================ */
+
+void Hist_Reset(RELAY_HIST *pHist)
+{
+    ZeroMemory(pHist, sizeof(RELAY_HIST));
+}
+
+void Hist_Record(RELAY_HIST *pHist, DWORD value, DWORD count)
+{
+    DWORD *pCount = &pHist->counts[BucketIndex(value)];
+
+    __atomic_store_n(pCount, *pCount + count, __ATOMIC_RELAXED);
+    __atomic_store_n(&pHist->total, pHist->total + count, __ATOMIC_RELAXED);
+    __atomic_store_n(&pHist->sum, pHist->sum + (unsigned long long)value * count,
+                     __ATOMIC_RELAXED);
+    if (value > pHist->max)
+        __atomic_store_n(&pHist->max, value, __ATOMIC_RELAXED);
+}
+
+void Hist_Merge(RELAY_HIST *pDest, const RELAY_HIST *pSrc)
+{
+    DWORD i, max;
+
+    for (i = 0; i < HIST_BUCKETS; i++)
+        pDest->counts[i] += __atomic_load_n(&pSrc->counts[i], __ATOMIC_RELAXED);
+    pDest->total += __atomic_load_n(&pSrc->total, __ATOMIC_RELAXED);
+    pDest->sum += __atomic_load_n(&pSrc->sum, __ATOMIC_RELAXED);
+
+    max = __atomic_load_n(&pSrc->max, __ATOMIC_RELAXED);
+    if (max > pDest->max) pDest->max = max;
+}
+
+DWORD Hist_Percentile(const RELAY_HIST *pHist, DWORD permille)
+{
+    unsigned long long rank, seen = 0;
+    DWORD i, top;
+
+    if (pHist->total == 0) return 0;
+
+    rank = (pHist->total * permille + 999) / 1000;
+    if (rank == 0) rank = 1;
+
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        seen += pHist->counts[i];
+        if (seen >= rank) {
+            top = BucketTop(i);
+            return top < pHist->max ? top : pHist->max;
+        }
+    }
+
+    /* Counts read mid-update can fall short of total */
+    return pHist->max;
+}
+
+void Hist_Format(const RELAY_HIST *pHist, char *buffer, size_t length)
+{
+    snprintf(buffer, length, "n=%llu mean=%llu p50=%u p90=%u p99=%u p99.9=%u max=%u",
+             pHist->total, pHist->total ? pHist->sum / pHist->total : 0,
+             Hist_Percentile(pHist, 500), Hist_Percentile(pHist, 900),
+             Hist_Percentile(pHist, 990), Hist_Percentile(pHist, 999), pHist->max);
+}
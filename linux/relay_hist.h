@@ -0,0 +1,43 @@
+/*
+ * relay_hist.h - Histograms for RemoteDesk2K Linux Relay
+ *
+ * Log-linear buckets in the style of HdrHistogram: each power of two is
+ * split into 8 equal sub-buckets, so any 32-bit value is recorded with
+ * at most 12.5% error in a fixed 240-bucket array. A histogram has one
+ * writer; counts are stored atomically so other threads may merge or
+ * read it at any time.
+ */
+
+#ifndef _RD2K_RELAY_HIST_H_
+#define _RD2K_RELAY_HIST_H_
+
+#include "common.h"
+
+#define HIST_SUB_BITS           3
+#define HIST_SUB_BUCKETS        (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS            (HIST_SUB_BUCKETS * (32 - HIST_SUB_BITS + 1))
+
+typedef struct _RELAY_HIST {
+    DWORD                   counts[HIST_BUCKETS];
+    unsigned long long      total;          /* Values recorded */
+    unsigned long long      sum;            /* For the mean */
+    DWORD                   max;
+} RELAY_HIST;
+
+/* Empty a histogram. Not safe against a concurrent writer */
+void Hist_Reset(RELAY_HIST *pHist);
+
+/* Record count occurrences of value (writer thread only) */
+void Hist_Record(RELAY_HIST *pHist, DWORD value, DWORD count);
+
+/* Add pSrc's counts to pDest. pSrc may be written meanwhile */
+void Hist_Merge(RELAY_HIST *pDest, const RELAY_HIST *pSrc);
+
+/* Smallest bucket bound that covers permille/1000 of the values
+ * (e.g. 990 for p99). 0 for an empty histogram */
+DWORD Hist_Percentile(const RELAY_HIST *pHist, DWORD permille);
+
+/* One-line summary: "n=... mean=... p50=... p90=... p99=... p99.9=... max=..." */
+void Hist_Format(const RELAY_HIST *pHist, char *buffer, size_t length);
+
+#endif /* _RD2K_RELAY_HIST_H_ */
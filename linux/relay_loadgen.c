@@ -0,0 +1,1305 @@
+/*
+ * relay_loadgen.c - RemoteDesk2K Linux Relay Load Generator
+ *
+ * Drives a running relay with simulated host/viewer pairs that speak the
+ * real protocol: both sides REGISTER, the viewer sends CONNECT_REQUEST
+ * for the host, and once paired they exchange DATA frames according to
+ * the traffic mix, with a PING from each side every second. A session
+ * ends with DISCONNECT from the viewer, at the end of the run or after
+ * --lifetime, in which case the pair reconnects under fresh IDs.
+ *
+ * Every DATA payload starts with the time it was queued, so the side
+ * that receives it measures forwarding latency through the relay. Both
+ * ends live in this process and share one clock.
+ *
+ * Build with "make loadgen" and run "./relay_loadgen --help".
+ *
+ * Traffic mixes (comma separated):
+ *   screen    - host -> viewer: a screen update every 33 ms, 16-192 KB
+ *               split into DATA frames of up to 60 KB (--chunk)
+ *   mouse     - viewer -> host: 60 Hz input events, each a 12-byte packet
+ *               header frame followed by a 16-byte body frame
+ *   bulk      - host -> viewer: file transfer, 60 KB chunks (--chunk) as
+ *               fast as the socket takes them
+ *   idle      - no session: both sides register and only PING, like
+ *               clients waiting for a partner (cannot be combined)
+ */
+
+#include "common.h"
+#include "crypto.h"
+#include "relay_hist.h"
+#include "relay_timer.h"
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+#define LOADGEN_DEFAULT_PAIRS       100
+#define LOADGEN_DEFAULT_DURATION    10          /* Seconds */
+#define LOADGEN_THREADS_MAX         64
+#define LOADGEN_ID_BASE             0x6C000000  /* Clear of the IDs real clients use */
+#define LOADGEN_LOCK_FILE           "/tmp/rd2k_relay.lock"  /* Holds the relay's PID */
+
+#define LOADGEN_SETUP_INFLIGHT      64          /* Pairs connecting at once, per thread */
+#define LOADGEN_SETUP_TIMEOUT_MS    10000
+#define LOADGEN_RETRY_MS            1000        /* After a failed or dropped session */
+#define LOADGEN_CLOSE_TIMEOUT_MS    5000        /* Wait for the relay to close a session */
+#define LOADGEN_DRAIN_MS            3000        /* At the end of the run */
+
+#define LOADGEN_MIX_SCREEN          0x01
+#define LOADGEN_MIX_MOUSE           0x02
+#define LOADGEN_MIX_BULK            0x04
+#define LOADGEN_MIX_IDLE            0x08
+
+#define LOADGEN_SCREEN_US           33333
+#define LOADGEN_SCREEN_MIN          (16 * 1024)
+#define LOADGEN_SCREEN_MAX          (192 * 1024)
+#define LOADGEN_MOUSE_US            16667
+#define LOADGEN_MOUSE_HEADER        12          /* Client packet header frame */
+#define LOADGEN_MOUSE_BODY          16
+#define LOADGEN_PING_US             1000000
+#define LOADGEN_CHUNK               (60 * 1024)     /* Default --chunk */
+#define LOADGEN_STAMP_SIZE          8           /* Send time at the start of a DATA payload */
+
+#define LOADGEN_PENDING_MAX         (1024 * 1024)   /* Timed traffic skipped beyond this */
+#define LOADGEN_BULK_REFILLS        16          /* Chunks per writable event */
+#define LOADGEN_EVENTS              256
+
+/* Connection states */
+#define LOADGEN_CONN_CLOSED         0
+#define LOADGEN_CONN_CONNECTING     1
+#define LOADGEN_CONN_REGISTERING    2
+#define LOADGEN_CONN_REGISTERED     3
+#define LOADGEN_CONN_PAIRING        4   /* Viewer: CONNECT_REQUEST sent */
+#define LOADGEN_CONN_ACTIVE         5
+
+/* Pair states */
+#define LOADGEN_PAIR_IDLE           0   /* Queued to start, or waiting to retry */
+#define LOADGEN_PAIR_SETUP          1
+#define LOADGEN_PAIR_ACTIVE         2
+#define LOADGEN_PAIR_CLOSING        3   /* DISCONNECT sent, waiting for the relay */
+#define LOADGEN_PAIR_DONE           4
+
+/* Counters, written by the owning worker only and read by the main thread */
+#define LOADGEN_STAT_ADD(pWorker, field, n) \
+    __atomic_store_n(&(pWorker)->stats.field, (pWorker)->stats.field + (n), __ATOMIC_RELAXED)
+
+typedef struct _LOADGEN_STATS {
+    unsigned long long  pairsEstablished;   /* Sessions that reached PAIRED */
+    unsigned long long  setupFailures;      /* Refused, timed out or connect errors */
+    unsigned long long  sessionsDropped;    /* Closed by the relay mid-session */
+    unsigned long long  sessionsEnded;      /* Ended by DISCONNECT */
+    unsigned long long  framesSent;         /* DATA */
+    unsigned long long  bytesSent;          /* DATA, headers included */
+    unsigned long long  framesReceived;
+    unsigned long long  bytesReceived;
+    unsigned long long  pongs;
+    unsigned long long  skippedEvents;      /* Timed traffic dropped to backpressure */
+    unsigned long long  activePairs;
+} LOADGEN_STATS;
+
+struct _LOADGEN_PAIR;
+
+typedef struct _LOADGEN_CONN {
+    SOCKET                  sock;
+    DWORD                   state;
+    DWORD                   clientId;
+    BOOL                    bHost;
+    BOOL                    bWantWrite;     /* EPOLLOUT registered */
+    struct _LOADGEN_PAIR*   pPair;
+
+    /* Output not yet taken by the socket */
+    BYTE*                   sendData;
+    DWORD                   sendHead;
+    DWORD                   sendTail;
+    DWORD                   sendCapacity;
+
+    /* Frame being received */
+    RELAY_HEADER            header;
+    DWORD                   headerLen;
+    DWORD                   payloadDone;
+    BYTE                    head[LOADGEN_STAMP_SIZE];   /* First payload bytes */
+} LOADGEN_CONN;
+
+typedef struct _LOADGEN_PAIR {
+    LOADGEN_CONN            host;
+    LOADGEN_CONN            viewer;
+    DWORD                   state;
+    RELAY_TIMER             timer;          /* Next traffic event, retry or timeout */
+    struct _LOADGEN_PAIR*   pNextStart;     /* Start queue */
+    unsigned long long      setupStartUs;
+    unsigned long long      endUs;          /* Lifetime runs out, 0 = never */
+    unsigned long long      nextScreenUs;
+    unsigned long long      nextMouseUs;
+    unsigned long long      nextPingUs;
+} LOADGEN_PAIR;
+
+typedef struct _LOADGEN_WORKER {
+    pthread_t               thread;
+    int                     epollFd;
+    RELAY_TIMER_WHEEL       timers;
+    LOADGEN_PAIR*           pairs;
+    DWORD                   pairCount;
+    DWORD                   livePairs;      /* Not yet DONE */
+    DWORD                   setupInFlight;
+    LOADGEN_PAIR*           pStartHead;
+    LOADGEN_PAIR**          ppStartTail;
+    DWORD                   random;
+    BOOL                    bStopping;
+    BYTE*                   recvBuffer;
+    LOADGEN_STATS           stats;
+    RELAY_HIST              latency;        /* Forwarding latency, microseconds */
+    RELAY_HIST              setup;          /* Connect to paired, microseconds */
+} LOADGEN_WORKER;
+
+/* Run settings, fixed before the workers start */
+static struct sockaddr_in g_serverAddr;
+static DWORD g_mix = LOADGEN_MIX_SCREEN | LOADGEN_MIX_MOUSE;
+static unsigned long long g_lifetimeUs = 0;
+static DWORD g_chunk = LOADGEN_CHUNK;
+static DWORD g_nextId;
+
+static volatile int g_bRunning = 1;
+static BYTE *g_fill;                /* g_chunk bytes of DATA filler */
+
+/* ============================================================
+ * HELPERS
+ * ============================================================ */
+
+static unsigned long long NowMicroseconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000ULL + (unsigned long long)ts.tv_nsec / 1000;
+}
+
+/* xorshift32 */
+static DWORD NextRandom(DWORD *pState)
+{
+    DWORD x = *pState;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *pState = x;
+    return x;
+}
+
+static void SignalHandler(int sig)
+{
+    (void)sig;
+    g_bRunning = 0;
+}
+
+static void RaiseFileLimit(void)
+{
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+/* ============================================================
+ * CONNECTION I/O
+ * ============================================================ */
+
+static DWORD PendingBytes(const LOADGEN_CONN *pConn)
+{
+    return pConn->sendTail - pConn->sendHead;
+}
+
+static void SetWantWrite(LOADGEN_WORKER *pWorker, LOADGEN_CONN *pConn, BOOL bWantWrite)
+{
+    struct epoll_event ev;
+
+    if (pConn->bWantWrite == bWantWrite) return;
+
+    ev.events = EPOLLIN | (bWantWrite ? EPOLLOUT : 0);
+    ev.data.ptr = pConn;
+    epoll_ctl(pWorker->epollFd, EPOLL_CTL_MOD, pConn->sock, &ev);
+    pConn->bWantWrite = bWantWrite;
+}
+
+/* Make room for length more bytes of output */
+static BYTE* ReserveOutput(LOADGEN_CONN *pConn, DWORD length)
+{
+    BYTE *pData;
+
+    if (pConn->sendHead == pConn->sendTail) {
+        pConn->sendHead = 0;
+        pConn->sendTail = 0;
+    }
+
+    if (pConn->sendTail + length > pConn->sendCapacity && pConn->sendHead > 0) {
+        memmove(pConn->sendData, pConn->sendData + pConn->sendHead, PendingBytes(pConn));
+        pConn->sendTail -= pConn->sendHead;
+        pConn->sendHead = 0;
+    }
+
+    if (pConn->sendTail + length > pConn->sendCapacity) {
+        DWORD capacity = pConn->sendCapacity ? pConn->sendCapacity : RELAY_BUFFER_SIZE;
+        while (capacity < pConn->sendTail + length) capacity *= 2;
+
+        pData = (BYTE*)realloc(pConn->sendData, capacity);
+        if (!pData) return NULL;
+        pConn->sendData = pData;
+        pConn->sendCapacity = capacity;
+    }
+
+    pData = pConn->sendData + pConn->sendTail;
+    pConn->sendTail += length;
+    return pData;
+}
+
+/* Queue one frame. Control payloads are encrypted as a client would.
+ * DATA payloads begin with stampUs and the rest is filler; they carry
+ * the encrypted flag but the relay never looks inside */
+static BOOL QueueFrame(LOADGEN_CONN *pConn, BYTE msgType, const BYTE *payload,
+                       DWORD length, unsigned long long stampUs)
+{
+    RELAY_HEADER header;
+    BYTE *pFrame = ReserveOutput(pConn, sizeof(RELAY_HEADER) + length);
+
+    if (!pFrame) return FALSE;
+
+    header.msgType = msgType;
+    header.flags = (msgType == RELAY_MSG_DATA || length > 0) ? 0x01 : 0;
+    header.reserved = 0;
+    header.dataLength = length;
+    memcpy(pFrame, &header, sizeof(header));
+    pFrame += sizeof(header);
+
+    if (payload) {
+        memcpy(pFrame, payload, length);
+        Crypto_Encrypt(pFrame, length);
+    } else if (length >= LOADGEN_STAMP_SIZE) {
+        memcpy(pFrame, &stampUs, LOADGEN_STAMP_SIZE);
+        memcpy(pFrame + LOADGEN_STAMP_SIZE, g_fill, length - LOADGEN_STAMP_SIZE);
+    } else {
+        memcpy(pFrame, g_fill, length);
+    }
+    return TRUE;
+}
+
+/* 8-byte control message: value, 0 */
+static BOOL QueueControl(LOADGEN_CONN *pConn, BYTE msgType, DWORD value)
+{
+    DWORD payload[2];
+
+    payload[0] = value;
+    payload[1] = 0;
+    return QueueFrame(pConn, msgType, (const BYTE*)payload, sizeof(payload), 0);
+}
+
+static BOOL QueueData(LOADGEN_WORKER *pWorker, LOADGEN_CONN *pConn, DWORD length,
+                      unsigned long long stampUs)
+{
+    if (!QueueFrame(pConn, RELAY_MSG_DATA, NULL, length, stampUs)) return FALSE;
+    LOADGEN_STAT_ADD(pWorker, framesSent, 1);
+    LOADGEN_STAT_ADD(pWorker, bytesSent, sizeof(RELAY_HEADER) + length);
+    return TRUE;
+}
+
+/* Write queued output. FALSE if the socket failed */
+static BOOL FlushOutput(LOADGEN_WORKER *pWorker, LOADGEN_CONN *pConn)
+{
+    while (pConn->sendHead < pConn->sendTail) {
+        ssize_t sent = send(pConn->sock, pConn->sendData + pConn->sendHead,
+                            PendingBytes(pConn), MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                SetWantWrite(pWorker, pConn, TRUE);
+                return TRUE;
+            }
+            return FALSE;
+        }
+        pConn->sendHead += (DWORD)sent;
+    }
+    return TRUE;
+}
+
+static BOOL OpenConnection(LOADGEN_WORKER *pWorker, LOADGEN_CONN *pConn, DWORD clientId)
+{
+    struct epoll_event ev;
+    int opt = 1;
+
+    pConn->sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (pConn->sock == INVALID_SOCKET) return FALSE;
+    setsockopt(pConn->sock, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+
+    if (connect(pConn->sock, (struct sockaddr*)&g_serverAddr, sizeof(g_serverAddr)) < 0 &&
+        errno != EINPROGRESS) {
+        close(pConn->sock);
+        pConn->sock = INVALID_SOCKET;
+        return FALSE;
+    }
+
+    ev.events = EPOLLIN | EPOLLOUT;
+    ev.data.ptr = pConn;
+    if (epoll_ctl(pWorker->epollFd, EPOLL_CTL_ADD, pConn->sock, &ev) < 0) {
+        close(pConn->sock);
+        pConn->sock = INVALID_SOCKET;
+        return FALSE;
+    }
+
+    pConn->state = LOADGEN_CONN_CONNECTING;
+    pConn->clientId = clientId;
+    pConn->bWantWrite = TRUE;
+    pConn->sendHead = 0;
+    pConn->sendTail = 0;
+    pConn->headerLen = 0;
+    return TRUE;
+}
+
+static void CloseConnection(LOADGEN_WORKER *pWorker, LOADGEN_CONN *pConn)
+{
+    if (pConn->sock == INVALID_SOCKET) return;
+
+    epoll_ctl(pWorker->epollFd, EPOLL_CTL_DEL, pConn->sock, NULL);
+    close(pConn->sock);
+    pConn->sock = INVALID_SOCKET;
+    pConn->state = LOADGEN_CONN_CLOSED;
+    pConn->sendHead = 0;
+    pConn->sendTail = 0;
+}
+
+/* ============================================================
+ * PAIR LIFECYCLE
+ * ============================================================ */
+
+static LOADGEN_PAIR* PairFromTimer(RELAY_TIMER *pTimer)
+{
+    return (LOADGEN_PAIR*)((BYTE*)pTimer - offsetof(LOADGEN_PAIR, timer));
+}
+
+static void ScheduleAt(LOADGEN_WORKER *pWorker, LOADGEN_PAIR *pPair, unsigned long long dueUs)
+{
+    unsigned long long nowUs = NowMicroseconds();
+    DWORD delayMs = dueUs > nowUs ? (DWORD)((dueUs - nowUs + 999) / 1000) : 0;
+
+    Timer_Schedule(&pWorker->timers, &pPair->timer, GetTickCount() + delayMs);
+}
+
+static void QueueStart(LOADGEN_WORKER *pWorker, LOADGEN_PAIR *pPair)
+{
+    pPair->state = LOADGEN_PAIR_IDLE;
+    pPair->pNextStart = NULL;
+    *pWorker->ppStartTail = pPair;
+    pWorker->ppStartTail = &pPair->pNextStart;
+}
+
+/* The pair has no sockets left: go again, or finish at the end of the run */
+static void RestartPair(LOADGEN_WORKER *pWorker, LOADGEN_PAIR *pPair, DWORD delayMs)
+{
+    Timer_Cancel(&pWorker->timers, &pPair->timer);
+
+    if (pWorker->bStopping) {
+        pPair->state = LOADGEN_PAIR_DONE;
+        pWorker->livePairs--;
+    } else if (delayMs == 0) {
+        QueueStart(pWorker, pPair);
+    } else {
+        pPair->state = LOADGEN_PAIR_IDLE;
+        Timer_Schedule(&pWorker->timers, &pPair->timer, GetTickCount() + delayMs);
+    }
+}
+
+static void LeaveState(LOADGEN_WORKER *pWorker, LOADGEN_PAIR *pPair)
+{
+    if (pPair->state == LOADGEN_PAIR_SETUP)
+        pWorker->setupInFlight--;
+    else if (pPair->state == LOADGEN_PAIR_ACTIVE)
+        LOADGEN_STAT_ADD(pWorker, activePairs, (unsigned long long)-1);
+}
+
+/* Setup failed or the relay dropped the session */
+static void FailPair(LOADGEN_WORKER *pWorker, LOADGEN_PAIR *pPair)
+{
+    if (pPair->state == LOADGEN_PAIR_SETUP)
+        LOADGEN_STAT_ADD(pWorker, setupFailures, 1);
+    else if (pPair->state == LOADGEN_PAIR_ACTIVE)
+        LOADGEN_STAT_ADD(pWorker, sessionsDropped, 1);
+
+    LeaveState(pWorker, pPair);
+    CloseConnection(pWorker, &pPair->host);
+    CloseConnection(pWorker, &pPair->viewer);
+    RestartPair(pWorker, pPair, LOADGEN_RETRY_MS);
+}
+
+static void StartPair(LOADGEN_WORKER *pWorker, LOADGEN_PAIR *pPair)
+{
+    DWORD clientId = __atomic_fetch_add(&g_nextId, 2, __ATOMIC_RELAXED);
+
+    pPair->state = LOADGEN_PAIR_SETUP;
+    pPair->setupStartUs = NowMicroseconds();
+    pWorker->setupInFlight++;
+
+    if (!OpenConnection(pWorker, &pPair->host, clientId) ||
+        !OpenConnection(pWorker, &pPair->viewer, clientId + 1)) {
+        FailPair(pWorker, pPair);
+        return;
+    }
+    Timer_Schedule(&pWorker->timers, &pPair->timer, GetTickCount() + LOADGEN_SETUP_TIMEOUT_MS);
+}
+
+static void PumpStarts(LOADGEN_WORKER *pWorker)
+{
+    while (pWorker->pStartHead && pWorker->setupInFlight < LOADGEN_SETUP_INFLIGHT) {
+        LOADGEN_PAIR *pPair = pWorker->pStartHead;
+
+        pWorker->pStartHead = pPair->pNextStart;
+        if (!pWorker->pStartHead) pWorker->ppStartTail = &pWorker->pStartHead;
+        StartPair(pWorker, pPair);
+    }
+}
+
+/* Both sides are PAIRED at the relay */
+static void ActivatePair(LOADGEN_WORKER *pWorker, LOADGEN_PAIR *pPair)
+{
+    unsigned long long nowUs = NowMicroseconds();
+
+    pWorker->setupInFlight--;
+    pPair->state = LOADGEN_PAIR_ACTIVE;
+    LOADGEN_STAT_ADD(pWorker, pairsEstablished, 1);
+    LOADGEN_STAT_ADD(pWorker, activePairs, 1);
+    Hist_Record(&pWorker->setup, (DWORD)(nowUs - pPair->setupStartUs), 1);
+
+    /* Spread the pairs' timers so their bursts do not line up */
+    pPair->nextScreenUs = nowUs + NextRandom(&pWorker->random) % LOADGEN_SCREEN_US;
+    pPair->nextMouseUs = nowUs + NextRandom(&pWorker->random) % LOADGEN_MOUSE_US;
+    pPair->nextPingUs = nowUs + LOADGEN_PING_US;
+    pPair->endUs = g_lifetimeUs ? nowUs + g_lifetimeUs : 0;
+
+    ScheduleAt(pWorker, pPair, nowUs);
+    if (g_mix & LOADGEN_MIX_BULK)
+        SetWantWrite(pWorker, &pPair->host, TRUE);
+}
+
+/* Send DISCONNECT and wait for the relay to close both sockets. Idle
+ * registrations have no session to take the host down with the viewer */
+static void EndSession(LOADGEN_WORKER *pWorker, LOADGEN_PAIR *pPair)
+{
+    LeaveState(pWorker, pPair);
+    LOADGEN_STAT_ADD(pWorker, sessionsEnded, 1);
+    pPair->state = LOADGEN_PAIR_CLOSING;
+
+    if (!QueueFrame(&pPair->viewer, RELAY_MSG_DISCONNECT, NULL, 0, 0) ||
+        !FlushOutput(pWorker, &pPair->viewer) ||
+        ((g_mix & LOADGEN_MIX_IDLE) &&
+         (!QueueFrame(&pPair->host, RELAY_MSG_DISCONNECT, NULL, 0, 0) ||
+          !FlushOutput(pWorker, &pPair->host)))) {
+        CloseConnection(pWorker, &pPair->host);
+        CloseConnection(pWorker, &pPair->viewer);
+        RestartPair(pWorker, pPair, 0);
+        return;
+    }
+    Timer_Schedule(&pWorker->timers, &pPair->timer, GetTickCount() + LOADGEN_CLOSE_TIMEOUT_MS);
+}
+
+/* ============================================================
+ * TRAFFIC
+ * ============================================================ */
+
+static unsigned long long CatchUp(unsigned long long dueUs, unsigned long long nowUs)
+{
+    /* After a long stall, resume the schedule instead of bursting */
+    return dueUs + LOADGEN_PING_US < nowUs ? nowUs : dueUs;
+}
+
+static BOOL SendScreenUpdate(LOADGEN_WORKER *pWorker, LOADGEN_PAIR *pPair,
+                             unsigned long long nowUs)
+{
+    DWORD remaining = LOADGEN_SCREEN_MIN +
+                      NextRandom(&pWorker->random) % (LOADGEN_SCREEN_MAX - LOADGEN_SCREEN_MIN);
+
+    while (remaining > 0) {
+        DWORD length = remaining < g_chunk ? remaining : g_chunk;
+        if (length < LOADGEN_STAMP_SIZE) length = LOADGEN_STAMP_SIZE;
+
+        if (!QueueData(pWorker, &pPair->host, length, nowUs)) return FALSE;
+        remaining -= length < remaining ? length : remaining;
+    }
+    return TRUE;
+}
+
+/* Timed traffic that came due; FALSE if a socket failed */
+static BOOL RunTraffic(LOADGEN_WORKER *pWorker, LOADGEN_PAIR *pPair, unsigned long long nowUs)
+{
+    unsigned long long dueUs;
+
+    if (g_mix & LOADGEN_MIX_SCREEN) {
+        pPair->nextScreenUs = CatchUp(pPair->nextScreenUs, nowUs);
+        while (pPair->nextScreenUs <= nowUs) {
+            if (PendingBytes(&pPair->host) >= LOADGEN_PENDING_MAX)
+                LOADGEN_STAT_ADD(pWorker, skippedEvents, 1);
+            else if (!SendScreenUpdate(pWorker, pPair, nowUs))
+                return FALSE;
+            pPair->nextScreenUs += LOADGEN_SCREEN_US;
+        }
+    }
+
+    if (g_mix & LOADGEN_MIX_MOUSE) {
+        pPair->nextMouseUs = CatchUp(pPair->nextMouseUs, nowUs);
+        while (pPair->nextMouseUs <= nowUs) {
+            if (PendingBytes(&pPair->viewer) >= LOADGEN_PENDING_MAX)
+                LOADGEN_STAT_ADD(pWorker, skippedEvents, 1);
+            else if (!QueueData(pWorker, &pPair->viewer, LOADGEN_MOUSE_HEADER, nowUs) ||
+                     !QueueData(pWorker, &pPair->viewer, LOADGEN_MOUSE_BODY, nowUs))
+                return FALSE;
+            pPair->nextMouseUs += LOADGEN_MOUSE_US;
+        }
+    }
+
+    if (pPair->nextPingUs <= nowUs) {
+        if (!QueueFrame(&pPair->host, RELAY_MSG_PING, NULL, 0, 0) ||
+            !QueueFrame(&pPair->viewer, RELAY_MSG_PING, NULL, 0, 0))
+            return FALSE;
+        pPair->nextPingUs = CatchUp(pPair->nextPingUs, nowUs) + LOADGEN_PING_US;
+    }
+
+    if (!FlushOutput(pWorker, &pPair->host) || !FlushOutput(pWorker, &pPair->viewer))
+        return FALSE;
+
+    dueUs = pPair->nextPingUs;
+    if ((g_mix & LOADGEN_MIX_SCREEN) && pPair->nextScreenUs < dueUs) dueUs = pPair->nextScreenUs;
+    if ((g_mix & LOADGEN_MIX_MOUSE) && pPair->nextMouseUs < dueUs) dueUs = pPair->nextMouseUs;
+    if (pPair->endUs && pPair->endUs < dueUs) dueUs = pPair->endUs;
+    ScheduleAt(pWorker, pPair, dueUs);
+    return TRUE;
+}
+
+/* Keep a bulk sender's output topped up while the socket takes it */
+static BOOL RefillBulk(LOADGEN_WORKER *pWorker, LOADGEN_PAIR *pPair)
+{
+    LOADGEN_CONN *pConn = &pPair->host;
+    DWORD i;
+
+    /* Queue a chunk only once the last one is in the socket, so the
+     * stamps do not include time spent waiting in our own buffer */
+    for (i = 0; i < LOADGEN_BULK_REFILLS && PendingBytes(pConn) == 0; i++) {
+        if (!QueueData(pWorker, pConn, g_chunk, NowMicroseconds())) return FALSE;
+        if (!FlushOutput(pWorker, pConn)) return FALSE;
+    }
+
+    /* Come back on the next EPOLLOUT */
+    SetWantWrite(pWorker, pConn, TRUE);
+    return TRUE;
+}
+
+static void OnPairTimer(LOADGEN_WORKER *pWorker, LOADGEN_PAIR *pPair)
+{
+    unsigned long long nowUs = NowMicroseconds();
+
+    switch (pPair->state) {
+        case LOADGEN_PAIR_IDLE:
+            QueueStart(pWorker, pPair);
+            break;
+
+        case LOADGEN_PAIR_SETUP:
+            FailPair(pWorker, pPair);
+            break;
+
+        case LOADGEN_PAIR_ACTIVE:
+            if (pPair->endUs && nowUs >= pPair->endUs)
+                EndSession(pWorker, pPair);
+            else if (!RunTraffic(pWorker, pPair, nowUs))
+                FailPair(pWorker, pPair);
+            break;
+
+        case LOADGEN_PAIR_CLOSING:
+            /* The relay never closed the session; do it ourselves */
+            CloseConnection(pWorker, &pPair->host);
+            CloseConnection(pWorker, &pPair->viewer);
+            RestartPair(pWorker, pPair, 0);
+            break;
+    }
+}
+
+/* ============================================================
+ * RECEIVE PATH
+ * ============================================================ */
+
+/* A complete frame arrived. FALSE if the pair was torn down */
+static BOOL HandleFrame(LOADGEN_WORKER *pWorker, LOADGEN_CONN *pConn)
+{
+    LOADGEN_PAIR *pPair = pConn->pPair;
+    DWORD status = 0;
+
+    /* The cipher is positional, so the first bytes decrypt on their own */
+    if (pConn->header.msgType != RELAY_MSG_DATA && (pConn->header.flags & 0x01) &&
+        pConn->header.dataLength > 0)
+        Crypto_Decrypt(pConn->head, pConn->header.dataLength < LOADGEN_STAMP_SIZE ?
+                                    pConn->header.dataLength : LOADGEN_STAMP_SIZE);
+    if (pConn->header.dataLength >= sizeof(DWORD))
+        memcpy(&status, pConn->head, sizeof(DWORD));
+
+    switch (pConn->header.msgType) {
+        case RELAY_MSG_DATA:
+            LOADGEN_STAT_ADD(pWorker, framesReceived, 1);
+            LOADGEN_STAT_ADD(pWorker, bytesReceived, sizeof(RELAY_HEADER) + pConn->header.dataLength);
+            if (pConn->header.dataLength >= LOADGEN_STAMP_SIZE) {
+                unsigned long long stampUs, nowUs = NowMicroseconds();
+                memcpy(&stampUs, pConn->head, LOADGEN_STAMP_SIZE);
+                if (nowUs >= stampUs)
+                    Hist_Record(&pWorker->latency, (DWORD)(nowUs - stampUs), 1);
+            }
+            return TRUE;
+
+        case RELAY_MSG_PONG:
+            LOADGEN_STAT_ADD(pWorker, pongs, 1);
+            return TRUE;
+
+        case RELAY_MSG_REGISTER_RESPONSE:
+            if (pPair->state != LOADGEN_PAIR_SETUP) return TRUE;
+            if (status != RELAY_REGISTER_OK) {
+                FailPair(pWorker, pPair);
+                return FALSE;
+            }
+            pConn->state = LOADGEN_CONN_REGISTERED;
+
+            if (g_mix & LOADGEN_MIX_IDLE) {
+                if (pPair->host.state == LOADGEN_CONN_REGISTERED &&
+                    pPair->viewer.state == LOADGEN_CONN_REGISTERED)
+                    ActivatePair(pWorker, pPair);
+                return TRUE;
+            }
+
+            /* The host must be online before the viewer asks for it */
+            if (pPair->host.state == LOADGEN_CONN_REGISTERED &&
+                pPair->viewer.state == LOADGEN_CONN_REGISTERED) {
+                pPair->viewer.state = LOADGEN_CONN_PAIRING;
+                if (!QueueControl(&pPair->viewer, RELAY_MSG_CONNECT_REQUEST, pPair->host.clientId) ||
+                    !FlushOutput(pWorker, &pPair->viewer)) {
+                    FailPair(pWorker, pPair);
+                    return FALSE;
+                }
+            }
+            return TRUE;
+
+        case RELAY_MSG_CONNECT_RESPONSE:
+        case RELAY_MSG_PARTNER_CONNECTED:
+            if (pPair->state != LOADGEN_PAIR_SETUP) return TRUE;
+            if (pConn->header.msgType == RELAY_MSG_CONNECT_RESPONSE && status != RD2K_SUCCESS) {
+                FailPair(pWorker, pPair);
+                return FALSE;
+            }
+            pConn->state = LOADGEN_CONN_ACTIVE;
+            if (pPair->host.state == LOADGEN_CONN_ACTIVE &&
+                pPair->viewer.state == LOADGEN_CONN_ACTIVE)
+                ActivatePair(pWorker, pPair);
+            return TRUE;
+
+        case RELAY_MSG_PARTNER_DISCONNECTED:
+            if (pPair->state == LOADGEN_PAIR_ACTIVE) {
+                FailPair(pWorker, pPair);
+                return FALSE;
+            }
+            return TRUE;
+
+        default:
+            return TRUE;
+    }
+}
+
+/* Walk received bytes frame by frame, keeping only what HandleFrame
+ * needs: the header and the first bytes of the payload */
+static BOOL ParseInput(LOADGEN_WORKER *pWorker, LOADGEN_CONN *pConn, const BYTE *data, DWORD length)
+{
+    DWORD offset = 0;
+
+    while (offset < length) {
+        DWORD take;
+
+        if (pConn->headerLen < sizeof(RELAY_HEADER)) {
+            take = sizeof(RELAY_HEADER) - pConn->headerLen;
+            if (take > length - offset) take = length - offset;
+            memcpy((BYTE*)&pConn->header + pConn->headerLen, data + offset, take);
+            pConn->headerLen += take;
+            offset += take;
+            if (pConn->headerLen < sizeof(RELAY_HEADER)) break;
+            pConn->payloadDone = 0;
+        }
+
+        take = pConn->header.dataLength - pConn->payloadDone;
+        if (take > length - offset) take = length - offset;
+        if (pConn->payloadDone < LOADGEN_STAMP_SIZE) {
+            DWORD copy = LOADGEN_STAMP_SIZE - pConn->payloadDone;
+            if (copy > take) copy = take;
+            memcpy(pConn->head + pConn->payloadDone, data + offset, copy);
+        }
+        pConn->payloadDone += take;
+        offset += take;
+
+        if (pConn->payloadDone == pConn->header.dataLength) {
+            pConn->headerLen = 0;
+            if (!HandleFrame(pWorker, pConn)) return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/* The relay closed a socket or it failed */
+static void HandleConnectionLost(LOADGEN_WORKER *pWorker, LOADGEN_CONN *pConn)
+{
+    LOADGEN_PAIR *pPair = pConn->pPair;
+
+    if (pPair->state != LOADGEN_PAIR_CLOSING) {
+        FailPair(pWorker, pPair);
+        return;
+    }
+
+    CloseConnection(pWorker, pConn);
+    if (pPair->host.sock == INVALID_SOCKET && pPair->viewer.sock == INVALID_SOCKET)
+        RestartPair(pWorker, pPair, 0);
+}
+
+static void HandleReadable(LOADGEN_WORKER *pWorker, LOADGEN_CONN *pConn)
+{
+    for (;;) {
+        ssize_t got = recv(pConn->sock, pWorker->recvBuffer, RELAY_BUFFER_SIZE, MSG_DONTWAIT);
+
+        if (got > 0) {
+            if (!ParseInput(pWorker, pConn, pWorker->recvBuffer, (DWORD)got)) return;
+            if (got < RELAY_BUFFER_SIZE) return;
+            continue;
+        }
+        if (got < 0 && errno == EINTR) continue;
+        if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+
+        HandleConnectionLost(pWorker, pConn);
+        return;
+    }
+}
+
+static void HandleWritable(LOADGEN_WORKER *pWorker, LOADGEN_CONN *pConn)
+{
+    LOADGEN_PAIR *pPair = pConn->pPair;
+
+    if (pConn->state == LOADGEN_CONN_CONNECTING) {
+        int error = 0;
+        socklen_t len = sizeof(error);
+
+        getsockopt(pConn->sock, SOL_SOCKET, SO_ERROR, &error, &len);
+        if (error != 0) {
+            FailPair(pWorker, pPair);
+            return;
+        }
+        pConn->state = LOADGEN_CONN_REGISTERING;
+        if (!QueueControl(pConn, RELAY_MSG_REGISTER, pConn->clientId)) {
+            FailPair(pWorker, pPair);
+            return;
+        }
+    }
+
+    SetWantWrite(pWorker, pConn, FALSE);
+    if (!FlushOutput(pWorker, pConn)) {
+        HandleConnectionLost(pWorker, pConn);
+        return;
+    }
+
+    if ((g_mix & LOADGEN_MIX_BULK) && pConn->bHost && pPair->state == LOADGEN_PAIR_ACTIVE &&
+        !RefillBulk(pWorker, pPair))
+        FailPair(pWorker, pPair);
+}
+
+/* ============================================================
+ * WORKER
+ * ============================================================ */
+
+/* End of run: close sessions cleanly and drop pairs that never got going */
+static void BeginStopping(LOADGEN_WORKER *pWorker)
+{
+    DWORD i;
+
+    pWorker->bStopping = TRUE;
+    pWorker->pStartHead = NULL;
+    pWorker->ppStartTail = &pWorker->pStartHead;
+
+    for (i = 0; i < pWorker->pairCount; i++) {
+        LOADGEN_PAIR *pPair = &pWorker->pairs[i];
+
+        switch (pPair->state) {
+            case LOADGEN_PAIR_IDLE:
+            case LOADGEN_PAIR_SETUP:
+                LeaveState(pWorker, pPair);
+                CloseConnection(pWorker, &pPair->host);
+                CloseConnection(pWorker, &pPair->viewer);
+                RestartPair(pWorker, pPair, 0);
+                break;
+
+            case LOADGEN_PAIR_ACTIVE:
+                EndSession(pWorker, pPair);
+                break;
+        }
+    }
+}
+
+static void* WorkerThread(void *arg)
+{
+    LOADGEN_WORKER *pWorker = (LOADGEN_WORKER*)arg;
+    struct epoll_event events[LOADGEN_EVENTS];
+    DWORD stopMs = 0;
+    DWORD i;
+
+    Timer_InitWheel(&pWorker->timers, GetTickCount());
+    for (i = 0; i < pWorker->pairCount; i++)
+        QueueStart(pWorker, &pWorker->pairs[i]);
+
+    while (pWorker->livePairs > 0) {
+        RELAY_TIMER *pTimer;
+        int count, n;
+
+        if (!pWorker->bStopping && !__atomic_load_n(&g_bRunning, __ATOMIC_RELAXED)) {
+            BeginStopping(pWorker);
+            stopMs = GetTickCount();
+        }
+        if (pWorker->bStopping && GetTickCount() - stopMs > LOADGEN_DRAIN_MS) break;
+
+        PumpStarts(pWorker);
+
+        count = epoll_wait(pWorker->epollFd, events, LOADGEN_EVENTS, TIMER_TICK_MS);
+        for (n = 0; n < count; n++) {
+            LOADGEN_CONN *pConn = (LOADGEN_CONN*)events[n].data.ptr;
+
+            if (pConn->sock != INVALID_SOCKET && (events[n].events & (EPOLLOUT | EPOLLERR)))
+                HandleWritable(pWorker, pConn);
+            if (pConn->sock != INVALID_SOCKET && (events[n].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+                HandleReadable(pWorker, pConn);
+        }
+
+        pTimer = Timer_Advance(&pWorker->timers, GetTickCount());
+        while (pTimer) {
+            RELAY_TIMER *pNext = pTimer->pNext;
+            OnPairTimer(pWorker, PairFromTimer(pTimer));
+            pTimer = pNext;
+        }
+    }
+
+    for (i = 0; i < pWorker->pairCount; i++) {
+        CloseConnection(pWorker, &pWorker->pairs[i].host);
+        CloseConnection(pWorker, &pWorker->pairs[i].viewer);
+    }
+    return NULL;
+}
+
+static BOOL InitWorker(LOADGEN_WORKER *pWorker, DWORD index, DWORD pairCount)
+{
+    DWORD i;
+
+    pWorker->epollFd = epoll_create1(0);
+    pWorker->pairs = (LOADGEN_PAIR*)calloc(pairCount ? pairCount : 1, sizeof(LOADGEN_PAIR));
+    pWorker->recvBuffer = (BYTE*)malloc(RELAY_BUFFER_SIZE);
+    if (pWorker->epollFd < 0 || !pWorker->pairs || !pWorker->recvBuffer) return FALSE;
+
+    pWorker->pairCount = pairCount;
+    pWorker->livePairs = pairCount;
+    pWorker->ppStartTail = &pWorker->pStartHead;
+    pWorker->random = 0x9E3779B9U ^ ((index + 1) * 0x85EBCA6BU);
+
+    for (i = 0; i < pairCount; i++) {
+        LOADGEN_PAIR *pPair = &pWorker->pairs[i];
+
+        pPair->host.sock = INVALID_SOCKET;
+        pPair->host.bHost = TRUE;
+        pPair->host.pPair = pPair;
+        pPair->viewer.sock = INVALID_SOCKET;
+        pPair->viewer.pPair = pPair;
+    }
+    return TRUE;
+}
+
+static void FreeWorker(LOADGEN_WORKER *pWorker)
+{
+    DWORD i;
+
+    for (i = 0; i < pWorker->pairCount; i++) {
+        free(pWorker->pairs[i].host.sendData);
+        free(pWorker->pairs[i].viewer.sendData);
+    }
+    free(pWorker->pairs);
+    free(pWorker->recvBuffer);
+    if (pWorker->epollFd >= 0) close(pWorker->epollFd);
+}
+
+/* ============================================================
+ * PROCESS STATISTICS
+ * ============================================================ */
+
+typedef struct _PROC_SAMPLE {
+    double              cpuSeconds;         /* User + system */
+    DWORD               rssKb;
+    DWORD               peakRssKb;
+} PROC_SAMPLE;
+
+/* CPU and memory of another process from /proc */
+static BOOL SampleProcess(pid_t pid, PROC_SAMPLE *pSample)
+{
+    char path[64], line[1024];
+    unsigned long long utime = 0, stime = 0;
+    char *p;
+    FILE *f;
+    int field;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    f = fopen(path, "r");
+    if (!f) return FALSE;
+    p = fgets(line, sizeof(line), f);
+    fclose(f);
+    if (!p || !(p = strrchr(line, ')'))) return FALSE;
+
+    /* Fields after the command name start at 3 (state); utime is 14 */
+    p = strtok(p + 1, " ");
+    for (field = 3; p && field < 15; field++) {
+        if (field == 14) utime = strtoull(p, NULL, 10);
+        p = strtok(NULL, " ");
+    }
+    if (!p) return FALSE;
+    stime = strtoull(p, NULL, 10);
+    pSample->cpuSeconds = (double)(utime + stime) / (double)sysconf(_SC_CLK_TCK);
+
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    f = fopen(path, "r");
+    if (!f) return FALSE;
+    pSample->rssKb = 0;
+    pSample->peakRssKb = 0;
+    while (fgets(line, sizeof(line), f)) {
+        if (strncmp(line, "VmRSS:", 6) == 0) pSample->rssKb = (DWORD)strtoul(line + 6, NULL, 10);
+        else if (strncmp(line, "VmHWM:", 6) == 0) pSample->peakRssKb = (DWORD)strtoul(line + 6, NULL, 10);
+    }
+    fclose(f);
+    return TRUE;
+}
+
+static void SampleSelf(PROC_SAMPLE *pSample)
+{
+    struct rusage usage;
+
+    getrusage(RUSAGE_SELF, &usage);
+    pSample->cpuSeconds = (double)usage.ru_utime.tv_sec + (double)usage.ru_utime.tv_usec / 1e6 +
+                          (double)usage.ru_stime.tv_sec + (double)usage.ru_stime.tv_usec / 1e6;
+    pSample->rssKb = 0;
+    pSample->peakRssKb = (DWORD)usage.ru_maxrss;
+}
+
+/* The relay writes its PID to the single-instance lock file */
+static pid_t FindRelayPid(void)
+{
+    char buffer[32];
+    ssize_t len;
+    pid_t pid;
+    int fd;
+
+    fd = open(LOADGEN_LOCK_FILE, O_RDONLY);
+    if (fd < 0) return 0;
+    len = read(fd, buffer, sizeof(buffer) - 1);
+    close(fd);
+    if (len <= 0) return 0;
+
+    buffer[len] = '\0';
+    pid = (pid_t)atoi(buffer);
+    if (pid <= 0 || kill(pid, 0) < 0) return 0;
+    return pid;
+}
+
+/* ============================================================
+ * REPORTING
+ * ============================================================ */
+
+static void SumStats(LOADGEN_WORKER *workers, DWORD workerCount, LOADGEN_STATS *pTotal)
+{
+    const unsigned long long *pSrc;
+    unsigned long long *pDest = (unsigned long long*)pTotal;
+    DWORD i, j;
+
+    ZeroMemory(pTotal, sizeof(LOADGEN_STATS));
+    for (i = 0; i < workerCount; i++) {
+        pSrc = (const unsigned long long*)&workers[i].stats;
+        for (j = 0; j < sizeof(LOADGEN_STATS) / sizeof(unsigned long long); j++)
+            pDest[j] += __atomic_load_n(&pSrc[j], __ATOMIC_RELAXED);
+    }
+}
+
+static void PrintInterval(double elapsed, double interval, const LOADGEN_STATS *pNow,
+                          const LOADGEN_STATS *pPrev, DWORD pairCount,
+                          pid_t relayPid, const PROC_SAMPLE *pRelayNow, const PROC_SAMPLE *pRelayPrev)
+{
+    printf("[%5.1fs] pairs %llu/%u  conn/s %6.0f  fwd %8.2f MB/s  %8.0f frames/s",
+           elapsed, pNow->activePairs, pairCount,
+           (double)(pNow->pairsEstablished - pPrev->pairsEstablished) * 2 / interval,
+           (double)(pNow->bytesReceived - pPrev->bytesReceived) / interval / 1e6,
+           (double)(pNow->framesReceived - pPrev->framesReceived) / interval);
+    if (relayPid)
+        printf("  relay cpu %5.1f%% rss %u KB",
+               (pRelayNow->cpuSeconds - pRelayPrev->cpuSeconds) / interval * 100.0,
+               pRelayNow->rssKb);
+    printf("\n");
+    fflush(stdout);
+}
+
+static void PrintReport(LOADGEN_WORKER *workers, DWORD workerCount, const LOADGEN_STATS *pTotal,
+                        double elapsed, double rampSeconds, DWORD pairCount,
+                        pid_t relayPid, const PROC_SAMPLE *pRelayStart, const PROC_SAMPLE *pRelayEnd,
+                        const PROC_SAMPLE *pSelfStart, const PROC_SAMPLE *pSelfEnd)
+{
+    RELAY_HIST latency, setup;
+    char summary[160];
+    DWORD i;
+
+    Hist_Reset(&latency);
+    Hist_Reset(&setup);
+    for (i = 0; i < workerCount; i++) {
+        Hist_Merge(&latency, &workers[i].latency);
+        Hist_Merge(&setup, &workers[i].setup);
+    }
+
+    printf("\n");
+    if (rampSeconds > 0)
+        printf("Setup:       %u pairs paired in %.2f s (%.0f connections/s)\n",
+               pairCount, rampSeconds, (double)pairCount * 2 / rampSeconds);
+    else
+        printf("Setup:       only %llu of %u pairs paired\n", pTotal->activePairs, pairCount);
+    printf("Sessions:    %llu established (%.0f connections/s over the run), %llu ended, "
+           "%llu dropped, %llu failed setups\n",
+           pTotal->pairsEstablished, (double)pTotal->pairsEstablished * 2 / elapsed,
+           pTotal->sessionsEnded, pTotal->sessionsDropped, pTotal->setupFailures);
+    Hist_Format(&setup, summary, sizeof(summary));
+    printf("Setup us:    %s\n", summary);
+
+    printf("Forwarded:   %.2f MB in %.1f s = %.2f MB/s, %.0f frames/s (sent %.2f MB, %llu events skipped)\n",
+           (double)pTotal->bytesReceived / 1e6, elapsed,
+           (double)pTotal->bytesReceived / elapsed / 1e6,
+           (double)pTotal->framesReceived / elapsed,
+           (double)pTotal->bytesSent / 1e6, pTotal->skippedEvents);
+    printf("Latency us:  p50=%u p99=%u p999=%u max=%u (n=%llu mean=%llu)\n",
+           Hist_Percentile(&latency, 500), Hist_Percentile(&latency, 990),
+           Hist_Percentile(&latency, 999), latency.max, latency.total,
+           latency.total ? latency.sum / latency.total : 0);
+
+    if (relayPid) {
+        printf("Relay:       pid %d, cpu %.1f%% (%.2f s), rss %u KB, peak %u KB\n",
+               (int)relayPid, (pRelayEnd->cpuSeconds - pRelayStart->cpuSeconds) / elapsed * 100.0,
+               pRelayEnd->cpuSeconds - pRelayStart->cpuSeconds,
+               pRelayEnd->rssKb, pRelayEnd->peakRssKb);
+        if ((g_mix & LOADGEN_MIX_IDLE) && pTotal->activePairs > 0)
+            printf("Idle:        %.0f bytes of relay rss per registration (%llu registered)\n",
+                   ((double)pRelayEnd->rssKb - (double)pRelayStart->rssKb) * 1024 /
+                   (double)(pTotal->activePairs * 2), pTotal->activePairs * 2);
+    } else
+        printf("Relay:       process not found, use --relay-pid for CPU and RSS\n");
+    printf("Loadgen:     cpu %.1f%% (%.2f s), peak rss %u KB\n",
+           (pSelfEnd->cpuSeconds - pSelfStart->cpuSeconds) / elapsed * 100.0,
+           pSelfEnd->cpuSeconds - pSelfStart->cpuSeconds, pSelfEnd->peakRssKb);
+}
+
+/* ============================================================
+ * MAIN
+ * ============================================================ */
+
+static void PrintHelp(const char *progname)
+{
+    fprintf(stdout, "Usage: %s [OPTIONS]\n\n", progname);
+    fprintf(stdout, "Options:\n");
+    fprintf(stdout, "  -s, --server HOST    Relay address (default: 127.0.0.1)\n");
+    fprintf(stdout, "  -p, --port PORT      Relay port (default: 5000)\n");
+    fprintf(stdout, "  -n, --pairs N        Host/viewer pairs (default: %d)\n", LOADGEN_DEFAULT_PAIRS);
+    fprintf(stdout, "  -d, --duration SEC   Length of the run (default: %d)\n", LOADGEN_DEFAULT_DURATION);
+    fprintf(stdout, "  -m, --mix LIST       Traffic: screen,mouse,bulk or idle (default: screen,mouse)\n");
+    fprintf(stdout, "  -l, --lifetime MS    End each session after MS and reconnect (default: never)\n");
+    fprintf(stdout, "  -c, --chunk BYTES    Largest screen/bulk DATA frame (default: %d)\n", LOADGEN_CHUNK);
+    fprintf(stdout, "  -t, --threads N      Client threads (default: 1)\n");
+    fprintf(stdout, "  -r, --relay-pid PID  Relay process to sample (default: from %s)\n", LOADGEN_LOCK_FILE);
+    fprintf(stdout, "  -h, --help           Show this help message\n");
+    fprintf(stdout, "\n");
+    fprintf(stdout, "Examples:\n");
+    fprintf(stdout, "  %s -n 500 -d 30              # 500 remote desktop sessions\n", progname);
+    fprintf(stdout, "  %s -n 50 -m bulk             # File transfer throughput\n", progname);
+    fprintf(stdout, "  %s -n 50 -m bulk -c 1048576  # 1 MB frames (relay cut-through)\n", progname);
+    fprintf(stdout, "  %s -n 200 -m mouse -l 500    # Connection churn\n", progname);
+    fprintf(stdout, "  %s -n 20000 -m idle -t 4     # Relay memory per waiting client\n", progname);
+    fprintf(stdout, "\n");
+}
+
+static BOOL ParseMix(const char *list, DWORD *pMix)
+{
+    char buffer[64];
+    char *name;
+
+    strncpy(buffer, list, sizeof(buffer) - 1);
+    buffer[sizeof(buffer) - 1] = '\0';
+    *pMix = 0;
+
+    for (name = strtok(buffer, ","); name; name = strtok(NULL, ",")) {
+        if (strcmp(name, "screen") == 0) *pMix |= LOADGEN_MIX_SCREEN;
+        else if (strcmp(name, "mouse") == 0) *pMix |= LOADGEN_MIX_MOUSE;
+        else if (strcmp(name, "bulk") == 0) *pMix |= LOADGEN_MIX_BULK;
+        else if (strcmp(name, "idle") == 0) *pMix |= LOADGEN_MIX_IDLE;
+        else return FALSE;
+    }
+    return *pMix != 0 && (*pMix == LOADGEN_MIX_IDLE || !(*pMix & LOADGEN_MIX_IDLE));
+}
+
+static BOOL ResolveServer(const char *host, WORD port)
+{
+    struct addrinfo hints, *pResult;
+
+    ZeroMemory(&hints, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, NULL, &hints, &pResult) != 0) return FALSE;
+
+    memcpy(&g_serverAddr, pResult->ai_addr, sizeof(g_serverAddr));
+    g_serverAddr.sin_port = htons(port);
+    freeaddrinfo(pResult);
+    return TRUE;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *server = "127.0.0.1";
+    const char *mixName = "screen,mouse";
+    WORD port = RELAY_DEFAULT_PORT;
+    DWORD pairCount = LOADGEN_DEFAULT_PAIRS;
+    DWORD duration = LOADGEN_DEFAULT_DURATION;
+    DWORD threadCount = 1;
+    pid_t relayPid = 0;
+    LOADGEN_WORKER *workers;
+    LOADGEN_STATS total, prev;
+    PROC_SAMPLE relayStart, relayPrev, relayNow, selfStart, selfEnd;
+    double start, lastReport, now, rampSeconds = 0;
+    DWORD i;
+    int arg;
+
+    for (arg = 1; arg < argc; arg++) {
+        if (strcmp(argv[arg], "-s") == 0 || strcmp(argv[arg], "--server") == 0) {
+            if (arg + 1 < argc) server = argv[++arg];
+        } else if (strcmp(argv[arg], "-p") == 0 || strcmp(argv[arg], "--port") == 0) {
+            if (arg + 1 < argc) {
+                port = (WORD)atoi(argv[++arg]);
+                if (port == 0) port = RELAY_DEFAULT_PORT;
+            }
+        } else if (strcmp(argv[arg], "-n") == 0 || strcmp(argv[arg], "--pairs") == 0) {
+            if (arg + 1 < argc) pairCount = (DWORD)atoi(argv[++arg]);
+        } else if (strcmp(argv[arg], "-d") == 0 || strcmp(argv[arg], "--duration") == 0) {
+            if (arg + 1 < argc) duration = (DWORD)atoi(argv[++arg]);
+        } else if (strcmp(argv[arg], "-m") == 0 || strcmp(argv[arg], "--mix") == 0) {
+            if (arg + 1 < argc) {
+                mixName = argv[++arg];
+                if (!ParseMix(mixName, &g_mix)) {
+                    fprintf(stderr, "Unknown traffic mix: %s\n", mixName);
+                    return 1;
+                }
+            }
+        } else if (strcmp(argv[arg], "-l") == 0 || strcmp(argv[arg], "--lifetime") == 0) {
+            if (arg + 1 < argc) g_lifetimeUs = (unsigned long long)atoi(argv[++arg]) * 1000;
+        } else if (strcmp(argv[arg], "-c") == 0 || strcmp(argv[arg], "--chunk") == 0) {
+            if (arg + 1 < argc) g_chunk = (DWORD)atoi(argv[++arg]);
+        } else if (strcmp(argv[arg], "-t") == 0 || strcmp(argv[arg], "--threads") == 0) {
+            if (arg + 1 < argc) threadCount = (DWORD)atoi(argv[++arg]);
+        } else if (strcmp(argv[arg], "-r") == 0 || strcmp(argv[arg], "--relay-pid") == 0) {
+            if (arg + 1 < argc) relayPid = (pid_t)atoi(argv[++arg]);
+        } else if (strcmp(argv[arg], "-h") == 0 || strcmp(argv[arg], "--help") == 0) {
+            PrintHelp(argv[0]);
+            return 0;
+        } else {
+            fprintf(stderr, "Unknown option: %s\n", argv[arg]);
+            PrintHelp(argv[0]);
+            return 1;
+        }
+    }
+
+    if (pairCount == 0 || duration == 0) {
+        fprintf(stderr, "[ERROR] --pairs and --duration must be at least 1\n");
+        return 1;
+    }
+    if (g_chunk < LOADGEN_STAMP_SIZE) {
+        fprintf(stderr, "[ERROR] --chunk must be at least %d\n", LOADGEN_STAMP_SIZE);
+        return 1;
+    }
+    if (threadCount < 1) threadCount = 1;
+    if (threadCount > LOADGEN_THREADS_MAX) threadCount = LOADGEN_THREADS_MAX;
+    if (threadCount > pairCount) threadCount = pairCount;
+
+    if (!ResolveServer(server, port)) {
+        fprintf(stderr, "[ERROR] Cannot resolve %s\n", server);
+        return 1;
+    }
+    if (!relayPid) relayPid = FindRelayPid();
+
+    RaiseFileLimit();
+    signal(SIGINT, SignalHandler);
+    signal(SIGTERM, SignalHandler);
+    signal(SIGPIPE, SIG_IGN);
+
+    Crypto_Init(NULL);
+    g_nextId = LOADGEN_ID_BASE + (((DWORD)getpid() & 0xFF) << 20);
+
+    g_fill = (BYTE*)malloc(g_chunk);
+    workers = (LOADGEN_WORKER*)calloc(threadCount, sizeof(LOADGEN_WORKER));
+    if (!g_fill || !workers) {
+        fprintf(stderr, "[ERROR] Out of memory\n");
+        return 1;
+    }
+    memset(g_fill, 0x5A, g_chunk);
+    for (i = 0; i < threadCount; i++) {
+        DWORD share = pairCount / threadCount + (i < pairCount % threadCount ? 1 : 0);
+        if (!InitWorker(&workers[i], i, share)) {
+            fprintf(stderr, "[ERROR] Out of memory\n");
+            return 1;
+        }
+    }
+
+    printf("relay_loadgen: %u pairs against %s:%u for %u s, mix %s, %u thread(s)\n",
+           pairCount, server, port, duration, mixName, threadCount);
+
+    ZeroMemory(&relayStart, sizeof(relayStart));
+    if (relayPid && !SampleProcess(relayPid, &relayStart)) relayPid = 0;
+    relayPrev = relayStart;
+    relayNow = relayStart;
+    SampleSelf(&selfStart);
+    ZeroMemory(&prev, sizeof(prev));
+
+    start = (double)NowMicroseconds() / 1e6;
+    lastReport = start;
+    for (i = 0; i < threadCount; i++)
+        pthread_create(&workers[i].thread, NULL, WorkerThread, &workers[i]);
+
+    /* Report once a second; the ramp ends when every pair is up */
+    while (g_bRunning) {
+        usleep(10000);
+        now = (double)NowMicroseconds() / 1e6;
+
+        if (rampSeconds == 0) {
+            SumStats(workers, threadCount, &total);
+            if (total.activePairs == pairCount) rampSeconds = now - start;
+        }
+        if (now - lastReport >= 1.0) {
+            SumStats(workers, threadCount, &total);
+            if (relayPid) SampleProcess(relayPid, &relayNow);
+            PrintInterval(now - start, now - lastReport, &total, &prev, pairCount,
+                          relayPid, &relayNow, &relayPrev);
+            prev = total;
+            relayPrev = relayNow;
+            lastReport = now;
+        }
+        if (now - start >= (double)duration) break;
+    }
+
+    /* Totals cover the traffic phase, not the drain */
+    now = (double)NowMicroseconds() / 1e6;
+    SumStats(workers, threadCount, &total);
+    if (relayPid) SampleProcess(relayPid, &relayNow);
+    SampleSelf(&selfEnd);
+
+    g_bRunning = 0;
+    for (i = 0; i < threadCount; i++)
+        pthread_join(workers[i].thread, NULL);
+
+    PrintReport(workers, threadCount, &total, now - start, rampSeconds, pairCount,
+                relayPid, &relayStart, &relayNow, &selfStart, &selfEnd);
+
+    for (i = 0; i < threadCount; i++)
+        FreeWorker(&workers[i]);
+    free(workers);
+    free(g_fill);
+    return 0;
+}
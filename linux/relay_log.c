@@ -0,0 +1,112 @@
+/*
+ * relay_log.c - Asynchronous Logging for RemoteDesk2K Linux Relay
+ *
+ * A ring set (relay_ring.c) whose records are the NUL terminated text,
+ * stamped with CLOCK_REALTIME. The set is created by the first Log_Start
+ * and never freed, so a thread racing Log_Stop still writes to live
+ * memory; what it queued goes out after the next Log_Start.
+ */
+
+#include "relay_log.h"
+#include "relay_ring.h"
+
+#define LOG_BATCH_MAX           256             /* Records between sink flushes */
+
+static RELAY_RINGS *g_pRings = NULL;
+static LOG_SINK g_pfnSink = NULL;
+static LOG_FLUSH g_pfnFlush = NULL;
+static BOOL g_bRunning = FALSE;             /* Atomic: Log_Write accepts records */
+
+static unsigned long long g_droppedReported = 0;   /* Writer only */
+
+/* ============================================================
+ * HELPERS
+ * ============================================================ */
+
+static unsigned long long RealtimeUs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000 + (unsigned long long)ts.tv_nsec / 1000;
+}
+
+static void SinkRecord(void *pContext, unsigned long long timeUs, const BYTE *data, DWORD length)
+{
+    (void)pContext;
+    (void)length;
+
+    g_pfnSink((const char*)data, timeUs);
+}
+
+static void FlushSink(void *pContext, DWORD count)
+{
+    RING_STATS stats;
+
+    (void)pContext;
+
+    /* Say so when records were lost, in the stream where they are missing */
+    Rings_GetStats(g_pRings, &stats);
+    if (stats.dropped > g_droppedReported) {
+        char message[96];
+        snprintf(message, sizeof(message), "[WARN] Log: %llu messages dropped (ring full)\n",
+                 stats.dropped - g_droppedReported);
+        g_droppedReported = stats.dropped;
+        g_pfnSink(message, RealtimeUs());
+        count++;
+    }
+
+    if (count > 0 && g_pfnFlush) g_pfnFlush();
+}
+
+/* ============================================================
+ * PUBLIC API
+ * ============================================================ */
+
+int Log_Start(LOG_SINK pfnSink, LOG_FLUSH pfnFlush)
+{
+    if (!pfnSink) return RD2K_ERR_MEMORY;
+    if (__atomic_load_n(&g_bRunning, __ATOMIC_ACQUIRE)) return RD2K_SUCCESS;
+
+    if (!g_pRings) {
+        g_pRings = Rings_Create(LOG_RING_SIZE, LOG_BATCH_MAX, SinkRecord, FlushSink, NULL);
+        if (!g_pRings) return RD2K_ERR_MEMORY;
+    }
+
+    g_pfnSink = pfnSink;
+    g_pfnFlush = pfnFlush;
+    if (Rings_Start(g_pRings) != RD2K_SUCCESS) return RD2K_ERR_SOCKET;
+
+    __atomic_store_n(&g_bRunning, TRUE, __ATOMIC_RELEASE);
+    return RD2K_SUCCESS;
+}
+
+void Log_Stop(void)
+{
+    if (!__atomic_exchange_n(&g_bRunning, FALSE, __ATOMIC_ACQ_REL)) return;
+
+    Rings_Stop(g_pRings);
+}
+
+BOOL Log_Write(const char *message)
+{
+    DWORD length;
+
+    if (!__atomic_load_n(&g_bRunning, __ATOMIC_ACQUIRE)) return FALSE;
+
+    length = (DWORD)strlen(message);
+    if (length > LOG_MESSAGE_MAX - 1) length = LOG_MESSAGE_MAX - 1;
+
+    return Rings_Append(g_pRings, RealtimeUs(), message, length, "", 1);
+}
+
+void Log_GetStats(LOG_STATS *pStats)
+{
+    RING_STATS stats;
+
+    if (!pStats) return;
+
+    Rings_GetStats(g_pRings, &stats);
+    pStats->records = stats.records;
+    pStats->dropped = stats.dropped;
+    pStats->batches = stats.batches;
+}
@@ -0,0 +1,47 @@
+/*
+ * relay_log.h - Asynchronous Logging for RemoteDesk2K Linux Relay
+ *
+ * Every thread that logs gets its own single-producer ring of records
+ * (timestamp, length, text). A writer thread drains all rings in
+ * timestamp order and hands the messages to a sink, flushing it once per
+ * batch. Producers never take a lock or make a blocking call: a full
+ * ring drops the record and counts it, and the writer is woken through
+ * an eventfd only when it is idle.
+ */
+
+#ifndef _RD2K_RELAY_LOG_H_
+#define _RD2K_RELAY_LOG_H_
+
+#include "common.h"
+
+#define LOG_RING_SIZE           (128 * 1024)    /* Bytes per thread, power of two */
+#define LOG_MESSAGE_MAX         512             /* Longer messages are truncated */
+
+/* Called on the writer thread for each message, oldest first.
+ * timeUs is the CLOCK_REALTIME time the message was logged */
+typedef void (*LOG_SINK)(const char *message, unsigned long long timeUs);
+
+/* Called on the writer thread after each batch of messages */
+typedef void (*LOG_FLUSH)(void);
+
+typedef struct _LOG_STATS {
+    unsigned long long  records;            /* Handed to the sink */
+    unsigned long long  dropped;            /* Lost to a full ring */
+    unsigned long long  batches;            /* Sink flushes */
+} LOG_STATS;
+
+/* Start the writer thread. Returns RD2K_SUCCESS, RD2K_ERR_MEMORY or
+ * RD2K_ERR_SOCKET (eventfd or thread creation failed) */
+int Log_Start(LOG_SINK pfnSink, LOG_FLUSH pfnFlush);
+
+/* Write out everything queued and stop the writer thread */
+void Log_Stop(void);
+
+/* Queue a message. FALSE if the writer is not running, in which case
+ * the caller should write the message itself */
+BOOL Log_Write(const char *message);
+
+/* Counters since the first Log_Start */
+void Log_GetStats(LOG_STATS *pStats);
+
+#endif /* _RD2K_RELAY_LOG_H_ */
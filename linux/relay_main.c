@@ -11,23 +11,52 @@
 #include "common.h"
 #include "crypto.h"
 #include "relay.h"
+#include "relay_admit.h"
+#include "relay_capture.h"
+#include "relay_cluster.h"
+#include "relay_log.h"
+#include "relay_pool.h"
+#include "relay_upgrade.h"
 #include <sys/file.h>  /* For flock() */
+#include <sys/resource.h>  /* For setrlimit() */
+#include <sys/eventfd.h>
+#include <sys/stat.h>  /* For chmod() */
+#include <sys/un.h>
+#include <poll.h>
+#include <sched.h>  /* For CPU_SETSIZE */
 
 /* ============================================================
  * GLOBAL STATE
  * ============================================================ */
 
 static RELAY_SERVER *g_pServer = NULL;
+static RELAY_CLUSTER *g_pCluster = NULL;  /* NULL unless --cluster-port is given */
+static RELAY_CAPTURE *g_pCapture = NULL;  /* NULL unless --capture is given */
 static volatile int g_bRunning = 1;
+static volatile int g_bDumpHist = 0;  /* SIGUSR1 received */
+static volatile int g_stopSignal = 0;  /* SIGINT/SIGTERM received, reported by main */
+static int g_wakeFd = -1;  /* eventfd the signal handlers wake the main loop with */
 static int g_bDaemon = 0;
 static int g_bColor = 1;
 static FILE *g_logFile = NULL;
 static pthread_mutex_t g_printMutex = PTHREAD_MUTEX_INITIALIZER;
 static char g_customIp[64] = "";  /* Custom IP for Server ID (for local testing) */
 static int g_lockFd = -1;  /* Lock file descriptor for single instance */
+static int g_metricsFd = -1;  /* Metrics endpoint listener, -1 if disabled */
+static int g_adminStopFd = -1;  /* eventfd that stops the admin thread, -1 if not running */
+static pthread_t g_adminThread;
+static int g_upgradeFd = -1;  /* Upgrade socket listener, -1 if unavailable */
+static int g_controlFd = -1;  /* Control socket listener, -1 if disabled */
+static int g_upgradeChannel = -1;  /* Successor that took our sockets */
+static int g_bUpgraded = 0;  /* Sockets handed to a successor */
 
-/* Lock file path */
+/* Lock file path. Cluster nodes may share a machine, so each locks its port */
 #define LOCK_FILE_PATH  "/tmp/rd2k_relay.lock"
+#define LOCK_FILE_NODE  "/tmp/rd2k_relay.%u.lock"
+static char g_lockPath[64] = LOCK_FILE_PATH;
+
+#define MAX_CLIENT_SHARES   64  /* Clients given a --weight or --rate-cap */
+#define MAX_CLIENT_WEIGHT   1000
 
 /* ANSI color codes */
 #define COLOR_RESET     "\033[0m"
@@ -47,19 +76,19 @@ static int g_lockFd = -1;  /* Lock file descriptor for single instance */
  * Returns: 0 on success, -1 if another instance is running */
 static int AcquireLock(void)
 {
-    g_lockFd = open(LOCK_FILE_PATH, O_CREAT | O_RDWR, 0644);
+    g_lockFd = open(g_lockPath, O_CREAT | O_RDWR, 0644);
     if (g_lockFd < 0) {
-        perror(\"Failed to open lock file\");
+        perror("Failed to open lock file");
         return -1;
     }
     
     /* Try to acquire exclusive lock (non-blocking) */
     if (flock(g_lockFd, LOCK_EX | LOCK_NB) < 0) {
         if (errno == EWOULDBLOCK) {
-            fprintf(stderr, \"\\n*** ERROR: Another instance of Relay Server is already running! ***\\n\");
-            fprintf(stderr, \"Close the other instance first.\\n\\n\");
+            fprintf(stderr, "\n*** ERROR: Another instance of Relay Server is already running! ***\n");
+            fprintf(stderr, "Close the other instance first.\n\n");
         } else {
-            perror(\"Failed to acquire lock\");
+            perror("Failed to acquire lock");
         }
         close(g_lockFd);
         g_lockFd = -1;
@@ -69,7 +98,7 @@ static int AcquireLock(void)
     /* Write PID to lock file */
     {
         char pid_str[32];
-        int len = snprintf(pid_str, sizeof(pid_str), \"%d\\n\", (int)getpid());
+        int len = snprintf(pid_str, sizeof(pid_str), "%d\n", (int)getpid());
         if (ftruncate(g_lockFd, 0) == 0) {
             (void)write(g_lockFd, pid_str, len);
         }
@@ -78,36 +107,54 @@ static int AcquireLock(void)
     return 0;
 }
 
-/* Release single instance lock */
+/* Record our PID in a lock taken over from the process we replace */
+static void AdoptLock(int lockFd)
+{
+    char pid_str[32];
+    int len = snprintf(pid_str, sizeof(pid_str), "%d\n", (int)getpid());
+    
+    g_lockFd = lockFd;
+    if (ftruncate(g_lockFd, 0) == 0) {
+        (void)pwrite(g_lockFd, pid_str, len, 0);
+    }
+}
+
+/* Release single instance lock. After a handoff the successor holds the
+ * same lock (flock belongs to the shared open file), so only our
+ * descriptor is closed */
 static void ReleaseLock(void)
 {
-    if (g_lockFd >= 0) {
+    if (g_lockFd >= 0 && g_bUpgraded) {
+        close(g_lockFd);
+        g_lockFd = -1;
+    } else if (g_lockFd >= 0) {
         flock(g_lockFd, LOCK_UN);
         close(g_lockFd);
         g_lockFd = -1;
-        unlink(LOCK_FILE_PATH);
+        unlink(g_lockPath);
     }
 }
 
 /* ============================================================ * LOGGING
  * ============================================================ */
 
-static void GetTimestamp(char *buffer, size_t len)
+static void GetTimestamp(char *buffer, size_t len, time_t when)
 {
-    time_t now;
-    struct tm *tm_info;
+    struct tm tm_info;
     
-    time(&now);
-    tm_info = localtime(&now);
-    strftime(buffer, len, "%Y-%m-%d %H:%M:%S", tm_info);
+    localtime_r(&when, &tm_info);
+    strftime(buffer, len, "%Y-%m-%d %H:%M:%S", &tm_info);
 }
 
-static void LogCallback(const char *message)
+/* Log sink: runs on the log writer thread (see relay_log.c), or on the
+ * caller's thread while the writer is not running. Streams are flushed
+ * once per batch by FlushLog */
+static void WriteLogMessage(const char *message, unsigned long long timeUs)
 {
     char timestamp[32];
     const char *color = COLOR_RESET;
     
-    GetTimestamp(timestamp, sizeof(timestamp));
+    GetTimestamp(timestamp, sizeof(timestamp), (time_t)(timeUs / 1000000));
     
     /* Determine color based on message type */
     if (strstr(message, "[ERROR]")) {
@@ -135,7 +182,6 @@ static void LogCallback(const char *message)
     if (g_logFile) {
         /* Plain text for log file */
         fprintf(g_logFile, "[%s] %s\n", timestamp, message);
-        fflush(g_logFile);
     }
     
     if (!g_bDaemon) {
@@ -150,39 +196,86 @@ static void LogCallback(const char *message)
         /* Add newline if message doesn't have one */
         if (message[strlen(message)-1] != '\n')
             fprintf(stdout, "\n");
-        
-        fflush(stdout);
     }
     
     pthread_mutex_unlock(&g_printMutex);
 }
 
+static void FlushLog(void)
+{
+    pthread_mutex_lock(&g_printMutex);
+    if (g_logFile) fflush(g_logFile);
+    if (!g_bDaemon) fflush(stdout);
+    pthread_mutex_unlock(&g_printMutex);
+}
+
+/* Relay log callback: queue for the writer thread, never block on I/O */
+static void LogCallback(const char *message)
+{
+    if (!Log_Write(message)) {
+        WriteLogMessage(message, (unsigned long long)time(NULL) * 1000000);
+        FlushLog();
+    }
+}
+
 /* ============================================================
  * SIGNAL HANDLING
  * ============================================================ */
 
+static void WakeMainLoop(void)
+{
+    uint64_t one = 1;
+    int savedErrno = errno;
+    
+    if (g_wakeFd >= 0 && write(g_wakeFd, &one, sizeof(one)) < 0) {
+        /* Counter saturated - the main loop is awake anyway */
+    }
+    errno = savedErrno;
+}
+
+/* Only async-signal-safe work here: the interrupted thread may hold
+ * g_printMutex or be inside stdio. The main loop reports the signal */
 static void SignalHandler(int sig)
 {
+    g_stopSignal = sig;
+    g_bRunning = 0;
+    WakeMainLoop();
+}
+
+static void DumpSignalHandler(int sig)
+{
+    (void)sig;
+    g_bDumpHist = 1;
+    WakeMainLoop();
+}
+
+static void ReportStopSignal(void)
+{
+    int sig = g_stopSignal;
+    
+    if (sig == 0 || g_bDaemon) return;
+    
     pthread_mutex_lock(&g_printMutex);
     
-    if (g_bColor && !g_bDaemon) {
+    if (g_bColor) {
         fprintf(stdout, "\n%s%s>>> Received signal %d (%s), shutting down...%s\n",
                 COLOR_BOLD, COLOR_YELLOW, sig,
                 sig == SIGINT ? "SIGINT" : sig == SIGTERM ? "SIGTERM" : "UNKNOWN",
                 COLOR_RESET);
-    } else if (!g_bDaemon) {
+    } else {
         fprintf(stdout, "\n>>> Received signal %d, shutting down...\n", sig);
     }
     
     pthread_mutex_unlock(&g_printMutex);
-    
-    g_bRunning = 0;
 }
 
 static void SetupSignalHandlers(void)
 {
     struct sigaction sa;
     
+    /* Without it the main loop falls back to polling the flags */
+    g_wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    
     memset(&sa, 0, sizeof(sa));
     sa.sa_handler = SignalHandler;
     sigemptyset(&sa.sa_mask);
@@ -191,6 +284,10 @@ static void SetupSignalHandlers(void)
     sigaction(SIGINT, &sa, NULL);
     sigaction(SIGTERM, &sa, NULL);
     
+    /* SIGUSR1 dumps the forwarding histograms from the main loop */
+    sa.sa_handler = DumpSignalHandler;
+    sigaction(SIGUSR1, &sa, NULL);
+    
     /* Ignore SIGPIPE (broken pipe) - handle in send() instead */
     signal(SIGPIPE, SIG_IGN);
 }
@@ -234,6 +331,40 @@ static void PrintHelp(const char *progname)
     fprintf(stdout, "  -d, --daemon         Run as daemon (background)\n");
     fprintf(stdout, "  -l, --log FILE       Log output to file\n");
     fprintf(stdout, "  -n, --no-color       Disable colored output\n");
+    fprintf(stdout, "  -s, --shards N       Event loop threads (default: one per CPU)\n");
+    fprintf(stdout, "      --cpus LIST      Pin shards to these CPUs in turn, e.g. 0-7,16-23, with\n");
+    fprintf(stdout, "                       their buffers on the CPUs' NUMA nodes (default: one\n");
+    fprintf(stdout, "                       shard per listed CPU)\n");
+    fprintf(stdout, "      --steer-accepts  Accept each connection on the shard pinned to the CPU\n");
+    fprintf(stdout, "                       that receives its packets (needs --cpus)\n");
+    fprintf(stdout, "      --splice         Zero-copy DATA forwarding with splice()\n");
+    fprintf(stdout, "      --uring          Use io_uring instead of epoll for socket I/O\n");
+    fprintf(stdout, "      --coalesce US    Hold small DATA output up to US microseconds to\n");
+    fprintf(stdout, "                       merge sends (default: off, epoll only)\n");
+    fprintf(stdout, "      --coalesce-bytes N  Write held output once N bytes wait (default: %d)\n",
+            RELAY_COALESCE_BYTES);
+    fprintf(stdout, "  -m, --metrics PORT   Serve Prometheus metrics on 127.0.0.1:PORT\n");
+    fprintf(stdout, "      --control PATH   Answer admin commands (sessions, hist, close ID) on\n");
+    fprintf(stdout, "                       UNIX socket PATH\n");
+    fprintf(stdout, "      --cluster-port PORT  Join a relay cluster, peer links on PORT\n");
+    fprintf(stdout, "      --peer IP:PORT   Cluster port of another node (repeat for each node)\n");
+    fprintf(stdout, "      --node-id N      Cluster node ID shown in peers' logs (default: random)\n");
+    fprintf(stdout, "      --takeover       Replace the relay running on the port, keeping its\n");
+    fprintf(stdout, "                       clients connected (shard count follows the old one)\n");
+    fprintf(stdout, "      --limit-accept RATE[/BURST]  Connections per second from one source IP\n");
+    fprintf(stdout, "      --limit-register RATE[/BURST]  Registrations per second from one source IP\n");
+    fprintf(stdout, "      --limit-accept-total RATE[/BURST]  Connections per second, all sources\n");
+    fprintf(stdout, "      --limit-register-total RATE[/BURST]  Registrations per second, all sources\n");
+    fprintf(stdout, "                       (default: unlimited; BURST defaults to twice RATE)\n");
+    fprintf(stdout, "      --fair           Share output between sessions round robin (epoll only)\n");
+    fprintf(stdout, "      --uplink RATE    Pace all output to RATE bytes/s (K/M/G), implies --fair\n");
+    fprintf(stdout, "      --weight ID=N    Quanta per round for what client ID sends (default: 1)\n");
+    fprintf(stdout, "      --rate-cap ID=RATE  Cap what client ID sends at RATE bytes/s\n");
+    fprintf(stdout, "                       (ID as logged, dots for spaces, or * for every client;\n");
+    fprintf(stdout, "                       both imply --fair)\n");
+    fprintf(stdout, "      --capture FILE   Record client frames and their timing to FILE\n");
+    fprintf(stdout, "                       (replay with relay_replay)\n");
+    fprintf(stdout, "      --capture-payloads  Also record DATA payloads (default: sizes only)\n");
     fprintf(stdout, "  -h, --help           Show this help message\n");
     fprintf(stdout, "  -v, --version        Show version information\n");
     fprintf(stdout, "\n");
@@ -242,13 +373,185 @@ static void PrintHelp(const char *progname)
     fprintf(stdout, "  %s -p 5900           # Listen on port 5900\n", progname);
     fprintf(stdout, "  %s -p 80 -i 127.0.0.1  # Local testing (Server ID uses 127.0.0.1)\n", progname);
     fprintf(stdout, "  %s -d -l relay.log   # Run as daemon with logging\n", progname);
+    fprintf(stdout, "  %s -m 9100           # Metrics at http://127.0.0.1:9100/metrics\n", progname);
+    fprintf(stdout, "  %s --control /run/rd2k.ctl  # Then: echo sessions | nc -U /run/rd2k.ctl\n",
+            progname);
+    fprintf(stdout, "  %s -p 5001 --cluster-port 6001 --peer 127.0.0.1:6002\n", progname);
+    fprintf(stdout, "                       # Node 1 of a two-node cluster on one machine\n");
+    fprintf(stdout, "  %s -p 5900 --takeover  # Upgrade the relay on port 5900 in place\n", progname);
+    fprintf(stdout, "  %s --limit-accept 5/20  # Refuse sources reconnecting faster than 5/s\n", progname);
+    fprintf(stdout, "  %s --uplink 11M --rate-cap '*=4M'\n", progname);
+    fprintf(stdout, "                       # 100 Mbit/s uplink, no client above a third of it\n");
+    fprintf(stdout, "  %s --capture incident.cap  # Record traffic for relay_replay\n", progname);
+    fprintf(stdout, "  %s --cpus 0-7 --steer-accepts\n", progname);
+    fprintf(stdout, "                       # Eight shards on CPUs 0-7, each serving its own RX queue\n");
     fprintf(stdout, "\n");
     fprintf(stdout, "Signals:\n");
     fprintf(stdout, "  SIGINT (Ctrl+C)      Graceful shutdown\n");
     fprintf(stdout, "  SIGTERM              Graceful shutdown\n");
+    fprintf(stdout, "  SIGUSR1              Log forwarding delay and frame size histograms\n");
     fprintf(stdout, "\n");
 }
 
+/* "RATE[/BURST]" for the --limit-* options. Returns 0 or -1 */
+static int ParseLimit(const char *text, ADMIT_LIMIT *pLimit)
+{
+    unsigned long rate, burst = 0;
+    BOOL bBad;
+    char *end;
+    
+    rate = strtoul(text, &end, 10);
+    bBad = end == text;
+    if (!bBad && *end == '/') {
+        const char *p = end + 1;
+        
+        burst = strtoul(p, &end, 10);
+        bBad = end == p;
+    }
+    if (bBad || *end != '\0' || rate == 0 || rate > ADMIT_RATE_MAX || burst > ADMIT_BURST_MAX) {
+        fprintf(stderr, "Bad limit '%s' - expected RATE[/BURST], RATE 1 to %d, BURST 1 to %d\n",
+                text, ADMIT_RATE_MAX, ADMIT_BURST_MAX);
+        return -1;
+    }
+    pLimit->rate = (DWORD)rate;
+    pLimit->burst = (DWORD)burst;
+    return 0;
+}
+
+/* "N[K|M|G]" bytes per second. Returns 0 or -1 */
+static int ParseRate(const char *text, DWORD *pRate)
+{
+    unsigned long long rate;
+    char *end;
+    
+    rate = strtoull(text, &end, 10);
+    if (*end == 'K' || *end == 'k') {
+        rate *= 1024;
+        end++;
+    } else if (*end == 'M' || *end == 'm') {
+        rate *= 1024 * 1024;
+        end++;
+    } else if (*end == 'G' || *end == 'g') {
+        rate *= 1024ULL * 1024 * 1024;
+        end++;
+    }
+    if (*end != '\0' || rate == 0 || rate > 0xFFFFFFFFULL) {
+        fprintf(stderr, "Bad rate '%s' - expected bytes per second below 4G, K/M/G allowed\n", text);
+        return -1;
+    }
+    *pRate = (DWORD)rate;
+    return 0;
+}
+
+/* A client ID as the log shows it, with dots or spaces between the four
+ * parts. Returns the text after it, or NULL if there is none */
+static const char* ParseClientId(const char *text, DWORD *pId)
+{
+    const char *p = text;
+    DWORD id = 0;
+    DWORD part;
+    
+    for (part = 0; part < 4; part++) {
+        char *end;
+        unsigned long value = strtoul(p, &end, 10);
+        
+        if (end == p || value > 255 || (part < 3 && *end != '.' && *end != ' ')) return NULL;
+        id = (id << 8) | (DWORD)value;
+        p = part < 3 ? end + 1 : end;
+    }
+    
+    *pId = id;
+    return p;
+}
+
+/* "ID=VALUE" for --weight and --rate-cap. ID is a client ID as the log
+ * shows it, or * for every client. Returns 0 or -1 */
+static int ParseShare(const char *option, const char *text, RELAY_CLIENT_SHARE *pShares,
+                      DWORD *pCount)
+{
+    RELAY_CLIENT_SHARE *pShare = NULL;
+    DWORD clientId = RELAY_SHARE_ANY_CLIENT;
+    const char *p = text;
+    unsigned long weight;
+    char *end;
+    DWORD i;
+    
+    if (*p == '*') {
+        p++;
+    } else {
+        p = ParseClientId(p, &clientId);
+        if (clientId == RELAY_SHARE_ANY_CLIENT) p = NULL;
+    }
+    if (!p || *p != '=') {
+        fprintf(stderr, "Bad client '%s' for %s - expected ID=VALUE, ID like 010.000.000.001 or *\n",
+                text, option);
+        return -1;
+    }
+    p++;
+    
+    for (i = 0; i < *pCount; i++) {
+        if (pShares[i].clientId == clientId) pShare = &pShares[i];
+    }
+    if (!pShare) {
+        if (*pCount == MAX_CLIENT_SHARES) {
+            fprintf(stderr, "At most %d clients can have a weight or rate cap\n", MAX_CLIENT_SHARES);
+            return -1;
+        }
+        pShare = &pShares[(*pCount)++];
+        ZeroMemory(pShare, sizeof(RELAY_CLIENT_SHARE));
+        pShare->clientId = clientId;
+    }
+    
+    if (strcmp(option, "--rate-cap") == 0) return ParseRate(p, &pShare->rate);
+    
+    weight = strtoul(p, &end, 10);
+    if (end == p || *end != '\0' || weight == 0 || weight > MAX_CLIENT_WEIGHT) {
+        fprintf(stderr, "Bad weight '%s' - expected 1 to %d\n", p, MAX_CLIENT_WEIGHT);
+        return -1;
+    }
+    pShare->weight = (DWORD)weight;
+    return 0;
+}
+
+/* "0-7,16,18-19" for --cpus, in the order given. Returns 0 or -1 */
+static int ParseCpus(const char *text, int *pCpus, DWORD *pCount)
+{
+    long cpuMax = sysconf(_SC_NPROCESSORS_CONF);
+    const char *p = text;
+    
+    *pCount = 0;
+    while (*p) {
+        unsigned long first, last;
+        char *end;
+        
+        first = strtoul(p, &end, 10);
+        last = first;
+        if (end != p && *end == '-') {
+            p = end + 1;
+            last = strtoul(p, &end, 10);
+        }
+        if (end == p || (*end != ',' && *end != '\0') || last < first ||
+            (cpuMax > 0 && last >= (unsigned long)cpuMax) || last >= CPU_SETSIZE) {
+            fprintf(stderr, "Bad CPU list '%s' - expected CPUs or ranges below %ld, like 0-3,8\n",
+                    text, cpuMax > 0 ? cpuMax : (long)CPU_SETSIZE);
+            return -1;
+        }
+        while (first <= last) {
+            if (*pCount == RELAY_MAX_SHARDS) {
+                fprintf(stderr, "At most %d CPUs can be listed\n", RELAY_MAX_SHARDS);
+                return -1;
+            }
+            pCpus[(*pCount)++] = (int)first++;
+        }
+        p = *end == ',' ? end + 1 : end;
+    }
+    if (*pCount == 0) {
+        fprintf(stderr, "Bad CPU list '%s' - no CPUs\n", text);
+        return -1;
+    }
+    return 0;
+}
+
 static void PrintVersion(void)
 {
     fprintf(stdout, "RemoteDesk2K Linux Relay Server v1.0.0\n");
@@ -310,6 +613,22 @@ static int Daemonize(void)
     return 0;
 }
 
+/* ============================================================
+ * RESOURCE LIMITS
+ * ============================================================ */
+
+/* Every client holds one descriptor; lift the soft limit to the hard
+ * limit so the event loop is not capped at the usual 1024 */
+static void RaiseFileLimit(void)
+{
+    struct rlimit rl;
+    
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
 /* ============================================================
  * PUBLIC IP DETECTION VIA OPENDNS
  * ============================================================ */
@@ -554,6 +873,857 @@ static void PrintStatus(WORD port, const char *bindIp)
     pthread_mutex_unlock(&g_printMutex);
 }
 
+/* ============================================================
+ * STATISTICS
+ * ============================================================ */
+
+static void LogRelayStats(RELAY_SERVER *pServer)
+{
+    RELAY_STATS stats;
+    char line[256];
+    
+    Relay_GetStatsEx(pServer, &stats);
+    snprintf(line, sizeof(line),
+             "[INFO] Totals: %llu connections, %llu pairs, %llu frames (%llu KB) forwarded, %llu timeouts\n",
+             stats.totalConnections, stats.successfulPairs, stats.framesForwarded,
+             stats.bytesForwarded / 1024, stats.timeouts);
+    LogCallback(line);
+    snprintf(line, sizeof(line),
+             "[INFO] Backpressure: %llu sender pauses, %u paused now, %llu KB queued\n",
+             stats.backpressurePauses, stats.pausedReaders, stats.queuedBytes / 1024);
+    LogCallback(line);
+    if (stats.coalescedBatches > 0) {
+        snprintf(line, sizeof(line),
+                 "[INFO] Coalescing: %llu DATA batches held, written in %llu sends\n",
+                 stats.coalescedBatches, stats.coalescedSends);
+        LogCallback(line);
+    }
+    if (stats.scheduledBytes + stats.rateCapWaits + stats.uplinkWaits > 0) {
+        snprintf(line, sizeof(line),
+                 "[INFO] Fair scheduling: %llu KB written from session queues, "
+                 "%llu rate cap waits, %llu uplink waits\n",
+                 stats.scheduledBytes / 1024, stats.rateCapWaits, stats.uplinkWaits);
+        LogCallback(line);
+    }
+    if (stats.refusedAccepts[0] + stats.refusedAccepts[1] +
+        stats.refusedRegisters[0] + stats.refusedRegisters[1] > 0) {
+        snprintf(line, sizeof(line),
+                 "[PROTECT] Admission: %llu connections and %llu registrations refused "
+                 "(%llu/%llu over the totals), %u sources tracked\n",
+                 stats.refusedAccepts[0] + stats.refusedAccepts[1],
+                 stats.refusedRegisters[0] + stats.refusedRegisters[1],
+                 stats.refusedAccepts[1], stats.refusedRegisters[1], stats.admitSources);
+        LogCallback(line);
+    }
+    if (stats.remoteAccepts > 0) {
+        snprintf(line, sizeof(line),
+                 "[INFO] Placement: %llu of %llu connections accepted off the CPU taking their packets\n",
+                 stats.remoteAccepts, stats.totalConnections);
+        LogCallback(line);
+    }
+}
+
+static void LogClusterStats(RELAY_SERVER *pServer)
+{
+    CLUSTER_STATS stats;
+    RELAY_STATS relayStats;
+    char line[256];
+    
+    if (!g_pCluster) return;
+    
+    Cluster_GetStats(g_pCluster, &stats);
+    Relay_GetStatsEx(pServer, &relayStats);
+    snprintf(line, sizeof(line),
+             "[INFO] Cluster: %llu sessions through node links, %llu updates sent, "
+             "%llu received, %llu link failures\n",
+             relayStats.nodeLinkPairs, stats.updatesSent, stats.updatesReceived,
+             stats.linkFailures);
+    LogCallback(line);
+}
+
+static void LogCaptureStats(void)
+{
+    CAPTURE_STATS stats;
+    char line[256];
+    
+    if (!g_pCapture) return;
+    
+    Capture_GetStats(g_pCapture, &stats);
+    snprintf(line, sizeof(line),
+             "[%s] Capture: %llu records, %llu KB written, %llu dropped%s\n",
+             stats.bFailed || stats.dropped > 0 ? "WARN" : "INFO",
+             stats.records, stats.bytes / 1024, stats.dropped,
+             stats.bFailed ? ", file write failed" : "");
+    LogCallback(line);
+}
+
+static void LogPoolStats(void)
+{
+    POOL_STATS stats;
+    char line[256];
+    
+    Pool_GetStats(&stats);
+    snprintf(line, sizeof(line),
+             "[INFO] Buffer pool: %llu allocations, %llu frees (%llu to another node), "
+             "%llu heap allocations, %llu KB reserved\n",
+             stats.allocations, stats.frees, stats.remoteFrees, stats.heapAllocations,
+             stats.bytesReserved / 1024);
+    LogCallback(line);
+}
+
+static void LogWriterStats(void)
+{
+    LOG_STATS stats;
+    char line[256];
+    
+    Log_GetStats(&stats);
+    snprintf(line, sizeof(line),
+             "[INFO] Log writer: %llu messages in %llu batches, %llu dropped\n",
+             stats.records, stats.batches, stats.dropped);
+    LogCallback(line);
+}
+
+/* ============================================================
+ * METRICS ENDPOINT
+ * ============================================================ */
+
+#define METRICS_BUFFER_SIZE     16384
+
+/* Label values for the per-type counters, indexed from RELAY_STATS_MSG_BASE */
+static const char *g_msgTypeNames[RELAY_STATS_MSG_TYPES] = {
+    "REGISTER", "CONNECT_REQUEST", "CONNECT_RESPONSE", "DATA",
+    "DISCONNECT", "PING", "PONG", "PARTNER_DISCONNECTED",
+    "REGISTER_RESPONSE", "PARTNER_CONNECTED", "PEER_CONNECT"
+};
+
+typedef struct _METRICS_TEXT {
+    char    buffer[METRICS_BUFFER_SIZE];
+    size_t  length;
+} METRICS_TEXT;
+
+static void MetricsAppend(METRICS_TEXT *pText, const char *format, ...)
+{
+    va_list args;
+    int written;
+    
+    if (pText->length >= sizeof(pText->buffer)) return;
+    
+    va_start(args, format);
+    written = vsnprintf(pText->buffer + pText->length,
+                        sizeof(pText->buffer) - pText->length, format, args);
+    va_end(args);
+    
+    if (written > 0) {
+        pText->length += (size_t)written;
+        if (pText->length > sizeof(pText->buffer))
+            pText->length = sizeof(pText->buffer);
+    }
+}
+
+static void MetricsHeader(METRICS_TEXT *pText, const char *name, const char *type,
+                          const char *help)
+{
+    MetricsAppend(pText, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void MetricsValue(METRICS_TEXT *pText, const char *name, const char *type,
+                         const char *help, unsigned long long value)
+{
+    MetricsHeader(pText, name, type, help);
+    MetricsAppend(pText, "%s %llu\n", name, value);
+}
+
+static void MetricsPerType(METRICS_TEXT *pText, const char *name, const char *help,
+                           const unsigned long long *values)
+{
+    DWORD i;
+    
+    MetricsHeader(pText, name, "counter", help);
+    for (i = 0; i < RELAY_STATS_MSG_TYPES; i++) {
+        if (g_msgTypeNames[i])
+            MetricsAppend(pText, "%s{type=\"%s\"} %llu\n", name, g_msgTypeNames[i], values[i]);
+        else if (values[i] != 0)
+            MetricsAppend(pText, "%s{type=\"0x%02X\"} %llu\n", name,
+                          (unsigned)(RELAY_STATS_MSG_BASE + i), values[i]);
+    }
+}
+
+/* Render the server counters in the Prometheus text exposition format */
+static void FormatMetrics(RELAY_SERVER *pServer, METRICS_TEXT *pText)
+{
+    RELAY_STATS stats;
+    LOG_STATS logStats;
+    
+    Relay_GetStatsEx(pServer, &stats);
+    Log_GetStats(&logStats);
+    pText->length = 0;
+    
+    MetricsValue(pText, "rd2k_relay_connections", "gauge",
+                 "Clients currently connected.", stats.activeConnections);
+    MetricsValue(pText, "rd2k_relay_connections_total", "counter",
+                 "Client connections accepted.", stats.totalConnections);
+    MetricsValue(pText, "rd2k_relay_pairs_total", "counter",
+                 "Clients paired with a partner.", stats.successfulPairs);
+    MetricsValue(pText, "rd2k_relay_connect_failures_total", "counter",
+                 "Connect requests refused.", stats.failedConnections);
+    MetricsValue(pText, "rd2k_relay_register_rejects_total", "counter",
+                 "Registrations rejected for a duplicate ID.", stats.rejectedRegistrations);
+    MetricsValue(pText, "rd2k_relay_timeouts_total", "counter",
+                 "Clients disconnected for inactivity.", stats.timeouts);
+    MetricsPerType(pText, "rd2k_relay_frames_received_total",
+                   "Frames received from clients by message type.", stats.framesIn);
+    MetricsPerType(pText, "rd2k_relay_bytes_received_total",
+                   "Bytes received from clients by message type, headers included.", stats.bytesIn);
+    MetricsValue(pText, "rd2k_relay_frames_forwarded_total", "counter",
+                 "DATA frames forwarded to a partner.", stats.framesForwarded);
+    MetricsValue(pText, "rd2k_relay_bytes_forwarded_total", "counter",
+                 "DATA bytes forwarded to a partner, headers included.", stats.bytesForwarded);
+    MetricsValue(pText, "rd2k_relay_queued_bytes", "gauge",
+                 "Bytes waiting in send queues.", stats.queuedBytes);
+    MetricsValue(pText, "rd2k_relay_paused_readers", "gauge",
+                 "Senders paused for a full partner queue.", stats.pausedReaders);
+    MetricsValue(pText, "rd2k_relay_backpressure_pauses_total", "counter",
+                 "Times a sender was paused for a full partner queue.", stats.backpressurePauses);
+    MetricsValue(pText, "rd2k_relay_cut_through_frames_total", "counter",
+                 "Large DATA frames forwarded while still arriving.", stats.cutThroughFrames);
+    MetricsValue(pText, "rd2k_relay_coalesced_batches_total", "counter",
+                 "Forwarded DATA batches held to share a send.", stats.coalescedBatches);
+    MetricsValue(pText, "rd2k_relay_coalesced_sends_total", "counter",
+                 "Writes of held DATA output.", stats.coalescedSends);
+    MetricsValue(pText, "rd2k_relay_scheduled_bytes_total", "counter",
+                 "Output the fair scheduler wrote from session queues.", stats.scheduledBytes);
+    MetricsValue(pText, "rd2k_relay_rate_cap_waits_total", "counter",
+                 "Times a session's queue waited for its sender's rate cap.", stats.rateCapWaits);
+    MetricsValue(pText, "rd2k_relay_uplink_waits_total", "counter",
+                 "Times queued output waited for the uplink rate.", stats.uplinkWaits);
+    MetricsValue(pText, "rd2k_relay_remote_accepts_total", "counter",
+                 "Connections a pinned shard accepted off the CPU taking their packets.",
+                 stats.remoteAccepts);
+    MetricsHeader(pText, "rd2k_relay_admission_refused_total", "counter",
+                  "Connections and registrations refused by admission limits.");
+    MetricsAppend(pText, "rd2k_relay_admission_refused_total{event=\"accept\",limit=\"source\"} %llu\n",
+                  stats.refusedAccepts[0]);
+    MetricsAppend(pText, "rd2k_relay_admission_refused_total{event=\"accept\",limit=\"total\"} %llu\n",
+                  stats.refusedAccepts[1]);
+    MetricsAppend(pText, "rd2k_relay_admission_refused_total{event=\"register\",limit=\"source\"} %llu\n",
+                  stats.refusedRegisters[0]);
+    MetricsAppend(pText, "rd2k_relay_admission_refused_total{event=\"register\",limit=\"total\"} %llu\n",
+                  stats.refusedRegisters[1]);
+    MetricsValue(pText, "rd2k_relay_admission_sources", "gauge",
+                 "Source addresses tracked by the admission limits.", stats.admitSources);
+    if (g_pCluster) {
+        CLUSTER_STATS clusterStats;
+        
+        Cluster_GetStats(g_pCluster, &clusterStats);
+        MetricsValue(pText, "rd2k_relay_cluster_peers_up", "gauge",
+                     "Links to other nodes that are connected.", clusterStats.peersUp);
+        MetricsValue(pText, "rd2k_relay_cluster_nodes", "gauge",
+                     "Other nodes announcing their clients to this node.", clusterStats.nodesKnown);
+        MetricsValue(pText, "rd2k_relay_cluster_remote_ids", "gauge",
+                     "Client IDs registered on other nodes.", clusterStats.remoteIds);
+        MetricsValue(pText, "rd2k_relay_cluster_updates_sent_total", "counter",
+                     "Registrations and removals sent to other nodes.", clusterStats.updatesSent);
+        MetricsValue(pText, "rd2k_relay_cluster_updates_received_total", "counter",
+                     "Registrations and removals received from other nodes.",
+                     clusterStats.updatesReceived);
+        MetricsValue(pText, "rd2k_relay_cluster_link_failures_total", "counter",
+                     "Links to other nodes lost or refused.", clusterStats.linkFailures);
+        MetricsValue(pText, "rd2k_relay_node_link_pairs_total", "counter",
+                     "Clients paired with a partner on another node.", stats.nodeLinkPairs);
+    }
+    if (g_pCapture) {
+        CAPTURE_STATS captureStats;
+        
+        Capture_GetStats(g_pCapture, &captureStats);
+        MetricsValue(pText, "rd2k_relay_capture_records_total", "counter",
+                     "Capture records written to the file.", captureStats.records);
+        MetricsValue(pText, "rd2k_relay_capture_dropped_total", "counter",
+                     "Capture records dropped because a thread's ring was full.",
+                     captureStats.dropped);
+    }
+    MetricsValue(pText, "rd2k_relay_log_messages_total", "counter",
+                 "Log messages written by the log writer thread.", logStats.records);
+    MetricsValue(pText, "rd2k_relay_log_dropped_total", "counter",
+                 "Log messages dropped because a thread's log ring was full.", logStats.dropped);
+}
+
+/* Listen for scrapes on loopback only; the counters are not meant for
+ * the clients' network */
+static int OpenMetricsListener(WORD port)
+{
+    struct sockaddr_in addr;
+    int fd;
+    int opt = 1;
+    
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0) {
+        close(fd);
+        return -1;
+    }
+    
+    return fd;
+}
+
+static void SendAll(int fd, const char *data, size_t length)
+{
+    while (length > 0) {
+        ssize_t sent = send(fd, data, length, MSG_NOSIGNAL);
+        if (sent <= 0) {
+            if (sent < 0 && errno == EINTR) continue;
+            return;
+        }
+        data += sent;
+        length -= (size_t)sent;
+    }
+}
+
+/* Answer one scrape, given the request it sent */
+static void ServeMetricsRequest(RELAY_SERVER *pServer, int fd, const char *request)
+{
+    static METRICS_TEXT text;
+    char header[256];
+    int headerLen;
+    
+    if (strncmp(request, "GET /metrics ", 13) == 0 || strncmp(request, "GET / ", 6) == 0) {
+        FormatMetrics(pServer, &text);
+        headerLen = snprintf(header, sizeof(header),
+                             "HTTP/1.1 200 OK\r\n"
+                             "Content-Type: text/plain; version=0.0.4\r\n"
+                             "Content-Length: %lu\r\n"
+                             "Connection: close\r\n\r\n",
+                             (unsigned long)text.length);
+        SendAll(fd, header, (size_t)headerLen);
+        SendAll(fd, text.buffer, text.length);
+    } else {
+        static const char notFound[] =
+            "HTTP/1.1 404 Not Found\r\n"
+            "Content-Type: text/plain\r\n"
+            "Content-Length: 10\r\n"
+            "Connection: close\r\n\r\n"
+            "Not Found\n";
+        SendAll(fd, notFound, sizeof(notFound) - 1);
+    }
+}
+
+/* ============================================================
+ * CONTROL SOCKET
+ * ============================================================ */
+
+#define CONTROL_REPLY_SIZE  8192    /* Replies go out in pieces this big */
+
+typedef struct _CONTROL_REPLY {
+    int     fd;
+    size_t  length;
+    char    buffer[CONTROL_REPLY_SIZE];
+} CONTROL_REPLY;
+
+static const char* g_stateNames[] = {
+    "CONNECTED", "REGISTERED", "WAITING", "PAIRED", "DISCONNECTED"
+};
+
+/* Listen on the UNIX socket path, replacing one a crashed relay left
+ * behind (the instance lock says none is running). Only the owner may
+ * connect: close kills sessions */
+static int OpenControlListener(const char *path)
+{
+    struct sockaddr_un addr;
+    struct stat st;
+    int fd;
+    
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    
+    /* Never remove anything but a socket */
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(path);
+    
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    if (chmod(path, 0600) < 0 || listen(fd, 4) < 0) {
+        unlink(path);
+        close(fd);
+        return -1;
+    }
+    
+    return fd;
+}
+
+static void FlushReply(CONTROL_REPLY *pReply)
+{
+    SendAll(pReply->fd, pReply->buffer, pReply->length);
+    pReply->length = 0;
+}
+
+/* Append a line to the reply, sending what is buffered when it is full */
+static void ReplyPrintf(CONTROL_REPLY *pReply, const char *format, ...)
+{
+    char line[512];
+    va_list args;
+    int len;
+    
+    va_start(args, format);
+    len = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    if (len < 0) return;
+    if ((size_t)len >= sizeof(line)) len = (int)sizeof(line) - 1;
+    
+    if (pReply->length + (size_t)len > sizeof(pReply->buffer)) FlushReply(pReply);
+    memcpy(pReply->buffer + pReply->length, line, (size_t)len);
+    pReply->length += (size_t)len;
+}
+
+/* "010 000 000 001", or "-" for no client */
+static void FormatId(DWORD id, char *buffer)
+{
+    if (id == 0) {
+        strcpy(buffer, "-");
+        return;
+    }
+    sprintf(buffer, "%03u %03u %03u %03u",
+            (id >> 24) & 0xFF, (id >> 16) & 0xFF, (id >> 8) & 0xFF, id & 0xFF);
+}
+
+/* Snapshot of every connection, or NULL after replying with the error */
+static RELAY_SESSION_INFO* ListSessions(RELAY_SERVER *pServer, CONTROL_REPLY *pReply,
+                                        DWORD *pCount)
+{
+    RELAY_SESSION_INFO *pInfo = NULL;
+    int result;
+    
+    result = Relay_ListSessions(pServer, &pInfo, pCount);
+    if (result == RD2K_ERR_TIMEOUT) {
+        ReplyPrintf(pReply, "ERROR shards did not answer\n");
+        return NULL;
+    }
+    if (result != RD2K_SUCCESS) {
+        ReplyPrintf(pReply, "ERROR out of memory\n");
+        return NULL;
+    }
+    if (*pCount == 0) ReplyPrintf(pReply, "No connections\n");
+    return pInfo;
+}
+
+static void ReplySessions(RELAY_SERVER *pServer, CONTROL_REPLY *pReply)
+{
+    RELAY_SESSION_INFO *pInfo;
+    DWORD count, paired = 0;
+    DWORD i;
+    
+    pInfo = ListSessions(pServer, pReply, &count);
+    if (!pInfo) return;
+    
+    ReplyPrintf(pReply, "%-15s  %-12s  %-15s  %5s  %-15s  %10s  %10s  %8s  %8s\n",
+                "CLIENT", "STATE", "PARTNER", "SHARD", "ADDRESS",
+                "IN KB", "OUT KB", "QUEUED", "IDLE MS");
+    for (i = 0; i < count; i++) {
+        const RELAY_SESSION_INFO *p = &pInfo[i];
+        char client[20], partner[20], address[INET_ADDRSTRLEN];
+        struct in_addr in;
+        
+        FormatId(p->clientId, client);
+        FormatId(p->partnerId, partner);
+        if (p->bNodeLink) {
+            strcpy(address, "node link");
+        } else if (p->peerAddr == 0) {
+            strcpy(address, "-");
+        } else {
+            in.s_addr = p->peerAddr;
+            inet_ntop(AF_INET, &in, address, sizeof(address));
+        }
+        if (p->state == RELAY_STATE_PAIRED) paired++;
+        
+        ReplyPrintf(pReply, "%-15s  %-12s  %-15s  %5u  %-15s  %10llu  %10llu  %8u  %8u\n",
+                    client, p->state <= RELAY_STATE_DISCONNECTED ? g_stateNames[p->state] : "?",
+                    partner, p->shard, address, p->bytesIn / 1024, p->bytesOut / 1024,
+                    p->queuedBytes, p->idleMs);
+    }
+    ReplyPrintf(pReply, "%u connections, %u paired\n", count, paired);
+    
+    free(pInfo);
+}
+
+static void ReplyHistograms(RELAY_SERVER *pServer, CONTROL_REPLY *pReply)
+{
+    RELAY_SESSION_INFO *pInfo;
+    RELAY_HIST delay, size;
+    char summary[256];
+    DWORD count, shown = 0;
+    DWORD i;
+    
+    Relay_GetHistograms(pServer, &delay, &size);
+    Hist_Format(&delay, summary, sizeof(summary));
+    ReplyPrintf(pReply, "Forwarding delay (us): %s\n", summary);
+    Hist_Format(&size, summary, sizeof(summary));
+    ReplyPrintf(pReply, "Frame size (bytes): %s\n", summary);
+    
+    /* Each paired connection stands for the direction forwarded to it */
+    pInfo = ListSessions(pServer, pReply, &count);
+    if (!pInfo) return;
+    
+    for (i = 0; i < count; i++) {
+        const RELAY_SESSION_INFO *p = &pInfo[i];
+        char from[20], to[20];
+        
+        if (p->frames == 0) continue;
+        if (shown++ == 0) {
+            ReplyPrintf(pReply, "%-15s     %-15s  %10s  %8s  %8s  %8s  %10s\n",
+                        "FROM", "TO", "FRAMES", "P50 US", "P99 US", "MAX US", "MEAN BYTES");
+        }
+        FormatId(p->partnerId, from);
+        FormatId(p->clientId, to);
+        ReplyPrintf(pReply, "%-15s  -> %-15s  %10llu  %8u  %8u  %8u  %10u\n",
+                    from, to, p->frames, p->delayP50, p->delayP99, p->delayMax, p->sizeMean);
+    }
+    if (shown == 0) ReplyPrintf(pReply, "No frames forwarded in current sessions\n");
+    
+    free(pInfo);
+}
+
+static void ReplyClose(RELAY_SERVER *pServer, CONTROL_REPLY *pReply, const char *arg)
+{
+    const char *end;
+    DWORD clientId = 0;
+    DWORD closed = 0;
+    char client[20];
+    
+    end = ParseClientId(arg, &clientId);
+    if (!end || *end != '\0' || clientId == 0) {
+        ReplyPrintf(pReply, "ERROR expected close ID, ID like 010.000.000.001\n");
+        return;
+    }
+    
+    FormatId(clientId, client);
+    if (Relay_CloseSession(pServer, clientId, &closed) != RD2K_SUCCESS) {
+        ReplyPrintf(pReply, "ERROR shards did not answer\n");
+    } else if (closed == 0) {
+        ReplyPrintf(pReply, "ERROR no client %s\n", client);
+    } else {
+        ReplyPrintf(pReply, "Closed %s\n", client);
+    }
+}
+
+/* Answer one command line, parsed in place. Like metrics scrapes these
+ * are rare and run on the admin thread; the shards answer between passes
+ * of their loops, so forwarding goes on meanwhile */
+static void ServeControlRequest(RELAY_SERVER *pServer, int fd, char *request)
+{
+    static CONTROL_REPLY reply;
+    char *command, *arg, *p;
+    
+    /* First line, trimmed; the command is its first word */
+    p = strchr(request, '\n');
+    if (p) *p = '\0';
+    p = request + strlen(request);
+    while (p > request && (p[-1] == '\r' || p[-1] == ' ' || p[-1] == '\t')) *--p = '\0';
+    command = request;
+    while (*command == ' ' || *command == '\t') command++;
+    arg = command + strcspn(command, " \t");
+    if (*arg) *arg++ = '\0';
+    while (*arg == ' ' || *arg == '\t') arg++;
+    
+    reply.fd = fd;
+    reply.length = 0;
+    
+    if (strcmp(command, "sessions") == 0) {
+        ReplySessions(pServer, &reply);
+    } else if (strcmp(command, "hist") == 0) {
+        ReplyHistograms(pServer, &reply);
+    } else if (strcmp(command, "close") == 0) {
+        ReplyClose(pServer, &reply, arg);
+    } else if (strcmp(command, "help") == 0 || command[0] == '\0') {
+        ReplyPrintf(&reply,
+                    "sessions    Every connection: state, partner, bytes, queue, idle time\n"
+                    "hist        Forwarding delay and frame size, overall and per session\n"
+                    "close ID    Disconnect client ID, as logged (e.g. 010 000 000 001)\n");
+    } else {
+        ReplyPrintf(&reply, "ERROR unknown command '%s' - try help\n", command);
+    }
+    
+    FlushReply(&reply);
+}
+
+/* ============================================================
+ * ADMIN THREAD
+ * ============================================================ */
+
+#define ADMIN_MAX_REQUESTS  16      /* Connections waiting for their request */
+#define ADMIN_REQUEST_MS    1000    /* Answer with what has arrived after this */
+
+/* A local client whose request is still arriving */
+typedef struct _ADMIN_REQUEST {
+    int     fd;
+    int     listenFd;               /* Endpoint it connected to */
+    DWORD   deadline;               /* GetTickCount() */
+    size_t  received;
+    char    buffer[1024];
+} ADMIN_REQUEST;
+
+/* Scrapes end with the HTTP headers, control commands with the line */
+static BOOL IsRequestComplete(const ADMIN_REQUEST *pRequest)
+{
+    if (pRequest->received == sizeof(pRequest->buffer) - 1) return TRUE;
+    if (pRequest->listenFd == g_controlFd) return strchr(pRequest->buffer, '\n') != NULL;
+    return strstr(pRequest->buffer, "\r\n\r\n") || strstr(pRequest->buffer, "\n\n");
+}
+
+static void AcceptRequest(int listenFd, ADMIN_REQUEST *pRequest)
+{
+    struct timeval tv;
+    
+    /* Replies are written blocking, bounded by the send timeout */
+    pRequest->fd = accept4(listenFd, NULL, NULL, SOCK_CLOEXEC);
+    if (pRequest->fd < 0) return;
+    
+    tv.tv_sec = 1;
+    tv.tv_usec = 0;
+    setsockopt(pRequest->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    
+    pRequest->listenFd = listenFd;
+    pRequest->deadline = GetTickCount() + ADMIN_REQUEST_MS;
+    pRequest->received = 0;
+    pRequest->buffer[0] = '\0';
+}
+
+/* Read what has arrived. Returns TRUE once the request can be answered */
+static BOOL ReadRequest(ADMIN_REQUEST *pRequest)
+{
+    for (;;) {
+        ssize_t n = recv(pRequest->fd, pRequest->buffer + pRequest->received,
+                         sizeof(pRequest->buffer) - 1 - pRequest->received, MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return FALSE;
+        if (n <= 0) return TRUE;
+        
+        pRequest->received += (size_t)n;
+        pRequest->buffer[pRequest->received] = '\0';
+        if (IsRequestComplete(pRequest)) return TRUE;
+    }
+}
+
+static void AnswerRequest(ADMIN_REQUEST *pRequest)
+{
+    if (pRequest->listenFd == g_controlFd)
+        ServeControlRequest(g_pServer, pRequest->fd, pRequest->buffer);
+    else
+        ServeMetricsRequest(g_pServer, pRequest->fd, pRequest->buffer);
+    close(pRequest->fd);
+}
+
+/* Serves the local endpoints. Requests are read as they arrive, so a
+ * client that connects and says nothing holds up neither the other
+ * clients nor the main loop's signal and upgrade handling */
+static void* AdminThread(void *pParam)
+{
+    static ADMIN_REQUEST requests[ADMIN_MAX_REQUESTS];
+    struct pollfd pfds[3 + ADMIN_MAX_REQUESTS];
+    int endpoints[3];
+    DWORD pending = 0;
+    DWORD listeners = 1;
+    DWORD i;
+    
+    (void)pParam;
+    
+    endpoints[0] = g_adminStopFd;
+    if (g_metricsFd >= 0) endpoints[listeners++] = g_metricsFd;
+    if (g_controlFd >= 0) endpoints[listeners++] = g_controlFd;
+    
+    for (;;) {
+        DWORD now = GetTickCount();
+        int timeout = -1;
+        
+        /* poll() skips negative fds: stop accepting while the table is full */
+        for (i = 0; i < listeners; i++) {
+            pfds[i].fd = (i == 0 || pending < ADMIN_MAX_REQUESTS) ? endpoints[i] : -1;
+            pfds[i].events = POLLIN;
+            pfds[i].revents = 0;
+        }
+        for (i = 0; i < pending; i++) {
+            int left = (int)(requests[i].deadline - now);
+            
+            pfds[listeners + i].fd = requests[i].fd;
+            pfds[listeners + i].events = POLLIN;
+            pfds[listeners + i].revents = 0;
+            if (left < 0) left = 0;
+            if (timeout < 0 || left < timeout) timeout = left;
+        }
+        
+        if (poll(pfds, listeners + pending, timeout) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (pfds[0].revents & POLLIN) break;
+        
+        /* Backwards, so the last request can fill a finished one's slot */
+        now = GetTickCount();
+        for (i = pending; i-- > 0;) {
+            if (pfds[listeners + i].revents ? !ReadRequest(&requests[i]) :
+                (int)(now - requests[i].deadline) < 0)
+                continue;
+            AnswerRequest(&requests[i]);
+            requests[i] = requests[--pending];
+        }
+        
+        for (i = 1; i < listeners && pending < ADMIN_MAX_REQUESTS; i++) {
+            if (!(pfds[i].revents & POLLIN)) continue;
+            AcceptRequest(endpoints[i], &requests[pending]);
+            if (requests[pending].fd >= 0) pending++;
+        }
+    }
+    
+    for (i = 0; i < pending; i++) close(requests[i].fd);
+    
+    return NULL;
+}
+
+/* Start the admin thread if any endpoint is open */
+static void StartAdminThread(void)
+{
+    sigset_t all, previous;
+    int result;
+    
+    if (g_metricsFd < 0 && g_controlFd < 0) return;
+    
+    g_adminStopFd = eventfd(0, EFD_CLOEXEC);
+    if (g_adminStopFd < 0) {
+        LogCallback("[WARN] Could not start the admin thread - metrics and control disabled\n");
+        return;
+    }
+    
+    /* Signals go to the main thread, as for the log writer */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &previous);
+    result = pthread_create(&g_adminThread, NULL, AdminThread, NULL);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    if (result != 0) {
+        LogCallback("[WARN] Could not start the admin thread - metrics and control disabled\n");
+        close(g_adminStopFd);
+        g_adminStopFd = -1;
+    }
+}
+
+/* Stop the admin thread; it finishes the request it is serving first */
+static void StopAdminThread(void)
+{
+    uint64_t one = 1;
+    
+    if (g_adminStopFd < 0) return;
+    
+    if (write(g_adminStopFd, &one, sizeof(one)) < 0) {
+        /* Cannot fail for a fresh eventfd */
+    }
+    pthread_join(g_adminThread, NULL);
+    close(g_adminStopFd);
+    g_adminStopFd = -1;
+}
+
+/* ============================================================
+ * HOT UPGRADE
+ * ============================================================ */
+
+/* A successor connected to the upgrade socket: detach the server and send
+ * it everything. Returns TRUE once it has taken over, FALSE if this
+ * process goes on serving */
+static BOOL HandOverToSuccessor(RELAY_SERVER *pServer)
+{
+    RELAY_HANDOFF handoff;
+    int fd;
+    
+    fd = Upgrade_Accept(g_upgradeFd);
+    if (fd < 0) return FALSE;
+    
+    LogCallback("[UPGRADE] Successor connected - handing over sockets\n");
+    
+    if (Relay_Detach(pServer, &handoff) != RD2K_SUCCESS) {
+        Upgrade_SendAbort(fd);
+        close(fd);
+        Relay_Resume(pServer);
+        return FALSE;
+    }
+    
+    if (Upgrade_SendHandoff(fd, &handoff, g_lockFd) != RD2K_SUCCESS ||
+        Upgrade_WaitAck(fd, UPGRADE_TIMEOUT_MS) != RD2K_SUCCESS) {
+        LogCallback("[WARN] Successor did not take over - resuming service\n");
+        Upgrade_SendAbort(fd);
+        close(fd);
+        Relay_FreeHandoff(&handoff);
+        Relay_Resume(pServer);
+        return FALSE;
+    }
+    
+    /* Closed on exit: tells the successor our ports are free */
+    g_upgradeChannel = fd;
+    g_bUpgraded = 1;
+    Relay_FreeHandoff(&handoff);
+    LogCallback("[UPGRADE] Successor took over - exiting\n");
+    return TRUE;
+}
+
+/* --takeover: receive the sockets of the relay running on port and wait
+ * for it to exit. Returns 0 with pHandoff filled, -1 on failure (the old
+ * relay keeps serving) */
+static int TakeOverRelay(WORD port, RELAY_HANDOFF *pHandoff)
+{
+    char line[128];
+    int lockFd;
+    int result;
+    int fd;
+    
+    fd = Upgrade_Connect(port);
+    if (fd < 0) {
+        snprintf(line, sizeof(line), "[ERROR] No relay to take over on port %u\n", port);
+        LogCallback(line);
+        return -1;
+    }
+    
+    /* On failure Upgrade_RecvHandoff has closed what it received */
+    result = Upgrade_RecvHandoff(fd, pHandoff, &lockFd);
+    if (result == RD2K_SUCCESS) {
+        result = Upgrade_SendAck(fd);
+        if (result == RD2K_SUCCESS) result = Upgrade_WaitClose(fd, 2 * UPGRADE_TIMEOUT_MS);
+        
+        /* It has our ACK and will not serve again; its ports may just
+         * come free late */
+        if (result == RD2K_ERR_TIMEOUT) {
+            LogCallback("[WARN] Old relay is slow to exit - taking over anyway\n");
+            result = RD2K_SUCCESS;
+        } else if (result != RD2K_SUCCESS) {
+            Upgrade_DiscardHandoff(pHandoff);
+            if (lockFd >= 0) close(lockFd);
+        }
+    }
+    close(fd);
+    
+    if (result != RD2K_SUCCESS) {
+        LogCallback("[ERROR] Takeover failed - the running relay keeps its clients\n");
+        return -1;
+    }
+    
+    if (lockFd >= 0) AdoptLock(lockFd);
+    snprintf(line, sizeof(line), "[UPGRADE] Received %u listen socket(s) and %u connection(s)\n",
+             pHandoff->listenCount, pHandoff->connCount);
+    LogCallback(line);
+    return 0;
+}
+
 /* ============================================================
  * MAIN
  * ============================================================ */
@@ -563,8 +1733,24 @@ int main(int argc, char *argv[])
     WORD port = RELAY_DEFAULT_PORT;
     char bindIp[64] = "0.0.0.0";
     const char *logFile = NULL;
+    WORD metricsPort = 0;
+    const char *controlPath = NULL;
+    RELAY_CONFIG config;
+    CLUSTER_CONFIG clusterConfig;
+    ADMIT_CONFIG admitConfig;
+    RELAY_CLIENT_SHARE shares[MAX_CLIENT_SHARES];
+    DWORD shareCount = 0;
+    int cpus[RELAY_MAX_SHARDS];
+    RELAY_HANDOFF handoff;
+    const char *captureFile = NULL;
+    BOOL bCapturePayloads = FALSE;
+    int bTakeover = 0;
     int i;
     
+    Relay_InitConfig(&config);
+    ZeroMemory(&clusterConfig, sizeof(clusterConfig));
+    ZeroMemory(&admitConfig, sizeof(admitConfig));
+    
     /* Parse command line arguments */
     for (i = 1; i < argc; i++) {
         if (strcmp(argv[i], "-p") == 0 || strcmp(argv[i], "--port") == 0) {
@@ -584,6 +1770,82 @@ int main(int argc, char *argv[])
             }
         } else if (strcmp(argv[i], "-n") == 0 || strcmp(argv[i], "--no-color") == 0) {
             g_bColor = 0;
+        } else if (strcmp(argv[i], "-s") == 0 || strcmp(argv[i], "--shards") == 0) {
+            if (i + 1 < argc) {
+                config.shardCount = (DWORD)atoi(argv[++i]);
+            }
+        } else if (strcmp(argv[i], "--cpus") == 0) {
+            if (i + 1 < argc) {
+                if (ParseCpus(argv[++i], cpus, &config.cpuCount) < 0) return 1;
+                config.pCpus = cpus;
+            }
+        } else if (strcmp(argv[i], "--steer-accepts") == 0) {
+            config.bSteerAccepts = TRUE;
+        } else if (strcmp(argv[i], "--splice") == 0) {
+            config.bSplice = TRUE;
+        } else if (strcmp(argv[i], "--uring") == 0) {
+            config.backend = RELAY_BACKEND_URING;
+        } else if (strcmp(argv[i], "--coalesce") == 0) {
+            if (i + 1 < argc) {
+                config.coalesceUs = (DWORD)atoi(argv[++i]);
+            }
+        } else if (strcmp(argv[i], "--coalesce-bytes") == 0) {
+            if (i + 1 < argc) {
+                config.coalesceBytes = (DWORD)atoi(argv[++i]);
+            }
+        } else if (strcmp(argv[i], "-m") == 0 || strcmp(argv[i], "--metrics") == 0) {
+            if (i + 1 < argc) {
+                metricsPort = (WORD)atoi(argv[++i]);
+            }
+        } else if (strcmp(argv[i], "--control") == 0) {
+            if (i + 1 < argc) {
+                controlPath = argv[++i];
+            }
+        } else if (strcmp(argv[i], "--cluster-port") == 0) {
+            if (i + 1 < argc) {
+                clusterConfig.port = (WORD)atoi(argv[++i]);
+            }
+        } else if (strcmp(argv[i], "--peer") == 0) {
+            if (i + 1 < argc) {
+                if (clusterConfig.peerCount == CLUSTER_MAX_PEERS) {
+                    fprintf(stderr, "At most %d cluster peers are supported\n", CLUSTER_MAX_PEERS);
+                    return 1;
+                }
+                clusterConfig.peers[clusterConfig.peerCount++] = argv[++i];
+            }
+        } else if (strcmp(argv[i], "--node-id") == 0) {
+            if (i + 1 < argc) {
+                clusterConfig.nodeId = (DWORD)strtoul(argv[++i], NULL, 0);
+            }
+        } else if (strcmp(argv[i], "--takeover") == 0) {
+            bTakeover = 1;
+        } else if (strcmp(argv[i], "--limit-accept") == 0) {
+            if (i + 1 < argc && ParseLimit(argv[++i], &admitConfig.source[ADMIT_ACCEPT]) < 0)
+                return 1;
+        } else if (strcmp(argv[i], "--limit-register") == 0) {
+            if (i + 1 < argc && ParseLimit(argv[++i], &admitConfig.source[ADMIT_REGISTER]) < 0)
+                return 1;
+        } else if (strcmp(argv[i], "--limit-accept-total") == 0) {
+            if (i + 1 < argc && ParseLimit(argv[++i], &admitConfig.total[ADMIT_ACCEPT]) < 0)
+                return 1;
+        } else if (strcmp(argv[i], "--limit-register-total") == 0) {
+            if (i + 1 < argc && ParseLimit(argv[++i], &admitConfig.total[ADMIT_REGISTER]) < 0)
+                return 1;
+        } else if (strcmp(argv[i], "--fair") == 0) {
+            config.bFair = TRUE;
+        } else if (strcmp(argv[i], "--uplink") == 0) {
+            if (i + 1 < argc && ParseRate(argv[++i], &config.uplinkRate) < 0)
+                return 1;
+        } else if (strcmp(argv[i], "--weight") == 0 || strcmp(argv[i], "--rate-cap") == 0) {
+            if (i + 1 < argc && ParseShare(argv[i], argv[i + 1], shares, &shareCount) < 0)
+                return 1;
+            i++;
+        } else if (strcmp(argv[i], "--capture") == 0) {
+            if (i + 1 < argc) {
+                captureFile = argv[++i];
+            }
+        } else if (strcmp(argv[i], "--capture-payloads") == 0) {
+            bCapturePayloads = TRUE;
         } else if (strcmp(argv[i], "-i") == 0 || strcmp(argv[i], "--server-ip") == 0) {
             if (i + 1 < argc) {
                 strncpy(g_customIp, argv[++i], sizeof(g_customIp) - 1);
@@ -601,8 +1863,32 @@ int main(int argc, char *argv[])
         }
     }
     
-    /* Acquire single instance lock */
-    if (AcquireLock() < 0) {
+    if (clusterConfig.peerCount > 0 && clusterConfig.port == 0) {
+        fprintf(stderr, "--peer needs --cluster-port\n");
+        return 1;
+    }
+    if (admitConfig.source[ADMIT_ACCEPT].rate || admitConfig.source[ADMIT_REGISTER].rate ||
+        admitConfig.total[ADMIT_ACCEPT].rate || admitConfig.total[ADMIT_REGISTER].rate)
+        config.pAdmit = &admitConfig;
+    if (config.uplinkRate > 0 || shareCount > 0) {
+        config.bFair = TRUE;
+        config.pShares = shares;
+        config.shareCount = shareCount;
+    }
+    if (config.bSteerAccepts && !config.pCpus) {
+        fprintf(stderr, "--steer-accepts needs --cpus\n");
+        return 1;
+    }
+    if (bCapturePayloads && !captureFile) {
+        fprintf(stderr, "--capture-payloads needs --capture\n");
+        return 1;
+    }
+    if (clusterConfig.port != 0)
+        snprintf(g_lockPath, sizeof(g_lockPath), LOCK_FILE_NODE, port);
+    
+    /* Acquire single instance lock. A takeover inherits the running
+     * relay's lock instead */
+    if (!bTakeover && AcquireLock() < 0) {
         return 1;  /* Another instance is running */
     }
     
@@ -626,19 +1912,84 @@ int main(int argc, char *argv[])
     /* Setup signal handlers */
     SetupSignalHandlers();
     
+    RaiseFileLimit();
+    
     /* Print banner */
     PrintBanner();
     
     /* Initialize crypto */
     Crypto_Init(NULL);
     
+    /* Log writer thread (after Daemonize: threads do not survive fork).
+     * Without it, messages are written synchronously */
+    if (Log_Start(WriteLogMessage, FlushLog) != RD2K_SUCCESS)
+        LogCallback("[WARN] Log writer thread unavailable - logging synchronously\n");
+    
     /* Set log callback */
     Relay_SetLogCallback(LogCallback);
     
-    /* Create relay server */
-    g_pServer = Relay_Create(port, bindIp);
+    /* The old relay exits once we have its sockets; its cluster and
+     * metrics ports are free by the time we bind them below */
+    if (bTakeover) {
+        if (TakeOverRelay(port, &handoff) < 0) {
+            Log_Stop();
+            if (g_logFile) fclose(g_logFile);
+            return 1;
+        }
+        config.pHandoff = &handoff;
+    }
+    
+    /* Cluster first: the relay announces registrations through it */
+    if (clusterConfig.port != 0) {
+        if (clusterConfig.nodeId == 0)
+            clusterConfig.nodeId = ((DWORD)time(NULL) ^ ((DWORD)getpid() << 12)) | 1;
+        clusterConfig.bindAddr = bindIp;
+        clusterConfig.clientPort = port;
+        clusterConfig.clientAddr = bindIp;
+        clusterConfig.pfnLog = LogCallback;
+        
+        g_pCluster = Cluster_Create(&clusterConfig);
+        if (!g_pCluster || Cluster_Start(g_pCluster) != RD2K_SUCCESS) {
+            LogCallback("[ERROR] Failed to start cluster node - check --cluster-port/--peer\n");
+            Cluster_Destroy(g_pCluster);
+            if (config.pHandoff) Upgrade_DiscardHandoff(config.pHandoff);
+            Log_Stop();
+            if (g_logFile) fclose(g_logFile);
+            return 1;
+        }
+        config.pCluster = g_pCluster;
+    }
+    
+    if (captureFile) {
+        char line[512];
+        
+        g_pCapture = Capture_Create(captureFile, bCapturePayloads);
+        if (!g_pCapture) {
+            snprintf(line, sizeof(line), "[ERROR] Cannot capture to %s: %s\n",
+                     captureFile, strerror(errno));
+            LogCallback(line);
+            Cluster_Stop(g_pCluster);
+            Cluster_Destroy(g_pCluster);
+            if (config.pHandoff) Upgrade_DiscardHandoff(config.pHandoff);
+            Log_Stop();
+            if (g_logFile) fclose(g_logFile);
+            return 1;
+        }
+        snprintf(line, sizeof(line), "[INFO] Capturing client traffic to %s (%s)\n",
+                 captureFile, bCapturePayloads ? "with DATA payloads" : "DATA sizes only");
+        LogCallback(line);
+        config.pCapture = g_pCapture;
+    }
+    
+    /* Create relay server (with a handoff, it owns the sockets now) */
+    g_pServer = Relay_CreateEx(port, bindIp, &config);
+    if (config.pHandoff) Relay_FreeHandoff(config.pHandoff);
     if (!g_pServer) {
         LogCallback("[ERROR] Failed to create relay server - check port/IP\n");
+        Cluster_Stop(g_pCluster);
+        Cluster_Destroy(g_pCluster);
+        Capture_Destroy(g_pCapture);
+        Log_Stop();
         if (g_logFile) fclose(g_logFile);
         return 1;
     }
@@ -647,6 +1998,10 @@ int main(int argc, char *argv[])
     if (Relay_Start(g_pServer) != RD2K_SUCCESS) {
         LogCallback("[ERROR] Failed to start relay server\n");
         Relay_Destroy(g_pServer);
+        Cluster_Stop(g_pCluster);
+        Cluster_Destroy(g_pCluster);
+        Capture_Destroy(g_pCapture);
+        Log_Stop();
         if (g_logFile) fclose(g_logFile);
         return 1;
     }
@@ -656,21 +2011,139 @@ int main(int argc, char *argv[])
     
     LogCallback("[INFO] Relay server started successfully\n");
     
-    /* Main loop - wait for shutdown signal */
+    if (metricsPort != 0) {
+        char line[128];
+        
+        g_metricsFd = OpenMetricsListener(metricsPort);
+        if (g_metricsFd < 0) {
+            snprintf(line, sizeof(line),
+                     "[WARN] Could not open metrics endpoint on 127.0.0.1:%u\n", metricsPort);
+        } else {
+            snprintf(line, sizeof(line),
+                     "[INFO] Metrics at http://127.0.0.1:%u/metrics\n", metricsPort);
+        }
+        LogCallback(line);
+    }
+    
+    if (controlPath) {
+        char line[256];
+        
+        g_controlFd = OpenControlListener(controlPath);
+        if (g_controlFd < 0) {
+            snprintf(line, sizeof(line), "[WARN] Could not open control socket %s: %s\n",
+                     controlPath, strerror(errno));
+        } else {
+            snprintf(line, sizeof(line), "[INFO] Control socket at %s\n", controlPath);
+        }
+        LogCallback(line);
+    }
+    
+    StartAdminThread();
+    
+    /* A --takeover of this port connects here */
+    g_upgradeFd = Upgrade_Listen(port);
+    if (g_upgradeFd < 0)
+        LogCallback("[WARN] Could not open upgrade socket - --takeover will not work\n");
+    
+    /* Main loop - wait for shutdown signal, answering upgrade requests.
+     * The signal handlers wake it through g_wakeFd */
     while (g_bRunning) {
-        usleep(100000);  /* 100ms */
+        struct pollfd pfds[2];
+        nfds_t count = 0;
+        
+        if (g_bDumpHist) {
+            g_bDumpHist = 0;
+            Relay_DumpHistograms(g_pServer);
+        }
+        
+        if (g_upgradeFd >= 0) {
+            pfds[count].fd = g_upgradeFd;
+            pfds[count].events = POLLIN;
+            pfds[count++].revents = 0;
+        }
+        if (g_wakeFd >= 0) {
+            pfds[count].fd = g_wakeFd;
+            pfds[count].events = POLLIN;
+            pfds[count++].revents = 0;
+        }
+        
+        if (count == 0) {
+            usleep(100000);  /* 100ms */
+            continue;
+        }
+        if (poll(pfds, count, g_wakeFd >= 0 ? -1 : 100) <= 0) continue;
+        
+        for (i = 0; i < (int)count; i++) {
+            if (!(pfds[i].revents & POLLIN)) continue;
+            if (pfds[i].fd == g_wakeFd) {
+                uint64_t wakes;
+                
+                if (read(g_wakeFd, &wakes, sizeof(wakes)) < 0) {
+                    /* Already reset */
+                }
+            } else if (HandOverToSuccessor(g_pServer)) {
+                g_bRunning = 0;
+            }
+        }
+    }
+    
+    StopAdminThread();
+    if (g_metricsFd >= 0) {
+        close(g_metricsFd);
+        g_metricsFd = -1;
+    }
+    if (g_controlFd >= 0) {
+        /* As with the upgrade socket, a successor may have replaced it */
+        close(g_controlFd);
+        g_controlFd = -1;
+        if (!g_bUpgraded) unlink(controlPath);
+    }
+    if (g_upgradeFd >= 0) {
+        char path[64];
+        
+        /* After a handoff the path is the successor's to replace */
+        close(g_upgradeFd);
+        g_upgradeFd = -1;
+        snprintf(path, sizeof(path), UPGRADE_SOCKET_PATH, port);
+        if (!g_bUpgraded) unlink(path);
     }
     
-    /* Shutdown */
+    /* Shutdown. After a handoff the sockets are only closed here, the
+     * connections live on in the successor */
+    ReportStopSignal();
     LogCallback("[INFO] Shutting down relay server...\n");
     
+    Relay_Stop(g_pServer);
+    Cluster_Stop(g_pCluster);
+    LogRelayStats(g_pServer);
+    LogClusterStats(g_pServer);
     Relay_Destroy(g_pServer);
     g_pServer = NULL;
+    Cluster_Destroy(g_pCluster);
+    g_pCluster = NULL;
+    
+    /* Nothing records any more: write out the rest of the capture */
+    Capture_Stop(g_pCapture);
+    LogCaptureStats();
+    Capture_Destroy(g_pCapture);
+    g_pCapture = NULL;
+    
+    /* Our ports are free: the successor may bind them now */
+    if (g_upgradeChannel >= 0) {
+        close(g_upgradeChannel);
+        g_upgradeChannel = -1;
+    }
+    
+    LogPoolStats();
     
     Crypto_Cleanup();
     
     LogCallback("[INFO] Relay server stopped\n");
     
+    /* Everything queued is written before the streams close */
+    Log_Stop();
+    LogWriterStats();
+    
     if (g_logFile) {
         fclose(g_logFile);
         g_logFile = NULL;
@@ -0,0 +1,356 @@
+/*
+ * relay_pool.c - Buffer Pools for RemoteDesk2K Linux Relay
+ *
+ * Every block carries a 16-byte header with its size class. Free blocks
+ * are chained through their payload. Allocation order:
+ *   1. the calling thread's cache for the class (no locking)
+ *   2. a batch from the class's shared free list (one mutex)
+ *   3. a new arena chunk, mmap'd with MAP_POPULATE so first use does not
+ *      page-fault on the forwarding path
+ * Chunks for large classes (receive buffers, send queues) are not
+ * pre-faulted: a session often touches only the first pages of its 64KB
+ * receive buffer, and pre-faulting would pin the rest for every session.
+ * Recycled blocks are warm anyway.
+ * Requests above POOL_MAX_BLOCK_SIZE fall back to malloc.
+ *
+ * With NUMA placement, every node has its own set of shared lists and the
+ * header records the node a block came from. A thread's cache only ever
+ * holds blocks of the thread's node: a block freed on another node (a
+ * session handed between shards) goes straight back to its own node's
+ * list. Chunks are bound to the node with mbind() before they are
+ * pre-faulted, so pages land there whichever CPU first touches them.
+ * Without placement every thread uses node 0's lists, as before.
+ */
+
+#include "relay_pool.h"
+#include <linux/mempolicy.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#define POOL_MIN_SHIFT          6                   /* 64 bytes */
+#define POOL_MAX_SHIFT          22                  /* 4MB */
+#define POOL_CLASS_COUNT        (POOL_MAX_SHIFT - POOL_MIN_SHIFT + 1)
+#define POOL_CLASS_OVERSIZE     0xFFFF
+#define POOL_BLOCK_MAGIC        0x504F4F4C          /* "POOL" */
+#define POOL_CHUNK_SIZE         (1024 * 1024)       /* Minimum arena chunk */
+#define POOL_CACHE_BYTES        (256 * 1024)        /* Per thread, per class */
+#define POOL_PREFAULT_MAX       (16 * 1024)         /* Largest pre-faulted class */
+#define POOL_MAX_NODES          16                  /* Higher nodes are not placed */
+#define POOL_PAGE_SIZE          4096
+
+typedef struct _POOL_HEADER {
+    DWORD               classIndex;
+    DWORD               magic;
+    DWORD               size;               /* Oversize blocks only */
+    DWORD               node;               /* Shared lists the block belongs to */
+} POOL_HEADER;
+
+typedef struct _POOL_FREE {
+    struct _POOL_FREE*  pNext;
+} POOL_FREE;
+
+typedef struct _POOL_CLASS {
+    pthread_mutex_t     mutex;
+    POOL_FREE*          pFreeList;
+    DWORD               freeCount;
+} POOL_CLASS;
+
+typedef struct _POOL_CACHE {
+    POOL_FREE*          pFreeList;
+    DWORD               count;
+} POOL_CACHE;
+
+static POOL_CLASS g_classes[POOL_MAX_NODES][POOL_CLASS_COUNT];
+static pthread_once_t g_poolOnce = PTHREAD_ONCE_INIT;
+static __thread POOL_CACHE t_cache[POOL_CLASS_COUNT];
+static __thread DWORD t_node = 0;          /* Shared lists this thread uses */
+static __thread BOOL t_bPlaced = FALSE;    /* Bind new chunks to t_node */
+
+static unsigned long long g_allocations = 0;
+static unsigned long long g_frees = 0;
+static unsigned long long g_heapAllocations = 0;
+static unsigned long long g_bytesReserved = 0;
+static unsigned long long g_remoteFrees = 0;
+
+/* ============================================================
+ * HELPERS
+ * ============================================================ */
+
+static void PoolInit(void)
+{
+    DWORD node, i;
+
+    for (node = 0; node < POOL_MAX_NODES; node++) {
+        for (i = 0; i < POOL_CLASS_COUNT; i++) {
+            pthread_mutex_init(&g_classes[node][i].mutex, NULL);
+            g_classes[node][i].pFreeList = NULL;
+            g_classes[node][i].freeCount = 0;
+        }
+    }
+}
+
+static DWORD ClassForSize(DWORD size)
+{
+    DWORD index = 0;
+
+    while (((DWORD)1 << (index + POOL_MIN_SHIFT)) < size)
+        index++;
+    return index;
+}
+
+static DWORD ClassSize(DWORD index)
+{
+    return (DWORD)1 << (index + POOL_MIN_SHIFT);
+}
+
+/* Most blocks kept in one thread's cache before spilling to the shared list */
+static DWORD CacheLimit(DWORD index)
+{
+    DWORD limit = POOL_CACHE_BYTES / ClassSize(index);
+    return limit < 2 ? 2 : limit;
+}
+
+/* Prefer node for the chunk's pages. Without NUMA support (or permission)
+ * the pages are simply first-touch placed, which for a pinned thread is
+ * its node anyway */
+static void BindChunk(BYTE *chunk, DWORD chunkSize, DWORD node)
+{
+    unsigned long mask = 1UL << node;
+
+    syscall(SYS_mbind, chunk, (unsigned long)chunkSize, MPOL_PREFERRED, &mask,
+            (unsigned long)(sizeof(mask) * 8 + 1), 0U);
+}
+
+/* Carve a fresh arena chunk into blocks. Caller holds the class mutex */
+static BOOL GrowClass(DWORD node, DWORD index)
+{
+    POOL_CLASS *pClass = &g_classes[node][index];
+    DWORD blockSize = sizeof(POOL_HEADER) + ClassSize(index);
+    DWORD chunkSize = blockSize > POOL_CHUNK_SIZE ? blockSize : POOL_CHUNK_SIZE;
+    DWORD count = chunkSize / blockSize;
+    BOOL bPrefault = ClassSize(index) <= POOL_PREFAULT_MAX;
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    BYTE *chunk;
+    DWORD i;
+
+    /* A placed chunk is faulted in after mbind() */
+    if (bPrefault && !t_bPlaced) flags |= MAP_POPULATE;
+
+    chunk = (BYTE*)mmap(NULL, chunkSize, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (chunk == MAP_FAILED) return FALSE;
+
+    if (t_bPlaced) {
+        BindChunk(chunk, chunkSize, node);
+        if (bPrefault) {
+            for (i = 0; i < chunkSize; i += POOL_PAGE_SIZE)
+                chunk[i] = 0;
+        }
+    }
+
+    __atomic_add_fetch(&g_heapAllocations, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&g_bytesReserved, chunkSize, __ATOMIC_RELAXED);
+
+    for (i = 0; i < count; i++) {
+        POOL_HEADER *pHeader = (POOL_HEADER*)(chunk + (size_t)i * blockSize);
+        POOL_FREE *pFree = (POOL_FREE*)(pHeader + 1);
+
+        pHeader->classIndex = index;
+        pHeader->magic = POOL_BLOCK_MAGIC;
+        pHeader->node = node;
+        pFree->pNext = pClass->pFreeList;
+        pClass->pFreeList = pFree;
+        pClass->freeCount++;
+    }
+
+    return TRUE;
+}
+
+/* Move up to half a cache worth of blocks from the shared list */
+static BOOL RefillCache(DWORD index)
+{
+    POOL_CLASS *pClass = &g_classes[t_node][index];
+    POOL_CACHE *pCache = &t_cache[index];
+    DWORD batch = CacheLimit(index) / 2;
+
+    if (batch == 0) batch = 1;
+
+    pthread_mutex_lock(&pClass->mutex);
+
+    if (!pClass->pFreeList && !GrowClass(t_node, index)) {
+        pthread_mutex_unlock(&pClass->mutex);
+        return FALSE;
+    }
+
+    while (batch-- > 0 && pClass->pFreeList) {
+        POOL_FREE *pFree = pClass->pFreeList;
+        pClass->pFreeList = pFree->pNext;
+        pClass->freeCount--;
+        pFree->pNext = pCache->pFreeList;
+        pCache->pFreeList = pFree;
+        pCache->count++;
+    }
+
+    pthread_mutex_unlock(&pClass->mutex);
+    return TRUE;
+}
+
+/* Give keepCount..count cached blocks back to the shared list */
+static void SpillCache(DWORD index, DWORD keepCount)
+{
+    POOL_CLASS *pClass = &g_classes[t_node][index];
+    POOL_CACHE *pCache = &t_cache[index];
+
+    if (pCache->count <= keepCount) return;
+
+    pthread_mutex_lock(&pClass->mutex);
+    while (pCache->count > keepCount) {
+        POOL_FREE *pFree = pCache->pFreeList;
+        pCache->pFreeList = pFree->pNext;
+        pCache->count--;
+        pFree->pNext = pClass->pFreeList;
+        pClass->pFreeList = pFree;
+        pClass->freeCount++;
+    }
+    pthread_mutex_unlock(&pClass->mutex);
+}
+
+/* ============================================================
+ * PUBLIC API
+ * ============================================================ */
+
+void* Pool_Alloc(DWORD size)
+{
+    POOL_HEADER *pHeader;
+    POOL_CACHE *pCache;
+    POOL_FREE *pFree;
+    DWORD index;
+
+    pthread_once(&g_poolOnce, PoolInit);
+    __atomic_add_fetch(&g_allocations, 1, __ATOMIC_RELAXED);
+
+    if (size > POOL_MAX_BLOCK_SIZE) {
+        pHeader = (POOL_HEADER*)malloc(sizeof(POOL_HEADER) + (size_t)size);
+        if (!pHeader) return NULL;
+        __atomic_add_fetch(&g_heapAllocations, 1, __ATOMIC_RELAXED);
+        pHeader->classIndex = POOL_CLASS_OVERSIZE;
+        pHeader->magic = POOL_BLOCK_MAGIC;
+        pHeader->size = size;
+        return pHeader + 1;
+    }
+
+    index = ClassForSize(size);
+    pCache = &t_cache[index];
+
+    if (!pCache->pFreeList && !RefillCache(index)) return NULL;
+
+    pFree = pCache->pFreeList;
+    pCache->pFreeList = pFree->pNext;
+    pCache->count--;
+    return pFree;
+}
+
+void* Pool_Calloc(DWORD size)
+{
+    void *ptr = Pool_Alloc(size);
+    if (ptr) memset(ptr, 0, size);
+    return ptr;
+}
+
+void* Pool_Realloc(void *ptr, DWORD size)
+{
+    void *newPtr;
+    DWORD oldSize;
+
+    if (!ptr) return Pool_Alloc(size);
+
+    oldSize = Pool_BlockSize(ptr);
+    if (size <= oldSize && size > oldSize / 2) return ptr;
+
+    newPtr = Pool_Alloc(size);
+    if (!newPtr) return NULL;
+    memcpy(newPtr, ptr, oldSize < size ? oldSize : size);
+    Pool_Free(ptr);
+    return newPtr;
+}
+
+void Pool_Free(void *ptr)
+{
+    POOL_HEADER *pHeader;
+    POOL_CACHE *pCache;
+    POOL_FREE *pFree;
+    DWORD index;
+
+    if (!ptr) return;
+
+    pHeader = (POOL_HEADER*)ptr - 1;
+    __atomic_add_fetch(&g_frees, 1, __ATOMIC_RELAXED);
+
+    if (pHeader->classIndex == POOL_CLASS_OVERSIZE) {
+        free(pHeader);
+        return;
+    }
+
+    index = pHeader->classIndex;
+    pFree = (POOL_FREE*)ptr;
+
+    if (pHeader->node != t_node) {
+        POOL_CLASS *pClass = &g_classes[pHeader->node][index];
+
+        __atomic_add_fetch(&g_remoteFrees, 1, __ATOMIC_RELAXED);
+        pthread_mutex_lock(&pClass->mutex);
+        pFree->pNext = pClass->pFreeList;
+        pClass->pFreeList = pFree;
+        pClass->freeCount++;
+        pthread_mutex_unlock(&pClass->mutex);
+        return;
+    }
+
+    pCache = &t_cache[index];
+    pFree->pNext = pCache->pFreeList;
+    pCache->pFreeList = pFree;
+    pCache->count++;
+
+    if (pCache->count > CacheLimit(index))
+        SpillCache(index, CacheLimit(index) / 2);
+}
+
+DWORD Pool_BlockSize(void *ptr)
+{
+    POOL_HEADER *pHeader = (POOL_HEADER*)ptr - 1;
+
+    if (pHeader->classIndex == POOL_CLASS_OVERSIZE) return pHeader->size;
+    return ClassSize(pHeader->classIndex);
+}
+
+void Pool_ThreadFlush(void)
+{
+    DWORD i;
+
+    pthread_once(&g_poolOnce, PoolInit);
+    for (i = 0; i < POOL_CLASS_COUNT; i++)
+        SpillCache(i, 0);
+}
+
+void Pool_SetThreadNode(int node)
+{
+    Pool_ThreadFlush();
+
+    if (node < 0 || node >= POOL_MAX_NODES) {
+        t_node = 0;
+        t_bPlaced = FALSE;
+    } else {
+        t_node = (DWORD)node;
+        t_bPlaced = TRUE;
+    }
+}
+
+void Pool_GetStats(POOL_STATS *pStats)
+{
+    if (!pStats) return;
+
+    pStats->allocations = __atomic_load_n(&g_allocations, __ATOMIC_RELAXED);
+    pStats->frees = __atomic_load_n(&g_frees, __ATOMIC_RELAXED);
+    pStats->heapAllocations = __atomic_load_n(&g_heapAllocations, __ATOMIC_RELAXED);
+    pStats->bytesReserved = __atomic_load_n(&g_bytesReserved, __ATOMIC_RELAXED);
+    pStats->remoteFrees = __atomic_load_n(&g_remoteFrees, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,57 @@
+/*
+ * relay_pool.h - Buffer Pools for RemoteDesk2K Linux Relay
+ *
+ * Power-of-two size classes from 64 bytes to 4MB. Each thread keeps a
+ * small cache of free blocks per class; the shared per-class free lists
+ * are refilled from pre-faulted arenas. Once the relay has warmed up,
+ * connection objects, frame buffers and send queues are recycled without
+ * touching the heap.
+ *
+ * A thread pinned to one NUMA node can ask for its arenas on that node;
+ * each node then has its own shared lists.
+ */
+
+#ifndef _RD2K_RELAY_POOL_H_
+#define _RD2K_RELAY_POOL_H_
+
+#include "common.h"
+
+#define POOL_MAX_BLOCK_SIZE     (4 * 1024 * 1024)
+
+typedef struct _POOL_STATS {
+    unsigned long long  allocations;        /* Pool_Alloc calls */
+    unsigned long long  frees;              /* Pool_Free calls */
+    unsigned long long  heapAllocations;    /* Arena chunks mapped + oversize blocks */
+    unsigned long long  bytesReserved;      /* Bytes held in arenas */
+    unsigned long long  remoteFrees;        /* Blocks freed on another node than their arena's */
+} POOL_STATS;
+
+/* Allocate at least size bytes (contents undefined). NULL on failure */
+void* Pool_Alloc(DWORD size);
+
+/* Allocate zero-filled memory */
+void* Pool_Calloc(DWORD size);
+
+/* Grow or shrink a block, keeping the first min(old, new) bytes */
+void* Pool_Realloc(void *ptr, DWORD size);
+
+/* Return a block to the pool (NULL is ignored) */
+void Pool_Free(void *ptr);
+
+/* Usable size of a block returned by Pool_Alloc */
+DWORD Pool_BlockSize(void *ptr);
+
+/* Hand the calling thread's cached blocks back to the shared lists.
+ * Call before a thread that used the pool exits */
+void Pool_ThreadFlush(void);
+
+/* Take the calling thread's blocks from arenas placed on NUMA node node
+ * from now on (-1 = no placement, the default). Its cached blocks are
+ * handed back first. Blocks it frees that belong to another node go
+ * straight back to that node's shared lists */
+void Pool_SetThreadNode(int node);
+
+/* Snapshot of the allocation counters */
+void Pool_GetStats(POOL_STATS *pStats);
+
+#endif /* _RD2K_RELAY_POOL_H_ */
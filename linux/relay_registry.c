@@ -0,0 +1,229 @@
+/*
+ * relay_registry.c - Client ID Registry for RemoteDesk2K Linux Relay
+ *
+ * Lock-striped hash map: the high bits of a mixed clientId pick a stripe,
+ * the low bits pick a bucket in that stripe's linear-probing table.
+ * Removal shifts following entries back instead of leaving tombstones,
+ * so lookups never degrade after a long run of reconnects.
+ */
+
+#include "relay_registry.h"
+
+#define REGISTRY_STRIPE_BITS    6
+#define REGISTRY_STRIPES        (1 << REGISTRY_STRIPE_BITS)
+#define REGISTRY_MIN_CAPACITY   16      /* Buckets per stripe, power of two */
+#define REGISTRY_CACHE_LINE     64
+
+typedef struct _REGISTRY_ENTRY {
+    DWORD               clientId;
+    void*               pValue;         /* NULL = empty bucket */
+} REGISTRY_ENTRY;
+
+/* A stripe is smaller than a cache line; aligning each to its own keeps
+ * shards working on different stripes from sharing lines */
+typedef struct _REGISTRY_STRIPE {
+    pthread_mutex_t     mutex;
+    REGISTRY_ENTRY*     entries;
+    DWORD               capacity;
+    DWORD               count;
+} __attribute__((aligned(REGISTRY_CACHE_LINE))) REGISTRY_STRIPE;
+
+struct _RELAY_REGISTRY {
+    REGISTRY_STRIPE     stripes[REGISTRY_STRIPES];
+};
+
+/* ============================================================
+ * HELPERS
+ * ============================================================ */
+
+static REGISTRY_STRIPE* GetStripe(RELAY_REGISTRY *pRegistry, DWORD hash)
+{
+    return &pRegistry->stripes[hash >> (32 - REGISTRY_STRIPE_BITS)];
+}
+
+/* Bucket holding clientId, or the empty bucket where it would go */
+static DWORD FindBucket(REGISTRY_STRIPE *pStripe, DWORD clientId, DWORD hash)
+{
+    DWORD mask = pStripe->capacity - 1;
+    DWORD i = hash & mask;
+
+    while (pStripe->entries[i].pValue && pStripe->entries[i].clientId != clientId)
+        i = (i + 1) & mask;
+
+    return i;
+}
+
+static int GrowStripe(REGISTRY_STRIPE *pStripe)
+{
+    REGISTRY_ENTRY *oldEntries = pStripe->entries;
+    DWORD oldCapacity = pStripe->capacity;
+    DWORD i;
+
+    pStripe->entries = (REGISTRY_ENTRY*)calloc(oldCapacity * 2, sizeof(REGISTRY_ENTRY));
+    if (!pStripe->entries) {
+        pStripe->entries = oldEntries;
+        return RD2K_ERR_MEMORY;
+    }
+    pStripe->capacity = oldCapacity * 2;
+
+    for (i = 0; i < oldCapacity; i++) {
+        if (oldEntries[i].pValue) {
+            DWORD slot = FindBucket(pStripe, oldEntries[i].clientId,
+                                    HashDword(oldEntries[i].clientId));
+            pStripe->entries[slot] = oldEntries[i];
+        }
+    }
+
+    free(oldEntries);
+    return RD2K_SUCCESS;
+}
+
+/* ============================================================
+ * PUBLIC API
+ * ============================================================ */
+
+RELAY_REGISTRY* Registry_Create(DWORD expectedCount)
+{
+    RELAY_REGISTRY *pRegistry;
+    DWORD capacity = REGISTRY_MIN_CAPACITY;
+    DWORD i;
+
+    if (posix_memalign((void**)&pRegistry, REGISTRY_CACHE_LINE, sizeof(RELAY_REGISTRY)) != 0)
+        return NULL;
+    ZeroMemory(pRegistry, sizeof(RELAY_REGISTRY));
+
+    /* Keep each stripe under half full at the expected size */
+    while (capacity < (expectedCount / REGISTRY_STRIPES) * 2)
+        capacity *= 2;
+
+    for (i = 0; i < REGISTRY_STRIPES; i++) {
+        REGISTRY_STRIPE *pStripe = &pRegistry->stripes[i];
+
+        pthread_mutex_init(&pStripe->mutex, NULL);
+        pStripe->capacity = capacity;
+        pStripe->entries = (REGISTRY_ENTRY*)calloc(capacity, sizeof(REGISTRY_ENTRY));
+        if (!pStripe->entries) {
+            Registry_Destroy(pRegistry);
+            return NULL;
+        }
+    }
+
+    return pRegistry;
+}
+
+void Registry_Destroy(RELAY_REGISTRY *pRegistry)
+{
+    DWORD i;
+
+    if (!pRegistry) return;
+
+    for (i = 0; i < REGISTRY_STRIPES; i++) {
+        pthread_mutex_destroy(&pRegistry->stripes[i].mutex);
+        free(pRegistry->stripes[i].entries);
+    }
+    free(pRegistry);
+}
+
+void Registry_Lock(RELAY_REGISTRY *pRegistry, DWORD clientId)
+{
+    pthread_mutex_lock(&GetStripe(pRegistry, HashDword(clientId))->mutex);
+}
+
+void Registry_Unlock(RELAY_REGISTRY *pRegistry, DWORD clientId)
+{
+    pthread_mutex_unlock(&GetStripe(pRegistry, HashDword(clientId))->mutex);
+}
+
+void* Registry_Find(RELAY_REGISTRY *pRegistry, DWORD clientId)
+{
+    DWORD hash = HashDword(clientId);
+    REGISTRY_STRIPE *pStripe = GetStripe(pRegistry, hash);
+
+    return pStripe->entries[FindBucket(pStripe, clientId, hash)].pValue;
+}
+
+int Registry_Insert(RELAY_REGISTRY *pRegistry, DWORD clientId, void *pValue)
+{
+    DWORD hash = HashDword(clientId);
+    REGISTRY_STRIPE *pStripe = GetStripe(pRegistry, hash);
+    DWORD slot;
+
+    if (!pValue) return RD2K_ERR_MEMORY;
+
+    slot = FindBucket(pStripe, clientId, hash);
+    if (pStripe->entries[slot].pValue) {
+        pStripe->entries[slot].pValue = pValue;
+        return RD2K_SUCCESS;
+    }
+
+    /* Load factor 3/4 */
+    if ((pStripe->count + 1) * 4 > pStripe->capacity * 3) {
+        if (GrowStripe(pStripe) != RD2K_SUCCESS) return RD2K_ERR_MEMORY;
+        slot = FindBucket(pStripe, clientId, hash);
+    }
+
+    pStripe->entries[slot].clientId = clientId;
+    pStripe->entries[slot].pValue = pValue;
+    __atomic_store_n(&pStripe->count, pStripe->count + 1, __ATOMIC_RELAXED);
+    return RD2K_SUCCESS;
+}
+
+BOOL Registry_Remove(RELAY_REGISTRY *pRegistry, DWORD clientId, void *pValue)
+{
+    DWORD hash = HashDword(clientId);
+    REGISTRY_STRIPE *pStripe = GetStripe(pRegistry, hash);
+    DWORD mask = pStripe->capacity - 1;
+    DWORD hole, i;
+
+    hole = FindBucket(pStripe, clientId, hash);
+    if (!pStripe->entries[hole].pValue || pStripe->entries[hole].pValue != pValue)
+        return FALSE;
+
+    /* Backward-shift: pull later entries of the probe run into the hole */
+    i = hole;
+    for (;;) {
+        DWORD home;
+
+        i = (i + 1) & mask;
+        if (!pStripe->entries[i].pValue) break;
+
+        home = HashDword(pStripe->entries[i].clientId) & mask;
+        /* Entry may move only if its home is not inside (hole, i] */
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            pStripe->entries[hole] = pStripe->entries[i];
+            hole = i;
+        }
+    }
+
+    pStripe->entries[hole].pValue = NULL;
+    pStripe->entries[hole].clientId = 0;
+    __atomic_store_n(&pStripe->count, pStripe->count - 1, __ATOMIC_RELAXED);
+    return TRUE;
+}
+
+void Registry_ForEach(RELAY_REGISTRY *pRegistry, REGISTRY_VISIT pfnVisit, void *pContext)
+{
+    DWORD i, j;
+
+    for (i = 0; i < REGISTRY_STRIPES; i++) {
+        REGISTRY_STRIPE *pStripe = &pRegistry->stripes[i];
+
+        pthread_mutex_lock(&pStripe->mutex);
+        for (j = 0; j < pStripe->capacity; j++) {
+            if (pStripe->entries[j].pValue)
+                pfnVisit(pStripe->entries[j].clientId, pStripe->entries[j].pValue, pContext);
+        }
+        pthread_mutex_unlock(&pStripe->mutex);
+    }
+}
+
+DWORD Registry_GetCount(RELAY_REGISTRY *pRegistry)
+{
+    DWORD total = 0;
+    DWORD i;
+
+    for (i = 0; i < REGISTRY_STRIPES; i++)
+        total += __atomic_load_n(&pRegistry->stripes[i].count, __ATOMIC_RELAXED);
+
+    return total;
+}
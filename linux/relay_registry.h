@@ -0,0 +1,51 @@
+/*
+ * relay_registry.h - Client ID Registry for RemoteDesk2K Linux Relay
+ *
+ * Hash map from clientId to the connection registered under it. The map is
+ * split into lock stripes, each an independent open-addressing table, so
+ * registrations of unrelated IDs on different shards do not contend.
+ *
+ * Callers bracket every lookup/insert/remove with Registry_Lock and
+ * Registry_Unlock for the same clientId. This lets a check-and-replace
+ * (e.g. evicting a stale registration) run as one atomic step. Never hold
+ * two stripe locks at once.
+ */
+
+#ifndef _RD2K_RELAY_REGISTRY_H_
+#define _RD2K_RELAY_REGISTRY_H_
+
+#include "common.h"
+
+typedef struct _RELAY_REGISTRY RELAY_REGISTRY;
+
+/* Create an empty registry, sized for roughly expectedCount IDs */
+RELAY_REGISTRY* Registry_Create(DWORD expectedCount);
+
+/* Free the registry (registered values are not touched) */
+void Registry_Destroy(RELAY_REGISTRY *pRegistry);
+
+/* Lock / unlock the stripe that holds clientId */
+void Registry_Lock(RELAY_REGISTRY *pRegistry, DWORD clientId);
+void Registry_Unlock(RELAY_REGISTRY *pRegistry, DWORD clientId);
+
+/* Value registered under clientId, or NULL. Stripe must be locked */
+void* Registry_Find(RELAY_REGISTRY *pRegistry, DWORD clientId);
+
+/* Register pValue (non-NULL) under clientId, replacing any previous value.
+ * Stripe must be locked. Returns RD2K_SUCCESS or RD2K_ERR_MEMORY */
+int Registry_Insert(RELAY_REGISTRY *pRegistry, DWORD clientId, void *pValue);
+
+/* Remove clientId if it is registered to pValue. Stripe must be locked.
+ * Returns TRUE if an entry was removed */
+BOOL Registry_Remove(RELAY_REGISTRY *pRegistry, DWORD clientId, void *pValue);
+
+/* Call pfnVisit for every registered ID. Locks one stripe at a time, so
+ * the caller must not hold a stripe lock and pfnVisit must not call back
+ * into the registry. IDs changed meanwhile may or may not be visited */
+typedef void (*REGISTRY_VISIT)(DWORD clientId, void *pValue, void *pContext);
+void Registry_ForEach(RELAY_REGISTRY *pRegistry, REGISTRY_VISIT pfnVisit, void *pContext);
+
+/* Number of registered IDs (approximate while other threads modify it) */
+DWORD Registry_GetCount(RELAY_REGISTRY *pRegistry);
+
+#endif /* _RD2K_RELAY_REGISTRY_H_ */
@@ -0,0 +1,771 @@
+/*
+ * relay_replay.c - RemoteDesk2K Linux Relay Traffic Replay
+ *
+ * Plays a capture written by "relay_server --capture FILE" against a
+ * relay: every captured connection is opened again and sends the same
+ * frames, each at its captured time divided by --speed. Control frames
+ * are sent as captured; DATA payloads as captured when the capture has
+ * them, otherwise (and past CAPTURE_PAYLOAD_MAX) as filler of the same
+ * size. Whatever the relay sends back is read and counted.
+ *
+ * Pairing depends on order across connections: a CONNECT_REQUEST only
+ * succeeds once its partner's REGISTER went through. The capture has the
+ * relay's answers in between, a faster replay may not, so the replay
+ * holds back a CONNECT_REQUEST until every REGISTER sent so far has been
+ * answered (at most REPLAY_SETUP_WAIT_MS). A connection with more than
+ * REPLAY_PENDING_MAX of output waiting also holds the replay back. Both
+ * show up as lateness: how long after its due time a record was sent.
+ *
+ * Build with "make replay" and run "./relay_replay --help".
+ */
+
+#include "common.h"
+#include "crypto.h"
+#include "relay_capture.h"
+#include "relay_hist.h"
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/timerfd.h>
+
+#define REPLAY_EVENTS               256
+#define REPLAY_BATCH                256         /* Records between event polls */
+#define REPLAY_PENDING_MAX          (4 * 1024 * 1024)   /* Output per connection */
+#define REPLAY_SETUP_WAIT_MS        1000        /* CONNECT_REQUEST waits for REGISTERs */
+#define REPLAY_DRAIN_MS             3000        /* At the end of the capture */
+#define REPLAY_FILL_SIZE            (64 * 1024)
+#define REPLAY_FILE_BUFFER          (1024 * 1024)
+#define REPLAY_PAYLOAD_MAX          (CAPTURE_PAYLOAD_MAX + RELAY_BUFFER_SIZE)  /* Sanity bound */
+
+typedef struct _REPLAY_STATS {
+    unsigned long long  records;
+    unsigned long long  connections;        /* Opened */
+    unsigned long long  connectFailures;
+    unsigned long long  closedByRelay;      /* From the relay's end, or failed */
+    unsigned long long  framesSent;
+    unsigned long long  bytesSent;          /* Headers included */
+    unsigned long long  dataFramesSent;
+    unsigned long long  framesReceived;
+    unsigned long long  bytesReceived;
+    unsigned long long  registersAnswered;
+    unsigned long long  skippedFrames;      /* Their connection was gone */
+    unsigned long long  setupWaits;         /* CONNECT_REQUESTs held back */
+    unsigned long long  setupTimeouts;
+    unsigned long long  backpressureWaits;
+} REPLAY_STATS;
+
+typedef struct _REPLAY_CONN {
+    SOCKET              sock;
+    DWORD               conn;               /* Capture connection number */
+    BOOL                bConnecting;
+    BOOL                bWantWrite;         /* EPOLLOUT registered */
+    BOOL                bClosing;           /* Close once the output is written */
+    DWORD               pendingRegisters;   /* REGISTERs sent, not answered */
+
+    /* Output not yet taken by the socket */
+    BYTE*               sendData;
+    DWORD               sendHead;
+    DWORD               sendTail;
+    DWORD               sendCapacity;
+
+    /* Frame being received */
+    RELAY_HEADER        header;
+    DWORD               headerLen;
+    DWORD               payloadDone;
+} REPLAY_CONN;
+
+static struct sockaddr_in g_serverAddr;
+static volatile int g_bRunning = 1;
+static int g_epollFd = -1;
+static int g_timerFd = -1;
+static REPLAY_CONN **g_conns;       /* By capture connection number */
+static DWORD g_connCapacity;
+static DWORD g_openConns;
+static DWORD g_pendingRegisters;
+static DWORD g_idOffset;
+static REPLAY_STATS g_stats;
+static RELAY_HIST g_lateness;       /* Microseconds past the due time */
+static BYTE g_fill[REPLAY_FILL_SIZE];
+static BYTE g_recvBuffer[RELAY_BUFFER_SIZE];
+
+/* ============================================================
+ * HELPERS
+ * ============================================================ */
+
+static unsigned long long NowMicroseconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000ULL + (unsigned long long)ts.tv_nsec / 1000;
+}
+
+static void SignalHandler(int sig)
+{
+    (void)sig;
+    g_bRunning = 0;
+}
+
+static void RaiseFileLimit(void)
+{
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+/* Wake the event loop at dueUs (CLOCK_MONOTONIC) */
+static void ArmTimer(unsigned long long dueUs)
+{
+    struct itimerspec its;
+
+    ZeroMemory(&its, sizeof(its));
+    its.it_value.tv_sec = (time_t)(dueUs / 1000000);
+    its.it_value.tv_nsec = (long)(dueUs % 1000000) * 1000;
+    if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0) its.it_value.tv_nsec = 1;
+    timerfd_settime(g_timerFd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+/* ============================================================
+ * CONNECTION I/O
+ * ============================================================ */
+
+static DWORD PendingBytes(const REPLAY_CONN *pConn)
+{
+    return pConn->sendTail - pConn->sendHead;
+}
+
+static void SetWantWrite(REPLAY_CONN *pConn, BOOL bWantWrite)
+{
+    struct epoll_event ev;
+
+    if (pConn->bWantWrite == bWantWrite) return;
+
+    ev.events = EPOLLIN | (bWantWrite ? EPOLLOUT : 0);
+    ev.data.ptr = pConn;
+    epoll_ctl(g_epollFd, EPOLL_CTL_MOD, pConn->sock, &ev);
+    pConn->bWantWrite = bWantWrite;
+}
+
+/* Make room for length more bytes of output */
+static BYTE* ReserveOutput(REPLAY_CONN *pConn, DWORD length)
+{
+    BYTE *pData;
+
+    if (pConn->sendHead == pConn->sendTail) {
+        pConn->sendHead = 0;
+        pConn->sendTail = 0;
+    }
+
+    if (pConn->sendTail + length > pConn->sendCapacity && pConn->sendHead > 0) {
+        memmove(pConn->sendData, pConn->sendData + pConn->sendHead, PendingBytes(pConn));
+        pConn->sendTail -= pConn->sendHead;
+        pConn->sendHead = 0;
+    }
+
+    if (pConn->sendTail + length > pConn->sendCapacity) {
+        DWORD capacity = pConn->sendCapacity ? pConn->sendCapacity : RELAY_BUFFER_SIZE;
+        while (capacity < pConn->sendTail + length) capacity *= 2;
+
+        pData = (BYTE*)realloc(pConn->sendData, capacity);
+        if (!pData) return NULL;
+        pConn->sendData = pData;
+        pConn->sendCapacity = capacity;
+    }
+
+    pData = pConn->sendData + pConn->sendTail;
+    pConn->sendTail += length;
+    return pData;
+}
+
+static void CloseConnection(REPLAY_CONN *pConn)
+{
+    epoll_ctl(g_epollFd, EPOLL_CTL_DEL, pConn->sock, NULL);
+    close(pConn->sock);
+    g_pendingRegisters -= pConn->pendingRegisters;
+    g_conns[pConn->conn] = NULL;
+    g_openConns--;
+    free(pConn->sendData);
+    free(pConn);
+}
+
+/* Write queued output; a closing connection is closed once it is all
+ * written. FALSE if the connection is gone */
+static BOOL FlushOutput(REPLAY_CONN *pConn)
+{
+    if (pConn->bConnecting) return TRUE;
+
+    while (pConn->sendHead < pConn->sendTail) {
+        ssize_t sent = send(pConn->sock, pConn->sendData + pConn->sendHead,
+                            PendingBytes(pConn), MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                SetWantWrite(pConn, TRUE);
+                return TRUE;
+            }
+            if (!pConn->bClosing) g_stats.closedByRelay++;
+            CloseConnection(pConn);
+            return FALSE;
+        }
+        pConn->sendHead += (DWORD)sent;
+    }
+
+    SetWantWrite(pConn, FALSE);
+    if (pConn->bClosing) {
+        CloseConnection(pConn);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static void OpenConnection(DWORD conn)
+{
+    REPLAY_CONN *pConn;
+    struct epoll_event ev;
+    int opt = 1;
+
+    if (conn >= g_connCapacity) {
+        DWORD capacity = g_connCapacity ? g_connCapacity : 1024;
+        REPLAY_CONN **conns;
+
+        while (capacity <= conn) capacity *= 2;
+        conns = (REPLAY_CONN**)realloc(g_conns, capacity * sizeof(REPLAY_CONN*));
+        if (!conns) {
+            g_stats.connectFailures++;
+            return;
+        }
+        ZeroMemory(conns + g_connCapacity, (capacity - g_connCapacity) * sizeof(REPLAY_CONN*));
+        g_conns = conns;
+        g_connCapacity = capacity;
+    }
+    if (g_conns[conn]) return;      /* Numbers are unique in a capture */
+
+    pConn = (REPLAY_CONN*)calloc(1, sizeof(REPLAY_CONN));
+    if (!pConn) {
+        g_stats.connectFailures++;
+        return;
+    }
+
+    pConn->sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (pConn->sock == INVALID_SOCKET) {
+        free(pConn);
+        g_stats.connectFailures++;
+        return;
+    }
+    setsockopt(pConn->sock, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+
+    ev.events = EPOLLIN | EPOLLOUT;
+    ev.data.ptr = pConn;
+    if ((connect(pConn->sock, (struct sockaddr*)&g_serverAddr, sizeof(g_serverAddr)) < 0 &&
+         errno != EINPROGRESS) ||
+        epoll_ctl(g_epollFd, EPOLL_CTL_ADD, pConn->sock, &ev) < 0) {
+        close(pConn->sock);
+        free(pConn);
+        g_stats.connectFailures++;
+        return;
+    }
+
+    pConn->conn = conn;
+    pConn->bConnecting = TRUE;
+    pConn->bWantWrite = TRUE;
+    g_conns[conn] = pConn;
+    g_openConns++;
+    g_stats.connections++;
+}
+
+static REPLAY_CONN* FindConnection(DWORD conn)
+{
+    return conn < g_connCapacity ? g_conns[conn] : NULL;
+}
+
+/* ============================================================
+ * RECORDS
+ * ============================================================ */
+
+/* Read the next record and its payload. FALSE at the end of the file
+ * or on a record that cannot be right */
+static BOOL ReadRecord(FILE *file, CAPTURE_RECORD *pRecord, BYTE *payload)
+{
+    if (fread(pRecord, sizeof(CAPTURE_RECORD), 1, file) != 1) return FALSE;
+
+    if (pRecord->payloadLength > REPLAY_PAYLOAD_MAX ||
+        (pRecord->event == CAPTURE_EVENT_FRAME &&
+         (pRecord->frameLength < sizeof(RELAY_HEADER) ||
+          pRecord->payloadLength > pRecord->frameLength - sizeof(RELAY_HEADER)))) {
+        fprintf(stderr, "[ERROR] Corrupt record at offset %ld\n",
+                ftell(file) - (long)sizeof(CAPTURE_RECORD));
+        return FALSE;
+    }
+
+    return pRecord->payloadLength == 0 ||
+           fread(payload, pRecord->payloadLength, 1, file) == 1;
+}
+
+/* Move a client ID in a REGISTER or CONNECT_REQUEST by --id-offset, so
+ * a replay does not collide with the clients of a live relay. The
+ * payload is encrypted if the header says so */
+static void OffsetClientId(BYTE *payload, DWORD length, BYTE headerFlags)
+{
+    DWORD id;
+
+    if (g_idOffset == 0 || length < sizeof(DWORD)) return;
+
+    if (headerFlags & 0x01) Crypto_Decrypt(payload, length);
+    memcpy(&id, payload, sizeof(DWORD));
+    id += g_idOffset;
+    memcpy(payload, &id, sizeof(DWORD));
+    if (headerFlags & 0x01) Crypto_Encrypt(payload, length);
+}
+
+/* Queue a captured frame: its captured payload, then filler */
+static void SendFrame(REPLAY_CONN *pConn, const CAPTURE_RECORD *pRecord, BYTE *payload)
+{
+    RELAY_HEADER header;
+    DWORD payloadLength = pRecord->frameLength - sizeof(RELAY_HEADER);
+    DWORD offset;
+    BYTE *pFrame;
+
+    if ((pRecord->msgType == RELAY_MSG_REGISTER || pRecord->msgType == RELAY_MSG_CONNECT_REQUEST) &&
+        pRecord->payloadLength == payloadLength)
+        OffsetClientId(payload, payloadLength, (BYTE)pRecord->arg);
+
+    pFrame = ReserveOutput(pConn, pRecord->frameLength);
+    if (!pFrame) {
+        g_stats.skippedFrames++;
+        return;
+    }
+
+    header.msgType = pRecord->msgType;
+    header.flags = (BYTE)pRecord->arg;
+    header.reserved = 0;
+    header.dataLength = payloadLength;
+    memcpy(pFrame, &header, sizeof(header));
+    pFrame += sizeof(header);
+
+    memcpy(pFrame, payload, pRecord->payloadLength);
+    for (offset = pRecord->payloadLength; offset < payloadLength; ) {
+        DWORD chunk = payloadLength - offset < REPLAY_FILL_SIZE ? payloadLength - offset : REPLAY_FILL_SIZE;
+        memcpy(pFrame + offset, g_fill, chunk);
+        offset += chunk;
+    }
+
+    if (pRecord->msgType == RELAY_MSG_REGISTER) {
+        pConn->pendingRegisters++;
+        g_pendingRegisters++;
+    }
+    g_stats.framesSent++;
+    g_stats.bytesSent += pRecord->frameLength;
+    if (pRecord->msgType == RELAY_MSG_DATA) g_stats.dataFramesSent++;
+
+    FlushOutput(pConn);
+}
+
+static void ApplyRecord(const CAPTURE_RECORD *pRecord, BYTE *payload)
+{
+    REPLAY_CONN *pConn;
+
+    g_stats.records++;
+
+    switch (pRecord->event) {
+        case CAPTURE_EVENT_OPEN:
+            OpenConnection(pRecord->conn);
+            break;
+
+        case CAPTURE_EVENT_FRAME:
+            pConn = FindConnection(pRecord->conn);
+            if (!pConn || pConn->bClosing) {
+                g_stats.skippedFrames++;
+                break;
+            }
+            SendFrame(pConn, pRecord, payload);
+            break;
+
+        case CAPTURE_EVENT_CLOSE:
+            pConn = FindConnection(pRecord->conn);
+            if (!pConn) break;
+            pConn->bClosing = TRUE;
+            FlushOutput(pConn);
+            break;
+    }
+}
+
+/* ============================================================
+ * EVENTS
+ * ============================================================ */
+
+static void HandleFrame(REPLAY_CONN *pConn)
+{
+    g_stats.framesReceived++;
+    g_stats.bytesReceived += sizeof(RELAY_HEADER) + pConn->header.dataLength;
+
+    if (pConn->header.msgType == RELAY_MSG_REGISTER_RESPONSE && pConn->pendingRegisters > 0) {
+        pConn->pendingRegisters--;
+        g_pendingRegisters--;
+        g_stats.registersAnswered++;
+    }
+}
+
+/* Walk received bytes frame by frame; only headers are kept */
+static void ParseInput(REPLAY_CONN *pConn, const BYTE *data, DWORD length)
+{
+    DWORD offset = 0;
+
+    while (offset < length) {
+        DWORD take;
+
+        if (pConn->headerLen < sizeof(RELAY_HEADER)) {
+            take = sizeof(RELAY_HEADER) - pConn->headerLen;
+            if (take > length - offset) take = length - offset;
+            memcpy((BYTE*)&pConn->header + pConn->headerLen, data + offset, take);
+            pConn->headerLen += take;
+            offset += take;
+            if (pConn->headerLen < sizeof(RELAY_HEADER)) break;
+            pConn->payloadDone = 0;
+        }
+
+        take = pConn->header.dataLength - pConn->payloadDone;
+        if (take > length - offset) take = length - offset;
+        pConn->payloadDone += take;
+        offset += take;
+
+        if (pConn->payloadDone == pConn->header.dataLength) {
+            pConn->headerLen = 0;
+            HandleFrame(pConn);
+        }
+    }
+}
+
+static void HandleReadable(REPLAY_CONN *pConn)
+{
+    for (;;) {
+        ssize_t got = recv(pConn->sock, g_recvBuffer, sizeof(g_recvBuffer), MSG_DONTWAIT);
+
+        if (got > 0) {
+            ParseInput(pConn, g_recvBuffer, (DWORD)got);
+            continue;
+        }
+        if (got < 0 && errno == EINTR) continue;
+        if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+
+        /* The relay closed it (e.g. after DISCONNECT) or it failed */
+        if (!pConn->bClosing) g_stats.closedByRelay++;
+        CloseConnection(pConn);
+        return;
+    }
+}
+
+static void HandleWritable(REPLAY_CONN *pConn)
+{
+    if (pConn->bConnecting) {
+        int error = 0;
+        socklen_t len = sizeof(error);
+
+        if (getsockopt(pConn->sock, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error != 0) {
+            g_stats.connectFailures++;
+            CloseConnection(pConn);
+            return;
+        }
+        pConn->bConnecting = FALSE;
+    }
+    FlushOutput(pConn);
+}
+
+static void PollEvents(int timeoutMs)
+{
+    struct epoll_event events[REPLAY_EVENTS];
+    int count, i;
+
+    count = epoll_wait(g_epollFd, events, REPLAY_EVENTS, timeoutMs);
+    for (i = 0; i < count; i++) {
+        REPLAY_CONN *pConn = (REPLAY_CONN*)events[i].data.ptr;
+
+        if (!pConn) {
+            uint64_t expirations;
+            (void)!read(g_timerFd, &expirations, sizeof(expirations));
+            continue;
+        }
+
+        /* Either handler may close and free the connection */
+        if ((events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) &&
+            (pConn->bConnecting || pConn->bWantWrite)) {
+            DWORD conn = pConn->conn;
+
+            HandleWritable(pConn);
+            if (FindConnection(conn) != pConn) continue;
+        }
+        if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+            HandleReadable(pConn);
+    }
+}
+
+static unsigned long long QueuedBytes(void)
+{
+    unsigned long long queued = 0;
+    DWORD i;
+
+    for (i = 0; i < g_connCapacity; i++) {
+        if (g_conns[i]) queued += PendingBytes(g_conns[i]);
+    }
+    return queued;
+}
+
+/* ============================================================
+ * MAIN
+ * ============================================================ */
+
+static void PrintHelp(const char *progname)
+{
+    fprintf(stdout, "Usage: %s [OPTIONS] FILE\n\n", progname);
+    fprintf(stdout, "Replays a capture made with relay_server --capture FILE.\n\n");
+    fprintf(stdout, "Options:\n");
+    fprintf(stdout, "  -s, --server HOST    Relay address (default: 127.0.0.1)\n");
+    fprintf(stdout, "  -p, --port PORT      Relay port (default: 5000)\n");
+    fprintf(stdout, "  -x, --speed N        Times real time, 0 = as fast as possible (default: 1)\n");
+    fprintf(stdout, "      --id-offset N    Add N to the client IDs in REGISTER and CONNECT_REQUEST\n");
+    fprintf(stdout, "  -h, --help           Show this help message\n");
+    fprintf(stdout, "\n");
+    fprintf(stdout, "Examples:\n");
+    fprintf(stdout, "  %s incident.cap              # As captured\n", progname);
+    fprintf(stdout, "  %s -x 10 incident.cap        # Ten times faster\n", progname);
+    fprintf(stdout, "  %s -x 0 -p 5900 incident.cap # Flat out, relay on port 5900\n", progname);
+    fprintf(stdout, "\n");
+}
+
+static BOOL ResolveServer(const char *host, WORD port)
+{
+    struct addrinfo hints, *pResult;
+
+    ZeroMemory(&hints, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, NULL, &hints, &pResult) != 0) return FALSE;
+
+    memcpy(&g_serverAddr, pResult->ai_addr, sizeof(g_serverAddr));
+    g_serverAddr.sin_port = htons(port);
+    freeaddrinfo(pResult);
+    return TRUE;
+}
+
+static void PrintInterval(double elapsed, double interval, double captureSeconds,
+                          const REPLAY_STATS *pPrev)
+{
+    printf("[%5.1fs] capture %6.1fs  conns %6u  sent %8.2f MB/s  recv %8.2f MB/s  %8.0f frames/s\n",
+           elapsed, captureSeconds, g_openConns,
+           (double)(g_stats.bytesSent - pPrev->bytesSent) / interval / 1e6,
+           (double)(g_stats.bytesReceived - pPrev->bytesReceived) / interval / 1e6,
+           (double)(g_stats.framesSent - pPrev->framesSent) / interval);
+    fflush(stdout);
+}
+
+static void PrintReport(double elapsed, double captureSeconds, double speed, BOOL bComplete)
+{
+    char summary[160];
+
+    printf("\n");
+    printf("Replayed:    %llu records, %.2f s of capture in %.2f s (%.2fx)%s\n",
+           g_stats.records, captureSeconds, elapsed,
+           elapsed > 0 ? captureSeconds / elapsed : 0.0, bComplete ? "" : ", stopped early");
+    printf("Connections: %llu opened, %llu failed to connect, %llu closed by the relay\n",
+           g_stats.connections, g_stats.connectFailures, g_stats.closedByRelay);
+    printf("Sent:        %llu frames (%llu DATA), %.2f MB, %llu skipped on closed connections\n",
+           g_stats.framesSent, g_stats.dataFramesSent, (double)g_stats.bytesSent / 1e6,
+           g_stats.skippedFrames);
+    printf("Received:    %llu frames, %.2f MB, %llu registrations answered\n",
+           g_stats.framesReceived, (double)g_stats.bytesReceived / 1e6, g_stats.registersAnswered);
+    printf("Held back:   %llu CONNECT_REQUESTs for REGISTERs (%llu timed out), "
+           "%llu times for a full connection\n",
+           g_stats.setupWaits, g_stats.setupTimeouts, g_stats.backpressureWaits);
+    if (speed > 0) {
+        Hist_Format(&g_lateness, summary, sizeof(summary));
+        printf("Lateness us: %s\n", summary);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    const char *server = "127.0.0.1";
+    const char *path = NULL;
+    WORD port = RELAY_DEFAULT_PORT;
+    double speed = 1.0;
+    FILE *file;
+    CAPTURE_FILE_HEADER fileHeader;
+    CAPTURE_RECORD record;
+    BYTE *payload;
+    REPLAY_STATS prev;
+    struct epoll_event ev;
+    unsigned long long startUs, nowUs, lastReportUs, dueUs = 0;
+    unsigned long long setupSinceUs = 0, drainUntilUs = 0, lastTimeUs = 0;
+    BOOL bHaveRecord, bHeldForFull = FALSE;
+    int arg;
+
+    for (arg = 1; arg < argc; arg++) {
+        if (strcmp(argv[arg], "-s") == 0 || strcmp(argv[arg], "--server") == 0) {
+            if (arg + 1 < argc) server = argv[++arg];
+        } else if (strcmp(argv[arg], "-p") == 0 || strcmp(argv[arg], "--port") == 0) {
+            if (arg + 1 < argc) {
+                port = (WORD)atoi(argv[++arg]);
+                if (port == 0) port = RELAY_DEFAULT_PORT;
+            }
+        } else if (strcmp(argv[arg], "-x") == 0 || strcmp(argv[arg], "--speed") == 0) {
+            if (arg + 1 < argc) speed = atof(argv[++arg]);
+        } else if (strcmp(argv[arg], "--id-offset") == 0) {
+            if (arg + 1 < argc) g_idOffset = (DWORD)strtoul(argv[++arg], NULL, 0);
+        } else if (strcmp(argv[arg], "-h") == 0 || strcmp(argv[arg], "--help") == 0) {
+            PrintHelp(argv[0]);
+            return 0;
+        } else if (argv[arg][0] != '-' && !path) {
+            path = argv[arg];
+        } else {
+            fprintf(stderr, "Unknown option: %s\n", argv[arg]);
+            PrintHelp(argv[0]);
+            return 1;
+        }
+    }
+
+    if (!path) {
+        PrintHelp(argv[0]);
+        return 1;
+    }
+    if (speed < 0) {
+        fprintf(stderr, "[ERROR] --speed must not be negative\n");
+        return 1;
+    }
+    if (!ResolveServer(server, port)) {
+        fprintf(stderr, "[ERROR] Cannot resolve %s\n", server);
+        return 1;
+    }
+
+    file = fopen(path, "rb");
+    if (!file) {
+        fprintf(stderr, "[ERROR] Cannot open %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    setvbuf(file, NULL, _IOFBF, REPLAY_FILE_BUFFER);
+    if (fread(&fileHeader, sizeof(fileHeader), 1, file) != 1 ||
+        fileHeader.magic != CAPTURE_MAGIC || fileHeader.version != CAPTURE_VERSION) {
+        fprintf(stderr, "[ERROR] %s is not a relay capture (version %d)\n", path, CAPTURE_VERSION);
+        fclose(file);
+        return 1;
+    }
+
+    RaiseFileLimit();
+    signal(SIGINT, SignalHandler);
+    signal(SIGTERM, SignalHandler);
+    signal(SIGPIPE, SIG_IGN);
+
+    Crypto_Init(NULL);
+    memset(g_fill, 0x5A, sizeof(g_fill));
+    Hist_Reset(&g_lateness);
+
+    payload = (BYTE*)malloc(REPLAY_PAYLOAD_MAX);
+    g_epollFd = epoll_create1(EPOLL_CLOEXEC);
+    g_timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (!payload || g_epollFd < 0 || g_timerFd < 0) {
+        fprintf(stderr, "[ERROR] Out of resources\n");
+        return 1;
+    }
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    epoll_ctl(g_epollFd, EPOLL_CTL_ADD, g_timerFd, &ev);
+
+    {
+        time_t captured = (time_t)(fileHeader.startTimeUs / 1000000);
+        char when[64];
+
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&captured));
+        printf("relay_replay: %s (captured %s, %s) against %s:%u at ", path, when,
+               (fileHeader.flags & CAPTURE_FILE_PAYLOADS) ? "with payloads" : "DATA sizes only",
+               server, port);
+        if (speed > 0) printf("%gx\n", speed);
+        else printf("full speed\n");
+    }
+
+    bHaveRecord = ReadRecord(file, &record, payload);
+    startUs = NowMicroseconds();
+    lastReportUs = startUs;
+    ZeroMemory(&prev, sizeof(prev));
+
+    while (g_bRunning) {
+        int timeoutMs = 1000;
+        DWORD batch = 0;
+
+        /* Send everything that is due */
+        nowUs = NowMicroseconds();
+        while (bHaveRecord && g_bRunning) {
+            REPLAY_CONN *pConn = FindConnection(record.conn);
+
+            if (record.event == CAPTURE_EVENT_FRAME && record.msgType == RELAY_MSG_CONNECT_REQUEST &&
+                g_pendingRegisters > 0) {
+                if (setupSinceUs == 0) {
+                    setupSinceUs = nowUs;
+                    g_stats.setupWaits++;
+                }
+                if (nowUs - setupSinceUs < REPLAY_SETUP_WAIT_MS * 1000ULL) {
+                    timeoutMs = 1;
+                    break;
+                }
+                g_stats.setupTimeouts++;
+            }
+            setupSinceUs = 0;
+
+            if (pConn && PendingBytes(pConn) > REPLAY_PENDING_MAX) {
+                if (!bHeldForFull) g_stats.backpressureWaits++;
+                bHeldForFull = TRUE;
+                break;
+            }
+            bHeldForFull = FALSE;
+
+            if (speed > 0) {
+                dueUs = startUs + (unsigned long long)((double)record.timeUs / speed);
+                if (dueUs > nowUs) {
+                    ArmTimer(dueUs);
+                    break;
+                }
+                Hist_Record(&g_lateness, (DWORD)(nowUs - dueUs < 0xFFFFFFFFULL ?
+                                                 nowUs - dueUs : 0xFFFFFFFFULL), 1);
+            }
+
+            lastTimeUs = record.timeUs;
+            ApplyRecord(&record, payload);
+            bHaveRecord = ReadRecord(file, &record, payload);
+
+            /* Answers must not wait for a long run of due records */
+            if (++batch == REPLAY_BATCH) {
+                timeoutMs = 0;
+                break;
+            }
+            nowUs = NowMicroseconds();
+        }
+
+        /* The capture is done: let the output drain, then stop */
+        if (!bHaveRecord) {
+            if (drainUntilUs == 0) drainUntilUs = nowUs + REPLAY_DRAIN_MS * 1000ULL;
+            if (QueuedBytes() == 0 || nowUs >= drainUntilUs) break;
+            timeoutMs = 10;
+        }
+
+        if (nowUs - lastReportUs >= 1000000) {
+            PrintInterval((double)(nowUs - startUs) / 1e6, (double)(nowUs - lastReportUs) / 1e6,
+                          (double)lastTimeUs / 1e6, &prev);
+            prev = g_stats;
+            lastReportUs = nowUs;
+        }
+
+        PollEvents(timeoutMs);
+    }
+
+    nowUs = NowMicroseconds();
+    PrintReport((double)(nowUs - startUs) / 1e6, (double)lastTimeUs / 1e6, speed, !bHaveRecord);
+
+    for (arg = 0; arg < (int)g_connCapacity; arg++) {
+        if (g_conns[arg]) CloseConnection(g_conns[arg]);
+    }
+    free(g_conns);
+    free(payload);
+    close(g_timerFd);
+    close(g_epollFd);
+    fclose(file);
+    Crypto_Cleanup();
+    return 0;
+}
@@ -0,0 +1,366 @@
+/*
+ * relay_ring.c - Per-Thread Record Rings for RemoteDesk2K Linux Relay
+ *
+ * Ring positions are free-running byte counters: the producer owns tail,
+ * the writer owns head. A record is a 16-byte RING_RECORD plus its bytes,
+ * padded to the size of a RING_RECORD, and never wraps; when it does not
+ * fit before the end of the ring, a filler record takes the rest. The
+ * padding keeps every gap before the end a whole RING_RECORD long, so the
+ * filler mark always lands inside the ring. Rings are freed with their
+ * set. A thread's ring is handed to the next new thread once the owner
+ * exits, and anything still queued in it is written as usual.
+ *
+ * Wakeups: an idle writer sets bWriterIdle, then checks the rings once
+ * more before sleeping. A producer publishes its record, then clears the
+ * flag and signals the eventfd only if the flag was set. With a full
+ * fence on both sides, either the writer sees the record or the producer
+ * sees the flag.
+ */
+
+#include "relay_ring.h"
+#include <poll.h>
+#include <sys/eventfd.h>
+
+#define RING_CACHE_LINE         64
+#define RING_SIZE_MIN           4096
+#define RING_RECORD_FILLER      0xFFFFFFFF      /* Skip to the start of the ring */
+#define RING_IDLE_WAIT_MS       1000
+
+typedef struct _RING_RECORD {
+    unsigned long long  timeUs;
+    DWORD               length;             /* Bytes that follow, or RING_RECORD_FILLER */
+    DWORD               reserved;
+} RING_RECORD;
+
+typedef struct _RECORD_RING {
+    struct _RECORD_RING* pNext;             /* Immutable once published */
+    RELAY_RINGS*        pRings;
+    BOOL                bInUse;             /* Owned by a live thread (under ringMutex) */
+    unsigned long long  tail;               /* Producer, published with release */
+    unsigned long long  dropped;            /* Producer */
+    unsigned long long  head __attribute__((aligned(RING_CACHE_LINE)));  /* Writer, published with release */
+    BYTE                data[] __attribute__((aligned(RING_CACHE_LINE)));
+} RECORD_RING;
+
+struct _RELAY_RINGS {
+    DWORD               ringSize;
+    DWORD               batchMax;
+    RING_CONSUME        pfnConsume;
+    RING_FLUSH          pfnFlush;
+    void*               pContext;
+    pthread_key_t       ringKey;            /* The calling thread's ring */
+    pthread_mutex_t     ringMutex;          /* Adding rings and handing them over */
+    RECORD_RING*        pList;              /* Atomic list head */
+    pthread_t           writerThread;
+    int                 wakeFd;
+    BOOL                bRunning;           /* Writer thread started */
+    BOOL                bStopping;          /* Atomic: writer exits once drained */
+    BOOL                bWriterIdle;        /* Atomic */
+    unsigned long long  records;            /* Writer only, read atomically */
+    unsigned long long  batches;
+};
+
+/* ============================================================
+ * HELPERS
+ * ============================================================ */
+
+static void ReleaseThreadRing(void *ptr)
+{
+    RECORD_RING *pRing = (RECORD_RING*)ptr;
+
+    pthread_mutex_lock(&pRing->pRings->ringMutex);
+    pRing->bInUse = FALSE;
+    pthread_mutex_unlock(&pRing->pRings->ringMutex);
+}
+
+/* The calling thread's ring; the first call per thread takes ringMutex */
+static RECORD_RING* GetThreadRing(RELAY_RINGS *pRings)
+{
+    RECORD_RING *pRing = (RECORD_RING*)pthread_getspecific(pRings->ringKey);
+    void *ptr;
+
+    if (pRing) return pRing;
+
+    pthread_mutex_lock(&pRings->ringMutex);
+
+    for (pRing = pRings->pList; pRing; pRing = pRing->pNext) {
+        if (!pRing->bInUse) break;
+    }
+    if (!pRing && posix_memalign(&ptr, RING_CACHE_LINE, sizeof(RECORD_RING) + pRings->ringSize) == 0) {
+        pRing = (RECORD_RING*)ptr;
+        ZeroMemory(pRing, sizeof(RECORD_RING));
+        pRing->pRings = pRings;
+        pRing->pNext = pRings->pList;
+        __atomic_store_n(&pRings->pList, pRing, __ATOMIC_RELEASE);
+    }
+    if (pRing) {
+        pRing->bInUse = TRUE;
+        pthread_setspecific(pRings->ringKey, pRing);
+    }
+
+    pthread_mutex_unlock(&pRings->ringMutex);
+    return pRing;
+}
+
+static DWORD RecordSize(DWORD length)
+{
+    return (DWORD)((sizeof(RING_RECORD) + length + sizeof(RING_RECORD) - 1) &
+                   ~(DWORD)(sizeof(RING_RECORD) - 1));
+}
+
+static void WakeWriter(RELAY_RINGS *pRings)
+{
+    uint64_t one = 1;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&pRings->bWriterIdle, __ATOMIC_RELAXED) &&
+        __atomic_exchange_n(&pRings->bWriterIdle, FALSE, __ATOMIC_ACQ_REL)) {
+        (void)!write(pRings->wakeFd, &one, sizeof(one));
+    }
+}
+
+/* Oldest unwritten record of a ring, skipping filler. Writer only */
+static RING_RECORD* PeekRecord(RELAY_RINGS *pRings, RECORD_RING *pRing)
+{
+    unsigned long long head = pRing->head;
+    unsigned long long tail = __atomic_load_n(&pRing->tail, __ATOMIC_ACQUIRE);
+
+    while (head != tail) {
+        DWORD offset = (DWORD)(head & (pRings->ringSize - 1));
+        RING_RECORD *pRecord = (RING_RECORD*)(pRing->data + offset);
+
+        if (pRecord->length != RING_RECORD_FILLER) return pRecord;
+
+        head += pRings->ringSize - offset;
+        __atomic_store_n(&pRing->head, head, __ATOMIC_RELEASE);
+    }
+
+    return NULL;
+}
+
+/* Hand up to batchMax records to the consumer, merging the rings by
+ * timestamp. Returns the number consumed */
+static DWORD WriteBatch(RELAY_RINGS *pRings)
+{
+    DWORD count = 0;
+
+    while (count < pRings->batchMax) {
+        RECORD_RING *pRing, *pOldestRing = NULL;
+        RING_RECORD *pRecord, *pOldest = NULL;
+
+        for (pRing = __atomic_load_n(&pRings->pList, __ATOMIC_ACQUIRE); pRing; pRing = pRing->pNext) {
+            pRecord = PeekRecord(pRings, pRing);
+            if (pRecord && (!pOldest || pRecord->timeUs < pOldest->timeUs)) {
+                pOldest = pRecord;
+                pOldestRing = pRing;
+            }
+        }
+        if (!pOldest) break;
+
+        pRings->pfnConsume(pRings->pContext, pOldest->timeUs, (const BYTE*)(pOldest + 1),
+                           pOldest->length);
+        __atomic_store_n(&pOldestRing->head, pOldestRing->head + RecordSize(pOldest->length),
+                         __ATOMIC_RELEASE);
+        count++;
+    }
+
+    return count;
+}
+
+static BOOL AnyPending(RELAY_RINGS *pRings)
+{
+    RECORD_RING *pRing;
+
+    for (pRing = __atomic_load_n(&pRings->pList, __ATOMIC_ACQUIRE); pRing; pRing = pRing->pNext) {
+        if (__atomic_load_n(&pRing->tail, __ATOMIC_ACQUIRE) != pRing->head) return TRUE;
+    }
+    return FALSE;
+}
+
+static void* WriterThread(void *arg)
+{
+    RELAY_RINGS *pRings = (RELAY_RINGS*)arg;
+    struct pollfd pfd;
+    uint64_t wakes;
+
+    for (;;) {
+        DWORD count = WriteBatch(pRings);
+
+        if (pRings->pfnFlush) pRings->pfnFlush(pRings->pContext, count);
+
+        if (count > 0) {
+            __atomic_store_n(&pRings->records, pRings->records + count, __ATOMIC_RELAXED);
+            __atomic_store_n(&pRings->batches, pRings->batches + 1, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        if (__atomic_load_n(&pRings->bStopping, __ATOMIC_ACQUIRE)) break;
+
+        /* Announce the nap, then look once more: a producer that missed
+         * the flag published its record before our second look */
+        __atomic_store_n(&pRings->bWriterIdle, TRUE, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (!AnyPending(pRings) && !__atomic_load_n(&pRings->bStopping, __ATOMIC_ACQUIRE)) {
+            pfd.fd = pRings->wakeFd;
+            pfd.events = POLLIN;
+            pfd.revents = 0;
+            if (poll(&pfd, 1, RING_IDLE_WAIT_MS) > 0)
+                (void)!read(pRings->wakeFd, &wakes, sizeof(wakes));
+        }
+        __atomic_store_n(&pRings->bWriterIdle, FALSE, __ATOMIC_RELAXED);
+    }
+
+    return NULL;
+}
+
+/* ============================================================
+ * PUBLIC API
+ * ============================================================ */
+
+RELAY_RINGS* Rings_Create(DWORD ringSize, DWORD batchMax, RING_CONSUME pfnConsume,
+                          RING_FLUSH pfnFlush, void *pContext)
+{
+    RELAY_RINGS *pRings;
+
+    if (ringSize < RING_SIZE_MIN || (ringSize & (ringSize - 1)) != 0 || batchMax == 0 ||
+        !pfnConsume) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    pRings = (RELAY_RINGS*)calloc(1, sizeof(RELAY_RINGS));
+    if (!pRings) return NULL;
+
+    if (pthread_key_create(&pRings->ringKey, ReleaseThreadRing) != 0) {
+        free(pRings);
+        errno = EAGAIN;
+        return NULL;
+    }
+
+    pRings->ringSize = ringSize;
+    pRings->batchMax = batchMax;
+    pRings->pfnConsume = pfnConsume;
+    pRings->pfnFlush = pfnFlush;
+    pRings->pContext = pContext;
+    pRings->wakeFd = -1;
+    pthread_mutex_init(&pRings->ringMutex, NULL);
+
+    return pRings;
+}
+
+int Rings_Start(RELAY_RINGS *pRings)
+{
+    sigset_t all, previous;
+    int result;
+
+    if (pRings->bRunning) return RD2K_SUCCESS;
+
+    pRings->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (pRings->wakeFd < 0) return RD2K_ERR_SOCKET;
+
+    __atomic_store_n(&pRings->bStopping, FALSE, __ATOMIC_RELAXED);
+
+    /* Signals go to the other threads: a handler that logs would
+     * deadlock against a consumer interrupted on this one */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &previous);
+    result = pthread_create(&pRings->writerThread, NULL, WriterThread, pRings);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+
+    if (result != 0) {
+        close(pRings->wakeFd);
+        pRings->wakeFd = -1;
+        errno = result;
+        return RD2K_ERR_SOCKET;
+    }
+
+    pRings->bRunning = TRUE;
+    return RD2K_SUCCESS;
+}
+
+void Rings_Stop(RELAY_RINGS *pRings)
+{
+    uint64_t one = 1;
+
+    if (!pRings || !pRings->bRunning) return;
+
+    __atomic_store_n(&pRings->bStopping, TRUE, __ATOMIC_RELEASE);
+    (void)!write(pRings->wakeFd, &one, sizeof(one));
+    pthread_join(pRings->writerThread, NULL);
+
+    close(pRings->wakeFd);
+    pRings->wakeFd = -1;
+    pRings->bRunning = FALSE;
+}
+
+void Rings_Destroy(RELAY_RINGS *pRings)
+{
+    RECORD_RING *pRing, *pNext;
+
+    if (!pRings) return;
+
+    Rings_Stop(pRings);
+
+    /* No destructor runs for a deleted key, so exiting threads leave the
+     * freed rings alone */
+    pthread_key_delete(pRings->ringKey);
+    for (pRing = pRings->pList; pRing; pRing = pNext) {
+        pNext = pRing->pNext;
+        free(pRing);
+    }
+    pthread_mutex_destroy(&pRings->ringMutex);
+    free(pRings);
+}
+
+BOOL Rings_Append(RELAY_RINGS *pRings, unsigned long long timeUs,
+                  const void *part1, DWORD length1, const void *part2, DWORD length2)
+{
+    RECORD_RING *pRing = GetThreadRing(pRings);
+    RING_RECORD *pRecord;
+    unsigned long long tail, head;
+    DWORD length = length1 + length2;
+    DWORD size, offset, room;
+
+    if (!pRing) return FALSE;
+
+    size = RecordSize(length);
+    tail = pRing->tail;
+    head = __atomic_load_n(&pRing->head, __ATOMIC_ACQUIRE);
+    offset = (DWORD)(tail & (pRings->ringSize - 1));
+    room = pRings->ringSize - offset;
+
+    if (tail + (room < size ? room : 0) + size - head > pRings->ringSize) {
+        __atomic_store_n(&pRing->dropped, pRing->dropped + 1, __ATOMIC_RELAXED);
+        return TRUE;
+    }
+
+    /* room is a multiple of RecordSize's padding, so the filler fits */
+    if (room < size) {
+        ((RING_RECORD*)(pRing->data + offset))->length = RING_RECORD_FILLER;
+        tail += room;
+        offset = 0;
+    }
+
+    pRecord = (RING_RECORD*)(pRing->data + offset);
+    pRecord->timeUs = timeUs;
+    pRecord->length = length;
+    if (length1 > 0) memcpy(pRecord + 1, part1, length1);
+    if (length2 > 0) memcpy((BYTE*)(pRecord + 1) + length1, part2, length2);
+
+    __atomic_store_n(&pRing->tail, tail + size, __ATOMIC_RELEASE);
+    WakeWriter(pRings);
+    return TRUE;
+}
+
+void Rings_GetStats(RELAY_RINGS *pRings, RING_STATS *pStats)
+{
+    RECORD_RING *pRing;
+
+    ZeroMemory(pStats, sizeof(RING_STATS));
+    if (!pRings) return;
+
+    pStats->records = __atomic_load_n(&pRings->records, __ATOMIC_RELAXED);
+    pStats->batches = __atomic_load_n(&pRings->batches, __ATOMIC_RELAXED);
+    for (pRing = __atomic_load_n(&pRings->pList, __ATOMIC_ACQUIRE); pRing; pRing = pRing->pNext)
+        pStats->dropped += __atomic_load_n(&pRing->dropped, __ATOMIC_RELAXED);
+}
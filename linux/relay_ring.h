@@ -0,0 +1,60 @@
+/*
+ * relay_ring.h - Per-Thread Record Rings for RemoteDesk2K Linux Relay
+ *
+ * Every thread that appends gets its own single-producer ring of records
+ * (timestamp, length, bytes). One writer thread drains all the rings of a
+ * set in timestamp order and hands each record to a callback. Producers
+ * never take a lock or make a blocking call: a full ring drops the record
+ * and counts it, and the writer is woken through an eventfd only when it
+ * is idle. The log (relay_log.c) and the capture (relay_capture.c) are
+ * both ring sets.
+ */
+
+#ifndef _RD2K_RELAY_RING_H_
+#define _RD2K_RELAY_RING_H_
+
+#include "common.h"
+
+typedef struct _RELAY_RINGS RELAY_RINGS;
+
+/* Called on the writer thread for each record, oldest first */
+typedef void (*RING_CONSUME)(void *pContext, unsigned long long timeUs,
+                             const BYTE *data, DWORD length);
+
+/* Called on the writer thread after each pass over the rings with the
+ * number of records it consumed, 0 when the rings were empty */
+typedef void (*RING_FLUSH)(void *pContext, DWORD count);
+
+typedef struct _RING_STATS {
+    unsigned long long  records;            /* Handed to the consumer */
+    unsigned long long  dropped;            /* Lost to a full ring */
+    unsigned long long  batches;            /* Passes that consumed records */
+} RING_STATS;
+
+/* Create a set of rings of ringSize bytes each (a power of two, at least
+ * 4 KB), drained up to batchMax records per pass. pfnFlush may be NULL.
+ * Returns NULL when out of memory */
+RELAY_RINGS* Rings_Create(DWORD ringSize, DWORD batchMax, RING_CONSUME pfnConsume,
+                          RING_FLUSH pfnFlush, void *pContext);
+
+/* Start the writer thread. Returns RD2K_SUCCESS or RD2K_ERR_SOCKET
+ * (eventfd or thread creation failed), with errno set */
+int Rings_Start(RELAY_RINGS *pRings);
+
+/* Write out everything queued and stop the writer thread. Records added
+ * after this wait for the next Rings_Start */
+void Rings_Stop(RELAY_RINGS *pRings);
+
+/* Stop if still running and free the set. No thread may append any more */
+void Rings_Destroy(RELAY_RINGS *pRings);
+
+/* Queue a record of the two parts (either may be empty) in the calling
+ * thread's ring. A full ring drops it and counts it; FALSE only when the
+ * thread has no ring (out of memory) */
+BOOL Rings_Append(RELAY_RINGS *pRings, unsigned long long timeUs,
+                  const void *part1, DWORD length1, const void *part2, DWORD length2);
+
+/* Counters since Rings_Create */
+void Rings_GetStats(RELAY_RINGS *pRings, RING_STATS *pStats);
+
+#endif /* _RD2K_RELAY_RING_H_ */
@@ -0,0 +1,153 @@
+/*
+ * relay_timer.c - Timer Wheel for RemoteDesk2K Linux Relay
+ *
+ * Level L slot S holds timers whose expiry tick has S in bits
+ * [6L, 6L+6) and shares all higher bits with the current tick, so every
+ * slot is reached before its timers are due. Each time the current tick
+ * enters a new level-L bucket, that bucket's slot is re-sorted into the
+ * levels below (the cascade). Deadlines past the top level's reach are
+ * parked in its farthest slot and fire early.
+ */
+
+#include "relay_timer.h"
+
+#define TIMER_LEVEL_MASK        (TIMER_LEVEL_SLOTS - 1)
+
+/* ============================================================
+ * HELPERS
+ * ============================================================ */
+
+static void LinkTimer(RELAY_TIMER **ppSlot, RELAY_TIMER *pTimer)
+{
+    pTimer->pNext = *ppSlot;
+    if (pTimer->pNext) pTimer->pNext->ppPrev = &pTimer->pNext;
+    pTimer->ppPrev = ppSlot;
+    *ppSlot = pTimer;
+}
+
+static void UnlinkTimer(RELAY_TIMER *pTimer)
+{
+    *pTimer->ppPrev = pTimer->pNext;
+    if (pTimer->pNext) pTimer->pNext->ppPrev = pTimer->ppPrev;
+    pTimer->pNext = NULL;
+    pTimer->ppPrev = NULL;
+}
+
+/* Put a timer into the lowest level whose current revolution contains
+ * its expiry tick. pTimer->expires is ahead of, or equal to, currentTick */
+static void AddTimer(RELAY_TIMER_WHEEL *pWheel, RELAY_TIMER *pTimer)
+{
+    DWORD current = pWheel->currentTick;
+    DWORD level;
+    DWORD shift;
+
+    for (level = 0; level < TIMER_LEVELS - 1; level++) {
+        shift = TIMER_LEVEL_BITS * (level + 1);
+        if ((pTimer->expires >> shift) == (current >> shift)) break;
+    }
+
+    shift = TIMER_LEVEL_BITS * level;
+    if (level == TIMER_LEVELS - 1 &&
+        (pTimer->expires >> shift) - (current >> shift) >= TIMER_LEVEL_SLOTS) {
+        pTimer->expires = ((current >> shift) + TIMER_LEVEL_SLOTS - 1) << shift;
+    }
+
+    LinkTimer(&pWheel->slots[level][(pTimer->expires >> shift) & TIMER_LEVEL_MASK], pTimer);
+}
+
+/* The current tick entered a new bucket of this level: re-sort its slot */
+static void CascadeLevel(RELAY_TIMER_WHEEL *pWheel, DWORD level)
+{
+    DWORD index = (pWheel->currentTick >> (TIMER_LEVEL_BITS * level)) & TIMER_LEVEL_MASK;
+    RELAY_TIMER *pTimer = pWheel->slots[level][index];
+
+    pWheel->slots[level][index] = NULL;
+    while (pTimer) {
+        RELAY_TIMER *pNext = pTimer->pNext;
+        AddTimer(pWheel, pTimer);
+        pTimer = pNext;
+    }
+}
+
+/* ============================================================
+ * PUBLIC API
+ * ============================================================ */
+
+void Timer_InitWheel(RELAY_TIMER_WHEEL *pWheel, DWORD nowMs)
+{
+    ZeroMemory(pWheel, sizeof(RELAY_TIMER_WHEEL));
+    pWheel->currentMs = nowMs;
+}
+
+void Timer_Schedule(RELAY_TIMER_WHEEL *pWheel, RELAY_TIMER *pTimer, DWORD expiresMs)
+{
+    DWORD delayMs = expiresMs - pWheel->currentMs;
+    DWORD ticks;
+
+    if (pTimer->ppPrev)
+        UnlinkTimer(pTimer);
+    else
+        pWheel->pending++;
+
+    /* Already due: the next tick */
+    if ((int)delayMs <= 0)
+        ticks = 1;
+    else
+        ticks = (delayMs + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+
+    pTimer->expires = pWheel->currentTick + ticks;
+    AddTimer(pWheel, pTimer);
+}
+
+void Timer_Cancel(RELAY_TIMER_WHEEL *pWheel, RELAY_TIMER *pTimer)
+{
+    if (!pTimer->ppPrev) return;
+
+    UnlinkTimer(pTimer);
+    pWheel->pending--;
+}
+
+RELAY_TIMER* Timer_Advance(RELAY_TIMER_WHEEL *pWheel, DWORD nowMs)
+{
+    RELAY_TIMER *pExpired = NULL;
+    RELAY_TIMER **ppTail = &pExpired;
+
+    while (nowMs - pWheel->currentMs >= TIMER_TICK_MS && pWheel->pending > 0) {
+        RELAY_TIMER *pTimer;
+        DWORD index;
+
+        pWheel->currentTick++;
+        pWheel->currentMs += TIMER_TICK_MS;
+
+        index = pWheel->currentTick & TIMER_LEVEL_MASK;
+        if (index == 0) {
+            DWORD top = 1;
+            DWORD level;
+
+            while (top < TIMER_LEVELS - 1 &&
+                   ((pWheel->currentTick >> (TIMER_LEVEL_BITS * top)) & TIMER_LEVEL_MASK) == 0)
+                top++;
+            for (level = top; level >= 1; level--)
+                CascadeLevel(pWheel, level);
+        }
+
+        pTimer = pWheel->slots[0][index];
+        pWheel->slots[0][index] = NULL;
+        *ppTail = pTimer;
+        while (pTimer) {
+            pTimer->ppPrev = NULL;
+            pWheel->pending--;
+            ppTail = &pTimer->pNext;
+            pTimer = pTimer->pNext;
+        }
+    }
+
+    /* Empty wheel: nothing left to cascade or fire, just catch up */
+    if (pWheel->pending == 0) {
+        DWORD ticks = (nowMs - pWheel->currentMs) / TIMER_TICK_MS;
+        pWheel->currentTick += ticks;
+        pWheel->currentMs += ticks * TIMER_TICK_MS;
+    }
+
+    return pExpired;
+}
@@ -0,0 +1,50 @@
+/*
+ * relay_timer.h - Timer Wheel for RemoteDesk2K Linux Relay
+ *
+ * Hierarchical timing wheel: four levels of 64 slots, 16ms per tick at
+ * the bottom level, about 74 hours of range. Scheduling and cancelling
+ * are O(1); advancing touches one slot per elapsed tick plus an
+ * occasional cascade of a higher-level slot. Timers are embedded in the
+ * objects they time. A wheel belongs to one thread and is not locked.
+ */
+
+#ifndef _RD2K_RELAY_TIMER_H_
+#define _RD2K_RELAY_TIMER_H_
+
+#include "common.h"
+#include <stddef.h>
+
+#define TIMER_TICK_MS           16
+#define TIMER_LEVEL_BITS        6
+#define TIMER_LEVEL_SLOTS       (1 << TIMER_LEVEL_BITS)
+#define TIMER_LEVELS            4
+
+typedef struct _RELAY_TIMER {
+    struct _RELAY_TIMER*    pNext;
+    struct _RELAY_TIMER**   ppPrev;         /* NULL while not on the wheel */
+    DWORD                   expires;        /* Wheel tick */
+} RELAY_TIMER;
+
+typedef struct _RELAY_TIMER_WHEEL {
+    RELAY_TIMER*            slots[TIMER_LEVELS][TIMER_LEVEL_SLOTS];
+    DWORD                   currentTick;
+    DWORD                   currentMs;      /* GetTickCount() at currentTick */
+    DWORD                   pending;        /* Timers on the wheel */
+} RELAY_TIMER_WHEEL;
+
+/* Start an empty wheel at nowMs (GetTickCount() time) */
+void Timer_InitWheel(RELAY_TIMER_WHEEL *pWheel, DWORD nowMs);
+
+/* Fire pTimer at or after expiresMs, rounded up to the next tick.
+ * A timer that is already scheduled is moved */
+void Timer_Schedule(RELAY_TIMER_WHEEL *pWheel, RELAY_TIMER *pTimer, DWORD expiresMs);
+
+/* Take pTimer off the wheel (no-op if it is not scheduled) */
+void Timer_Cancel(RELAY_TIMER_WHEEL *pWheel, RELAY_TIMER *pTimer);
+
+/* Move the wheel to nowMs and return every timer that came due, chained
+ * through pNext. Returned timers are off the wheel; save pNext before
+ * scheduling one of them again */
+RELAY_TIMER* Timer_Advance(RELAY_TIMER_WHEEL *pWheel, DWORD nowMs);
+
+#endif /* _RD2K_RELAY_TIMER_H_ */
@@ -0,0 +1,508 @@
+/*
+ * relay_upgrade.c - Hot Upgrade Channel for RemoteDesk2K Linux Relay
+ *
+ * Every message starts with an UPGRADE_HEADER; sockets ride along as
+ * SCM_RIGHTS control data. A connection is one CONN message carrying its
+ * record and socket, followed by its input and then its output in DATA
+ * chunks of at most UPGRADE_CHUNK bytes (the receiver knows both lengths
+ * from the record, so chunks never need framing of their own). Both ends
+ * block with UPGRADE_TIMEOUT_MS send/receive timeouts: the old relay's
+ * shards are stopped while it sends, and a stuck successor must not keep
+ * them stopped.
+ */
+
+#include "relay_upgrade.h"
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#define UPGRADE_VERSION         2       /* REQUEST count; both binaries must agree */
+#define UPGRADE_CHUNK           (32 * 1024)
+
+#define UPGRADE_MSG_REQUEST     1
+#define UPGRADE_MSG_LISTEN      2       /* count = listen sockets attached */
+#define UPGRADE_MSG_LOCK        3       /* count = 0 or 1 (lock file attached) */
+#define UPGRADE_MSG_CONN        4       /* UPGRADE_CONN, socket attached */
+#define UPGRADE_MSG_DATA        5
+#define UPGRADE_MSG_END         6       /* count = connections sent */
+#define UPGRADE_MSG_ACK         7
+#define UPGRADE_MSG_ABORT       8
+
+#pragma pack(push, 1)
+
+typedef struct {
+    DWORD   type;               /* UPGRADE_MSG_* */
+    DWORD   count;
+    DWORD   length;             /* Payload bytes after the header */
+    DWORD   reserved;
+} UPGRADE_HEADER;
+
+typedef struct {
+    DWORD   clientId;
+    DWORD   state;
+    DWORD   prevState;
+    DWORD   partner;
+    DWORD   flags;
+    DWORD   idleMs;
+    DWORD   streamIn;
+    DWORD   inputLength;
+    DWORD   outputLength;
+} UPGRADE_CONN;
+
+#pragma pack(pop)
+
+/* Room for the most descriptors one message carries */
+typedef union {
+    struct cmsghdr  align;
+    char            buffer[CMSG_SPACE(sizeof(int) * RELAY_MAX_SHARDS)];
+} UPGRADE_CONTROL;
+
+/* ============================================================
+ * MESSAGES
+ * ============================================================ */
+
+static void FormatSocketPath(struct sockaddr_un *pAddr, WORD port)
+{
+    ZeroMemory(pAddr, sizeof(*pAddr));
+    pAddr->sun_family = AF_UNIX;
+    snprintf(pAddr->sun_path, sizeof(pAddr->sun_path), UPGRADE_SOCKET_PATH, port);
+}
+
+static void SetChannelTimeouts(int fd)
+{
+    struct timeval tv;
+
+    tv.tv_sec = UPGRADE_TIMEOUT_MS / 1000;
+    tv.tv_usec = (UPGRADE_TIMEOUT_MS % 1000) * 1000;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+/* Only the relay's own user may hand sockets over or take them */
+static BOOL IsSameUser(int fd)
+{
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0) return FALSE;
+    return cred.uid == geteuid();
+}
+
+static BOOL SendMessage(int fd, DWORD type, DWORD count, const void *payload, DWORD length,
+                        const int *fds, DWORD fdCount)
+{
+    UPGRADE_HEADER header;
+    UPGRADE_CONTROL control;
+    struct iovec iov[2];
+    struct msghdr msg;
+    ssize_t sent;
+
+    header.type = type;
+    header.count = count;
+    header.length = length;
+    header.reserved = 0;
+
+    iov[0].iov_base = &header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = (void*)payload;
+    iov[1].iov_len = length;
+
+    ZeroMemory(&msg, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = length > 0 ? 2 : 1;
+
+    if (fdCount > 0) {
+        struct cmsghdr *pCmsg;
+
+        ZeroMemory(&control, sizeof(control));
+        msg.msg_control = control.buffer;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * fdCount);
+        pCmsg = CMSG_FIRSTHDR(&msg);
+        pCmsg->cmsg_level = SOL_SOCKET;
+        pCmsg->cmsg_type = SCM_RIGHTS;
+        pCmsg->cmsg_len = CMSG_LEN(sizeof(int) * fdCount);
+        memcpy(CMSG_DATA(pCmsg), fds, sizeof(int) * fdCount);
+    }
+
+    do {
+        sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    } while (sent < 0 && errno == EINTR);
+
+    return sent == (ssize_t)(sizeof(header) + length);
+}
+
+/* Receive one message: its payload (up to maxLength bytes) into payload
+ * and up to maxFds descriptors into fds. Anything that does not fit is a
+ * protocol error; descriptors received with it are closed. Returns the
+ * payload length, or -1 on error or when the peer has gone */
+static int RecvMessage(int fd, UPGRADE_HEADER *pHeader, void *payload, DWORD maxLength,
+                       int *fds, DWORD maxFds, DWORD *pFdCount)
+{
+    UPGRADE_CONTROL control;
+    struct cmsghdr *pCmsg;
+    struct iovec iov[2];
+    struct msghdr msg;
+    DWORD fdCount = 0;
+    BOOL bValid;
+    ssize_t n;
+
+    iov[0].iov_base = pHeader;
+    iov[0].iov_len = sizeof(*pHeader);
+    iov[1].iov_base = payload;
+    iov[1].iov_len = maxLength;
+
+    ZeroMemory(&msg, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = maxLength > 0 ? 2 : 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+
+    do {
+        n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0) return -1;
+
+    bValid = !(msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) && n >= (ssize_t)sizeof(*pHeader) &&
+             pHeader->length == (DWORD)(n - (ssize_t)sizeof(*pHeader));
+
+    for (pCmsg = CMSG_FIRSTHDR(&msg); pCmsg; pCmsg = CMSG_NXTHDR(&msg, pCmsg)) {
+        DWORD count, i;
+        int received[RELAY_MAX_SHARDS];
+
+        if (pCmsg->cmsg_level != SOL_SOCKET || pCmsg->cmsg_type != SCM_RIGHTS) continue;
+
+        count = (DWORD)((pCmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+        if (count > RELAY_MAX_SHARDS) count = RELAY_MAX_SHARDS;
+        memcpy(received, CMSG_DATA(pCmsg), sizeof(int) * count);
+        for (i = 0; i < count; i++) {
+            if (bValid && fdCount < maxFds)
+                fds[fdCount++] = received[i];
+            else
+                close(received[i]);
+        }
+    }
+
+    if (!bValid) {
+        while (fdCount > 0) close(fds[--fdCount]);
+        return -1;
+    }
+
+    *pFdCount = fdCount;
+    return (int)pHeader->length;
+}
+
+/* Receive length bytes sent as DATA chunks */
+static BOOL RecvBytes(int fd, BYTE *buffer, DWORD length)
+{
+    UPGRADE_HEADER header;
+    DWORD have = 0;
+    DWORD fdCount;
+    int n;
+
+    while (have < length) {
+        DWORD chunk = length - have < UPGRADE_CHUNK ? length - have : UPGRADE_CHUNK;
+
+        n = RecvMessage(fd, &header, buffer + have, chunk, NULL, 0, &fdCount);
+        if (n <= 0 || header.type != UPGRADE_MSG_DATA) return FALSE;
+        have += (DWORD)n;
+    }
+    return TRUE;
+}
+
+static BOOL SendBytes(int fd, const BYTE *data, DWORD length)
+{
+    while (length > 0) {
+        DWORD chunk = length < UPGRADE_CHUNK ? length : UPGRADE_CHUNK;
+
+        if (!SendMessage(fd, UPGRADE_MSG_DATA, 0, data, chunk, NULL, 0)) return FALSE;
+        data += chunk;
+        length -= chunk;
+    }
+    return TRUE;
+}
+
+/* Wait up to timeoutMs for the next message or the peer's close.
+ * Returns the message type, 0 if the peer closed, -1 on timeout or error */
+static int WaitMessage(int fd, DWORD timeoutMs)
+{
+    UPGRADE_HEADER header;
+    struct pollfd pfd;
+    DWORD fdCount;
+    int result;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    do {
+        result = poll(&pfd, 1, (int)timeoutMs);
+    } while (result < 0 && errno == EINTR);
+    if (result <= 0) return -1;
+
+    if (RecvMessage(fd, &header, NULL, 0, NULL, 0, &fdCount) < 0) {
+        char probe;
+
+        /* An orderly close reads as end of file */
+        return recv(fd, &probe, sizeof(probe), MSG_DONTWAIT) == 0 ? 0 : -1;
+    }
+    return (int)header.type;
+}
+
+/* ============================================================
+ * RUNNING RELAY
+ * ============================================================ */
+
+int Upgrade_Listen(WORD port)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+
+    /* A path left by a crashed relay would fail the bind. The single
+     * instance lock is held, so it is not anyone else's */
+    FormatSocketPath(&addr, port);
+    unlink(addr.sun_path);
+
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+        chmod(addr.sun_path, 0600) < 0 || listen(fd, 1) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int Upgrade_Accept(int listenFd)
+{
+    UPGRADE_HEADER header;
+    DWORD fdCount;
+    int fd;
+
+    fd = accept4(listenFd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd < 0) return -1;
+
+    SetChannelTimeouts(fd);
+    if (!IsSameUser(fd) ||
+        RecvMessage(fd, &header, NULL, 0, NULL, 0, &fdCount) < 0 ||
+        header.type != UPGRADE_MSG_REQUEST || header.count != UPGRADE_VERSION) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int Upgrade_SendHandoff(int fd, const RELAY_HANDOFF *pHandoff, int lockFd)
+{
+    DWORD i;
+
+    if (pHandoff->listenCount == 0 || pHandoff->listenCount > RELAY_MAX_SHARDS ||
+        !SendMessage(fd, UPGRADE_MSG_LISTEN, pHandoff->listenCount, NULL, 0,
+                     pHandoff->listenSockets, pHandoff->listenCount) ||
+        !SendMessage(fd, UPGRADE_MSG_LOCK, lockFd >= 0 ? 1 : 0, NULL, 0,
+                     &lockFd, lockFd >= 0 ? 1 : 0))
+        return RD2K_ERR_SEND;
+
+    for (i = 0; i < pHandoff->connCount; i++) {
+        const RELAY_HANDOFF_CONN *pConn = &pHandoff->conns[i];
+        UPGRADE_CONN record;
+
+        record.clientId = pConn->clientId;
+        record.state = pConn->state;
+        record.prevState = pConn->prevState;
+        record.partner = pConn->partner;
+        record.flags = pConn->flags;
+        record.idleMs = pConn->idleMs;
+        record.streamIn = pConn->streamIn;
+        record.inputLength = pConn->inputLength;
+        record.outputLength = pConn->outputLength;
+
+        if (!SendMessage(fd, UPGRADE_MSG_CONN, 1, &record, sizeof(record), &pConn->socket, 1) ||
+            !SendBytes(fd, pConn->input, pConn->inputLength) ||
+            !SendBytes(fd, pConn->output, pConn->outputLength))
+            return RD2K_ERR_SEND;
+    }
+
+    if (!SendMessage(fd, UPGRADE_MSG_END, pHandoff->connCount, NULL, 0, NULL, 0))
+        return RD2K_ERR_SEND;
+    return RD2K_SUCCESS;
+}
+
+int Upgrade_WaitAck(int fd, DWORD timeoutMs)
+{
+    int type = WaitMessage(fd, timeoutMs);
+
+    if (type == UPGRADE_MSG_ACK) return RD2K_SUCCESS;
+    return type < 0 ? RD2K_ERR_TIMEOUT : RD2K_ERR_RECV;
+}
+
+void Upgrade_SendAbort(int fd)
+{
+    SendMessage(fd, UPGRADE_MSG_ABORT, 0, NULL, 0, NULL, 0);
+}
+
+/* ============================================================
+ * SUCCESSOR
+ * ============================================================ */
+
+int Upgrade_Connect(WORD port)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+
+    FormatSocketPath(&addr, port);
+    SetChannelTimeouts(fd);
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || !IsSameUser(fd) ||
+        !SendMessage(fd, UPGRADE_MSG_REQUEST, UPGRADE_VERSION, NULL, 0, NULL, 0)) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/* Read one CONN message and its bytes into a new entry of pHandoff */
+static int RecvConnection(int fd, RELAY_HANDOFF *pHandoff, DWORD *pCapacity,
+                          const UPGRADE_CONN *pRecord, int socket)
+{
+    RELAY_HANDOFF_CONN *pConn;
+
+    if (pHandoff->connCount == *pCapacity) {
+        DWORD capacity = *pCapacity ? *pCapacity * 2 : 256;
+        RELAY_HANDOFF_CONN *pConns = (RELAY_HANDOFF_CONN*)realloc(
+            pHandoff->conns, capacity * sizeof(RELAY_HANDOFF_CONN));
+
+        if (!pConns) {
+            close(socket);
+            return RD2K_ERR_MEMORY;
+        }
+        pHandoff->conns = pConns;
+        *pCapacity = capacity;
+    }
+
+    /* Counted right away: the socket is the handoff's from here on */
+    pConn = &pHandoff->conns[pHandoff->connCount++];
+    ZeroMemory(pConn, sizeof(*pConn));
+    pConn->socket = socket;
+    pConn->clientId = pRecord->clientId;
+    pConn->state = pRecord->state;
+    pConn->prevState = pRecord->prevState;
+    pConn->partner = pRecord->partner;
+    pConn->flags = pRecord->flags;
+    pConn->idleMs = pRecord->idleMs;
+    pConn->streamIn = pRecord->streamIn;
+
+    if (pRecord->inputLength > 0) {
+        pConn->input = (BYTE*)malloc(pRecord->inputLength);
+        if (!pConn->input) return RD2K_ERR_MEMORY;
+        pConn->inputLength = pRecord->inputLength;
+        if (!RecvBytes(fd, pConn->input, pConn->inputLength)) return RD2K_ERR_RECV;
+    }
+    if (pRecord->outputLength > 0) {
+        pConn->output = (BYTE*)malloc(pRecord->outputLength);
+        if (!pConn->output) return RD2K_ERR_MEMORY;
+        pConn->outputLength = pRecord->outputLength;
+        if (!RecvBytes(fd, pConn->output, pConn->outputLength)) return RD2K_ERR_RECV;
+    }
+
+    return RD2K_SUCCESS;
+}
+
+static int RecvHandoff(int fd, RELAY_HANDOFF *pHandoff, int *pLockFd)
+{
+    UPGRADE_HEADER header;
+    UPGRADE_CONN record;
+    int fds[RELAY_MAX_SHARDS];
+    DWORD capacity = 0;
+    DWORD fdCount, i;
+    int result;
+
+    if (RecvMessage(fd, &header, NULL, 0, fds, RELAY_MAX_SHARDS, &fdCount) < 0)
+        return RD2K_ERR_RECV;
+    if (header.type == UPGRADE_MSG_ABORT) return RD2K_ERR_CONNECT;
+
+    pHandoff->listenSockets = (SOCKET*)malloc(RELAY_MAX_SHARDS * sizeof(SOCKET));
+    if (!pHandoff->listenSockets) {
+        while (fdCount > 0) close(fds[--fdCount]);
+        return RD2K_ERR_MEMORY;
+    }
+    for (i = 0; i < fdCount; i++)
+        pHandoff->listenSockets[i] = fds[i];
+    pHandoff->listenCount = fdCount;
+    if (header.type != UPGRADE_MSG_LISTEN || fdCount == 0 || fdCount != header.count)
+        return RD2K_ERR_RECV;
+
+    if (RecvMessage(fd, &header, NULL, 0, fds, 1, &fdCount) < 0) return RD2K_ERR_RECV;
+    if (fdCount == 1) *pLockFd = fds[0];
+    if (header.type != UPGRADE_MSG_LOCK || fdCount != header.count) return RD2K_ERR_RECV;
+
+    for (;;) {
+        if (RecvMessage(fd, &header, &record, sizeof(record), fds, 1, &fdCount) < 0)
+            return RD2K_ERR_RECV;
+
+        if (header.type == UPGRADE_MSG_END && fdCount == 0)
+            return header.count == pHandoff->connCount ? RD2K_SUCCESS : RD2K_ERR_RECV;
+
+        if (header.type != UPGRADE_MSG_CONN || header.length != sizeof(record) || fdCount != 1) {
+            while (fdCount > 0) close(fds[--fdCount]);
+            return RD2K_ERR_RECV;
+        }
+
+        result = RecvConnection(fd, pHandoff, &capacity, &record, fds[0]);
+        if (result != RD2K_SUCCESS) return result;
+    }
+}
+
+int Upgrade_RecvHandoff(int fd, RELAY_HANDOFF *pHandoff, int *pLockFd)
+{
+    int result;
+
+    ZeroMemory(pHandoff, sizeof(RELAY_HANDOFF));
+    *pLockFd = -1;
+
+    result = RecvHandoff(fd, pHandoff, pLockFd);
+    if (result != RD2K_SUCCESS) {
+        Upgrade_DiscardHandoff(pHandoff);
+        if (*pLockFd >= 0) close(*pLockFd);
+        *pLockFd = -1;
+    }
+    return result;
+}
+
+int Upgrade_SendAck(int fd)
+{
+    return SendMessage(fd, UPGRADE_MSG_ACK, 0, NULL, 0, NULL, 0) ? RD2K_SUCCESS : RD2K_ERR_SEND;
+}
+
+int Upgrade_WaitClose(int fd, DWORD timeoutMs)
+{
+    DWORD start = GetTickCount();
+    DWORD elapsed;
+
+    /* ABORT: the ACK came too late and the old relay kept the sockets */
+    while ((elapsed = GetTickCount() - start) < timeoutMs) {
+        int type = WaitMessage(fd, timeoutMs - elapsed);
+
+        if (type == 0) return RD2K_SUCCESS;
+        if (type == UPGRADE_MSG_ABORT) return RD2K_ERR_CONNECT;
+        if (type < 0) break;
+    }
+    return RD2K_ERR_TIMEOUT;
+}
+
+void Upgrade_DiscardHandoff(RELAY_HANDOFF *pHandoff)
+{
+    DWORD i;
+
+    for (i = 0; i < pHandoff->listenCount; i++) {
+        if (pHandoff->listenSockets[i] != INVALID_SOCKET) close(pHandoff->listenSockets[i]);
+    }
+    for (i = 0; i < pHandoff->connCount; i++) {
+        if (pHandoff->conns[i].socket != INVALID_SOCKET) close(pHandoff->conns[i].socket);
+    }
+    Relay_FreeHandoff(pHandoff);
+}
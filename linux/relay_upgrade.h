@@ -0,0 +1,73 @@
+/*
+ * relay_upgrade.h - Hot Upgrade Channel for RemoteDesk2K Linux Relay
+ *
+ * A new relay binary started with --takeover connects to the running
+ * relay's upgrade socket, a UNIX socket next to the lock file that only
+ * the relay's own user may use. The running relay detaches its server
+ * (Relay_Detach) and sends the listen sockets, the single instance lock
+ * and every client connection with its state and buffered bytes; the
+ * sockets travel as SCM_RIGHTS. Once the successor acknowledges, the old
+ * process exits without touching the connections, and closing the channel
+ * tells the successor that the old process's ports are free.
+ *
+ * The channel is SOCK_SEQPACKET, so each message arrives whole:
+ *   new -> old   REQUEST
+ *   old -> new   LISTEN (fds), LOCK (fd), { CONN (record, fd), DATA... }, END
+ *   new -> old   ACK
+ * or ABORT from the old process if it cannot detach or gave up waiting
+ * for the ACK. Either way exactly one process serves the sockets.
+ */
+
+#ifndef _RD2K_RELAY_UPGRADE_H_
+#define _RD2K_RELAY_UPGRADE_H_
+
+#include "common.h"
+#include "relay.h"
+
+#define UPGRADE_SOCKET_PATH     "/tmp/rd2k_relay.%u.upgrade"   /* Relay port */
+#define UPGRADE_TIMEOUT_MS      5000    /* Per message, and for the ACK */
+
+/* Running relay: bind the upgrade socket for port, replacing a stale one.
+ * Returns the listening fd or -1 */
+int Upgrade_Listen(WORD port);
+
+/* Running relay: accept a successor on listenFd and read its REQUEST.
+ * Peers running as another user are refused. Returns the channel or -1 */
+int Upgrade_Accept(int listenFd);
+
+/* Running relay: send the detached server's sockets and state. lockFd is
+ * the single instance lock (-1 for none). Returns RD2K_SUCCESS or
+ * RD2K_ERR_SEND */
+int Upgrade_SendHandoff(int fd, const RELAY_HANDOFF *pHandoff, int lockFd);
+
+/* Running relay: wait for the successor to take over. Returns
+ * RD2K_SUCCESS, RD2K_ERR_TIMEOUT or RD2K_ERR_RECV (it gave up) */
+int Upgrade_WaitAck(int fd, DWORD timeoutMs);
+
+/* Running relay: tell the successor there will be no handoff, or that
+ * its ACK came too late and this process keeps the sockets */
+void Upgrade_SendAbort(int fd);
+
+/* Successor: connect to the relay running on port and ask for its
+ * sockets. Returns the channel or -1 */
+int Upgrade_Connect(WORD port);
+
+/* Successor: receive the handoff. On success pHandoff owns the sockets
+ * (Relay_CreateEx takes them) and *pLockFd is the lock or -1. On failure
+ * everything received is closed and freed. Returns RD2K_SUCCESS,
+ * RD2K_ERR_RECV, RD2K_ERR_MEMORY or RD2K_ERR_CONNECT (aborted) */
+int Upgrade_RecvHandoff(int fd, RELAY_HANDOFF *pHandoff, int *pLockFd);
+
+/* Successor: acknowledge the handoff. Returns RD2K_SUCCESS or RD2K_ERR_SEND */
+int Upgrade_SendAck(int fd);
+
+/* Successor: wait for the old process to close the channel on exit.
+ * Returns RD2K_SUCCESS, RD2K_ERR_CONNECT (it kept the sockets) or
+ * RD2K_ERR_TIMEOUT */
+int Upgrade_WaitClose(int fd, DWORD timeoutMs);
+
+/* Successor: close the sockets of a handoff that will not be used and
+ * free it */
+void Upgrade_DiscardHandoff(RELAY_HANDOFF *pHandoff);
+
+#endif /* _RD2K_RELAY_UPGRADE_H_ */
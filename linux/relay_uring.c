@@ -0,0 +1,322 @@
+/*
+ * relay_uring.c - io_uring Rings for RemoteDesk2K Linux Relay
+ *
+ * The SQ and CQ rings are shared with the kernel through mmap. We publish
+ * SQEs by storing the SQ tail with release semantics and consume CQEs by
+ * advancing the CQ head the same way; io_uring_enter() then submits the
+ * whole batch and optionally waits, so one system call covers every
+ * accept, recv and send a shard issued during a loop pass.
+ */
+
+#include "relay_uring.h"
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+#include <linux/time_types.h>
+
+#define URING_MIN_KERNEL_MAJOR  6       /* Multishot recv arrived in 6.0 */
+
+static int UringSetup(DWORD entries, struct io_uring_params *pParams)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, pParams);
+}
+
+static int UringEnter(int ringFd, unsigned toSubmit, unsigned minComplete, unsigned flags,
+                      void *arg, size_t argSize)
+{
+    return (int)syscall(__NR_io_uring_enter, ringFd, toSubmit, minComplete, flags, arg, argSize);
+}
+
+static int UringRegister(int ringFd, unsigned opcode, void *arg, unsigned count)
+{
+    return (int)syscall(__NR_io_uring_register, ringFd, opcode, arg, count);
+}
+
+/* ============================================================
+ * SETUP
+ * ============================================================ */
+
+BOOL Uring_IsSupported(void)
+{
+    struct utsname name;
+    RELAY_URING ring;
+    BOOL bSupported;
+
+    if (uname(&name) < 0 || atoi(name.release) < URING_MIN_KERNEL_MAJOR)
+        return FALSE;
+
+    if (Uring_Init(&ring, 8) != RD2K_SUCCESS) return FALSE;
+    bSupported = Uring_SetupBuffers(&ring, 0, 1, 64) == RD2K_SUCCESS;
+    Uring_Destroy(&ring);
+    return bSupported;
+}
+
+int Uring_Init(RELAY_URING *pRing, DWORD entries)
+{
+    struct io_uring_params params;
+    BYTE *sqPtr, *cqPtr;
+    int ringFd;
+
+    ZeroMemory(pRing, sizeof(RELAY_URING));
+    pRing->ringFd = -1;
+
+    /* Multishot requests post many completions per SQE; give the CQ room */
+    ZeroMemory(&params, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+    params.cq_entries = entries * 8;
+    ringFd = UringSetup(entries, &params);
+    if (ringFd < 0 && errno == EINVAL) {
+        ZeroMemory(&params, sizeof(params));
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = entries * 8;
+        ringFd = UringSetup(entries, &params);
+    }
+    if (ringFd < 0) return RD2K_ERR_SOCKET;
+
+    pRing->ringFd = ringFd;
+
+    if (!(params.features & IORING_FEAT_EXT_ARG) || !(params.features & IORING_FEAT_NODROP)) {
+        Uring_Destroy(pRing);
+        return RD2K_ERR_SOCKET;
+    }
+
+    pRing->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    pRing->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (pRing->cqRingSize > pRing->sqRingSize) pRing->sqRingSize = pRing->cqRingSize;
+        pRing->cqRingSize = pRing->sqRingSize;
+    }
+
+    pRing->sqRing = mmap(NULL, pRing->sqRingSize, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+    if (pRing->sqRing == MAP_FAILED) {
+        pRing->sqRing = NULL;
+        Uring_Destroy(pRing);
+        return RD2K_ERR_SOCKET;
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        pRing->cqRing = pRing->sqRing;
+    } else {
+        pRing->cqRing = mmap(NULL, pRing->cqRingSize, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+        if (pRing->cqRing == MAP_FAILED) {
+            pRing->cqRing = NULL;
+            Uring_Destroy(pRing);
+            return RD2K_ERR_SOCKET;
+        }
+    }
+
+    pRing->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    pRing->sqes = (struct io_uring_sqe*)mmap(NULL, pRing->sqesSize, PROT_READ | PROT_WRITE,
+                                              MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+    if (pRing->sqes == MAP_FAILED) {
+        pRing->sqes = NULL;
+        Uring_Destroy(pRing);
+        return RD2K_ERR_SOCKET;
+    }
+
+    sqPtr = (BYTE*)pRing->sqRing;
+    pRing->sqHead = (unsigned*)(sqPtr + params.sq_off.head);
+    pRing->sqTail = (unsigned*)(sqPtr + params.sq_off.tail);
+    pRing->sqArray = (unsigned*)(sqPtr + params.sq_off.array);
+    pRing->sqMask = *(unsigned*)(sqPtr + params.sq_off.ring_mask);
+    pRing->sqEntries = params.sq_entries;
+    pRing->sqLocalTail = *pRing->sqTail;
+
+    cqPtr = (BYTE*)pRing->cqRing;
+    pRing->cqHead = (unsigned*)(cqPtr + params.cq_off.head);
+    pRing->cqTail = (unsigned*)(cqPtr + params.cq_off.tail);
+    pRing->cqMask = *(unsigned*)(cqPtr + params.cq_off.ring_mask);
+    pRing->cqes = (struct io_uring_cqe*)(cqPtr + params.cq_off.cqes);
+
+    return RD2K_SUCCESS;
+}
+
+void Uring_Destroy(RELAY_URING *pRing)
+{
+    if (pRing->ringFd >= 0) close(pRing->ringFd);
+    if (pRing->sqes) munmap(pRing->sqes, pRing->sqesSize);
+    if (pRing->cqRing && pRing->cqRing != pRing->sqRing) munmap(pRing->cqRing, pRing->cqRingSize);
+    if (pRing->sqRing) munmap(pRing->sqRing, pRing->sqRingSize);
+    /* The ring is gone, so the kernel no longer writes into the buffers */
+    if (pRing->bufRing) munmap(pRing->bufRing, pRing->bufRingSize);
+    if (pRing->bufBase) munmap(pRing->bufBase, (size_t)pRing->bufCount * pRing->bufSize);
+    ZeroMemory(pRing, sizeof(RELAY_URING));
+    pRing->ringFd = -1;
+}
+
+/* ============================================================
+ * PROVIDED BUFFERS
+ * ============================================================ */
+
+int Uring_SetupBuffers(RELAY_URING *pRing, WORD group, DWORD bufCount, DWORD bufSize)
+{
+    struct io_uring_buf_reg reg;
+    DWORD i;
+
+    pRing->bufRingSize = bufCount * sizeof(struct io_uring_buf);
+    pRing->bufRing = (struct io_uring_buf_ring*)mmap(NULL, pRing->bufRingSize,
+                                                     PROT_READ | PROT_WRITE,
+                                                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (pRing->bufRing == MAP_FAILED) {
+        pRing->bufRing = NULL;
+        return RD2K_ERR_MEMORY;
+    }
+
+    pRing->bufBase = (BYTE*)mmap(NULL, (size_t)bufCount * bufSize, PROT_READ | PROT_WRITE,
+                                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (pRing->bufBase == MAP_FAILED) {
+        pRing->bufBase = NULL;
+        return RD2K_ERR_MEMORY;
+    }
+
+    pRing->bufCount = bufCount;
+    pRing->bufSize = bufSize;
+    pRing->bufGroup = group;
+    pRing->bufTail = 0;
+
+    ZeroMemory(&reg, sizeof(reg));
+    reg.ring_addr = (unsigned long long)(uintptr_t)pRing->bufRing;
+    reg.ring_entries = bufCount;
+    reg.bgid = group;
+    if (UringRegister(pRing->ringFd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        return RD2K_ERR_SOCKET;
+
+    for (i = 0; i < bufCount; i++)
+        Uring_RecycleBuffer(pRing, (WORD)i);
+
+    return RD2K_SUCCESS;
+}
+
+BYTE* Uring_GetBuffer(RELAY_URING *pRing, WORD bufferId)
+{
+    return pRing->bufBase + (size_t)bufferId * pRing->bufSize;
+}
+
+void Uring_RecycleBuffer(RELAY_URING *pRing, WORD bufferId)
+{
+    struct io_uring_buf *pBuf = &pRing->bufRing->bufs[pRing->bufTail & (pRing->bufCount - 1)];
+
+    pBuf->addr = (unsigned long long)(uintptr_t)Uring_GetBuffer(pRing, bufferId);
+    pBuf->len = pRing->bufSize;
+    pBuf->bid = bufferId;
+    pRing->bufTail++;
+    __atomic_store_n(&pRing->bufRing->tail, pRing->bufTail, __ATOMIC_RELEASE);
+}
+
+/* ============================================================
+ * SUBMISSION AND COMPLETION
+ * ============================================================ */
+
+struct io_uring_sqe* Uring_GetSqe(RELAY_URING *pRing)
+{
+    struct io_uring_sqe *pSqe;
+    unsigned index;
+
+    if (pRing->sqLocalTail - __atomic_load_n(pRing->sqHead, __ATOMIC_ACQUIRE) >= pRing->sqEntries) {
+        if (Uring_Submit(pRing, 0) < 0) return NULL;
+        if (pRing->sqLocalTail - __atomic_load_n(pRing->sqHead, __ATOMIC_ACQUIRE) >= pRing->sqEntries)
+            return NULL;
+    }
+
+    index = pRing->sqLocalTail & pRing->sqMask;
+    pSqe = &pRing->sqes[index];
+    ZeroMemory(pSqe, sizeof(struct io_uring_sqe));
+    pRing->sqArray[index] = index;
+    pRing->sqLocalTail++;
+    return pSqe;
+}
+
+int Uring_Submit(RELAY_URING *pRing, DWORD waitMs)
+{
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned toSubmit;
+    int result;
+
+    toSubmit = pRing->sqLocalTail - *pRing->sqTail;
+    __atomic_store_n(pRing->sqTail, pRing->sqLocalTail, __ATOMIC_RELEASE);
+
+    ZeroMemory(&arg, sizeof(arg));
+    ts.tv_sec = waitMs / 1000;
+    ts.tv_nsec = (long long)(waitMs % 1000) * 1000000;
+    arg.ts = (unsigned long long)(uintptr_t)&ts;
+
+    /* GETEVENTS also runs deferred completion work when not waiting */
+    result = UringEnter(pRing->ringFd, toSubmit, waitMs ? 1 : 0,
+                        IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    if (result < 0) {
+        if (errno == ETIME || errno == EINTR || errno == EBUSY) return 0;
+        return -errno;
+    }
+    return result;
+}
+
+struct io_uring_cqe* Uring_PeekCqe(RELAY_URING *pRing)
+{
+    unsigned head = *pRing->cqHead;
+
+    if (head == __atomic_load_n(pRing->cqTail, __ATOMIC_ACQUIRE)) return NULL;
+    return &pRing->cqes[head & pRing->cqMask];
+}
+
+void Uring_SeenCqe(RELAY_URING *pRing)
+{
+    __atomic_store_n(pRing->cqHead, *pRing->cqHead + 1, __ATOMIC_RELEASE);
+}
+
+/* ============================================================
+ * SQE PREPARATION
+ * ============================================================ */
+
+void Uring_PrepAcceptMultishot(struct io_uring_sqe *pSqe, int fd, unsigned long long userData)
+{
+    pSqe->opcode = IORING_OP_ACCEPT;
+    pSqe->fd = fd;
+    pSqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    pSqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    pSqe->user_data = userData;
+}
+
+void Uring_PrepRecvMultishot(struct io_uring_sqe *pSqe, int fd, WORD group,
+                             unsigned long long userData)
+{
+    pSqe->opcode = IORING_OP_RECV;
+    pSqe->fd = fd;
+    pSqe->ioprio = IORING_RECV_MULTISHOT;
+    pSqe->flags = IOSQE_BUFFER_SELECT;
+    pSqe->buf_group = group;
+    pSqe->user_data = userData;
+}
+
+void Uring_PrepSend(struct io_uring_sqe *pSqe, int fd, const void *data, DWORD length,
+                    unsigned long long userData)
+{
+    pSqe->opcode = IORING_OP_SEND;
+    pSqe->fd = fd;
+    pSqe->addr = (unsigned long long)(uintptr_t)data;
+    pSqe->len = length;
+    pSqe->msg_flags = MSG_NOSIGNAL;
+    pSqe->user_data = userData;
+}
+
+void Uring_PrepRead(struct io_uring_sqe *pSqe, int fd, void *data, DWORD length,
+                    unsigned long long userData)
+{
+    pSqe->opcode = IORING_OP_READ;
+    pSqe->fd = fd;
+    pSqe->addr = (unsigned long long)(uintptr_t)data;
+    pSqe->len = length;
+    pSqe->off = (unsigned long long)-1;    /* Current position (eventfd ignores it) */
+    pSqe->user_data = userData;
+}
+
+void Uring_PrepCancel(struct io_uring_sqe *pSqe, unsigned long long targetData,
+                      unsigned long long userData)
+{
+    pSqe->opcode = IORING_OP_ASYNC_CANCEL;
+    pSqe->fd = -1;
+    pSqe->addr = targetData;
+    pSqe->user_data = userData;
+}
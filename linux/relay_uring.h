@@ -0,0 +1,89 @@
+/*
+ * relay_uring.h - io_uring Rings for RemoteDesk2K Linux Relay
+ *
+ * Thin wrapper over the raw io_uring system calls (no liburing): ring
+ * setup and teardown, SQE preparation for the few operations the relay
+ * submits, completion reaping, and a provided buffer ring that multishot
+ * recv fills. A ring is used by one shard thread only and is not locked.
+ */
+
+#ifndef _RD2K_RELAY_URING_H_
+#define _RD2K_RELAY_URING_H_
+
+#include "common.h"
+#include <linux/io_uring.h>
+
+typedef struct _RELAY_URING {
+    int                     ringFd;
+    /* Submission queue */
+    unsigned*               sqHead;
+    unsigned*               sqTail;
+    unsigned*               sqArray;
+    unsigned                sqMask;
+    unsigned                sqEntries;
+    unsigned                sqLocalTail;    /* SQEs prepared, not yet published */
+    struct io_uring_sqe*    sqes;
+    /* Completion queue */
+    unsigned*               cqHead;
+    unsigned*               cqTail;
+    unsigned                cqMask;
+    struct io_uring_cqe*    cqes;
+    /* Mappings */
+    void*                   sqRing;
+    size_t                  sqRingSize;
+    void*                   cqRing;         /* Same as sqRing with IORING_FEAT_SINGLE_MMAP */
+    size_t                  cqRingSize;
+    size_t                  sqesSize;
+    /* Provided buffers for multishot recv */
+    struct io_uring_buf_ring* bufRing;
+    size_t                  bufRingSize;
+    BYTE*                   bufBase;
+    DWORD                   bufCount;       /* Power of two */
+    DWORD                   bufSize;
+    WORD                    bufGroup;
+    WORD                    bufTail;
+} RELAY_URING;
+
+/* TRUE if the kernel has everything the relay backend needs
+ * (multishot accept/recv, buffer rings, timed waits) */
+BOOL Uring_IsSupported(void);
+
+/* Set up a ring with room for entries SQEs. Returns RD2K_SUCCESS or RD2K_ERR_SOCKET */
+int Uring_Init(RELAY_URING *pRing, DWORD entries);
+
+/* Tear the ring down; the kernel cancels whatever is still in flight */
+void Uring_Destroy(RELAY_URING *pRing);
+
+/* Register bufCount buffers of bufSize bytes as buffer group 'group'.
+ * bufCount must be a power of two. Returns RD2K_SUCCESS, RD2K_ERR_MEMORY
+ * or RD2K_ERR_SOCKET */
+int Uring_SetupBuffers(RELAY_URING *pRing, WORD group, DWORD bufCount, DWORD bufSize);
+
+/* Provided buffer named by a completion, and handing it back afterwards */
+BYTE* Uring_GetBuffer(RELAY_URING *pRing, WORD bufferId);
+void Uring_RecycleBuffer(RELAY_URING *pRing, WORD bufferId);
+
+/* Next free SQE, zeroed. Submits queued SQEs first if the queue is full.
+ * NULL only if the kernel refuses the submission */
+struct io_uring_sqe* Uring_GetSqe(RELAY_URING *pRing);
+
+/* Submit prepared SQEs and, if waitMs != 0, wait up to waitMs for at
+ * least one completion. Returns the number submitted or -errno */
+int Uring_Submit(RELAY_URING *pRing, DWORD waitMs);
+
+/* Oldest unconsumed completion or NULL; Uring_SeenCqe releases it */
+struct io_uring_cqe* Uring_PeekCqe(RELAY_URING *pRing);
+void Uring_SeenCqe(RELAY_URING *pRing);
+
+/* SQE preparation */
+void Uring_PrepAcceptMultishot(struct io_uring_sqe *pSqe, int fd, unsigned long long userData);
+void Uring_PrepRecvMultishot(struct io_uring_sqe *pSqe, int fd, WORD group,
+                             unsigned long long userData);
+void Uring_PrepSend(struct io_uring_sqe *pSqe, int fd, const void *data, DWORD length,
+                    unsigned long long userData);
+void Uring_PrepRead(struct io_uring_sqe *pSqe, int fd, void *data, DWORD length,
+                    unsigned long long userData);
+void Uring_PrepCancel(struct io_uring_sqe *pSqe, unsigned long long targetData,
+                      unsigned long long userData);
+
+#endif /* _RD2K_RELAY_URING_H_ */